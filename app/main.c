@@ -1,5 +1,20 @@
+#include <getopt.h>
+#include <inttypes.h>
+
 #include "core/container.h"
 
+#define MAX_PUBLISH 16
+#define MAX_VOLUME 16
+#define STATE_DIR "/var/lib/ducker"
+#define STOP_TIMEOUT_MS 10000
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-d] [-P pod] [-s stats.jsonl] [-m events.jsonl] [-c n_cpu | -x n_cpu] [-S] [-k] [-u id_base] [-F] [-r idle_ms] [-U scan_ms] [-l log [-L] [-i]] [-C ctl.sock] [-N net_profile] [-b rx[:tx]] [-p host_port:cont_port]... [-v host_path:path[:ro]]... [-t path[:size]]... <image> [command...]\n", prog);
+    fprintf(stderr, "       %s -n name [-D state_dir] [options] create <image> | start [command...] | stop | rm\n", prog);
+}
+
 int main(int argc, char **argv)
 {
     cgroup_entry_t cg_conf[] = {
@@ -10,10 +25,65 @@ int main(int argc, char **argv)
         }
     };
 
+    proxy_entry_t proxy_conf[MAX_PUBLISH];
+    volume_entry_t volume_conf[MAX_VOLUME];
+    volume_entry_t *vol;
+    char *sep;
+
+    // forward to the nameserver below, cached
+    dns_config_t dns_conf = {
+        .upstream = NULL,
+        .port = 0,
+        .max_entry = 0
+    };
+
+    stats_config_t stats_conf = {
+        .interval_ms = 0,
+        .n_sample = 0,
+        .out = NULL
+    };
+
+    // stall 100ms in any second counts as pressure
+    memwatch_config_t memwatch_conf = {
+        .stall_us = 100000,
+        .window_us = 0,
+        .level = NULL,
+        .out = NULL
+    };
+
+    // -c shares cpus with other containers, -x takes them exclusively
+    cpuset_config_t cpuset_conf = {
+        .n_cpu = 0,
+        .mode = CPUSET_SHARED,
+        .policy = CPUSET_PACK
+    };
+
+    // -L follows the log on our stdout and stderr, -i makes it a terminal
+    capture_config_t capture_conf = { 0 };
+
+    // -U 0 walks the upper dir at exit only
+    upper_config_t upper_conf = { 0 };
+
+    // defaults but for how long a container has to idle
+    reclaim_config_t reclaim_conf = { 0 };
+
+    // throwaway root: nothing synced, chmod/chown without copying data
+    overlay_config_t overlay_conf = {
+        .volatile_upper = true,
+        .metacopy = true,
+        .redirect_dir = NULL,
+        .index = NULL
+    };
+
+    // -b in bytes/s, rx is the traffic the container receives
+    tc_config_t shape_conf = { 0 };
+
     bridge_config_t bridge_conf = {
         .host_ip = "10.200.1.1",
         .cont_ip = "10.200.1.2",
-        .use_physical = true
+        .use_physical = true,
+        .profile = NULL,
+        .shape = NULL
     };
 
     container_config_t conf = {
@@ -23,19 +93,217 @@ int main(int argc, char **argv)
         .bridge_conf = &bridge_conf,
 
         .cg_conf = cg_conf,
-        .cg_n_conf = sizeof(cg_conf) / sizeof(*cg_conf)
+        .cg_n_conf = sizeof(cg_conf) / sizeof(*cg_conf),
+
+        .proxy_conf = proxy_conf,
+        .proxy_n_conf = 0,
+
+        .volume_conf = volume_conf,
+        .volume_n_conf = 0
     };
 
     container_t *cont;
+    char *cmd;
+    int opt;
+
+    // timestamps from here, and the pending log on a crash
+    log_init(2);
+
+    while ((opt = getopt(argc, argv, "dP:s:m:c:x:Sku:Fr:U:l:LiC:N:b:p:v:t:n:D:")) != -1) {
+        switch (opt) {
+            case 'd':
+                conf.dns_conf = &dns_conf;
+                break;
+
+            case 'P':
+                conf.pod = optarg;
+                break;
+
+            case 's':
+                stats_conf.out = optarg;
+                conf.stats_conf = &stats_conf;
+                break;
+
+            case 'm':
+                memwatch_conf.out = optarg;
+                conf.memwatch_conf = &memwatch_conf;
+                break;
+
+            case 'x':
+                cpuset_conf.mode = CPUSET_EXCLUSIVE;
+                // fall through
+
+            case 'c':
+                cpuset_conf.n_cpu = atoi(optarg);
+                conf.cpuset_conf = &cpuset_conf;
+                break;
+
+            case 'S':
+                cpuset_conf.policy = CPUSET_SPREAD;
+                break;
+
+            case 'k':
+                conf.ksm = true;
+                break;
+
+            case 'u':
+                conf.id_base = atoi(optarg);
+                break;
+
+            case 'F':
+                conf.overlay_conf = &overlay_conf;
+                break;
+
+            case 'r':
+                reclaim_conf.idle_ms = atoi(optarg);
+                conf.reclaim_conf = &reclaim_conf;
+                break;
+
+            case 'U':
+                upper_conf.interval_ms = atoi(optarg);
+                conf.upper_conf = &upper_conf;
+                break;
 
-    if (argc < 2) {
-        fprintf(stderr, "need one argument\n");
+            case 'l':
+                capture_conf.path = optarg;
+                conf.capture_conf = &capture_conf;
+                break;
+
+            case 'L':
+                capture_conf.follow = true;
+                break;
+
+            case 'i':
+                capture_conf.pty = true;
+                break;
+
+            case 'C':
+                conf.ctl_path = optarg;
+                break;
+
+            case 'N':
+                bridge_conf.profile = bridge_profile_find(optarg);
+
+                if (!bridge_conf.profile) {
+                    fprintf(stderr, "unknown network profile '%s'\n", optarg);
+                    return -1;
+                }
+
+                break;
+
+            case 'b':
+                if (sscanf(optarg, "%" SCNu64 ":%" SCNu64,
+                           &shape_conf.rx.rate, &shape_conf.tx.rate) < 1) {
+                    usage(argv[0]);
+                    return -1;
+                }
+
+                bridge_conf.shape = &shape_conf;
+                break;
+
+            case 'n':
+                conf.name = optarg;
+                conf.state_dir = conf.state_dir ? conf.state_dir : STATE_DIR;
+                break;
+
+            case 'D':
+                conf.state_dir = optarg;
+                break;
+
+            case 'p':
+                if (conf.proxy_n_conf >= MAX_PUBLISH ||
+                    sscanf(optarg, "%d:%d",
+                           &proxy_conf[conf.proxy_n_conf].host_port,
+                           &proxy_conf[conf.proxy_n_conf].cont_port) != 2) {
+                    usage(argv[0]);
+                    return -1;
+                }
+
+                proxy_conf[conf.proxy_n_conf++].host_ip = NULL;
+                break;
+
+            case 'v':
+            case 't':
+                if (conf.volume_n_conf >= MAX_VOLUME) {
+                    usage(argv[0]);
+                    return -1;
+                }
+
+                vol = &volume_conf[conf.volume_n_conf++];
+                memset(vol, 0, sizeof(*vol));
+
+                // no devices or setuid binaries from the host through a volume
+                vol->nosuid = vol->nodev = true;
+
+                if (opt == 't') {
+                    vol->type = VOLUME_TMPFS;
+                    vol->target = optarg;
+
+                    if ((sep = strchr(optarg, ':'))) {
+                        *sep = '\0';
+                        vol->size = sep + 1;
+                    }
+
+                    break;
+                }
+
+                vol->type = VOLUME_BIND;
+                vol->source = optarg;
+
+                if (!(sep = strchr(optarg, ':'))) {
+                    usage(argv[0]);
+                    return -1;
+                }
+
+                *sep = '\0';
+                vol->target = sep + 1;
+
+                if ((sep = strchr(vol->target, ':'))) {
+                    if (strcmp(sep + 1, "ro")) {
+                        usage(argv[0]);
+                        return -1;
+                    }
+
+                    *sep = '\0';
+                    vol->read_only = true;
+                }
+
+                break;
+
+            default:
+                usage(argv[0]);
+                return -1;
+        }
+    }
+
+    if (optind >= argc) {
+        usage(argv[0]);
         return -1;
     }
 
+    if (optind + 1 < argc) {
+        conf.argv = argv + optind + 1;
+    }
+
+    if (conf.name) {
+        cmd = argv[optind];
+
+        if (!strcmp(cmd, "create") && optind + 2 == argc) {
+            return container_create(conf.state_dir, conf.name, argv[optind + 1]) ? 1 : 0;
+        } else if (!strcmp(cmd, "stop") && optind + 1 == argc) {
+            return container_stop(conf.state_dir, conf.name, STOP_TIMEOUT_MS) ? 1 : 0;
+        } else if (!strcmp(cmd, "rm") && optind + 1 == argc) {
+            return container_remove(conf.state_dir, conf.name) ? 1 : 0;
+        } else if (strcmp(cmd, "start")) {
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
     cont = container_new(&conf);
 
-    if (container_run_image(cont, argv[1])) {
+    // a named container runs the image it was created from
+    if (container_run_image(cont, conf.name ? NULL : argv[optind])) {
         fprintf(stderr, "failed to run image\n");
     }
 
@@ -0,0 +1,340 @@
+/*
+
+container lifecycle benchmark of the root overlay options
+
+starts a container per run with the bundled workload, which copies up
+the image files and syncs new ones, and reports for each option set
+the start-to-done and teardown times, the fsync time inside, and what
+ended up in the upper dir
+
+must be run as root
+
+*/
+
+#include <errno.h>
+#include <getopt.h>
+#include <glob.h>
+#include <ftw.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/xattr.h>
+
+#include "pub/limit.h"
+
+#include "core/container.h"
+
+#define LIFEBENCH_TMP "/tmp/ducker-lifebench-XXXXXX"
+#define LIFEBENCH_UPPER "/tmp/ducker-lifebench-*/upper" // the image dir has none
+#define LIFEBENCH_METACOPY "trusted.overlay.metacopy"
+
+typedef struct {
+    const char *name;
+    overlay_config_t conf;
+    bool defaults; // conf is not used
+} lifemode_t;
+
+static const lifemode_t modes[] = {
+    { "default", { 0 }, true },
+    { "volatile", { .volatile_upper = true }, false },
+    { "metacopy", { .metacopy = true }, false },
+    { "fast", { .volatile_upper = true, .metacopy = true }, false }
+};
+
+typedef struct {
+    double ready_ms; // start until the workload is done
+    double teardown_ms; // done until the container is cleaned up
+    double work_ms;
+    double fsync_ms;
+
+    // upper dir, files under /data only
+    size_t copied_up;
+    size_t meta_only; // metadata copied up, data still in the image
+    uint64_t upper_bytes; // allocated, everything
+} liferun_t;
+
+// nftw has no user data
+static liferun_t *walk_run;
+
+static double
+now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+walk_upper(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    if (flag != FTW_F) return 0;
+
+    walk_run->upper_bytes += (uint64_t)st->st_blocks * 512;
+
+    if (strstr(path, "/upper/data/")) {
+        walk_run->copied_up++;
+
+        if (lgetxattr(path, LIFEBENCH_METACOPY, NULL, 0) >= 0) {
+            walk_run->meta_only++;
+        }
+    }
+
+    return 0;
+}
+
+static void
+scan_upper(liferun_t *run)
+{
+    glob_t g;
+
+    if (glob(LIFEBENCH_UPPER, 0, NULL, &g)) {
+        LOG_ERROR("no upper dir found");
+        return;
+    }
+
+    walk_run = run;
+
+    if (nftw(g.gl_pathv[0], walk_upper, 16, FTW_PHYS)) {
+        LOG_ERROR("walk upper dir: %s", strerror(errno));
+    }
+
+    globfree(&g);
+}
+
+static int
+run_once(const lifemode_t *mode, const char *img, liferun_t *run)
+{
+    char *argv[] = { "/lifebench-work", NULL };
+
+    bridge_config_t bridge_conf = {
+        .host_ip = "10.200.1.1",
+        .cont_ip = "10.200.1.2",
+        .use_physical = false
+    };
+
+    container_config_t conf = {
+        .tmp_dir = LIFEBENCH_TMP,
+        .host_name = "lifebench",
+        .nameserver = "1.1.1.1",
+        .argv = argv,
+        .bridge_conf = &bridge_conf,
+        .overlay_conf = mode->defaults ? NULL : (overlay_config_t *)&mode->conf
+    };
+
+    char line[256];
+    long work_us, fsync_us;
+    int in[2], out[2];
+    double start, ready;
+    container_t *cont;
+    bool done = false;
+    FILE *fp;
+    pid_t pid;
+    int ret;
+
+    if (pipe(in) || pipe(out)) {
+        LOG_ERROR("pipe: %s", strerror(errno));
+        return -1;
+    }
+
+    start = now();
+    pid = fork();
+
+    if (pid == 0) {
+        // the workload reports on stdout and waits on stdin
+        dup2(in[0], 0);
+        dup2(out[1], 1);
+        close(in[0]);
+        close(in[1]);
+        close(out[0]);
+        close(out[1]);
+
+        cont = container_new(&conf);
+        ret = container_run_image(cont, img);
+        container_free(cont);
+        _exit(ret ? 1 : 0);
+    }
+
+    close(in[0]);
+    close(out[1]);
+
+    fp = fdopen(out[0], "r");
+
+    // the supervisor's helpers may print on the same pipe
+    while (!done && fgets(line, sizeof(line), fp)) {
+        done = sscanf(line, "work_us %ld fsync_us %ld", &work_us, &fsync_us) == 2;
+    }
+
+    ready = now();
+
+    if (done) {
+        run->work_ms = work_us / 1e3;
+        run->fsync_ms = fsync_us / 1e3;
+        scan_upper(run);
+    }
+
+    close(in[1]);
+    fclose(fp);
+
+    if (waitpid(pid, NULL, 0) == -1) {
+        LOG_ERROR("waitpid: %s", strerror(errno));
+    }
+
+    run->ready_ms = (ready - start) * 1e3;
+    run->teardown_ms = (now() - ready) * 1e3;
+
+    if (!done) {
+        LOG_ERROR("workload in mode '%s' did not finish", mode->name);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+run_mode(const lifemode_t *mode, const char *img, int n_run)
+{
+    liferun_t sum = { 0 }, run;
+    int i, n = 0;
+
+    for (i = 0; i < n_run; i++) {
+        memset(&run, 0, sizeof(run));
+
+        if (run_once(mode, img, &run)) continue;
+
+        sum.ready_ms += run.ready_ms;
+        sum.teardown_ms += run.teardown_ms;
+        sum.work_ms += run.work_ms;
+        sum.fsync_ms += run.fsync_ms;
+        sum.copied_up += run.copied_up;
+        sum.meta_only += run.meta_only;
+        sum.upper_bytes += run.upper_bytes;
+        n++;
+    }
+
+    if (!n) {
+        printf("%-9s no successful run\n", mode->name);
+        return;
+    }
+
+    printf("%-9s %9.1f %9.1f %9.1f %9.1f %9zu %9zu %9.1f\n", mode->name,
+           sum.ready_ms / n, sum.teardown_ms / n, sum.work_ms / n, sum.fsync_ms / n,
+           sum.copied_up / n, sum.meta_only / n, sum.upper_bytes / n / 1048576.0);
+
+    fflush(stdout);
+}
+
+/* setup */
+
+static int
+build_image(const char *dir, const char *work, int n_file, int file_kb)
+{
+    char buf[PATH_MAX * 2];
+    char *data;
+    FILE *fp;
+    int i, ret;
+
+    snprintf(buf, sizeof(buf),
+             "mkdir -p '%s/rootfs/proc' '%s/rootfs/sys' '%s/rootfs/tmp' '%s/rootfs/data' && "
+             "cp '%s' '%s/rootfs/lifebench-work'",
+             dir, dir, dir, dir, work, dir);
+
+    if (system(buf)) {
+        LOG_ERROR("failed to build benchmark image");
+        return -1;
+    }
+
+    data = malloc(file_kb * 1024);
+    ASSERT(data, "out of mem");
+
+    memset(data, 'd', file_kb * 1024);
+
+    for (i = 0; i < n_file; i++) {
+        snprintf(buf, sizeof(buf), "%s/rootfs/data/file-%d", dir, i);
+
+        if (!(fp = fopen(buf, "w")) || fwrite(data, 1024, file_kb, fp) != file_kb) {
+            LOG_ERROR("%s: %s", buf, strerror(errno));
+            if (fp) fclose(fp);
+            free(data);
+            return -1;
+        }
+
+        fclose(fp);
+    }
+
+    free(data);
+
+    snprintf(buf, sizeof(buf), "tar -czf '%s/image.tar.gz' -C '%s/rootfs' .", dir, dir);
+
+    ret = system(buf);
+
+    if (ret) {
+        LOG_ERROR("failed to build benchmark image");
+    }
+
+    return ret;
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-n runs] [-f files] [-s file_kb] [-m mode] [-w workload]\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    char dir[] = "/tmp/ducker-lifebench-img-XXXXXX";
+    char img[PATH_MAX];
+    char cmd[PATH_MAX];
+    const char *work = LIFEBENCH_WORK;
+    const char *only = NULL;
+    int n_run = 5, n_file = 256, file_kb = 256;
+    size_t i;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:f:s:m:w:")) != -1) {
+        switch (opt) {
+            case 'n': n_run = atoi(optarg); break;
+            case 'f': n_file = atoi(optarg); break;
+            case 's': file_kb = atoi(optarg); break;
+            case 'm': only = optarg; break;
+            case 'w': work = optarg; break;
+
+            default:
+                usage(argv[0]);
+                return -1;
+        }
+    }
+
+    if (n_run < 1 || n_file < 0 || file_kb < 1) {
+        usage(argv[0]);
+        return -1;
+    }
+
+    // the workload's pipes are the only way to tell it is done
+    signal(SIGPIPE, SIG_IGN);
+
+    if (!mkdtemp(dir)) {
+        LOG_ERROR("mkdtemp: %s", strerror(errno));
+        return -1;
+    }
+
+    snprintf(img, sizeof(img), "%s/image.tar.gz", dir);
+
+    if (build_image(dir, work, n_file, file_kb) == 0) {
+        printf("%-9s %9s %9s %9s %9s %9s %9s %9s\n", "mode",
+               "ready_ms", "down_ms", "work_ms", "fsync_ms", "copied_up", "meta_only", "upper_mb");
+
+        for (i = 0; i < sizeof(modes) / sizeof(*modes); i++) {
+            if (!only || !strcmp(only, modes[i].name)) {
+                run_mode(&modes[i], img, n_run);
+            }
+        }
+    }
+
+    snprintf(cmd, sizeof(cmd), "rm -r '%s'", dir);
+
+    if (system(cmd)) {
+        LOG_WARN("failed to remove '%s'", dir);
+    }
+
+    return 0;
+}
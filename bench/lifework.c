@@ -0,0 +1,85 @@
+/*
+
+static workload bundled into the lifebench image
+
+copies up every file under /data, by metadata (chmod) and by data
+(append to one in four), then creates new files synced one by one.
+prints the time spent, then holds the container up until stdin closes
+so the host can look at the upper dir
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define LIFEWORK_DATA "/data"
+#define LIFEWORK_NEW_FILE 64
+#define LIFEWORK_NEW_SIZE (64 * 1024)
+
+static long
+now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+int main()
+{
+    static char buf[LIFEWORK_NEW_SIZE];
+    char path[512], c;
+    long start = now_us(), fsync_us = 0, t;
+    struct dirent *ent;
+    DIR *dir;
+    int i = 0, fd;
+
+    dir = opendir(LIFEWORK_DATA);
+
+    if (!dir) {
+        perror(LIFEWORK_DATA);
+        return 1;
+    }
+
+    while ((ent = readdir(dir))) {
+        if (ent->d_name[0] == '.') continue;
+
+        snprintf(path, sizeof(path), LIFEWORK_DATA "/%s", ent->d_name);
+        chmod(path, 0600);
+
+        if (i++ % 4 == 0 && (fd = open(path, O_WRONLY | O_APPEND)) != -1) {
+            write(fd, "x", 1);
+            close(fd);
+        }
+    }
+
+    closedir(dir);
+
+    memset(buf, 'n', sizeof(buf));
+
+    for (i = 0; i < LIFEWORK_NEW_FILE; i++) {
+        snprintf(path, sizeof(path), "/new-%d", i);
+
+        if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) continue;
+
+        write(fd, buf, sizeof(buf));
+
+        t = now_us();
+        fsync(fd);
+        fsync_us += now_us() - t;
+
+        close(fd);
+    }
+
+    printf("work_us %ld fsync_us %ld\n", now_us() - start, fsync_us);
+    fflush(stdout);
+
+    while (read(0, &c, 1) > 0);
+
+    return 0;
+}
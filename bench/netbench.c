@@ -0,0 +1,544 @@
+/*
+
+host <-> container network benchmark
+
+starts a container running the bundled static server
+and measures tcp/udp throughput, packet rate and rtt
+for every networking mode ducker supports, under the
+kernel defaults and each built-in network profile
+
+must be run as root
+
+*/
+
+#include <getopt.h>
+#include <pthread.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "pub/limit.h"
+
+#include "core/container.h"
+
+#include "netbench.h"
+
+#define RR_MSG_SIZE 64
+#define UDP_MSG_SIZE 64
+#define UDP_WINDOW 32
+#define READY_TIMEOUT_MS 15000
+
+typedef struct {
+    const char *name;
+    bool proxy; // reach the server through a published port on loopback
+    bool udp; // udp is not relayed by every mode
+} netmode_t;
+
+static const netmode_t modes[] = {
+    { "veth", false, true },
+    { "proxy", true, false }
+};
+
+// "default" runs without a profile, see bridge_profile_find
+static const char *profiles[] = { "default", "throughput", "connrate", "latency" };
+
+typedef struct {
+    struct sockaddr_in addr;
+    double deadline;
+    uint64_t count; // bytes or packets, depending on the test
+
+    double *samples; // rtt of each transaction, rr tests only
+    size_t n_sample;
+    size_t cap;
+} flow_t;
+
+static double
+now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+tcp_connect(const struct sockaddr_in *addr, char cmd)
+{
+    int one = 1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (fd == -1) return -1;
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (connect(fd, (const struct sockaddr *)addr, sizeof(*addr)) ||
+        write(fd, &cmd, 1) != 1) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static int
+read_full(int fd, char *buf, size_t size)
+{
+    size_t got = 0;
+    ssize_t n;
+
+    while (got < size) {
+        n = read(fd, buf + got, size - got);
+        if (n <= 0) return -1;
+        got += n;
+    }
+
+    return 0;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void
+print_latency(const char *mode, const char *prof, const char *test, int n_flow,
+              double *samples, size_t n, double dur)
+{
+    if (!n) {
+        printf("%-6s %-10s %-11s %5d   no samples\n", mode, prof, test, n_flow);
+        return;
+    }
+
+    qsort(samples, n, sizeof(*samples), cmp_double);
+
+#define PCT(p) (samples[(size_t)((n - 1) * (p))] * 1e6)
+
+    printf("%-6s %-10s %-11s %5d   p50 %.1fus p90 %.1fus p99 %.1fus p99.9 %.1fus (%.0f trans/s)\n",
+           mode, prof, test, n_flow, PCT(0.5), PCT(0.9), PCT(0.99), PCT(0.999), n / dur);
+
+#undef PCT
+}
+
+static double *
+push_sample(double *samples, size_t *n, size_t *cap, double val)
+{
+    if (*n == *cap) {
+        *cap = *cap ? *cap * 2 : 4096;
+        samples = realloc(samples, sizeof(*samples) * *cap);
+        ASSERT(samples, "out of mem");
+    }
+
+    samples[(*n)++] = val;
+
+    return samples;
+}
+
+/* tests */
+
+static void *
+tcp_stream_flow(void *arg)
+{
+    static char buf[NETBENCH_BUF_SIZE];
+    flow_t *flow = arg;
+    ssize_t n;
+    int fd = tcp_connect(&flow->addr, NETBENCH_CMD_SINK);
+
+    if (fd == -1) return NULL;
+
+    while (now() < flow->deadline) {
+        n = write(fd, buf, sizeof(buf));
+        if (n <= 0) break;
+        flow->count += n;
+    }
+
+    close(fd);
+
+    return NULL;
+}
+
+static void *
+udp_pps_flow(void *arg)
+{
+    char buf[UDP_MSG_SIZE] = { 0 };
+    struct timeval tv = { .tv_sec = 0, .tv_usec = 100000 };
+    flow_t *flow = arg;
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    int i;
+
+    if (fd == -1) return NULL;
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    if (connect(fd, (struct sockaddr *)&flow->addr, sizeof(flow->addr))) {
+        close(fd);
+        return NULL;
+    }
+
+    // keep a window of datagrams in flight, count echoes
+    while (now() < flow->deadline) {
+        for (i = 0; i < UDP_WINDOW; i++) {
+            send(fd, buf, sizeof(buf), 0);
+        }
+
+        for (i = 0; i < UDP_WINDOW; i++) {
+            if (recv(fd, buf, sizeof(buf), 0) <= 0) break;
+            flow->count++;
+        }
+    }
+
+    close(fd);
+
+    return NULL;
+}
+
+static void *
+tcp_rr_flow(void *arg)
+{
+    char buf[RR_MSG_SIZE] = { 0 };
+    flow_t *flow = arg;
+    double t;
+    int fd = tcp_connect(&flow->addr, NETBENCH_CMD_ECHO);
+
+    if (fd == -1) {
+        LOG_ERROR("tcp_rr connect: %s", strerror(errno));
+        return NULL;
+    }
+
+    while ((t = now()) < flow->deadline) {
+        if (write(fd, buf, sizeof(buf)) != sizeof(buf) ||
+            read_full(fd, buf, sizeof(buf))) {
+            break;
+        }
+
+        flow->samples = push_sample(flow->samples, &flow->n_sample, &flow->cap, now() - t);
+    }
+
+    close(fd);
+
+    return NULL;
+}
+
+static void *
+udp_rr_flow(void *arg)
+{
+    char buf[UDP_MSG_SIZE] = { 0 };
+    struct timeval tv = { .tv_sec = 0, .tv_usec = 100000 };
+    flow_t *flow = arg;
+    double t;
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+    if (fd == -1) return NULL;
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    if (connect(fd, (const struct sockaddr *)&flow->addr, sizeof(flow->addr))) {
+        LOG_ERROR("udp_rr connect: %s", strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    while ((t = now()) < flow->deadline) {
+        // a lost datagram just costs one timeout
+        if (send(fd, buf, sizeof(buf), 0) != sizeof(buf) ||
+            recv(fd, buf, sizeof(buf), 0) != sizeof(buf)) {
+            continue;
+        }
+
+        flow->samples = push_sample(flow->samples, &flow->n_sample, &flow->cap, now() - t);
+    }
+
+    close(fd);
+
+    return NULL;
+}
+
+// samples, if not NULL, gets the rtt samples of all flows, to be freed
+static uint64_t
+run_flows(void *(*fn)(void *), const struct sockaddr_in *addr, int n_flow, double dur,
+          double **samples, size_t *n_sample)
+{
+    pthread_t threads[n_flow];
+    flow_t flows[n_flow];
+    uint64_t total = 0;
+    double deadline = now() + dur;
+    size_t cap = 0, j;
+    int i;
+
+    if (samples) {
+        *samples = NULL;
+        *n_sample = 0;
+    }
+
+    for (i = 0; i < n_flow; i++) {
+        flows[i] = (flow_t) { .addr = *addr, .deadline = deadline, .count = 0 };
+        pthread_create(&threads[i], NULL, fn, &flows[i]);
+    }
+
+    for (i = 0; i < n_flow; i++) {
+        pthread_join(threads[i], NULL);
+        total += flows[i].count;
+
+        for (j = 0; samples && j < flows[i].n_sample; j++) {
+            *samples = push_sample(*samples, n_sample, &cap, flows[i].samples[j]);
+        }
+
+        free(flows[i].samples);
+    }
+
+    return total;
+}
+
+static void
+run_rr(const char *mode, const char *prof, const char *test, void *(*fn)(void *),
+       const struct sockaddr_in *addr, int max_flow, double dur)
+{
+    double *samples;
+    size_t n_sample;
+    int n;
+
+    for (n = 1; n <= max_flow; n *= 2) {
+        run_flows(fn, addr, n, dur, &samples, &n_sample);
+        print_latency(mode, prof, test, n, samples, n_sample, dur);
+        free(samples);
+    }
+}
+
+/* setup */
+
+static int
+build_image(const char *dir, const char *server)
+{
+    char buf[PATH_MAX * 2];
+    int ret;
+
+    snprintf(buf, sizeof(buf),
+             "mkdir -p '%s/rootfs/proc' '%s/rootfs/sys' '%s/rootfs/tmp' && "
+             "cp '%s' '%s/rootfs/netbench-server' && "
+             "tar -czf '%s/image.tar.gz' -C '%s/rootfs' .",
+             dir, dir, dir, server, dir, dir, dir);
+
+    ret = system(buf);
+
+    if (ret) {
+        LOG_ERROR("failed to build benchmark image");
+    }
+
+    return ret;
+}
+
+static pid_t
+start_container(const netmode_t *mode, const char *prof, tc_config_t *shape, const char *img)
+{
+    char *argv[] = { "/netbench-server", NULL };
+
+    proxy_entry_t proxy_conf = {
+        .host_ip = "127.0.0.1",
+        .host_port = NETBENCH_PROXY_PORT,
+        .cont_port = NETBENCH_PORT
+    };
+
+    bridge_config_t bridge_conf = {
+        .host_ip = "10.200.1.1",
+        .cont_ip = "10.200.1.2",
+        .use_physical = false,
+        .profile = bridge_profile_find(prof),
+        .shape = shape
+    };
+
+    container_config_t conf = {
+        .tmp_dir = "/tmp/ducker-netbench-XXXXXX",
+        .host_name = "netbench",
+        .nameserver = "1.1.1.1",
+        .argv = argv,
+        .bridge_conf = &bridge_conf,
+
+        .cg_conf = NULL,
+        .cg_n_conf = 0,
+
+        .proxy_conf = &proxy_conf,
+        .proxy_n_conf = mode->proxy ? 1 : 0
+    };
+
+    container_t *cont;
+    pid_t pid = fork();
+    int ret;
+
+    if (pid == 0) {
+        cont = container_new(&conf);
+        ret = container_run_image(cont, img);
+        container_free(cont);
+        _exit(ret ? 1 : 0);
+    }
+
+    return pid;
+}
+
+static int
+wait_ready(const struct sockaddr_in *addr)
+{
+    char buf[1] = { 0 };
+    double deadline = now() + READY_TIMEOUT_MS / 1000.0;
+    int fd;
+
+    while (now() < deadline) {
+        fd = tcp_connect(addr, NETBENCH_CMD_ECHO);
+
+        if (fd != -1) {
+            if (write(fd, buf, 1) == 1 && read_full(fd, buf, 1) == 0) {
+                close(fd);
+                return 0;
+            }
+
+            close(fd);
+        }
+
+        usleep(100000);
+    }
+
+    return -1;
+}
+
+static void
+run_mode(const netmode_t *mode, const char *prof, tc_config_t *shape, const char *img, int max_flow, double dur)
+{
+    struct sockaddr_in addr, direct;
+    uint64_t total;
+    pid_t pid;
+    int n, fd;
+
+    memset(&direct, 0, sizeof(direct));
+    direct.sin_family = AF_INET;
+    direct.sin_port = htons(NETBENCH_PORT);
+    inet_pton(AF_INET, "10.200.1.2", &direct.sin_addr);
+
+    addr = direct;
+
+    if (mode->proxy) {
+        addr.sin_port = htons(NETBENCH_PROXY_PORT);
+        inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    }
+
+    pid = start_container(mode, prof, shape, img);
+
+    if (pid == -1) {
+        LOG_ERROR("fork: %s", strerror(errno));
+        return;
+    }
+
+    if (wait_ready(&addr)) {
+        LOG_ERROR("server in mode '%s' with profile '%s' is not reachable", mode->name, prof);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return;
+    }
+
+    for (n = 1; n <= max_flow; n *= 2) {
+        total = run_flows(tcp_stream_flow, &addr, n, dur, NULL, NULL);
+        printf("%-6s %-10s %-11s %5d   %.2f Gbps\n", mode->name, prof, "tcp_stream", n, total * 8 / dur / 1e9);
+    }
+
+    run_rr(mode->name, prof, "tcp_rr", tcp_rr_flow, &addr, max_flow, dur);
+
+    if (mode->udp) {
+        for (n = 1; n <= max_flow; n *= 2) {
+            total = run_flows(udp_pps_flow, &addr, n, dur, NULL, NULL);
+            printf("%-6s %-10s %-11s %5d   %.3f Mpps\n", mode->name, prof, "udp_pps", n, total / dur / 1e6);
+        }
+
+        run_rr(mode->name, prof, "udp_rr", udp_rr_flow, &addr, max_flow, dur);
+    }
+
+    fflush(stdout);
+
+    // stop the server, taking the container down with it
+    fd = tcp_connect(&direct, NETBENCH_CMD_QUIT);
+    if (fd != -1) close(fd);
+
+    if (waitpid(pid, NULL, 0) == -1) {
+        LOG_ERROR("waitpid: %s", strerror(errno));
+    }
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-n max_flows] [-d seconds] [-m mode] [-p profile] [-b bytes/s] [-s server]\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    char dir[] = "/tmp/ducker-netbench-img-XXXXXX";
+    char img[PATH_MAX];
+    char cmd[PATH_MAX];
+    const char *server = NETBENCH_SERVER;
+    const char *only = NULL;
+    const char *only_prof = NULL;
+    tc_config_t shape_conf = { 0 };
+    tc_config_t *shape = NULL;
+    int max_flow = 4;
+    double dur = 3;
+    size_t i, j;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:d:m:p:b:s:")) != -1) {
+        switch (opt) {
+            case 'n': max_flow = atoi(optarg); break;
+            case 'd': dur = atof(optarg); break;
+            case 'm': only = optarg; break;
+            case 'p': only_prof = optarg; break;
+
+            // the same limit both ways
+            case 'b':
+                shape_conf.rx.rate = shape_conf.tx.rate = strtoull(optarg, NULL, 10);
+                shape = &shape_conf;
+                break;
+
+            case 's': server = optarg; break;
+
+            default:
+                usage(argv[0]);
+                return -1;
+        }
+    }
+
+    if (max_flow < 1 || dur <= 0) {
+        usage(argv[0]);
+        return -1;
+    }
+
+    if (only_prof && strcmp(only_prof, "default") && !bridge_profile_find(only_prof)) {
+        fprintf(stderr, "unknown network profile '%s'\n", only_prof);
+        return -1;
+    }
+
+    if (!mkdtemp(dir)) {
+        LOG_ERROR("mkdtemp: %s", strerror(errno));
+        return -1;
+    }
+
+    snprintf(img, sizeof(img), "%s/image.tar.gz", dir);
+
+    if (build_image(dir, server) == 0) {
+        printf("%-6s %-10s %-11s %5s   %s\n", "mode", "profile", "test", "flows", "result");
+
+        for (i = 0; i < sizeof(modes) / sizeof(*modes); i++) {
+            if (only && strcmp(only, modes[i].name)) continue;
+
+            for (j = 0; j < sizeof(profiles) / sizeof(*profiles); j++) {
+                if (!only_prof || !strcmp(only_prof, profiles[j])) {
+                    run_mode(&modes[i], profiles[j], shape, img, max_flow, dur);
+                }
+            }
+        }
+    }
+
+    snprintf(cmd, sizeof(cmd), "rm -r '%s'", dir);
+
+    if (system(cmd)) {
+        LOG_WARN("failed to remove '%s'", dir);
+    }
+
+    return 0;
+}
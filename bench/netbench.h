@@ -0,0 +1,13 @@
+#ifndef _BENCH_NETBENCH_H_
+#define _BENCH_NETBENCH_H_
+
+#define NETBENCH_PORT 5201
+#define NETBENCH_PROXY_PORT 15201 // host port used by the proxy mode
+
+#define NETBENCH_BUF_SIZE (128 * 1024)
+
+#define NETBENCH_CMD_ECHO 'E'
+#define NETBENCH_CMD_SINK 'S'
+#define NETBENCH_CMD_QUIT 'Q'
+
+#endif
@@ -0,0 +1,132 @@
+/*
+
+static echo/stream server bundled into the netbench image
+
+tcp connections start with a one byte command:
+    'E' echo everything back
+    'S' sink everything
+    'Q' exit the server (and so the container)
+
+udp datagrams are echoed back as is
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "netbench.h"
+
+static void
+serve_conn(int fd)
+{
+    static char buf[NETBENCH_BUF_SIZE];
+    ssize_t n;
+    char cmd;
+    int one = 1;
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (read(fd, &cmd, 1) != 1) return;
+
+    switch (cmd) {
+        case NETBENCH_CMD_ECHO:
+            while ((n = read(fd, buf, sizeof(buf))) > 0) {
+                if (write(fd, buf, n) != n) break;
+            }
+            break;
+
+        case NETBENCH_CMD_SINK:
+            while (read(fd, buf, sizeof(buf)) > 0);
+            break;
+
+        case NETBENCH_CMD_QUIT:
+            // we are pid 1, exiting tears down the container
+            kill(-1, SIGKILL);
+            exit(0);
+    }
+}
+
+static void
+serve_udp(int fd)
+{
+    static char buf[NETBENCH_BUF_SIZE];
+    struct sockaddr_in peer;
+    socklen_t len;
+    ssize_t n;
+
+    while (1) {
+        len = sizeof(peer);
+        n = recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr *)&peer, &len);
+
+        if (n >= 0) {
+            sendto(fd, buf, n, 0, (struct sockaddr *)&peer, len);
+        }
+    }
+}
+
+int main()
+{
+    struct sockaddr_in addr;
+    int tcp, udp, conn;
+    int one = 1;
+    pid_t pid;
+
+    signal(SIGCHLD, SIG_IGN);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(NETBENCH_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    tcp = socket(AF_INET, SOCK_STREAM, 0);
+    udp = socket(AF_INET, SOCK_DGRAM, 0);
+
+    setsockopt(tcp, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    if (bind(tcp, (struct sockaddr *)&addr, sizeof(addr)) || listen(tcp, 128)) {
+        perror("tcp listen");
+        return -1;
+    }
+
+    if (bind(udp, (struct sockaddr *)&addr, sizeof(addr))) {
+        perror("udp bind");
+        return -1;
+    }
+
+    if (fork() == 0) {
+        close(tcp);
+        serve_udp(udp);
+        return 0;
+    }
+
+    close(udp);
+
+    while ((conn = accept(tcp, NULL, NULL)) != -1) {
+        char cmd;
+
+        // quit is handled in pid 1 so the whole container goes down
+        if (recv(conn, &cmd, 1, MSG_PEEK) == 1 && cmd == NETBENCH_CMD_QUIT) {
+            serve_conn(conn);
+        }
+
+        pid = fork();
+
+        if (pid == 0) {
+            close(tcp);
+            serve_conn(conn);
+            exit(0);
+        }
+
+        close(conn);
+    }
+
+    perror("accept");
+
+    return -1;
+}
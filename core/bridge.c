@@ -1,4 +1,10 @@
+#include <errno.h>
 #include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <linux/ethtool.h>
+#include <linux/sockios.h>
 
 #include "pub/type.h"
 #include "pub/limit.h"
@@ -6,16 +12,13 @@
 
 #include "bridge.h"
 
-#define BRIDGE_VETH_PREFIX "dveth"
-#define BRIDGE_VPEER_PREFIX "dvpeer"
-
 #define SYSTEM(clean, action, ...) \
     do { \
         char *cmd; \
         asprintf(&cmd, __VA_ARGS__); \
-        LOG("+ %s", cmd); \
+        LOG_DEBUG("+ %s", cmd); \
         if (system(cmd)) { \
-            LOG("failed to " action); \
+            LOG_ERROR("failed to " action); \
             free(cmd); \
             clean; \
             return -1; \
@@ -23,6 +26,92 @@
         free(cmd); \
     } while (0);
 
+// only namespaced knobs, see bridge_write_sysctl
+static bridge_sysctl_t bridge_throughput_sysctl[] = {
+    { "net.ipv4.tcp_rmem", "4096 131072 33554432" },
+    { "net.ipv4.tcp_wmem", "4096 65536 33554432" },
+    { "net.ipv4.tcp_slow_start_after_idle", "0" },
+};
+
+static bridge_sysctl_t bridge_connrate_sysctl[] = {
+    { "net.core.somaxconn", "65535" },
+    { "net.ipv4.tcp_max_syn_backlog", "65535" },
+    { "net.ipv4.ip_local_port_range", "1024 65535" },
+    { "net.ipv4.tcp_tw_reuse", "1" },
+    { "net.ipv4.tcp_fin_timeout", "15" },
+};
+
+// busy polling is host wide, the namespaced part is sending without delay
+static bridge_sysctl_t bridge_latency_sysctl[] = {
+    { "net.ipv4.tcp_autocorking", "0" },
+    { "net.ipv4.tcp_notsent_lowat", "16384" },
+};
+
+#define BRIDGE_SYSCTLS(a) a, sizeof(a) / sizeof(*a)
+
+static struct {
+    const char *name;
+    bridge_profile_t prof;
+} bridge_profiles[] = {
+    { "throughput", { BRIDGE_SYSCTLS(bridge_throughput_sysctl), BRIDGE_QUEUE_AUTO, BRIDGE_OFFLOAD_ON, BRIDGE_OFFLOAD_ON } },
+    { "connrate", { BRIDGE_SYSCTLS(bridge_connrate_sysctl), BRIDGE_QUEUE_AUTO, BRIDGE_OFFLOAD_DEFAULT, BRIDGE_OFFLOAD_DEFAULT } },
+    { "latency", { BRIDGE_SYSCTLS(bridge_latency_sysctl), 0, BRIDGE_OFFLOAD_OFF, BRIDGE_OFFLOAD_DEFAULT } },
+};
+
+#undef BRIDGE_SYSCTLS
+
+bridge_profile_t *
+bridge_profile_find(const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(bridge_profiles) / sizeof(*bridge_profiles); i++) {
+        if (!strcmp(bridge_profiles[i].name, name)) return &bridge_profiles[i].prof;
+    }
+
+    return NULL;
+}
+
+static bridge_profile_t *
+bridge_profile_copy(const bridge_profile_t *prof)
+{
+    bridge_profile_t *copy;
+    size_t i;
+
+    if (!prof) return NULL;
+
+    copy = malloc(sizeof(*copy));
+    ASSERT(copy, "out of mem");
+
+    *copy = *prof;
+
+    copy->sysctl = malloc(sizeof(*copy->sysctl) * prof->n_sysctl);
+    ASSERT(copy->sysctl || !prof->n_sysctl, "out of mem");
+
+    for (i = 0; i < prof->n_sysctl; i++) {
+        copy->sysctl[i].key = strdup(prof->sysctl[i].key);
+        copy->sysctl[i].val = strdup(prof->sysctl[i].val);
+    }
+
+    return copy;
+}
+
+static void
+bridge_profile_free(bridge_profile_t *prof)
+{
+    size_t i;
+
+    if (prof) {
+        for (i = 0; i < prof->n_sysctl; i++) {
+            free(prof->sysctl[i].key);
+            free(prof->sysctl[i].val);
+        }
+
+        free(prof->sysctl);
+        free(prof);
+    }
+}
+
 bridge_config_t *
 bridge_config_copy(const bridge_config_t *conf)
 {
@@ -32,6 +121,8 @@ bridge_config_copy(const bridge_config_t *conf)
     copy->host_ip = strdup(conf->host_ip);
     copy->cont_ip = strdup(conf->cont_ip);
     copy->use_physical = conf->use_physical;
+    copy->profile = bridge_profile_copy(conf->profile);
+    copy->shape = tc_config_copy(conf->shape);
 
     return copy;
 }
@@ -42,6 +133,8 @@ bridge_config_free(bridge_config_t *conf)
     if (conf) {
         free(conf->host_ip);
         free(conf->cont_ip);
+        bridge_profile_free(conf->profile);
+        tc_config_free(conf->shape);
         free(conf);
     }
 }
@@ -53,12 +146,12 @@ static char *get_physical_dev()
     char dev[16];
 
     if (!fp) {
-        perror("failed to execute command");
+        LOG_ERROR("failed to execute command: %s", strerror(errno));
         return NULL;
     }
 
     if (fscanf(fp, "default via %*s dev %16s", dev) != 1) {
-        LOG("failed to get device name");
+        LOG_ERROR("failed to get device name");
         return NULL;
     }
 
@@ -67,14 +160,171 @@ static char *get_physical_dev()
     return strdup(dev);
 }
 
-int bridge_set_up(const bridge_config_t *conf, pid_t pid)
+static int
+bridge_n_queue(const bridge_profile_t *prof, pid_t pid)
+{
+    cpu_set_t set;
+
+    if (!prof || prof->n_queue >= 0) {
+        return prof ? prof->n_queue : 0;
+    }
+
+    // match the cpus the container is allowed to run on
+    if (sched_getaffinity(pid, sizeof(set), &set)) {
+        LOG_ERROR("sched_getaffinity: %s", strerror(errno));
+        return 0;
+    }
+
+    return CPU_COUNT(&set);
+}
+
+static int
+bridge_set_offload(const char *dev, uint32_t cmd, bridge_offload_t val)
+{
+    struct ethtool_value eval;
+    struct ifreq ifr;
+    int fd, ret;
+
+    if (val == BRIDGE_OFFLOAD_DEFAULT) return 0;
+
+    // the socket decides which netns dev is looked up in
+    fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+
+    if (fd == -1) {
+        LOG_ERROR("offload socket: %s", strerror(errno));
+        return -1;
+    }
+
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, dev, sizeof(ifr.ifr_name) - 1);
+
+    eval.cmd = cmd;
+    eval.data = val == BRIDGE_OFFLOAD_ON;
+    ifr.ifr_data = (void *)&eval;
+
+    ret = ioctl(fd, SIOCETHTOOL, &ifr);
+
+    if (ret) {
+        LOG_ERROR("set offload: %s", strerror(errno));
+    }
+
+    close(fd);
+
+    return ret;
+}
+
+static int
+bridge_set_offloads(const bridge_profile_t *prof, const char *dev)
+{
+    int ret = 0;
+
+    ret |= bridge_set_offload(dev, ETHTOOL_SGRO, prof->gro);
+    ret |= bridge_set_offload(dev, ETHTOOL_SGSO, prof->gso);
+
+    return ret;
+}
+
+static int
+bridge_write_sysctl(const bridge_sysctl_t *ctl)
+{
+    char path[PATH_MAX];
+    size_t i, len;
+    int fd;
+
+    // only namespaced knobs, never touch host-wide settings
+    if (strncmp(ctl->key, "net.", 4) || strchr(ctl->key, '/')) {
+        LOG_WARN("refusing to set sysctl '%s'", ctl->key);
+        return -1;
+    }
+
+    len = snprintf(path, sizeof(path), "/proc/sys/%s", ctl->key);
+
+    for (i = sizeof("/proc/sys/") - 1; i < len && i < sizeof(path); i++) {
+        if (path[i] == '.') path[i] = '/';
+    }
+
+    LOG_DEBUG("sysctl %s = %s", ctl->key, ctl->val);
+
+    fd = open(path, O_WRONLY | O_TRUNC);
+
+    if (fd == -1) {
+        LOG_ERROR("open sysctl: %s", strerror(errno));
+        return -1;
+    }
+
+    if (write(fd, ctl->val, strlen(ctl->val)) == -1) {
+        LOG_ERROR("write sysctl: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    close(fd);
+
+    return 0;
+}
+
+// sysctls under /proc/sys/net and ethtool ioctls act on the
+// netns of the caller, so briefly switch into the container's
+static int
+bridge_apply_profile(const bridge_profile_t *prof, pid_t pid,
+                     const char *veth, const char *vpeer)
+{
+    char path[PATH_MAX];
+    int self, target;
+    size_t i;
+
+    if (!prof) return 0;
+
+    if (bridge_set_offloads(prof, veth)) {
+        LOG_WARN("failed to set offloads on %s", veth);
+    }
+
+    snprintf(path, sizeof(path), "/proc/%d/ns/net", pid);
+
+    self = open("/proc/self/ns/net", O_RDONLY | O_CLOEXEC);
+    target = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (self == -1 || target == -1 || setns(target, CLONE_NEWNET)) {
+        LOG_ERROR("enter container netns: %s", strerror(errno));
+        if (self != -1) close(self);
+        if (target != -1) close(target);
+        return -1;
+    }
+
+    // a knob the kernel does not namespace should not fail the start
+    for (i = 0; i < prof->n_sysctl; i++) {
+        if (bridge_write_sysctl(&prof->sysctl[i])) {
+            LOG_WARN("failed to set sysctl '%s'", prof->sysctl[i].key);
+        }
+    }
+
+    if (bridge_set_offloads(prof, vpeer)) {
+        LOG_WARN("failed to set offloads on %s", vpeer);
+    }
+
+    // stuck in the container's netns, the caller must not go on
+    if (setns(self, CLONE_NEWNET)) {
+        LOG_ERROR("return to host netns: %s", strerror(errno));
+        close(self);
+        close(target);
+        return -1;
+    }
+
+    close(self);
+    close(target);
+
+    return 0;
+}
+
+int bridge_set_up(const bridge_config_t *conf, pid_t pid, const char *id)
 {
     char *veth = NULL, *vpeer = NULL, *phy = NULL;
     char p1[PATH_MAX], p2[PATH_MAX];
+    int n_queue;
     int fd;
 
     snprintf(p1, sizeof(p1), "/proc/%d/ns/net", pid);
-    snprintf(p2, sizeof(p2), "/var/run/netns/%d", pid);
+    snprintf(p2, sizeof(p2), "/var/run/netns/" BRIDGE_NETNS_PREFIX "%s", id);
 
     // make dir first if not exist
     mkdir("/var/run/netns", 0755);
@@ -82,19 +332,19 @@ int bridge_set_up(const bridge_config_t *conf, pid_t pid)
     fd = open(p2, O_RDONLY | O_CREAT, 0444); // read only
 
     if (fd == -1) {
-        perror("open namespace");
+        LOG_ERROR("open namespace: %s", strerror(errno));
         return -1;
     }
 
     close(fd);
 
     if (mount(p1, p2, "bind", MS_BIND, NULL)) {
-        perror("bind netns name");
+        LOG_ERROR("bind netns name: %s", strerror(errno));
         return -1;
     }
 
-    asprintf(&veth, BRIDGE_VETH_PREFIX "%d", pid);
-    asprintf(&vpeer, BRIDGE_VPEER_PREFIX "%d", pid);
+    asprintf(&veth, BRIDGE_VETH_PREFIX "%s", id);
+    asprintf(&vpeer, BRIDGE_VPEER_PREFIX "%s", id);
 
 #define CLEAN \
     do { \
@@ -103,31 +353,53 @@ int bridge_set_up(const bridge_config_t *conf, pid_t pid)
         free(phy); \
     } while (0)
 
-    SYSTEM(CLEAN, "create veth pair", "ip link add %s type veth peer name %s", veth, vpeer);
+    n_queue = bridge_n_queue(conf->profile, pid);
+
+    if (n_queue > 0) {
+        SYSTEM(CLEAN, "create veth pair",
+               "ip link add %s numtxqueues %d numrxqueues %d type veth peer name %s numtxqueues %d numrxqueues %d",
+               veth, n_queue, n_queue, vpeer, n_queue, n_queue);
+    } else {
+        SYSTEM(CLEAN, "create veth pair", "ip link add %s type veth peer name %s", veth, vpeer);
+    }
+
     SYSTEM(CLEAN, "add vpeer to the new namespace", "ip link set %s netns %d", vpeer, pid);
 
     SYSTEM(CLEAN, "assign host ip", "ip addr add %s/24 dev %s", conf->host_ip, veth);
     SYSTEM(CLEAN, "start veth", "ip link set %s up", veth);
 
-    SYSTEM(CLEAN, "assign container ip", "ip netns exec %d ip addr add %s/24 dev %s", pid, conf->cont_ip, vpeer);
-    SYSTEM(CLEAN, "activate lo", "ip netns exec %d ip link set lo up", pid);
-    SYSTEM(CLEAN, "start vpeer", "ip netns exec %d ip link set %s up", pid, vpeer);
+    SYSTEM(CLEAN, "assign container ip", "ip netns exec " BRIDGE_NETNS_PREFIX "%s ip addr add %s/24 dev %s", id, conf->cont_ip, vpeer);
+    SYSTEM(CLEAN, "activate lo", "ip netns exec " BRIDGE_NETNS_PREFIX "%s ip link set lo up", id);
+    SYSTEM(CLEAN, "start vpeer", "ip netns exec " BRIDGE_NETNS_PREFIX "%s ip link set %s up", id, vpeer);
+
+    SYSTEM(CLEAN, "activate routing", "ip netns exec " BRIDGE_NETNS_PREFIX "%s ip route add default via %s", id, conf->host_ip);
+
+    if (bridge_apply_profile(conf->profile, pid, veth, vpeer)) {
+        LOG_ERROR("failed to apply network profile");
+        CLEAN;
+        return -1;
+    }
 
-    SYSTEM(CLEAN, "activate routing", "ip netns exec %d ip route add default via %s", pid, conf->host_ip);
+    if (tc_set_up(conf->shape, id)) {
+        LOG_ERROR("failed to set up bandwidth limits");
+        CLEAN;
+        return -1;
+    }
 
     if (umount(p2)) {
-        perror("umount tmp netns");
+        LOG_ERROR("umount tmp netns: %s", strerror(errno));
         CLEAN;
         return -1;
     }
 
     if (unlink(p2)) {
-        perror("unlink tmp netns");
+        LOG_ERROR("unlink tmp netns: %s", strerror(errno));
         CLEAN;
         return -1;
     }
 
-    phy = get_physical_dev();
+    // host-only networking skips forwarding to the uplink
+    phy = conf->use_physical ? get_physical_dev() : NULL;
 
     if (phy) {
         // set access to internet
@@ -136,13 +408,13 @@ int bridge_set_up(const bridge_config_t *conf, pid_t pid)
         fd = open("/proc/sys/net/ipv4/ip_forward", O_WRONLY | O_TRUNC);
 
         if (fd == -1) {
-            perror("enable ip forward");
+            LOG_ERROR("enable ip forward: %s", strerror(errno));
             CLEAN;
             return -1;
         }
 
         if (write(fd, "1", 1) != 1) {
-            perror("failed to enable ip forward");
+            LOG_ERROR("failed to enable ip forward: %s", strerror(errno));
             CLEAN;
             return -1;
         }
@@ -165,11 +437,15 @@ int bridge_set_up(const bridge_config_t *conf, pid_t pid)
     return 0;
 }
 
-int bridge_clean(pid_t pid)
+int bridge_clean(const char *id)
 {
     char *veth;
 
-    asprintf(&veth, BRIDGE_VETH_PREFIX "%d", pid);
+    asprintf(&veth, BRIDGE_VETH_PREFIX "%s", id);
+
+    if (tc_clean(id)) {
+        LOG_WARN("failed to remove ifb");
+    }
 
     // ignore any failures
     SYSTEM({ free(veth); return 0; }, "remove veth", "ip link del %s", veth);
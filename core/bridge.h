@@ -5,20 +5,59 @@
 #include "pub/mount.h"
 #include "pub/clone.h"
 
+#include "tc.h"
+
+#define BRIDGE_VETH_PREFIX "dveth"
+#define BRIDGE_VPEER_PREFIX "dvpeer"
+#define BRIDGE_NETNS_PREFIX "ducker-" // name under /var/run/netns while setting up
+
+#define BRIDGE_QUEUE_AUTO -1 // one veth queue per cpu the container may use
+
+typedef enum {
+    BRIDGE_OFFLOAD_DEFAULT = 0,
+    BRIDGE_OFFLOAD_ON,
+    BRIDGE_OFFLOAD_OFF
+} bridge_offload_t;
+
+typedef struct {
+    char *key; // namespaced sysctl, e.g. net.core.somaxconn
+    char *val;
+} bridge_sysctl_t;
+
+// network tuning applied to the container netns and its veth pair
+typedef struct {
+    bridge_sysctl_t *sysctl;
+    size_t n_sysctl;
+
+    int n_queue; // veth tx/rx queues, 0 for the kernel default
+    bridge_offload_t gro;
+    bridge_offload_t gso;
+} bridge_profile_t;
+
 typedef struct {
     char *host_ip;
     char *cont_ip;
     bool use_physical;
+    bridge_profile_t *profile; // NULL for kernel defaults
+    tc_config_t *shape; // NULL for no bandwidth limits
 } bridge_config_t;
 
+// built-in profiles: throughput (large tcp buffers, a queue per cpu, gro/gso on),
+// connrate (deep accept and syn queues, wide port range) and latency (no
+// corking, gro off). NULL if unknown, the profile is static
+bridge_profile_t *
+bridge_profile_find(const char *name);
+
 bridge_config_t *
 bridge_config_copy(const bridge_config_t *conf);
 
 void
 bridge_config_free(bridge_config_t *conf);
 
-int bridge_set_up(const bridge_config_t *conf, pid_t pid);
+// the devices are named after id, the pid of init or, for a pod whose
+// network outlives its leader, an allocated slot that no pid can reuse
+int bridge_set_up(const bridge_config_t *conf, pid_t pid, const char *id);
 
-int bridge_clean(pid_t pid);
+int bridge_clean(const char *id);
 
 #endif
@@ -0,0 +1,468 @@
+#include <errno.h>
+#include <time.h>
+#include <inttypes.h>
+#include <sys/ioctl.h>
+
+#include "pub/type.h"
+#include "pub/fd.h"
+#include "pub/limit.h"
+
+#include "capture.h"
+
+#define CAPTURE_COPY_SIZE 65536
+
+capture_config_t *
+capture_config_copy(const capture_config_t *conf)
+{
+    capture_config_t *copy;
+
+    if (!conf) return NULL;
+
+    copy = malloc(sizeof(*copy));
+    ASSERT(copy, "out of mem");
+
+    *copy = *conf;
+    copy->path = strdup(conf->path);
+
+    return copy;
+}
+
+void
+capture_config_free(capture_config_t *conf)
+{
+    if (conf) {
+        free(conf->path);
+        free(conf);
+    }
+}
+
+static uint64_t
+capture_now_usec()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static int
+capture_open_log(capture_t *cap)
+{
+    struct stat st;
+
+    // splice refuses files opened for append, the offset is moved to the end instead
+    cap->file = open(cap->conf.path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+
+    if (cap->file == -1 || fstat(cap->file, &st) || lseek(cap->file, 0, SEEK_END) == -1) {
+        LOG_ERROR("%s: %s", cap->conf.path, strerror(errno));
+
+        if (cap->file != -1) close(cap->file);
+        cap->file = -1;
+
+        return -1;
+    }
+
+    cap->size = st.st_size;
+
+    return 0;
+}
+
+// lines may be split across two files, the log is only rotated between writes
+static void
+capture_rotate(capture_t *cap)
+{
+    char from[PATH_MAX], to[PATH_MAX];
+    unsigned i;
+
+    for (i = cap->conf.n_keep; i > 1; i--) {
+        snprintf(from, sizeof(from), "%s.%u", cap->conf.path, i - 1);
+        snprintf(to, sizeof(to), "%s.%u", cap->conf.path, i);
+
+        if (rename(from, to) && errno != ENOENT) {
+            LOG_ERROR("rotate log: %s", strerror(errno));
+        }
+    }
+
+    snprintf(to, sizeof(to), "%s.1", cap->conf.path);
+
+    if (rename(cap->conf.path, to)) {
+        LOG_ERROR("rotate log: %s", strerror(errno));
+    }
+
+    close(cap->file);
+    cap->n_rotate++;
+
+    if (capture_open_log(cap)) {
+        LOG_WARN("container output is dropped from now on");
+    }
+}
+
+static void
+capture_written(capture_t *cap, capture_stream_t *s, size_t n, uint64_t start)
+{
+    cap->slow = capture_now_usec() - start > (uint64_t)cap->conf.stall_ms * 1000;
+
+    if (cap->dropping && !cap->slow) {
+        LOG("log writes caught up, %" PRIu64 " bytes of output dropped so far",
+            cap->streams[0].dropped + cap->streams[1].dropped);
+        cap->dropping = false;
+    }
+
+    s->bytes += n;
+    cap->size += n;
+
+    if (cap->size >= cap->conf.max_bytes) capture_rotate(cap);
+}
+
+static void
+capture_dropped(capture_t *cap, capture_stream_t *s, size_t n)
+{
+    if (!cap->dropping && cap->file != -1) {
+        LOG_WARN("log writes take over %ums, dropping container output", cap->conf.stall_ms);
+    }
+
+    // the disk gets another chance with what comes next
+    cap->slow = false;
+    cap->dropping = true;
+
+    s->dropped += n;
+}
+
+// returns 0 once every writer is gone, -1 with EAGAIN if there is nothing for now
+static ssize_t
+capture_splice(capture_t *cap, capture_stream_t *s)
+{
+    uint64_t start;
+    ssize_t n;
+    int avail = 0;
+
+    // a follower that does not keep up misses output, it never holds up the log
+    if (s->follow != -1) {
+        tee(s->fd, s->follow, cap->pipe_size, SPLICE_F_NONBLOCK);
+    }
+
+    if (ioctl(s->fd, FIONREAD, &avail) == -1) avail = 0;
+
+    // the container is about to block on a full pipe behind a slow disk
+    if (cap->file == -1 || (cap->slow && avail >= cap->pipe_size / 4 * 3)) {
+        n = splice(s->fd, NULL, cap->null, NULL, cap->pipe_size, SPLICE_F_NONBLOCK);
+        if (n > 0) capture_dropped(cap, s, n);
+        return n;
+    }
+
+    start = capture_now_usec();
+    n = splice(s->fd, NULL, cap->file, NULL, cap->pipe_size, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+    if (n > 0) capture_written(cap, s, n, start);
+
+    return n;
+}
+
+static ssize_t
+capture_copy(capture_t *cap, capture_stream_t *s)
+{
+    char buf[CAPTURE_COPY_SIZE];
+    uint64_t start;
+    ssize_t n, w;
+
+    n = read(s->fd, buf, sizeof(buf));
+
+    // a pty master reads EIO once the last slave is closed
+    if (n == -1 && errno == EIO) return 0;
+    if (n <= 0) return n;
+
+    if (s->follow != -1 && write(s->follow, buf, n) != n) {
+        // the terminal is gone, the log still gets it
+    }
+
+    if (cap->file == -1 || cap->slow) {
+        capture_dropped(cap, s, n);
+        return n;
+    }
+
+    start = capture_now_usec();
+    w = write(cap->file, buf, n);
+
+    if (w > 0) capture_written(cap, s, w, start);
+    if (w < n) capture_dropped(cap, s, n - (w > 0 ? w : 0));
+
+    return n;
+}
+
+static ssize_t
+capture_move(capture_t *cap, capture_stream_t *s)
+{
+    return s->copy ? capture_copy(cap, s) : capture_splice(cap, s);
+}
+
+static void
+capture_close_stream(capture_t *cap, capture_stream_t *s)
+{
+    if (s->fd == -1) return;
+
+    loop_del(cap->loop, s->fd);
+    close(s->fd);
+    s->fd = -1;
+
+    // nothing left to type into
+    if (cap->conf.pty && cap->stdin_relay) {
+        loop_del(cap->loop, 0);
+        cap->stdin_relay = false;
+    }
+}
+
+static void
+capture_event(void *data, int fd, uint32_t events)
+{
+    capture_stream_t *s = data;
+    ssize_t n = capture_move(s->cap, s);
+
+    if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR)) {
+        capture_close_stream(s->cap, s);
+    }
+}
+
+static void
+capture_stdin_event(void *data, int fd, uint32_t events)
+{
+    capture_t *cap = data;
+    char buf[4096];
+    ssize_t n = read(fd, buf, sizeof(buf));
+
+    if (n <= 0) {
+        loop_del(cap->loop, fd);
+        cap->stdin_relay = false;
+        return;
+    }
+
+    if (write(cap->streams[0].fd, buf, n) != n) {
+        LOG_ERROR("write to pty: %s", strerror(errno));
+    }
+}
+
+static void
+capture_set_follow(capture_stream_t *s, int fd)
+{
+    struct stat st;
+
+    s->follow = fd;
+
+    // tee only goes between pipes
+    if (fstat(fd, &st) || !S_ISFIFO(st.st_mode)) {
+        s->copy = true;
+        return;
+    }
+
+    // as much slack for the reader as the log has, fails harmlessly if it is not ours to grow
+    fcntl(fd, F_SETPIPE_SZ, CAPTURE_PIPE_SIZE);
+}
+
+static int
+capture_open_pipes(capture_t *cap)
+{
+    int fds[2], i;
+
+    for (i = 0; i < 2; i++) {
+        if (pipe2(fds, O_CLOEXEC)) {
+            LOG_ERROR("capture pipe: %s", strerror(errno));
+            return -1;
+        }
+
+        cap->streams[i].fd = fds[0];
+        cap->child[i + 1] = fds[1];
+
+        // room for bursts while the log is written
+        if (fcntl(fds[0], F_SETPIPE_SZ, CAPTURE_PIPE_SIZE) == -1) {
+            LOG_ERROR("resize capture pipe: %s", strerror(errno));
+        }
+
+        cap->pipe_size = fcntl(fds[0], F_GETPIPE_SZ);
+
+        // only the supervisor's end, the container blocks as usual
+        if (cap->pipe_size == -1 || fcntl(fds[0], F_SETFL, O_NONBLOCK)) {
+            LOG_ERROR("set up capture pipe: %s", strerror(errno));
+            return -1;
+        }
+
+        if (cap->conf.follow) capture_set_follow(&cap->streams[i], i + 1);
+    }
+
+    return 0;
+}
+
+static int
+capture_open_pty(capture_t *cap)
+{
+    int master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC), slave = -1;
+    struct termios raw;
+    struct winsize ws;
+    struct stat st;
+    char *name = NULL;
+
+    if (master == -1 || grantpt(master) || unlockpt(master) || !(name = ptsname(master)) ||
+        (slave = open(name, O_RDWR | O_NOCTTY | O_CLOEXEC)) == -1 ||
+        fcntl(master, F_SETFL, O_NONBLOCK)) {
+        LOG_ERROR("open pty: %s", strerror(errno));
+        if (master != -1) close(master);
+        if (slave != -1) close(slave);
+        return -1;
+    }
+
+    cap->streams[0].fd = master;
+    cap->streams[0].copy = true;
+    cap->child[0] = cap->child[1] = cap->child[2] = slave;
+
+    // interactive, the output is for the user first
+    cap->streams[0].follow = 1;
+
+    // keys go through as they are, the pty does the line editing,
+    // output processing stays for the supervisor's own messages
+    if (isatty(0) && !tcgetattr(0, &cap->saved)) {
+        if (!ioctl(0, TIOCGWINSZ, &ws)) ioctl(master, TIOCSWINSZ, &ws);
+
+        raw = cap->saved;
+        cfmakeraw(&raw);
+        raw.c_oflag |= OPOST;
+
+        cap->raw = !tcsetattr(0, TCSANOW, &raw);
+    }
+
+    // epoll takes anything but regular files
+    if (!fstat(0, &st) && !S_ISREG(st.st_mode) &&
+        !loop_add(cap->loop, 0, EPOLLIN, capture_stdin_event, cap)) {
+        cap->stdin_relay = true;
+    }
+
+    return 0;
+}
+
+capture_t *
+capture_new(loop_t *loop, const capture_config_t *conf)
+{
+    capture_t *cap = malloc(sizeof(*cap));
+    size_t i;
+
+    ASSERT(cap, "out of mem");
+
+    memset(cap, 0, sizeof(*cap));
+
+    cap->conf = *conf;
+    cap->conf.path = strdup(conf->path);
+    cap->loop = loop;
+    cap->null = -1;
+    cap->pipe_size = CAPTURE_PIPE_SIZE;
+
+    if (!cap->conf.max_bytes) cap->conf.max_bytes = CAPTURE_DEFAULT_MAX_BYTES;
+    if (!cap->conf.n_keep) cap->conf.n_keep = CAPTURE_DEFAULT_N_KEEP;
+    if (!cap->conf.stall_ms) cap->conf.stall_ms = CAPTURE_DEFAULT_STALL_MS;
+
+    for (i = 0; i < 2; i++) {
+        cap->streams[i].cap = cap;
+        cap->streams[i].fd = -1;
+        cap->streams[i].follow = -1;
+    }
+
+    for (i = 0; i < 3; i++) {
+        cap->child[i] = -1;
+    }
+
+    if (capture_open_log(cap)) goto ERROR;
+
+    cap->null = open("/dev/null", O_WRONLY | O_CLOEXEC);
+
+    if (cap->null == -1) {
+        LOG_ERROR("open /dev/null: %s", strerror(errno));
+        goto ERROR;
+    }
+
+    if (conf->pty ? capture_open_pty(cap) : capture_open_pipes(cap)) goto ERROR;
+
+    for (i = 0; i < 2; i++) {
+        if (cap->streams[i].fd != -1 &&
+            loop_add(loop, cap->streams[i].fd, EPOLLIN, capture_event, &cap->streams[i])) {
+            close(cap->streams[i].fd);
+            cap->streams[i].fd = -1;
+            goto ERROR;
+        }
+    }
+
+    return cap;
+
+ERROR:
+    capture_free(cap);
+    return NULL;
+}
+
+void
+capture_free(capture_t *cap)
+{
+    uint64_t bytes = 0, dropped = 0;
+    size_t i;
+
+    if (cap) {
+        for (i = 0; i < 2; i++) {
+            // init is gone, nobody waits on the pipe any more
+            while (cap->streams[i].fd != -1) {
+                cap->slow = false;
+                if (capture_move(cap, &cap->streams[i]) <= 0) break;
+            }
+
+            capture_close_stream(cap, &cap->streams[i]);
+
+            bytes += cap->streams[i].bytes;
+            dropped += cap->streams[i].dropped;
+        }
+
+        if (bytes || dropped) {
+            LOG("logged %" PRIu64 " bytes of container output to %s, %" PRIu64 " dropped, "
+                "rotated %" PRIu64 " times", bytes, cap->conf.path, dropped, cap->n_rotate);
+        }
+
+        if (cap->stdin_relay) loop_del(cap->loop, 0);
+        if (cap->raw) tcsetattr(0, TCSANOW, &cap->saved);
+
+        capture_close_child(cap);
+
+        if (cap->file != -1) close(cap->file);
+        if (cap->null != -1) close(cap->null);
+
+        free(cap->conf.path);
+        free(cap);
+    }
+}
+
+int
+capture_set_up_child(const capture_t *cap)
+{
+    int i;
+
+    // a session of its own with the pty as its terminal, for job control and ^C
+    if (cap->conf.pty && (setsid() == -1 || ioctl(cap->child[0], TIOCSCTTY, 0))) {
+        LOG_ERROR("take pty: %s", strerror(errno));
+        return -1;
+    }
+
+    for (i = 0; i < 3; i++) {
+        if (cap->child[i] != -1 && dup2(cap->child[i], i) == -1) {
+            LOG_ERROR("dup2: %s", strerror(errno));
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void
+capture_close_child(capture_t *cap)
+{
+    int last = -1, i;
+
+    // the pty slave is all three
+    for (i = 0; i < 3; i++) {
+        if (cap->child[i] != -1 && cap->child[i] != last) close(cap->child[i]);
+
+        last = cap->child[i];
+        cap->child[i] = -1;
+    }
+}
@@ -0,0 +1,97 @@
+#ifndef _CORE_CAPTURE_H_
+#define _CORE_CAPTURE_H_
+
+#include <termios.h>
+
+#include "pub/type.h"
+
+#include "loop.h"
+
+/*
+
+stdout and stderr of the container captured to a size rotated log file
+
+init writes to a pipe per stream, which the supervisor loop splices into
+the log without the data passing through user space. a follower (the
+supervisor's own stdout and stderr) gets a tee of it when it is a pipe,
+anything else is copied.
+
+with pty, init gets a terminal for stdin, stdout and stderr instead, relayed
+to and from the supervisor's terminal. terminals cannot be spliced, so its
+output is copied.
+
+a slow disk must not stall the container: once a write to the log took
+longer than stall_ms and the pipe is close to full, its backlog is dropped
+
+*/
+
+#define CAPTURE_DEFAULT_MAX_BYTES (64 << 20)
+#define CAPTURE_DEFAULT_N_KEEP 3
+#define CAPTURE_DEFAULT_STALL_MS 100
+#define CAPTURE_PIPE_SIZE (1 << 20)
+
+// 0 for the defaults
+typedef struct {
+    char *path; // rotated to path.1 .. path.n_keep
+    uint64_t max_bytes; // rotate once the log is this big
+    unsigned n_keep;
+    unsigned stall_ms;
+    bool follow; // also to the supervisor's stdout and stderr
+    bool pty;
+} capture_config_t;
+
+typedef struct capture_t capture_t;
+
+typedef struct {
+    capture_t *cap;
+    int fd; // read end, or the pty master, -1 once closed
+    int follow; // -1 for none
+    bool copy; // read and written, it or the follower cannot be spliced
+    uint64_t bytes;
+    uint64_t dropped;
+} capture_stream_t;
+
+struct capture_t {
+    capture_config_t conf;
+    loop_t *loop;
+
+    int file;
+    uint64_t size; // of the current log
+    int null; // where dropped output goes
+    int pipe_size;
+
+    capture_stream_t streams[2]; // stdout and stderr, only the first one with pty
+    int child[3]; // stdin, stdout and stderr of init, -1 to inherit
+
+    bool slow; // the last write to the log took too long
+    bool dropping;
+    uint64_t n_rotate;
+
+    bool stdin_relay; // the supervisor's stdin goes to the pty
+    bool raw; // the supervisor's terminal, put back on free
+    struct termios saved;
+};
+
+capture_config_t *
+capture_config_copy(const capture_config_t *conf);
+
+void
+capture_config_free(capture_config_t *conf);
+
+// before init is started
+capture_t *
+capture_new(loop_t *loop, const capture_config_t *conf);
+
+// moves what is left in the pipes to the log first
+void
+capture_free(capture_t *cap);
+
+// in init, before exec
+int
+capture_set_up_child(const capture_t *cap);
+
+// in the supervisor once init has its copies
+void
+capture_close_child(capture_t *cap);
+
+#endif
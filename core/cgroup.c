@@ -1,5 +1,9 @@
 #include <stdio.h>
 #include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
 
 #include "pub/type.h"
 #include "pub/fd.h"
@@ -11,6 +15,10 @@
 #define CGROUP_NAME_PREFIX "ducker.cgroup."
 #define CGROUP_MODE 0700
 
+#define CGROUP_ROOT "/sys/fs/cgroup"
+#define CGROUP_V2_PARENT "ducker" // holds no processes, so it may delegate controllers
+#define CGROUP_FREEZE_POLL_MAX_US 10000 // v1 has no notification, freezer.state is polled
+
 cgroup_entry_t *
 cgroup_entry_copy(cgroup_entry_t *conf, size_t n)
 {
@@ -42,113 +50,731 @@ cgroup_entry_free(cgroup_entry_t *conf, size_t n)
     free(conf);
 }
 
+cgroup_version_t
+cgroup_version()
+{
+    static cgroup_version_t version = 0;
+    struct statfs st;
+
+    if (!version) {
+        // hybrid hosts mount v2 below the root, with no controllers in it
+        if (statfs(CGROUP_ROOT, &st) == 0 && st.f_type == CGROUP2_SUPER_MAGIC) {
+            version = CGROUP_V2;
+        } else {
+            version = CGROUP_V1;
+        }
+    }
+
+    return version;
+}
+
 int
-cgroup_init(cgroup_entry_t *conf, size_t n_conf, pid_t pid)
+cgroup_write_at(int dir, const char *var, const char *val)
+{
+    int fd = openat(dir, var, O_WRONLY | O_CLOEXEC);
+    int ret = 0;
+
+    if (fd == -1) return -1;
+
+    if (write(fd, val, strlen(val)) == -1) ret = -1;
+
+    close(fd);
+
+    return ret;
+}
+
+ssize_t
+cgroup_read_at(int dir, const char *var, char *buf, size_t size)
+{
+    int fd = openat(dir, var, O_RDONLY | O_CLOEXEC);
+    ssize_t n;
+
+    if (fd == -1) return -1;
+
+    n = read(fd, buf, size - 1);
+    close(fd);
+
+    buf[n > 0 ? n : 0] = '\0';
+
+    return n;
+}
+
+ssize_t
+cgroup_reread(int fd, char *buf, size_t size)
+{
+    ssize_t n;
+
+    if (fd == -1) return -1;
+
+    n = pread(fd, buf, size - 1, 0);
+    if (n < 0) return -1;
+
+    buf[n] = '\0';
+
+    return n;
+}
+
+static bool
+cgroup_has_word(const char *list, const char *word)
+{
+    size_t len = strlen(word);
+    const char *p;
+
+    for (p = list; (p = strstr(p, word)); p += len) {
+        if ((p == list || p[-1] == ' ') &&
+            (p[len] == ' ' || p[len] == '\n' || p[len] == '\0')) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// names end up in openat, keep them inside the cgroup directory
+static bool
+cgroup_valid_name(const char *name)
+{
+    return name && *name && name[0] != '.' && !strchr(name, '/');
+}
+
+// v1 names that have a direct v2 equivalent
+typedef struct {
+    const char *v1;
+    const char *v2;
+    void (*conv)(const char *val, char *buf, size_t size);
+} cgroup_alias_t;
+
+static void
+cgroup_conv_limit(const char *val, char *buf, size_t size)
+{
+    snprintf(buf, size, "%s", strcmp(val, "-1") ? val : "max");
+}
+
+static void
+cgroup_conv_shares(const char *val, char *buf, size_t size)
+{
+    unsigned long long shares = strtoull(val, NULL, 10);
+
+    // [2, 262144] onto [1, 10000]
+    if (shares < 2) shares = 2;
+    if (shares > 262144) shares = 262144;
+
+    snprintf(buf, size, "%llu", 1 + (shares - 2) * 9999 / 262142);
+}
+
+static void
+cgroup_conv_quota(const char *val, char *buf, size_t size)
+{
+    // v1 default period
+    snprintf(buf, size, "%s 100000", strcmp(val, "-1") ? val : "max");
+}
+
+static const cgroup_alias_t cgroup_alias[] = {
+    { "memory.limit_in_bytes", "memory.max", cgroup_conv_limit },
+    { "memory.soft_limit_in_bytes", "memory.low", cgroup_conv_limit },
+    { "cpu.shares", "cpu.weight", cgroup_conv_shares },
+    { "cpu.cfs_quota_us", "cpu.max", cgroup_conv_quota },
+};
+
+// v2 name and value of an entry, controller is the prefix of the name
+static void
+cgroup_v2_translate(const cgroup_entry_t *ent,
+                    char *var, size_t var_size,
+                    char *val, size_t val_size,
+                    char *ctrl, size_t ctrl_size)
+{
+    size_t i;
+    char *dot;
+
+    snprintf(var, var_size, "%s", ent->var);
+    snprintf(val, val_size, "%s", ent->val);
+
+    for (i = 0; i < sizeof(cgroup_alias) / sizeof(*cgroup_alias); i++) {
+        if (!strcmp(ent->var, cgroup_alias[i].v1)) {
+            snprintf(var, var_size, "%s", cgroup_alias[i].v2);
+            cgroup_alias[i].conv(ent->val, val, val_size);
+            break;
+        }
+    }
+
+    snprintf(ctrl, ctrl_size, "%s", var);
+    dot = strchr(ctrl, '.');
+    if (dot) *dot = '\0';
+}
+
+static size_t
+cgroup_add_dir(cgroup_t *cg, const char *ctrl, int parent)
+{
+    cg->dirs = realloc(cg->dirs, sizeof(*cg->dirs) * (cg->n_dir + 1));
+    ASSERT(cg->dirs, "out of mem");
+
+    cg->dirs[cg->n_dir].ctrl = ctrl ? strdup(ctrl) : NULL;
+    cg->dirs[cg->n_dir].parent = parent;
+    cg->dirs[cg->n_dir].fd = -1;
+
+    return cg->n_dir++;
+}
+
+static void
+cgroup_add_var(cgroup_t *cg, size_t dir, const char *var, const char *val)
+{
+    cg->vars = realloc(cg->vars, sizeof(*cg->vars) * (cg->n_var + 1));
+    ASSERT(cg->vars, "out of mem");
+
+    cg->vars[cg->n_var].dir = dir;
+    cg->vars[cg->n_var].var = strdup(var);
+    cg->vars[cg->n_var].val = strdup(val);
+
+    cg->n_var++;
+}
+
+// one directory per hierarchy, shared by all entries of the controller
+static int
+cgroup_add_v1(cgroup_t *cg, const cgroup_entry_t *ent)
 {
     char path[PATH_MAX];
-    char var[PATH_MAX];
+    size_t i;
     int fd;
 
-    char pid_str[16];
+    if (!cgroup_valid_name(ent->resrc) || !cgroup_valid_name(ent->var)) {
+        LOG_ERROR("invalid cgroup entry '%s' '%s'", ent->resrc, ent->var);
+        return -1;
+    }
+
+    for (i = 0; i < cg->n_dir && strcmp(cg->dirs[i].ctrl, ent->resrc); i++);
+
+    if (i == cg->n_dir) {
+        snprintf(path, sizeof(path), CGROUP_ROOT "/%s", ent->resrc);
+
+        fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+        if (fd == -1) {
+            LOG_ERROR("no cgroup hierarchy for '%s'", ent->resrc);
+            return -1;
+        }
+
+        i = cgroup_add_dir(cg, ent->resrc, fd);
+    }
+
+    cgroup_add_var(cg, i, ent->var, ent->val);
+
+    return 0;
+}
+
+// the directory is created with or without entries, freezing, stats and
+// memory events work on any v2 cgroup
+static int
+cgroup_v2_init(cgroup_t *cg)
+{
+    cg->root = open(CGROUP_ROOT, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (cg->root == -1) {
+        LOG_ERROR("open cgroup root: %s", strerror(errno));
+        return -1;
+    }
+
+    if (cgroup_read_at(cg->root, "cgroup.controllers", cg->avail, sizeof(cg->avail)) == -1) {
+        LOG_ERROR("read cgroup controllers: %s", strerror(errno));
+        return -1;
+    }
+
+    cgroup_add_dir(cg, NULL, -1);
+
+    return 0;
+}
+
+// a single directory, every controller used has to be delegated to it
+static int
+cgroup_add_v2(cgroup_t *cg, const cgroup_entry_t *ent)
+{
+    char var[128], val[256], ctrl[64];
+
+    if (!cgroup_valid_name(ent->var)) {
+        LOG_ERROR("invalid cgroup variable '%s'", ent->var);
+        return -1;
+    }
+
+    cgroup_v2_translate(ent, var, sizeof(var), val, sizeof(val), ctrl, sizeof(ctrl));
+
+    if (!cgroup_has_word(cg->avail, ctrl)) {
+        LOG_ERROR("cgroup controller '%s' is not available", ctrl);
+        return -1;
+    }
+
+    if (!cgroup_has_word(cg->ctrls, ctrl)) {
+        snprintf(cg->ctrls + strlen(cg->ctrls), sizeof(cg->ctrls) - strlen(cg->ctrls),
+                 "%s%s", *cg->ctrls ? " " : "", ctrl);
+    }
+
+    cgroup_add_var(cg, 0, var, val);
+
+    return 0;
+}
 
+cgroup_t *
+cgroup_new(const cgroup_entry_t *conf, size_t n_conf, const char *id)
+{
+    cgroup_t *cg = malloc(sizeof(*cg));
     size_t i;
 
-    snprintf(pid_str, sizeof(pid_str), "%d", pid);
+    ASSERT(cg, "out of mem");
+
+    cg->version = cgroup_version();
+    snprintf(cg->name, sizeof(cg->name), CGROUP_NAME_PREFIX "%s", id);
+
+    cg->root = -1;
+    cg->avail[0] = '\0';
+    cg->ctrls[0] = '\0';
+
+    cg->dirs = NULL;
+    cg->n_dir = 0;
+    cg->vars = NULL;
+    cg->n_var = 0;
+
+    cg->frozen = false;
+
+    if (cg->version == CGROUP_V2 && cgroup_v2_init(cg)) {
+        cgroup_free(cg);
+        return NULL;
+    }
 
     for (i = 0; i < n_conf; i++) {
-        snprintf(path, sizeof(path), "/sys/fs/cgroup/%s/" CGROUP_NAME_PREFIX "%d", conf[i].resrc, pid);
+        if (cgroup_set(cg, &conf[i])) {
+            cgroup_free(cg);
+            return NULL;
+        }
+    }
 
-        if (mkdir(path, CGROUP_MODE) && errno != EEXIST) {
-            perror("create cgroup namespace");
-            return -1;
-        } else {
-            // created new directory, add pid to it
-            snprintf(var, sizeof(var), "%s/tasks", path);
+    return cg;
+}
 
-            fd = open(var, O_WRONLY);
+int
+cgroup_set(cgroup_t *cg, const cgroup_entry_t *ent)
+{
+    if (cg->version == CGROUP_V2) {
+        return cgroup_add_v2(cg, ent);
+    }
 
-            if (fd == -1) {
-                perror("failed to open tasks");
-                return -1;
-            }
+    return cgroup_add_v1(cg, ent);
+}
 
-            // add process to cgroup
-            if (write(fd, pid_str, strlen(pid_str)) == -1) {
-                perror("failed to add task");
-                close(fd);
-                return -1;
-            }
+void
+cgroup_path(const cgroup_t *cg, const char *ctrl, char *buf, size_t size)
+{
+    if (cg->version == CGROUP_V2) {
+        snprintf(buf, size, CGROUP_ROOT "/" CGROUP_V2_PARENT "/%s", cg->name);
+    } else {
+        snprintf(buf, size, CGROUP_ROOT "/%s/%s", ctrl, cg->name);
+    }
+}
+
+// delegate the missing controllers of the plan, in a single write
+static int
+cgroup_v2_enable(cgroup_t *cg, int dir)
+{
+    char enabled[512], req[sizeof(cg->ctrls) * 2];
+    char ctrls[sizeof(cg->ctrls)];
+    char *tok, *save;
+
+    req[0] = '\0';
+
+    if (cgroup_read_at(dir, "cgroup.subtree_control", enabled, sizeof(enabled)) == -1) {
+        LOG_ERROR("read cgroup.subtree_control: %s", strerror(errno));
+        return -1;
+    }
+
+    strcpy(ctrls, cg->ctrls);
+
+    for (tok = strtok_r(ctrls, " ", &save); tok; tok = strtok_r(NULL, " ", &save)) {
+        if (!cgroup_has_word(enabled, tok)) {
+            snprintf(req + strlen(req), sizeof(req) - strlen(req), "%s+%s", *req ? " " : "", tok);
+        }
+    }
+
+    if (*req && cgroup_write_at(dir, "cgroup.subtree_control", req)) {
+        LOG_ERROR("write cgroup.subtree_control: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+cgroup_create(cgroup_t *cg)
+{
+    cgroup_dir_t *dir;
+    size_t i;
 
-            close(fd);
+    // v1 has a directory per hierarchy in use, none without entries
+    if (!cg->n_dir) return 0;
+
+    if (cg->version == CGROUP_V2) {
+        if (cgroup_v2_enable(cg, cg->root)) {
+            LOG_ERROR("failed to enable cgroup controllers '%s'", cg->ctrls);
+            return -1;
         }
 
-        // set variable
+        if (mkdirat(cg->root, CGROUP_V2_PARENT, CGROUP_MODE) && errno != EEXIST) {
+            LOG_ERROR("create cgroup parent: %s", strerror(errno));
+            return -1;
+        }
 
-        LOG("cgroup setting %s = %s", conf[i].var, conf[i].val);
+        cg->dirs[0].parent = openat(cg->root, CGROUP_V2_PARENT, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
 
-        snprintf(var, sizeof(var), "%s/%s", path, conf[i].var);
+        if (cg->dirs[0].parent == -1 || cgroup_v2_enable(cg, cg->dirs[0].parent)) {
+            LOG_ERROR("failed to enable cgroup controllers '%s'", cg->ctrls);
+            return -1;
+        }
+    }
 
-        fd = open(var, O_WRONLY);
+    for (i = 0; i < cg->n_dir; i++) {
+        dir = &cg->dirs[i];
 
-        if (fd == -1) {
-            perror("failed to open setting");
+        if (mkdirat(dir->parent, cg->name, CGROUP_MODE) && errno != EEXIST) {
+            LOG_ERROR("create cgroup: %s", strerror(errno));
             return -1;
         }
 
-        if (write(fd, conf[i].val, strlen(conf[i].val)) == -1) {
-            perror("failed to set variable");
-            close(fd);
+        dir->fd = openat(dir->parent, cg->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+        if (dir->fd == -1) {
+            LOG_ERROR("open cgroup: %s", strerror(errno));
             return -1;
         }
+    }
 
-        close(fd);
+    for (i = 0; i < cg->n_var; i++) {
+        LOG_DEBUG("cgroup setting %s = %s", cg->vars[i].var, cg->vars[i].val);
+
+        if (cgroup_write_at(cg->dirs[cg->vars[i].dir].fd, cg->vars[i].var, cg->vars[i].val)) {
+            LOG_ERROR("%s: %s", cg->vars[i].var, strerror(errno));
+            LOG_ERROR("failed to set cgroup variable '%s'", cg->vars[i].var);
+            return -1;
+        }
     }
 
     return 0;
 }
 
+// put back a value read before an update, keyed files (io.max, etc.) one line at a time.
+// a key added by the update has no line to put back and keeps its new value
+static int
+cgroup_restore_at(int dir, const char *var, char *old)
+{
+    char *line, *save;
+    int ret = 0;
+
+    for (line = strtok_r(old, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+        if (cgroup_write_at(dir, var, line)) {
+            LOG_ERROR("%s: %s", var, strerror(errno));
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+// the directory of cg holding the variable, -1 if the cgroup has none
+static ssize_t
+cgroup_update_dir(const cgroup_t *cg, const cgroup_t *plan, const cgroup_var_t *var)
+{
+    char ctrl[64];
+    size_t i;
+
+    if (cg->version == CGROUP_V2) {
+        // controllers are delegated at creation, none can be added later
+        snprintf(ctrl, sizeof(ctrl), "%s", var->var);
+        if (strchr(ctrl, '.')) *strchr(ctrl, '.') = '\0';
+
+        return cgroup_has_word(cg->ctrls, ctrl) && cg->dirs[0].fd != -1 ? 0 : -1;
+    }
+
+    for (i = 0; i < cg->n_dir; i++) {
+        if (!strcmp(cg->dirs[i].ctrl, plan->dirs[var->dir].ctrl)) {
+            return cg->dirs[i].fd != -1 ? (ssize_t)i : -1;
+        }
+    }
+
+    return -1;
+}
+
+// keep the plan in sync with what was written
+static void
+cgroup_update_var(cgroup_t *cg, size_t dir, const char *var, const char *val)
+{
+    size_t i;
+
+    for (i = 0; i < cg->n_var; i++) {
+        if (cg->vars[i].dir == dir && !strcmp(cg->vars[i].var, var)) {
+            free(cg->vars[i].val);
+            cg->vars[i].val = strdup(val);
+            return;
+        }
+    }
+
+    cgroup_add_var(cg, dir, var, val);
+}
+
 int
-cgroup_clean(cgroup_entry_t *conf, size_t n_conf, pid_t pid)
+cgroup_update(cgroup_t *cg, const cgroup_entry_t *conf, size_t n_conf)
 {
-    char path[PATH_MAX];
-    char tasks[PATH_MAX];
-    char pid_str[16];
-    int fd;
+    cgroup_t *plan;
+    ssize_t *dirs = NULL;
+    char (*old)[4096] = NULL;
+    size_t i, n_done = 0;
+    int ret = -1;
+
+    if (!n_conf) return 0;
+
+    // names are checked and translated the same way as at creation
+    plan = cgroup_new(conf, n_conf, "plan");
+    if (!plan) return -1;
+
+    dirs = malloc(sizeof(*dirs) * plan->n_var);
+    old = malloc(sizeof(*old) * plan->n_var);
+    ASSERT(dirs && old, "out of mem");
+
+    for (i = 0; i < plan->n_var; i++) {
+        dirs[i] = cgroup_update_dir(cg, plan, &plan->vars[i]);
+
+        if (dirs[i] == -1) {
+            LOG_ERROR("cgroup controller of '%s' was not set up for the container", plan->vars[i].var);
+            goto CLEAN;
+        }
+
+        if (cgroup_read_at(cg->dirs[dirs[i]].fd, plan->vars[i].var, old[i], sizeof(old[i])) == -1) {
+            LOG_ERROR("%s: %s", plan->vars[i].var, strerror(errno));
+            goto CLEAN;
+        }
+    }
+
+    for (; n_done < plan->n_var; n_done++) {
+        LOG("cgroup updating %s = %s", plan->vars[n_done].var, plan->vars[n_done].val);
+
+        if (cgroup_write_at(cg->dirs[dirs[n_done]].fd, plan->vars[n_done].var, plan->vars[n_done].val)) {
+            LOG_ERROR("%s: %s", plan->vars[n_done].var, strerror(errno));
+            LOG_ERROR("failed to update cgroup variable '%s', rolling back", plan->vars[n_done].var);
+            break;
+        }
+    }
+
+    if (n_done < plan->n_var) {
+        // in reverse, in case the order mattered (e.g. memory.limit_in_bytes before memsw)
+        while (n_done--) {
+            if (cgroup_restore_at(cg->dirs[dirs[n_done]].fd, plan->vars[n_done].var, old[n_done])) {
+                LOG_ERROR("failed to restore cgroup variable '%s'", plan->vars[n_done].var);
+            }
+        }
+
+        goto CLEAN;
+    }
+
+    for (i = 0; i < plan->n_var; i++) {
+        cgroup_update_var(cg, dirs[i], plan->vars[i].var, plan->vars[i].val);
+    }
 
-    struct stat buf;
+    ret = 0;
 
+CLEAN:
+    free(dirs);
+    free(old);
+    cgroup_free(plan);
+
+    return ret;
+}
+
+int
+cgroup_attach(cgroup_t *cg, pid_t pid)
+{
+    char pid_str[16];
     size_t i;
 
     snprintf(pid_str, sizeof(pid_str), "%d", pid);
 
-    for (i = 0; i < n_conf; i++) {
-        snprintf(path, sizeof(path), "/sys/fs/cgroup/%s/" CGROUP_NAME_PREFIX "%d", conf[i].resrc, pid);
+    for (i = 0; i < cg->n_dir; i++) {
+        if (cg->dirs[i].fd == -1) continue;
 
-        // cgroup exists
-        if (stat(path, &buf) == 0) {
-            snprintf(tasks, sizeof(tasks), "/sys/fs/cgroup/%s/tasks", conf[i].resrc);
+        if (cgroup_write_at(cg->dirs[i].fd, "cgroup.procs", pid_str)) {
+            LOG_ERROR("cgroup.procs: %s", strerror(errno));
+            LOG_ERROR("failed to add process to cgroup");
+            return -1;
+        }
+    }
 
-            fd = open(tasks, O_WRONLY);
+    return 0;
+}
 
-            if (fd == -1) {
-                perror("failed to open tasks");
-                return -1;
-            }
+static int64_t
+cgroup_now_ms()
+{
+    struct timespec now;
 
-            if (write(fd, pid_str, strlen(pid_str)) == -1) {
-                perror("failed to switch tasks");
-                close(fd);
-                return -1;
-            }
+    clock_gettime(CLOCK_MONOTONIC, &now);
 
-            close(fd);
+    return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
 
-            if (rmdir(path)) {
-                perror("failed to remove cgroup");
-                return -1;
-            }
+// cgroup.events is notified with POLLPRI when a key changes
+static int
+cgroup_v2_wait_frozen(int dir, bool frozen, int timeout_ms)
+{
+    int64_t deadline = cgroup_now_ms() + timeout_ms;
+    struct pollfd pfd = { .events = POLLPRI };
+    char buf[256];
+    int ret = -1;
+
+    pfd.fd = openat(dir, "cgroup.events", O_RDONLY | O_CLOEXEC);
+
+    if (pfd.fd == -1) {
+        LOG_ERROR("open cgroup.events: %s", strerror(errno));
+        return -1;
+    }
+
+    while (1) {
+        if (cgroup_reread(pfd.fd, buf, sizeof(buf)) == -1) {
+            LOG_ERROR("read cgroup.events: %s", strerror(errno));
+            break;
+        }
+
+        if (strstr(buf, frozen ? "frozen 1" : "frozen 0")) {
+            ret = 0;
+            break;
         }
+
+        if (cgroup_now_ms() >= deadline) break;
+
+        if (poll(&pfd, 1, deadline - cgroup_now_ms()) == -1 && errno != EINTR) {
+            LOG_ERROR("poll cgroup.events: %s", strerror(errno));
+            break;
+        }
+    }
+
+    close(pfd.fd);
+
+    return ret;
+}
+
+// FREEZING turns into FROZEN once every task stopped, with backoff in between
+static int
+cgroup_v1_wait_frozen(int dir, bool frozen, int timeout_ms)
+{
+    int64_t deadline = cgroup_now_ms() + timeout_ms;
+    unsigned delay_us = 10;
+    char buf[32];
+
+    while (cgroup_read_at(dir, "freezer.state", buf, sizeof(buf)) != -1) {
+        if (!strncmp(buf, frozen ? "FROZEN" : "THAWED", 6)) return 0;
+        if (cgroup_now_ms() >= deadline) return -1;
+
+        usleep(delay_us);
+        if (delay_us < CGROUP_FREEZE_POLL_MAX_US) delay_us *= 2;
     }
 
+    LOG_ERROR("read freezer.state: %s", strerror(errno));
+
+    return -1;
+}
+
+int
+cgroup_freeze(cgroup_t *cg, bool frozen, int timeout_ms)
+{
+    const char *var, *on, *off;
+    size_t i = 0;
+    int dir, ret;
+
+    if (cg->version == CGROUP_V2) {
+        var = "cgroup.freeze";
+        on = "1";
+        off = "0";
+    } else {
+        var = "freezer.state";
+        on = "FROZEN";
+        off = "THAWED";
+
+        for (; i < cg->n_dir && strcmp(cg->dirs[i].ctrl, "freezer"); i++);
+    }
+
+    if (i == cg->n_dir || cg->dirs[i].fd == -1) {
+        LOG_ERROR("no freezer for the cgroup");
+        return -1;
+    }
+
+    dir = cg->dirs[i].fd;
+
+    if (cgroup_write_at(dir, var, frozen ? on : off)) {
+        LOG_ERROR("%s: %s", var, strerror(errno));
+        return -1;
+    }
+
+    if (cg->version == CGROUP_V2) {
+        ret = cgroup_v2_wait_frozen(dir, frozen, timeout_ms);
+    } else {
+        ret = cgroup_v1_wait_frozen(dir, frozen, timeout_ms);
+    }
+
+    if (ret) {
+        LOG_ERROR("cgroup did not become %s in %dms", frozen ? "frozen" : "thawed", timeout_ms);
+
+        // a half frozen cgroup helps nobody
+        if (frozen) cgroup_write_at(dir, var, off);
+
+        return -1;
+    }
+
+    cg->frozen = frozen;
+
+    // v1 keeps freezer.state in the plan
+    if (cg->version == CGROUP_V1) cgroup_update_var(cg, i, var, frozen ? on : off);
+
     return 0;
 }
+
+int
+cgroup_destroy(cgroup_t *cg)
+{
+    cgroup_dir_t *dir;
+    size_t i;
+    int ret = 0;
+
+    for (i = 0; i < cg->n_dir; i++) {
+        dir = &cg->dirs[i];
+
+        if (dir->fd == -1) continue;
+
+        close(dir->fd);
+        dir->fd = -1;
+
+        // the attached processes are gone once the container init is reaped
+        if (unlinkat(dir->parent, cg->name, AT_REMOVEDIR)) {
+            LOG_ERROR("failed to remove cgroup: %s", strerror(errno));
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+void
+cgroup_free(cgroup_t *cg)
+{
+    size_t i;
+
+    if (cg) {
+        for (i = 0; i < cg->n_dir; i++) {
+            if (cg->dirs[i].fd != -1) close(cg->dirs[i].fd);
+            if (cg->dirs[i].parent != -1) close(cg->dirs[i].parent);
+            free(cg->dirs[i].ctrl);
+        }
+
+        for (i = 0; i < cg->n_var; i++) {
+            free(cg->vars[i].var);
+            free(cg->vars[i].val);
+        }
+
+        if (cg->root != -1) close(cg->root);
+
+        free(cg->dirs);
+        free(cg->vars);
+        free(cg);
+    }
+}
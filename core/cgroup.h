@@ -1,24 +1,120 @@
 #ifndef _CORE_CGROUP_H_
 #define _CORE_CGROUP_H_
 
+#include "pub/type.h"
 #include "pub/clone.h"
 
+typedef enum {
+    CGROUP_V1 = 1, // one hierarchy per controller
+    CGROUP_V2 // unified hierarchy
+} cgroup_version_t;
+
+/*
+
+on v2 resrc is ignored, the controller is the prefix of var,
+e.g. cpu.max, cpu.weight, memory.high, memory.max, memory.swap.max,
+io.max, pids.max, cpuset.cpus and cpuset.mems
+
+common v1 names are translated: memory.limit_in_bytes, memory.soft_limit_in_bytes,
+cpu.shares and cpu.cfs_quota_us (with the default period)
+
+*/
+
 typedef struct {
     char *resrc; // resource used(memory, cpu, etc.)
     char *var; // name of the variable
     char *val;
 } cgroup_entry_t;
 
+typedef struct {
+    char *ctrl; // v1 hierarchy, NULL on v2
+    int parent; // where the container cgroup is created
+    int fd; // the container cgroup, -1 until created
+} cgroup_dir_t;
+
+typedef struct {
+    size_t dir;
+    char *var;
+    char *val;
+} cgroup_var_t;
+
+// a config compiled and validated against the host, before anything is created
+typedef struct {
+    cgroup_version_t version;
+    char name[48];
+
+    int root; // v2 only
+    char avail[512]; // v2 controllers offered by the root
+    char ctrls[256]; // v2 controllers to delegate, space separated
+
+    cgroup_dir_t *dirs;
+    size_t n_dir;
+
+    cgroup_var_t *vars;
+    size_t n_var;
+
+    bool frozen;
+} cgroup_t;
+
 cgroup_entry_t *
 cgroup_entry_copy(cgroup_entry_t *conf, size_t n);
 
 void
 cgroup_entry_free(cgroup_entry_t *conf, size_t n);
 
+// detected from the file system on /sys/fs/cgroup
+cgroup_version_t
+cgroup_version();
+
+// one variable of a cgroup directory, -1 with errno set on failure
 int
-cgroup_init(cgroup_entry_t *conf, size_t n_conf, pid_t child);
+cgroup_write_at(int dir, const char *var, const char *val);
 
+// returns the length, buf is always terminated
+ssize_t
+cgroup_read_at(int dir, const char *var, char *buf, size_t size);
+
+// the whole of an open stat file again, from the start
+ssize_t
+cgroup_reread(int fd, char *buf, size_t size);
+
+// id names the cgroup, unique among those of the host
+cgroup_t *
+cgroup_new(const cgroup_entry_t *conf, size_t n_conf, const char *id);
+
+// add an entry to a plan that is not created yet
+int
+cgroup_set(cgroup_t *cg, const cgroup_entry_t *ent);
+
+// directory of the container cgroup for ctrl, whether or not it exists yet
+void
+cgroup_path(const cgroup_t *cg, const char *ctrl, char *buf, size_t size);
+
+// create the directories and set the variables
+int
+cgroup_create(cgroup_t *cg);
+
+// move a process and its future children in, once per hierarchy
 int
-cgroup_clean(cgroup_entry_t *conf, size_t n_conf, pid_t pid);
+cgroup_attach(cgroup_t *cg, pid_t pid);
+
+// change variables of a created cgroup, all or nothing: every entry is
+// checked and its current value saved before the first write, and the
+// values written so far are put back if a later one is refused
+int
+cgroup_update(cgroup_t *cg, const cgroup_entry_t *conf, size_t n_conf);
+
+// stop or resume every process of the cgroup, returns once the kernel reports
+// the new state. v1 needs a directory in the freezer hierarchy (freezer.state
+// in the plan). a freeze not done within timeout_ms is undone and fails
+int
+cgroup_freeze(cgroup_t *cg, bool frozen, int timeout_ms);
+
+// remove the directories, the attached processes have to be gone
+int
+cgroup_destroy(cgroup_t *cg);
+
+void
+cgroup_free(cgroup_t *cg);
 
 #endif
@@ -1,10 +1,16 @@
 #include <stdlib.h>
+#include <errno.h>
+#include <inttypes.h>
 
 #include "pub/type.h"
 #include "pub/clone.h"
 #include "pub/limit.h"
 #include "pub/fd.h"
 
+#include <sys/pidfd.h>
+#include <sys/file.h>
+#include <grp.h>
+
 #include "container.h"
 #include "cgroup.h"
 #include "bridge.h"
@@ -16,8 +22,48 @@
 #define IMAGE_DIR "image"
 #define UPPER_DIR "upper"
 #define WORK_DIR "work"
+#define FREEZE_TIMEOUT_MS 5000
 #define ROOT_DIR "root"
 #define HOST_DIR "host"
+#define STATE_LOCK "lock" // held by the supervisor of a running named container
+#define STATE_PID "pid"
+#define STOP_POLL_MS 10
+
+static char **
+container_argv_copy(char **argv)
+{
+    char **copy;
+    size_t n = 0, i;
+
+    if (!argv) return NULL;
+
+    while (argv[n]) n++;
+
+    copy = malloc(sizeof(*copy) * (n + 1));
+    ASSERT(copy, "out of mem");
+
+    for (i = 0; i < n; i++) {
+        copy[i] = strdup(argv[i]);
+    }
+
+    copy[n] = NULL;
+
+    return copy;
+}
+
+static void
+container_argv_free(char **argv)
+{
+    size_t i;
+
+    if (argv) {
+        for (i = 0; argv[i]; i++) {
+            free(argv[i]);
+        }
+
+        free(argv);
+    }
+}
 
 container_config_t *
 container_config_copy(const container_config_t *conf)
@@ -25,14 +71,37 @@ container_config_copy(const container_config_t *conf)
     container_config_t *copy = malloc(sizeof(*copy));
     ASSERT(copy, "out of mem");
 
-    copy->tmp_dir = strdup(conf->tmp_dir);
+    copy->tmp_dir = conf->tmp_dir ? strdup(conf->tmp_dir) : NULL;
+    copy->name = conf->name ? strdup(conf->name) : NULL;
+    copy->state_dir = conf->state_dir ? strdup(conf->state_dir) : NULL;
     copy->host_name = strdup(conf->host_name);
     copy->nameserver = strdup(conf->nameserver);
+    copy->image_dir = conf->image_dir ? strdup(conf->image_dir) : NULL;
+    copy->argv = container_argv_copy(conf->argv);
     copy->bridge_conf = bridge_config_copy(conf->bridge_conf);
 
     copy->cg_conf = cgroup_entry_copy(conf->cg_conf, conf->cg_n_conf);
     copy->cg_n_conf = conf->cg_n_conf;
 
+    copy->proxy_conf = proxy_entry_copy(conf->proxy_conf, conf->proxy_n_conf);
+    copy->proxy_n_conf = conf->proxy_n_conf;
+
+    copy->dns_conf = dns_config_copy(conf->dns_conf);
+
+    copy->pod = conf->pod ? strdup(conf->pod) : NULL;
+    copy->stats_conf = stats_config_copy(conf->stats_conf);
+    copy->cpuset_conf = cpuset_config_copy(conf->cpuset_conf);
+    copy->memwatch_conf = memwatch_config_copy(conf->memwatch_conf);
+    copy->reclaim_conf = reclaim_config_copy(conf->reclaim_conf);
+    copy->ksm = conf->ksm;
+    copy->id_base = conf->id_base;
+    copy->volume_conf = volume_entry_copy(conf->volume_conf, conf->volume_n_conf);
+    copy->volume_n_conf = conf->volume_n_conf;
+    copy->overlay_conf = overlay_config_copy(conf->overlay_conf);
+    copy->upper_conf = upper_config_copy(conf->upper_conf);
+    copy->capture_conf = capture_config_copy(conf->capture_conf);
+    copy->ctl_path = conf->ctl_path ? strdup(conf->ctl_path) : NULL;
+
     return copy;
 }
 
@@ -41,10 +110,26 @@ container_config_free(container_config_t *conf)
 {
     if (conf) {
         free(conf->tmp_dir);
+        free(conf->name);
+        free(conf->state_dir);
         free(conf->host_name);
         free(conf->nameserver);
+        free(conf->image_dir);
+        container_argv_free(conf->argv);
         bridge_config_free(conf->bridge_conf);
         cgroup_entry_free(conf->cg_conf, conf->cg_n_conf);
+        proxy_entry_free(conf->proxy_conf, conf->proxy_n_conf);
+        dns_config_free(conf->dns_conf);
+        free(conf->pod);
+        stats_config_free(conf->stats_conf);
+        cpuset_config_free(conf->cpuset_conf);
+        memwatch_config_free(conf->memwatch_conf);
+        reclaim_config_free(conf->reclaim_conf);
+        overlay_config_free(conf->overlay_conf);
+        upper_config_free(conf->upper_conf);
+        capture_config_free(conf->capture_conf);
+        volume_entry_free(conf->volume_conf, conf->volume_n_conf);
+        free(conf->ctl_path);
 
         free(conf);
     }
@@ -58,17 +143,62 @@ container_new(const container_config_t *conf)
 
     pipe(ret->pipe);
     ret->tmp_dir = NULL;
+    ret->root_fd = -1;
+    ret->volume_fds = NULL;
+    ret->state_lock = -1;
+    ret->child = -1;
+    ret->child_fd = -1;
+    ret->running = false;
+    ret->exit_status = 0;
+    ret->exec_fds = NULL;
+    ret->n_exec = 0;
     ret->conf = container_config_copy(conf);
 
+    ret->loop = NULL;
+    ret->proxy = NULL;
+    ret->dns = NULL;
+    ret->pod = NULL;
+    ret->cgroup = NULL;
+    ret->stats = NULL;
+    ret->cpuset = NULL;
+    ret->memwatch = NULL;
+    ret->ctl = NULL;
+    ret->reclaim = NULL;
+    ret->upper = NULL;
+    ret->capture = NULL;
+    ret->ksmd_base_usec = 0;
+
     return ret;
 }
 
+// detached volumes that were not attached
+static void
+container_close_volumes(container_t *cont)
+{
+    size_t i;
+
+    if (cont->volume_fds) {
+        for (i = 0; i < cont->conf->volume_n_conf; i++) {
+            if (cont->volume_fds[i] != -1) close(cont->volume_fds[i]);
+        }
+
+        free(cont->volume_fds);
+        cont->volume_fds = NULL;
+    }
+}
+
 void
 container_free(container_t *cont)
 {
     if (cont) {
+        if (cont->root_fd != -1) close(cont->root_fd);
+        container_close_volumes(cont);
+        if (cont->state_lock != -1) close(cont->state_lock);
+
+        free(cont->exec_fds);
         free(cont->tmp_dir);
         container_config_free(cont->conf);
+        cgroup_free(cont->cgroup);
 
         container_close_read(cont);
         container_close_write(cont);
@@ -111,34 +241,18 @@ container_pipe_read(container_t *cont, char *buf, size_t size)
     return read(cont->pipe[0], buf, size);
 }
 
-int
-container_set_up_tmp_dir(container_t *cont, const char *img)
+// image, upper, work and root dirs under dir, with the image extracted
+// img NULL leaves the image dir empty
+static int
+container_fill_dir(const char *dir, const char *img)
 {
-    char *template = strdup(cont->conf->tmp_dir);
     char buf[PATH_MAX];
 
-    if (cont->tmp_dir) {
-        // tmp dir already exists
-        return 0;
-    }
-
-    if (!mkdtemp(template)) {
-        perror("mkdtemp");
-        return -1;
-    }
-
-    cont->tmp_dir = template;
-
-    if (chmod(cont->tmp_dir, DEFAULT_MODE)) {
-        perror("chmod tmp dir");
-        return -1;
-    }
-
 #define MKDIR(name) \
     do { \
-        snprintf(buf, sizeof(buf), "%s/%s", template, (name)); \
+        snprintf(buf, sizeof(buf), "%s/%s", dir, (name)); \
         if (mkdir(buf, DEFAULT_MODE)) { \
-            perror("mkdir"); \
+            LOG_ERROR("mkdir: %s", strerror(errno)); \
             return -1; \
         } \
     } while (0)
@@ -148,15 +262,19 @@ container_set_up_tmp_dir(container_t *cont, const char *img)
     MKDIR(WORK_DIR); // work dir is overlay fs's word directory
     MKDIR(ROOT_DIR); // actual root of the container
 
+#undef MKDIR
+
     // temporal implementation for decompression
     // copy image to upper dir
-    // snprintf(buf, sizeof(buf), "tar -xzf '%s' -C %s/%s", img, template, IMAGE_DIR);
+    // snprintf(buf, sizeof(buf), "tar -xzf '%s' -C %s/%s", img, dir, IMAGE_DIR);
     // if (system(buf)) {
     //     LOG("failed to load image '%s'", img);
     //     return -1;
     // }
 
-    snprintf(buf, sizeof(buf), "%s/%s", template, IMAGE_DIR);
+    if (!img) return 0;
+
+    snprintf(buf, sizeof(buf), "%s/%s", dir, IMAGE_DIR);
 
     if (decompress_image(img, buf)) {
         return -1;
@@ -165,6 +283,126 @@ container_set_up_tmp_dir(container_t *cont, const char *img)
     return 0;
 }
 
+static int
+container_check_name(const char *name)
+{
+    if (!*name || strchr(name, '/') || !strcmp(name, ".") || !strcmp(name, "..")) {
+        LOG_ERROR("bad container name '%s'", name);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+container_state_path(const char *state_dir, const char *name, const char *file,
+                     char *buf, size_t size)
+{
+    snprintf(buf, size, "%s/%s%s%s", state_dir, name, file ? "/" : "", file ? file : "");
+}
+
+// dirs of a named container from container_create, locked for as long as it runs
+static int
+container_open_state_dir(container_t *cont)
+{
+    const char *name = cont->conf->name;
+    char buf[PATH_MAX];
+
+    if (container_check_name(name)) return -1;
+
+    // the kernel refuses to mount a volatile upper dir again, as it may
+    // not have made it to disk
+    if (cont->conf->overlay_conf && cont->conf->overlay_conf->volatile_upper) {
+        LOG_WARN("upper dir of a named container is kept, not mounting it volatile");
+        cont->conf->overlay_conf->volatile_upper = false;
+    }
+
+    container_state_path(cont->conf->state_dir, name, NULL, buf, sizeof(buf));
+    cont->tmp_dir = realpath(buf, NULL);
+
+    if (!cont->tmp_dir) {
+        LOG_ERROR("no container named '%s'", name);
+        return -1;
+    }
+
+    container_state_path(cont->conf->state_dir, name, STATE_LOCK, buf, sizeof(buf));
+    cont->state_lock = open(buf, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+
+    if (cont->state_lock == -1) {
+        LOG_ERROR("open state lock: %s", strerror(errno));
+        return -1;
+    }
+
+    if (flock(cont->state_lock, LOCK_EX | LOCK_NB)) {
+        if (errno == EWOULDBLOCK) LOG_ERROR("container '%s' is already running", name);
+        else LOG_ERROR("lock container: %s", strerror(errno));
+
+        close(cont->state_lock);
+        cont->state_lock = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+container_set_up_tmp_dir(container_t *cont, const char *img)
+{
+    char *template;
+
+    if (cont->tmp_dir) {
+        // tmp dir already exists
+        return 0;
+    }
+
+    if (cont->conf->name) {
+        return container_open_state_dir(cont);
+    }
+
+    template = strdup(cont->conf->tmp_dir);
+
+    if (!mkdtemp(template)) {
+        LOG_ERROR("mkdtemp: %s", strerror(errno));
+        free(template);
+        return -1;
+    }
+
+    // everything below is addressed by absolute path, the cwd is left alone
+    cont->tmp_dir = realpath(template, NULL);
+    free(template);
+
+    if (!cont->tmp_dir) {
+        LOG_ERROR("realpath tmp dir: %s", strerror(errno));
+        return -1;
+    }
+
+    if (chmod(cont->tmp_dir, DEFAULT_MODE)) {
+        LOG_ERROR("chmod tmp dir: %s", strerror(errno));
+        return -1;
+    }
+
+    // a shared image needs only the empty dirs
+    return container_fill_dir(cont->tmp_dir, cont->conf->image_dir ? NULL : img);
+}
+
+// the init pid of a running named container, for container_stop
+static void
+container_write_pid(container_t *cont, pid_t child)
+{
+    char buf[PATH_MAX];
+    FILE *fp;
+
+    container_state_path(cont->conf->state_dir, cont->conf->name, STATE_PID, buf, sizeof(buf));
+
+    if (!(fp = fopen(buf, "w"))) {
+        LOG_ERROR("write pid file: %s", strerror(errno));
+        return;
+    }
+
+    fprintf(fp, "%d\n", child);
+    fclose(fp);
+}
+
 int
 container_clean_tmp_dir(container_t *cont)
 {
@@ -175,178 +413,1533 @@ container_clean_tmp_dir(container_t *cont)
         return 0;
     }
 
+    // a named container keeps everything, it is just no longer running
+    if (cont->conf->name) {
+        container_state_path(cont->conf->state_dir, cont->conf->name, STATE_PID, cmd, sizeof(cmd));
+
+        if (unlink(cmd) && errno != ENOENT) {
+            LOG_ERROR("remove pid file: %s", strerror(errno));
+        }
+
+        if (cont->state_lock != -1) {
+            close(cont->state_lock);
+            cont->state_lock = -1;
+        }
+
+        return 0;
+    }
+
     snprintf(cmd, sizeof(cmd), "rm -r '%s'", cont->tmp_dir);
 
     if (system(cmd)) {
-        LOG("failed to remove tmp dir");
+        LOG_WARN("failed to remove tmp dir");
         return -1;
     }
 
     return 0;
 }
 
-static int init(void *arg);
-
 int
-container_run_image(container_t *cont, const char *img)
+container_create(const char *state_dir, const char *name, const char *img)
 {
-    pid_t child;
-    pid_t parent = getpid();
+    char dir[PATH_MAX], cmd[PATH_MAX * 2];
 
-    if (container_set_up_tmp_dir(cont, img)) {
-        LOG("failed to set up tmp dir");
+    if (container_check_name(name)) return -1;
+
+    if (mkdir(state_dir, 0700) && errno != EEXIST) {
+        LOG_ERROR("%s: %s", state_dir, strerror(errno));
         return -1;
     }
 
-    if (chdir(cont->tmp_dir)) {
-        LOG("failed to chdir to tmp dir");
+    container_state_path(state_dir, name, NULL, dir, sizeof(dir));
+
+    if (mkdir(dir, DEFAULT_MODE)) {
+        if (errno == EEXIST) LOG_ERROR("container '%s' already exists", name);
+        else LOG_ERROR("%s: %s", dir, strerror(errno));
         return -1;
     }
 
-    // if (root_mount(ROOT_DIR, "/", IMAGE_DIR, WORK_DIR)) {
-    if (root_mount(ROOT_DIR, IMAGE_DIR, UPPER_DIR, WORK_DIR)) {
-        LOG("failed to mount root");
-        goto CLEAN;
-    }
+    if (chmod(dir, DEFAULT_MODE) || container_fill_dir(dir, img)) {
+        LOG_ERROR("failed to create container '%s'", name);
 
-    if (cgroup_init(cont->conf->cg_conf, cont->conf->cg_n_conf, parent)) {
-        LOG("failed to set up cgroup");
-        goto CLEAN;
+        snprintf(cmd, sizeof(cmd), "rm -r '%s'", dir);
+
+        if (system(cmd)) {
+            LOG_WARN("failed to remove '%s'", dir);
+        }
+
+        return -1;
     }
 
-    child = clone(init, cont->stack.stack + sizeof(cont->stack),
-                  CLONE_NEWPID | CLONE_NEWNS |
-                  CLONE_NEWUTS | CLONE_NEWUSER | CLONE_NEWNET |
-                  CLONE_NEWIPC | SIGCHLD, cont, NULL);
+    return 0;
+}
+
+// the lock of a named container, -1 if there is none
+static int
+container_open_state_lock(const char *state_dir, const char *name)
+{
+    char buf[PATH_MAX];
+    int fd;
+
+    if (container_check_name(name)) return -1;
+
+    container_state_path(state_dir, name, NULL, buf, sizeof(buf));
 
-    if (user_map_set_up(child)) {
-        LOG("failed to set up id map");
+    if (access(buf, F_OK)) {
+        LOG_ERROR("no container named '%s'", name);
+        return -1;
     }
 
-    if (bridge_set_up(cont->conf->bridge_conf, child)) {
-        LOG("failed to set up bridge");
+    container_state_path(state_dir, name, STATE_LOCK, buf, sizeof(buf));
+    fd = open(buf, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+
+    if (fd == -1) {
+        LOG_ERROR("open state lock: %s", strerror(errno));
     }
 
-    // wake init
-    container_close_read(cont);
-    container_pipe_write(cont, "", 1);
-    container_close_write(cont);
+    return fd;
+}
 
-    if (waitpid(child, NULL, 0) == -1) {
-        perror("waitpid");
-        return -1;
+static pid_t
+container_read_pid(const char *state_dir, const char *name)
+{
+    char buf[PATH_MAX];
+    FILE *fp;
+    int pid;
+
+    container_state_path(state_dir, name, STATE_PID, buf, sizeof(buf));
+
+    if (!(fp = fopen(buf, "r"))) return -1;
+
+    if (fscanf(fp, "%d", &pid) != 1) pid = -1;
+
+    fclose(fp);
+
+    return pid;
+}
+
+int
+container_stop(const char *state_dir, const char *name, int timeout_ms)
+{
+    int lock = container_open_state_lock(state_dir, name);
+    int pidfd = -1, waited = 0, ret = -1;
+    bool killed = false;
+    pid_t pid;
+
+    if (lock == -1) return -1;
+
+    if (!flock(lock, LOCK_SH | LOCK_NB)) {
+        LOG_ERROR("container '%s' is not running", name);
+        ret = 0;
+        goto CLEAN;
     }
 
-CLEAN:
-    if (cgroup_clean(cont->conf->cg_conf, cont->conf->cg_n_conf, parent)) {
-        LOG("failed to clean up cgroup");
+    // through a pidfd, and only if the file still names it after, so a
+    // recycled pid is never signaled
+    if ((pid = container_read_pid(state_dir, name)) == -1 ||
+        (pidfd = pidfd_open(pid, 0)) == -1 ||
+        container_read_pid(state_dir, name) != pid) {
+        LOG_ERROR("container '%s' is not up yet or already going down", name);
+        goto CLEAN;
     }
 
-    if (root_umount(ROOT_DIR)) {
-        LOG("failed to umount file system");
-        // return -1;
+    // init is pid 1 in there, it only gets the signals it handles
+    if (pidfd_send_signal(pidfd, SIGTERM, NULL, 0)) {
+        LOG_ERROR("signal init: %s", strerror(errno));
     }
 
-    if (bridge_clean(child)) {
-        LOG("failed to clean up bridge");
+    // the lock goes once the supervisor has cleaned up
+    while (flock(lock, LOCK_SH | LOCK_NB)) {
+        if (waited >= timeout_ms) {
+            if (killed) {
+                LOG_ERROR("container '%s' did not stop", name);
+                goto CLEAN;
+            }
+
+            LOG_WARN("container '%s' ignored SIGTERM, killing it", name);
+
+            if (pidfd_send_signal(pidfd, SIGKILL, NULL, 0) && errno != ESRCH) {
+                LOG_ERROR("kill init: %s", strerror(errno));
+            }
+
+            killed = true;
+            waited = 0;
+        }
+
+        usleep(STOP_POLL_MS * 1000);
+        waited += STOP_POLL_MS;
     }
 
-    // exit tmp dir
-    if (chdir("..")) {
-        LOG("failed to chdir to parent dir");
+    ret = 0;
+
+CLEAN:
+    if (pidfd != -1) close(pidfd);
+    close(lock);
+
+    return ret;
+}
+
+int
+container_remove(const char *state_dir, const char *name)
+{
+    int lock = container_open_state_lock(state_dir, name);
+    char dir[PATH_MAX], cmd[PATH_MAX * 2];
+    int ret = 0;
+
+    if (lock == -1) return -1;
+
+    // held while removing, so it cannot be started meanwhile
+    if (flock(lock, LOCK_EX | LOCK_NB)) {
+        LOG_ERROR("container '%s' is running, stop it first", name);
+        close(lock);
         return -1;
     }
 
-    if (container_clean_tmp_dir(cont)) {
-        LOG("failed to clean tmp dir");
-        // return -1;
+    container_state_path(state_dir, name, NULL, dir, sizeof(dir));
+    snprintf(cmd, sizeof(cmd), "rm -r '%s'", dir);
+
+    if (system(cmd)) {
+        LOG_ERROR("failed to remove container '%s'", name);
+        ret = -1;
     }
 
-    return 0;
+    close(lock);
+
+    return ret;
 }
 
-/* inside container */
+static int init(void *arg);
+
+static void
+container_path(const container_t *cont, const char *name, char *buf, size_t size)
+{
+    snprintf(buf, size, "%s/%s", cont->tmp_dir, name);
+}
 
+// detached along with the root, init attaches them right after it
 static int
-pivot_root(char *new, char *old)
+container_mount_volumes(container_t *cont, int userns)
 {
-    return syscall(SYS_pivot_root, new, old);
+    size_t n = cont->conf->volume_n_conf, i;
+
+    if (!n) return 0;
+
+    cont->volume_fds = malloc(sizeof(*cont->volume_fds) * n);
+    ASSERT(cont->volume_fds, "out of mem");
+
+    for (i = 0; i < n; i++) {
+        cont->volume_fds[i] = -1;
+    }
+
+    for (i = 0; i < n; i++) {
+        cont->volume_fds[i] = volume_mount_detached(&cont->conf->volume_conf[i],
+                                                    userns, cont->conf->id_base);
+
+        if (cont->volume_fds[i] == -1) {
+            LOG_ERROR("failed to mount volume %s", cont->conf->volume_conf[i].target);
+            return -1;
+        }
+    }
+
+    return 0;
 }
 
+// build the overlay detached, for init to attach in its own mount namespace,
+// or mount it in place where the kernel lacks the new mount api
 static int
-init_load_container()
+container_mount_root(container_t *cont)
 {
-    if (mount(ROOT_DIR, ROOT_DIR, "bind", MS_BIND | MS_REC, "")) {
-        perror("bind mount root");
-        return -1;
+    char root[PATH_MAX], lower[PATH_MAX], upper[PATH_MAX], work[PATH_MAX];
+    uid_t base = cont->conf->id_base;
+    int userns = -1, ret = 0;
+
+    container_path(cont, ROOT_DIR, root, sizeof(root));
+    container_path(cont, UPPER_DIR, upper, sizeof(upper));
+    container_path(cont, WORK_DIR, work, sizeof(work));
+
+    if (cont->conf->image_dir) {
+        snprintf(lower, sizeof(lower), "%s", cont->conf->image_dir);
+    } else {
+        container_path(cont, IMAGE_DIR, lower, sizeof(lower));
     }
 
-    if (mkdir(ROOT_DIR "/" HOST_DIR, DEFAULT_MODE)) {
-        perror("mkdir");
-        return -1;
+    // the image stays owned by host ids, only the empty upper layer is handed over
+    if (base) {
+        if (chown(upper, base, base)) {
+            LOG_ERROR("chown upper dir: %s", strerror(errno));
+            return -1;
+        }
+
+        userns = user_ns_open(base);
+        if (userns == -1) return -1;
     }
 
-    if (pivot_root(ROOT_DIR, ROOT_DIR "/" HOST_DIR)) {
-        perror("pivot_root");
-        return -1;
+    cont->root_fd = root_mount_detached(lower, upper, work, userns, cont->conf->overlay_conf);
+
+    if (cont->root_fd != -1) {
+        ret = container_mount_volumes(cont, userns);
     }
 
-    if (chdir("/")) {
-        perror("chdir");
+    if (userns != -1) close(userns);
+
+    if (cont->root_fd != -1) return ret;
+    if (errno != ENOSYS) return -1;
+
+    if (base) {
+        LOG_ERROR("idmapped layers need the new mount api");
         return -1;
     }
 
-    vfs_mount();
-
-    return 0;
+    return root_mount(root, lower, upper, work, cont->conf->overlay_conf);
 }
 
-static int
-init_set_up_env(container_t *cont)
+static void
+container_umount_root(container_t *cont)
 {
-    int fd;
+    char root[PATH_MAX];
 
-    if (sethostname(cont->conf->host_name, strlen(cont->conf->host_name))) {
-        perror("sethostname");
-        // return -1;
+    container_close_volumes(cont);
+
+    // the detached mount goes away with the last reference to it
+    if (cont->root_fd != -1) {
+        close(cont->root_fd);
+        cont->root_fd = -1;
+        return;
     }
 
-    fd = open("/etc/resolv.conf", O_WRONLY | O_TRUNC);
+    container_path(cont, ROOT_DIR, root, sizeof(root));
 
-    // set dns server
-    if (fd == -1) {
-        perror("open /etc/resolv.conf");
-    } else {
-        dprintf(fd, "nameserver %s\n", cont->conf->nameserver);
+    if (root_umount(root)) {
+        LOG_WARN("failed to umount file system");
+    }
+}
+
+// also called to reap it directly, once nothing else can be done
+static void
+container_child_exit(void *data, int fd, uint32_t events)
+{
+    container_t *cont = data;
+
+    if (fd != -1) {
+        loop_del(cont->loop, fd);
         close(fd);
+        cont->child_fd = -1;
     }
 
-    return -1;
+    if (waitpid(cont->child, &cont->exit_status, 0) == -1) {
+        LOG_ERROR("waitpid: %s", strerror(errno));
+    }
+
+    cont->running = false;
 }
 
+// update <resrc> <var> <val> [<resrc> <var> <val>]...
 static int
-init(void *arg)
+container_cmd_update(void *data, int argc, char **argv, FILE *out)
 {
-    container_t *cont = arg;
-    char buf[1];
-    int ret;
-
-    container_close_write(cont);
-    container_pipe_read(cont, buf, 1);
-    // container_close_read(cont);
-
-    LOG("init is up");
+    cgroup_entry_t conf[CTL_MAX_ARG / 3];
+    size_t n = 0;
+    int i;
 
-    if (init_load_container()) {
-        LOG("failed to load container");
+    if (argc < 4 || (argc - 1) % 3 || (argc - 1) / 3 > sizeof(conf) / sizeof(*conf)) {
+        fprintf(out, "usage: update <resrc> <var> <val>...\n");
         return -1;
     }
 
-    if (init_set_up_env(cont)) {
-        // do nothing
+    for (i = 1; i < argc; i += 3, n++) {
+        conf[n].resrc = argv[i];
+        conf[n].var = argv[i + 1];
+        conf[n].val = argv[i + 2];
     }
 
-    ret = system("/bin/bash");
+    if (container_update_limits(data, conf, n)) {
+        fprintf(out, "update refused, nothing changed\n");
+        return -1;
+    }
 
-    return ret;
+    return 0;
+}
+
+// shape <rx|tx> <rate> [flow_rate [pps]], bytes/s and packets/s, 0 for unlimited
+static int
+container_cmd_shape(void *data, int argc, char **argv, FILE *out)
+{
+    container_t *cont = data;
+    tc_config_t shape = { 0 };
+    tc_limit_t *limit;
+    uint64_t vals[3] = { 0 };
+    char *end;
+    int i;
+
+    if (cont->conf->bridge_conf->shape) shape = *cont->conf->bridge_conf->shape;
+
+    limit = argc > 1 && !strcmp(argv[1], "rx") ? &shape.rx :
+            argc > 1 && !strcmp(argv[1], "tx") ? &shape.tx : NULL;
+
+    if (!limit || argc < 3 || argc > 5) goto USAGE;
+
+    for (i = 2; i < argc; i++) {
+        vals[i - 2] = strtoull(argv[i], &end, 10);
+        if (!*argv[i] || *end) goto USAGE;
+    }
+
+    limit->rate = vals[0];
+    limit->flow_rate = vals[1];
+    limit->pps = vals[2];
+
+    if (container_shape(cont, &shape)) {
+        fprintf(out, "shaping failed\n");
+        return -1;
+    }
+
+    return 0;
+
+USAGE:
+    fprintf(out, "usage: shape <rx|tx> <rate> [flow_rate [pps]]\n");
+    return -1;
+}
+
+static void
+container_print_tc(FILE *out, const char *dir, const tc_stat_t *st)
+{
+    fprintf(out, "%s bytes %" PRIu64 " packets %" PRIu64 " drops %u overlimits %u backlog %u qlen %u policed %u\n",
+            dir, st->bytes, st->packets, st->drops, st->overlimits, st->backlog, st->qlen, st->policed);
+}
+
+// counters of the shaping qdiscs, backlog and qlen as queued right now,
+// policed as dropped over the pps limit
+static int
+container_cmd_shaping(void *data, int argc, char **argv, FILE *out)
+{
+    tc_stat_t rx, tx;
+
+    if (container_shape_stats(data, &rx, &tx)) {
+        fprintf(out, "no shaping stats\n");
+        return -1;
+    }
+
+    container_print_tc(out, "rx", &rx);
+    container_print_tc(out, "tx", &tx);
+
+    return 0;
+}
+
+// freeze and thaw, reporting how long the kernel took
+static int
+container_cmd_freeze(void *data, int argc, char **argv, FILE *out)
+{
+    bool freeze = !strcmp(argv[0], "freeze");
+    struct timespec start, end;
+    int ret;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ret = freeze ? container_freeze(data) : container_thaw(data);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (ret) {
+        fprintf(out, "%s failed\n", argv[0]);
+        return -1;
+    }
+
+    fprintf(out, "%s in %ldus\n", freeze ? "frozen" : "thawed",
+            (long)((end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000));
+
+    return 0;
+}
+
+static int
+container_cmd_reclaim(void *data, int argc, char **argv, FILE *out)
+{
+    container_t *cont = data;
+
+    if (!cont->reclaim) {
+        fprintf(out, "reclaim is not running\n");
+        return -1;
+    }
+
+    reclaim_report(cont->reclaim, out);
+
+    return 0;
+}
+
+// the last walk of the upper dir, another one starts in the background
+static int
+container_cmd_upper(void *data, int argc, char **argv, FILE *out)
+{
+    container_t *cont = data;
+
+    if (!cont->upper) {
+        fprintf(out, "upper dir accounting is off for the container\n");
+        return -1;
+    }
+
+    if (upper_scan_start(cont->upper)) {
+        fprintf(out, "failed to walk the upper dir\n");
+        return -1;
+    }
+
+    if (!cont->upper->last.ts_ms) {
+        fprintf(out, "the first walk of the upper dir is running, ask again\n");
+        return 0;
+    }
+
+    upper_report(cont->upper, out);
+
+    return 0;
+}
+
+static int
+container_cmd_ksm(void *data, int argc, char **argv, FILE *out)
+{
+    container_t *cont = data;
+    ksm_stat_t st;
+
+    if (!cont->conf->ksm) {
+        fprintf(out, "page merging is off for the container\n");
+        return -1;
+    }
+
+    if (ksm_stat(cont->cgroup, &st)) {
+        fprintf(out, "failed to read ksm stats\n");
+        return -1;
+    }
+
+    ksm_report(&st, cont->ksmd_base_usec, out);
+
+    return 0;
+}
+
+// memory trouble, reclaim went too far or is about to
+static void
+container_memwatch_event(void *data, const memwatch_event_t *ev)
+{
+    reclaim_backoff(data);
+}
+
+static int
+container_cmd_pid(void *data, int argc, char **argv, FILE *out)
+{
+    container_t *cont = data;
+
+    fprintf(out, "%d\n", cont->running ? cont->child : -1);
+    return 0;
+}
+
+// number or name, with or without SIG
+static int
+container_parse_signal(const char *name)
+{
+    const char *abbrev;
+    char *end;
+    long sig;
+    int i;
+
+    sig = strtol(name, &end, 10);
+    if (*name && !*end) return sig > 0 && sig < NSIG ? sig : -1;
+
+    if (!strncmp(name, "SIG", 3)) name += 3;
+
+    for (i = 1; i < NSIG; i++) {
+        abbrev = sigabbrev_np(i);
+        if (abbrev && !strcmp(abbrev, name)) return i;
+    }
+
+    return -1;
+}
+
+// kill [signal], SIGKILL by default. init only gets the signals it handles,
+// but SIGKILL and SIGSTOP
+static int
+container_cmd_kill(void *data, int argc, char **argv, FILE *out)
+{
+    container_t *cont = data;
+    int sig = argc > 1 ? container_parse_signal(argv[1]) : SIGKILL;
+
+    if (argc > 2 || sig == -1) {
+        fprintf(out, "usage: kill [signal]\n");
+        return -1;
+    }
+
+    if (!cont->running) {
+        fprintf(out, "kill: not running\n");
+        return -1;
+    }
+
+    if (kill(cont->child, sig)) {
+        fprintf(out, "kill: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+container_cmd_exec(void *data, int argc, char **argv, FILE *out)
+{
+    pid_t pid;
+
+    if (argc < 2) {
+        fprintf(out, "usage: exec <path> [args...]\n");
+        return -1;
+    }
+
+    pid = container_exec(data, argv + 1);
+
+    if (pid == -1) {
+        fprintf(out, "failed to run %s\n", argv[1]);
+        return -1;
+    }
+
+    fprintf(out, "%d\n", pid);
+
+    return 0;
+}
+
+// read now, counters are cumulative. the sampling interval is left alone
+static int
+container_cmd_stats(void *data, int argc, char **argv, FILE *out)
+{
+    stats_t *stats = ((container_t *)data)->stats;
+    stats_sample_t s;
+
+    if (!stats || stats_read(stats, &s)) {
+        fprintf(out, "no stats\n");
+        return -1;
+    }
+
+    fprintf(out, "cpu_usec %" PRIu64 "\n", s.cpu_usec);
+    fprintf(out, "nr_throttled %" PRIu64 "\n", s.nr_throttled);
+    fprintf(out, "throttled_usec %" PRIu64 "\n", s.throttled_usec);
+    fprintf(out, "mem %" PRIu64 "\n", s.mem);
+    fprintf(out, "peak_mem %" PRIu64 "\n", s.mem > stats->peak_mem ? s.mem : stats->peak_mem);
+    fprintf(out, "io_rbytes %" PRIu64 "\n", s.io_rbytes);
+    fprintf(out, "io_wbytes %" PRIu64 "\n", s.io_wbytes);
+
+    return 0;
+}
+
+// the samples kept in the ring, oldest first, as json lines
+static int
+container_cmd_samples(void *data, int argc, char **argv, FILE *out)
+{
+    stats_t *stats = ((container_t *)data)->stats;
+
+    if (!stats) {
+        fprintf(out, "no stats\n");
+        return -1;
+    }
+
+    return stats_dump(stats, out);
+}
+
+// the variables as last set
+static int
+container_cmd_limits(void *data, int argc, char **argv, FILE *out)
+{
+    cgroup_t *cg = ((container_t *)data)->cgroup;
+    size_t i;
+
+    for (i = 0; i < cg->n_var; i++) {
+        fprintf(out, "%s %s %s\n",
+                cg->dirs[cg->vars[i].dir].ctrl ? cg->dirs[cg->vars[i].dir].ctrl : "-",
+                cg->vars[i].var, cg->vars[i].val);
+    }
+
+    return 0;
+}
+
+// services run on the supervisor loop while the container is up,
+// they are started before clone so init knows which ones came up
+static int
+container_start_services(container_t *cont)
+{
+    container_config_t *conf = cont->conf;
+    dns_config_t *dns_conf = conf->dns_conf;
+
+    stats_config_t stats_conf = { 0 };
+    char upper[PATH_MAX];
+
+    // init's exit is watched on it too
+    cont->loop = loop_new();
+    if (!cont->loop) return -1;
+
+    if (!conf->proxy_n_conf && !dns_conf && !conf->stats_conf && !conf->memwatch_conf &&
+        !conf->reclaim_conf && !conf->upper_conf && !conf->capture_conf && !conf->ctl_path) return 0;
+
+    if (conf->proxy_n_conf) {
+        cont->proxy = proxy_new(cont->loop, conf->bridge_conf->cont_ip,
+                                conf->proxy_conf, conf->proxy_n_conf);
+
+        if (!cont->proxy) {
+            LOG_WARN("failed to set up port proxy");
+        }
+    }
+
+    if (dns_conf) {
+        cont->dns = dns_new(cont->loop,
+                            dns_conf->upstream ? dns_conf->upstream : conf->nameserver,
+                            dns_conf->max_entry);
+
+        if (!cont->dns || dns_listen(cont->dns, conf->bridge_conf->host_ip, dns_conf->port)) {
+            LOG_WARN("failed to set up dns forwarder, using %s directly", conf->nameserver);
+
+            dns_free(cont->dns);
+            cont->dns = NULL;
+
+            dns_config_free(conf->dns_conf);
+            conf->dns_conf = NULL;
+        }
+    }
+
+    // reclaim is driven by the sampler
+    if (conf->stats_conf || conf->reclaim_conf) {
+        cont->stats = stats_new(cont->loop, cont->cgroup,
+                                conf->stats_conf ? conf->stats_conf : &stats_conf);
+
+        if (!cont->stats) {
+            LOG_WARN("failed to set up stats sampler");
+        }
+    }
+
+    if (conf->memwatch_conf) {
+        cont->memwatch = memwatch_new(cont->loop, cont->cgroup, conf->memwatch_conf);
+
+        if (!cont->memwatch) {
+            LOG_WARN("failed to set up memory events");
+        }
+    }
+
+    if (conf->reclaim_conf && cont->stats) {
+        cont->reclaim = reclaim_new(cont->cgroup, cont->stats, conf->reclaim_conf);
+
+        if (!cont->reclaim) {
+            LOG_WARN("failed to set up memory reclaim");
+        } else {
+            stats_set_cb(cont->stats, reclaim_sample, cont->reclaim);
+            if (cont->memwatch) memwatch_set_cb(cont->memwatch, container_memwatch_event, cont->reclaim);
+        }
+    }
+
+    if (conf->upper_conf) {
+        container_path(cont, UPPER_DIR, upper, sizeof(upper));
+
+        cont->upper = upper_new(cont->loop, upper, conf->upper_conf,
+                                cont->stats ? cont->stats->out : -1);
+
+        if (!cont->upper) {
+            LOG_WARN("failed to set up upper dir accounting");
+        }
+    }
+
+    if (conf->capture_conf) {
+        cont->capture = capture_new(cont->loop, conf->capture_conf);
+
+        if (!cont->capture) {
+            LOG_WARN("failed to set up output capture, the container shares our output");
+        }
+    }
+
+    if (conf->ctl_path) {
+        cont->ctl = ctl_new(cont->loop, conf->ctl_path);
+
+        if (!cont->ctl) {
+            LOG_WARN("failed to set up control socket");
+        } else {
+            ctl_add(cont->ctl, "update", "<resrc> <var> <val>...", container_cmd_update, cont);
+            ctl_add(cont->ctl, "limits", "", container_cmd_limits, cont);
+            ctl_add(cont->ctl, "shape", "<rx|tx> <rate> [flow_rate [pps]]", container_cmd_shape, cont);
+            ctl_add(cont->ctl, "shaping", "", container_cmd_shaping, cont);
+            ctl_add(cont->ctl, "freeze", "", container_cmd_freeze, cont);
+            ctl_add(cont->ctl, "thaw", "", container_cmd_freeze, cont);
+            ctl_add(cont->ctl, "reclaim", "", container_cmd_reclaim, cont);
+            ctl_add(cont->ctl, "ksm", "", container_cmd_ksm, cont);
+            ctl_add(cont->ctl, "upper", "", container_cmd_upper, cont);
+            ctl_add(cont->ctl, "pid", "", container_cmd_pid, cont);
+            ctl_add(cont->ctl, "kill", "[signal]", container_cmd_kill, cont);
+            ctl_add(cont->ctl, "exec", "<path> [args...]", container_cmd_exec, cont);
+            ctl_add(cont->ctl, "stats", "", container_cmd_stats, cont);
+            ctl_add(cont->ctl, "samples", "", container_cmd_samples, cont);
+        }
+    }
+
+    return 0;
+}
+
+static void
+container_stop_services(container_t *cont)
+{
+    siginfo_t info;
+    size_t i;
+
+    // their commands went with the pid namespace
+    for (i = 0; i < cont->n_exec; i++) {
+        loop_del(cont->loop, cont->exec_fds[i]);
+
+        if (waitid(P_PIDFD, cont->exec_fds[i], &info, WEXITED) == -1) {
+            LOG_ERROR("wait for exec helper: %s", strerror(errno));
+        }
+
+        close(cont->exec_fds[i]);
+    }
+
+    cont->n_exec = 0;
+
+    ctl_free(cont->ctl);
+    cont->ctl = NULL;
+
+    proxy_free(cont->proxy);
+    cont->proxy = NULL;
+
+    dns_free(cont->dns);
+    cont->dns = NULL;
+
+    if (cont->reclaim) {
+        LOG("reclaimed %" PRIu64 " bytes in %" PRIu64 " rounds, %" PRIu64 " bytes refaulted",
+            cont->reclaim->reclaimed, cont->reclaim->n_round, cont->reclaim->refaulted);
+
+        // nothing left to reclaim from
+        stats_set_cb(cont->stats, NULL, NULL);
+        if (cont->memwatch) memwatch_set_cb(cont->memwatch, NULL, NULL);
+
+        reclaim_free(cont->reclaim);
+        cont->reclaim = NULL;
+    }
+
+    // before the overlay goes, a throwaway upper dir goes with it
+    if (cont->upper && !upper_scan(cont->upper)) {
+        LOG("upper dir: %" PRIu64 " bytes, %" PRIu64 " files copied up (%" PRIu64 " bytes, "
+            "%" PRIu64 " metadata only), %" PRIu64 " whiteouts",
+            cont->upper->last.bytes, cont->upper->last.n_copied_up,
+            cont->upper->last.copied_up_bytes, cont->upper->last.n_meta_only,
+            cont->upper->last.n_whiteout);
+
+        if (cont->upper->last.n_largest) {
+            LOG("largest copy-up: %s, %" PRIu64 " bytes",
+                cont->upper->last.largest[0].path, cont->upper->last.largest[0].bytes);
+        }
+    }
+
+    upper_free(cont->upper);
+    cont->upper = NULL;
+
+    // init is gone, the last of its output is still in the pipes
+    capture_free(cont->capture);
+    cont->capture = NULL;
+
+    // the cgroup outlives the child, so this catches the final totals
+    if (cont->stats) stats_sample(cont->stats);
+    if (cont->memwatch) memwatch_poll(cont->memwatch);
+
+    stats_free(cont->stats);
+    cont->stats = NULL;
+
+    memwatch_free(cont->memwatch);
+    cont->memwatch = NULL;
+
+    loop_free(cont->loop);
+    cont->loop = NULL;
+}
+
+// pick cpus and memory nodes and add them to the cgroup plan
+static int
+container_alloc_cpuset(container_t *cont)
+{
+    char path[PATH_MAX];
+    cgroup_entry_t ent = { .resrc = "cpuset" };
+
+    cgroup_path(cont->cgroup, "cpuset", path, sizeof(path));
+
+    // several containers of one supervisor each have a cgroup of their own
+    cont->cpuset = cpuset_alloc(cont->conf->cpuset_conf, cont->cgroup->name, getpid(), path);
+    if (!cont->cpuset) return -1;
+
+    LOG("placed on cpus %s, memory nodes %s", cont->cpuset->cpus, cont->cpuset->mems);
+
+    // v1 wants mems before any task joins, v2 takes them in any order
+    ent.var = "cpuset.mems";
+    ent.val = cont->cpuset->mems;
+
+    if (cgroup_set(cont->cgroup, &ent)) return -1;
+
+    ent.var = "cpuset.cpus";
+    ent.val = cont->cpuset->cpus;
+
+    return cgroup_set(cont->cgroup, &ent);
+}
+
+static bool
+container_is_pod_member(const container_t *cont)
+{
+    return cont->pod && !cont->pod->leader;
+}
+
+// suffix of the network device names, a pod's outlive its leader
+static void
+container_net_id(const container_t *cont, pid_t child, char *buf, size_t size)
+{
+    if (cont->pod) pod_net_id(cont->pod, buf, size);
+    else snprintf(buf, size, "%d", child);
+}
+
+// clean up the bridge unless other pod members still use it
+static void
+container_clean_net(container_t *cont, pid_t child)
+{
+    char id[16];
+    bool last = true;
+
+    container_net_id(cont, child, id, sizeof(id));
+
+    if (cont->pod) {
+        if (pod_leave(cont->pod, &last)) {
+            LOG_WARN("failed to leave pod '%s'", cont->pod->name);
+        }
+
+        pod_free(cont->pod);
+        cont->pod = NULL;
+    } else if (child == -1) {
+        return;
+    }
+
+    if (!last) return;
+
+    if (bridge_clean(id)) {
+        LOG_WARN("failed to clean up bridge");
+    }
+}
+
+// torn down in reverse, also after a failed start
+static void
+container_teardown(container_t *cont)
+{
+    container_stop_services(cont);
+
+    // host wide, shared with whatever else ksmd scans
+    if (cont->conf->ksm && cont->child != -1) {
+        LOG("ksmd used %" PRIu64 "ms of cpu while the container ran",
+            (ksm_ksmd_usec() - cont->ksmd_base_usec) / 1000);
+    }
+
+    if (cgroup_destroy(cont->cgroup)) {
+        LOG_WARN("failed to clean up cgroup");
+    }
+
+    cgroup_free(cont->cgroup);
+    cont->cgroup = NULL;
+
+    // after the cgroup is gone, so a rebalance never sees our cpus in use
+    if (cont->cpuset && cpuset_release(cont->cpuset)) {
+        LOG_WARN("failed to release cpuset");
+    }
+
+    cpuset_free(cont->cpuset);
+    cont->cpuset = NULL;
+
+    container_umount_root(cont);
+
+    container_clean_net(cont, cont->child);
+
+    if (container_clean_tmp_dir(cont)) {
+        LOG_WARN("failed to clean tmp dir");
+    }
+
+    cont->child = -1;
+}
+
+int
+container_start(container_t *cont, const char *img)
+{
+    static unsigned container_seq;
+    cgroup_entry_t freezer = { "freezer", "freezer.state", "THAWED" };
+    cgroup_entry_t cpuacct = { "cpuacct", "cpuacct.usage", "0" };
+    char id[32], net_id[16];
+    pid_t child;
+
+    // the first one keeps the name it always had
+    if (container_seq++) {
+        snprintf(id, sizeof(id), "%d.%u", getpid(), container_seq - 1);
+    } else {
+        snprintf(id, sizeof(id), "%d", getpid());
+    }
+
+    // reject a bad config before anything is set up
+    cont->cgroup = cgroup_new(cont->conf->cg_conf, cont->conf->cg_n_conf, id);
+
+    if (!cont->cgroup) {
+        LOG_ERROR("invalid cgroup config");
+        return -1;
+    }
+
+    // v2 can freeze any cgroup, v1 needs one in the freezer hierarchy
+    if (cont->cgroup->version == CGROUP_V1 && cgroup_set(cont->cgroup, &freezer)) {
+        LOG_WARN("no freezer hierarchy, the container cannot be frozen");
+    }
+
+    // the sampler reads cpu usage from cpuacct on v1, resetting a new counter is harmless
+    if (cont->cgroup->version == CGROUP_V1 && (cont->conf->stats_conf || cont->conf->reclaim_conf) &&
+        cgroup_set(cont->cgroup, &cpuacct)) {
+        LOG_WARN("no cpuacct hierarchy, samples have no cpu usage");
+    }
+
+    if (container_set_up_tmp_dir(cont, img)) {
+        LOG_ERROR("failed to set up tmp dir");
+        cgroup_free(cont->cgroup);
+        cont->cgroup = NULL;
+        return -1;
+    }
+
+    if (container_mount_root(cont)) {
+        LOG_ERROR("failed to mount root");
+        goto FAIL;
+    }
+
+    if (cont->conf->cpuset_conf && container_alloc_cpuset(cont)) {
+        LOG_ERROR("failed to place container");
+        goto FAIL;
+    }
+
+    if (cgroup_create(cont->cgroup)) {
+        LOG_ERROR("failed to set up cgroup");
+        goto FAIL;
+    }
+
+    if (container_start_services(cont)) {
+        LOG_ERROR("failed to start supervisor services");
+        goto FAIL;
+    }
+
+    if (cont->conf->ksm) {
+        if (!ksm_running()) LOG_WARN("ksmd is not running, pages will not be merged");
+        cont->ksmd_base_usec = ksm_ksmd_usec();
+    }
+
+    if (cont->conf->pod) {
+        cont->pod = pod_join(cont->conf->pod);
+
+        if (!cont->pod) {
+            LOG_ERROR("failed to join pod '%s'", cont->conf->pod);
+            goto FAIL;
+        }
+    }
+
+    // init starts with a copy of the ring
+    log_flush();
+
+    if (container_is_pod_member(cont)) {
+        // namespaces, id map and bridge are already set up by the leader
+        child = pod_clone(cont->pod, init, cont->stack.stack + sizeof(cont->stack), cont);
+    } else {
+        child = clone(init, cont->stack.stack + sizeof(cont->stack),
+                      CLONE_NEWPID | CLONE_NEWNS |
+                      CLONE_NEWUTS | CLONE_NEWUSER | CLONE_NEWNET |
+                      CLONE_NEWIPC | SIGCHLD, cont, NULL);
+    }
+
+    if (child == -1) {
+        LOG_ERROR("failed to start init");
+        goto FAIL;
+    }
+
+    cont->child = child;
+    cont->running = true;
+
+    // its exit is an event on the loop like any other
+    cont->child_fd = pidfd_open(child, 0);
+
+    if (cont->child_fd == -1 ||
+        loop_add(cont->loop, cont->child_fd, EPOLLIN, container_child_exit, cont)) {
+        LOG_ERROR("pidfd_open: %s", strerror(errno));
+        kill(child, SIGKILL);
+
+        if (cont->child_fd != -1) close(cont->child_fd);
+        cont->child_fd = -1;
+
+        container_child_exit(cont, -1, 0);
+        goto FAIL;
+    }
+
+    if (cont->conf->name) {
+        container_write_pid(cont, child);
+    }
+
+    if (cont->capture) {
+        capture_close_child(cont->capture);
+    }
+
+    // init is still blocked on the pipe, nothing runs unlimited
+    if (cgroup_attach(cont->cgroup, child)) {
+        LOG_ERROR("failed to attach cgroup");
+        kill(child, SIGKILL);
+    }
+
+    if (!container_is_pod_member(cont)) {
+        if (user_map_set_up(child, cont->conf->id_base)) {
+            LOG_ERROR("failed to set up id map");
+        }
+
+        container_net_id(cont, child, net_id, sizeof(net_id));
+
+        if (bridge_set_up(cont->conf->bridge_conf, child, net_id)) {
+            LOG_ERROR("failed to set up bridge");
+        }
+
+        // members wait on the pod lock until the network is ready
+        if (cont->pod && pod_publish(cont->pod, child)) {
+            LOG_ERROR("failed to publish pod '%s'", cont->pod->name);
+        }
+    }
+
+    // wake init
+    container_close_read(cont);
+    container_pipe_write(cont, "", 1);
+    container_close_write(cont);
+
+    return 0;
+
+FAIL:
+    container_teardown(cont);
+    return -1;
+}
+
+int
+container_fd(const container_t *cont)
+{
+    return cont->loop ? cont->loop->epfd : -1;
+}
+
+int
+container_poll(container_t *cont)
+{
+    if (cont->running && loop_run_once(cont->loop, 0)) return -1;
+
+    return !cont->running;
+}
+
+int
+container_wait(container_t *cont)
+{
+    while (cont->running) {
+        if (loop_run_once(cont->loop, -1)) {
+            LOG_ERROR("supervisor loop failed");
+
+            // services stop here, init is still reaped
+            if (cont->child_fd != -1) {
+                container_child_exit(cont, cont->child_fd, 0);
+            }
+
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int
+container_destroy(container_t *cont)
+{
+    int ret = 0;
+
+    if (cont->child == -1) return 0;
+
+    if (cont->running) {
+        kill(cont->child, SIGKILL);
+        ret = container_wait(cont);
+    }
+
+    container_teardown(cont);
+
+    return ret;
+}
+
+int
+container_run_image(container_t *cont, const char *img)
+{
+    int ret;
+
+    if (container_start(cont, img)) return -1;
+
+    ret = container_wait(cont);
+
+    return container_destroy(cont) || ret ? -1 : 0;
+}
+
+/* inside container */
+
+static int
+pivot_root(char *new, char *old)
+{
+    return syscall(SYS_pivot_root, new, old);
+}
+
+static int
+init_load_container(container_t *cont)
+{
+    char root[PATH_MAX], host[PATH_MAX];
+    size_t i;
+
+    container_path(cont, ROOT_DIR, root, sizeof(root));
+    container_path(cont, ROOT_DIR "/" HOST_DIR, host, sizeof(host));
+
+    if (cont->root_fd != -1) {
+        // prepared by the supervisor, only this namespace gets to see it
+        if (root_attach(cont->root_fd, root)) return -1;
+
+        close(cont->root_fd);
+        cont->root_fd = -1;
+    } else if (mount(root, root, "bind", MS_BIND | MS_REC, "")) {
+        LOG_ERROR("bind mount root: %s", strerror(errno));
+        return -1;
+    }
+
+    // host paths are still reachable by their own names until the pivot
+    for (i = 0; i < cont->conf->volume_n_conf; i++) {
+        if (volume_attach(&cont->conf->volume_conf[i],
+                          cont->volume_fds ? cont->volume_fds[i] : -1, root)) {
+            LOG_ERROR("failed to mount volume %s", cont->conf->volume_conf[i].target);
+            return -1;
+        }
+    }
+
+    container_close_volumes(cont);
+
+    // posix shm of the pod, sysv ipc comes with its namespace
+    if (cont->pod && pod_attach_shm(cont->pod, root)) {
+        LOG_ERROR("failed to share /dev/shm of pod '%s'", cont->pod->name);
+        return -1;
+    }
+
+    // left in the upper dir by the last run of a named container
+    if (mkdir(host, DEFAULT_MODE) && errno != EEXIST) {
+        LOG_ERROR("mkdir: %s", strerror(errno));
+        return -1;
+    }
+
+    if (pivot_root(root, host)) {
+        LOG_ERROR("pivot_root: %s", strerror(errno));
+        return -1;
+    }
+
+    if (chdir("/")) {
+        LOG_ERROR("chdir: %s", strerror(errno));
+        return -1;
+    }
+
+    vfs_mount();
+
+    return 0;
+}
+
+static int
+init_set_up_env(container_t *cont)
+{
+    int fd;
+
+    if (container_is_pod_member(cont)) {
+        // the uts namespace and its host name belong to the pod leader
+    } else if (sethostname(cont->conf->host_name, strlen(cont->conf->host_name))) {
+        LOG_ERROR("sethostname: %s", strerror(errno));
+        // return -1;
+    }
+
+    fd = open("/etc/resolv.conf", O_WRONLY | O_TRUNC);
+
+    // set dns server
+    if (fd == -1) {
+        LOG_ERROR("open /etc/resolv.conf: %s", strerror(errno));
+    } else {
+        // the forwarder listens on our side of the bridge
+        dprintf(fd, "nameserver %s\n",
+                cont->conf->dns_conf ? cont->conf->bridge_conf->host_ip
+                                     : cont->conf->nameserver);
+        close(fd);
+    }
+
+    // inherited by everything init starts, across exec
+    if (cont->conf->ksm && ksm_enable()) {
+        LOG_WARN("kernel same-page merging is not available");
+    }
+
+    return -1;
+}
+
+static int
+init_run(void *arg)
+{
+    container_t *cont = arg;
+    char buf[1];
+    int ret;
+
+    pod_close(cont->pod);
+    container_close_write(cont);
+    container_pipe_read(cont, buf, 1);
+    // container_close_read(cont);
+
+    if (cont->capture && capture_set_up_child(cont->capture)) {
+        return -1;
+    }
+
+    LOG("init is up");
+
+    // the credentials from before the map are unmapped in it, unless it is the identity
+    if (setgroups(0, NULL) || setresgid(0, 0, 0) || setresuid(0, 0, 0)) {
+        LOG_ERROR("become root of the container: %s", strerror(errno));
+        return -1;
+    }
+
+    if (init_load_container(cont)) {
+        LOG_ERROR("failed to load container");
+        return -1;
+    }
+
+    if (init_set_up_env(cont)) {
+        // do nothing
+    }
+
+    if (cont->conf->argv) {
+        log_flush();
+        execv(cont->conf->argv[0], cont->conf->argv);
+        LOG_ERROR("execv: %s", strerror(errno));
+        return -1;
+    }
+
+    ret = system("/bin/bash");
+
+    return ret;
+}
+
+// a cloned child exits without atexit handlers
+static int
+init(void *arg)
+{
+    int ret = init_run(arg);
+
+    log_flush();
+
+    return ret;
+}
+
+int
+container_freeze(container_t *cont)
+{
+    if (!cont->cgroup) return -1;
+    return cgroup_freeze(cont->cgroup, true, FREEZE_TIMEOUT_MS);
+}
+
+int
+container_thaw(container_t *cont)
+{
+    if (!cont->cgroup) return -1;
+    return cgroup_freeze(cont->cgroup, false, FREEZE_TIMEOUT_MS);
+}
+
+int
+container_update_limits(container_t *cont, const cgroup_entry_t *conf, size_t n_conf)
+{
+    size_t i;
+
+    if (!cont->cgroup) {
+        LOG_ERROR("container has no cgroup");
+        return -1;
+    }
+
+    // the allocator owns the placement, a manual one would be lost at the next rebalance
+    for (i = 0; cont->cpuset && i < n_conf; i++) {
+        if (!strncmp(conf[i].var, "cpuset.", 7)) {
+            LOG_ERROR("cpuset of the container is managed by the allocator");
+            return -1;
+        }
+    }
+
+    return cgroup_update(cont->cgroup, conf, n_conf);
+}
+
+int
+container_shape(container_t *cont, const tc_config_t *shape)
+{
+    bridge_config_t *bridge = cont->conf->bridge_conf;
+    char id[16];
+
+    if (!cont->running) {
+        LOG_ERROR("shaping needs a running container");
+        return -1;
+    }
+
+    container_net_id(cont, cont->child, id, sizeof(id));
+
+    if (tc_set_up(shape, id)) return -1;
+
+    // what a later reader of the config sees
+    if (!bridge->shape) bridge->shape = tc_config_copy(shape);
+    else *bridge->shape = *shape;
+
+    return 0;
+}
+
+int
+container_shape_stats(container_t *cont, tc_stat_t *rx, tc_stat_t *tx)
+{
+    char id[16];
+
+    if (!cont->running) {
+        LOG_ERROR("shaping stats need a running container");
+        return -1;
+    }
+
+    container_net_id(cont, cont->child, id, sizeof(id));
+
+    return tc_stats(id, rx, tx);
+}
+
+static void
+container_exec_exit(void *data, int fd, uint32_t events)
+{
+    container_t *cont = data;
+    siginfo_t info;
+    size_t i;
+
+    loop_del(cont->loop, fd);
+
+    if (waitid(P_PIDFD, fd, &info, WEXITED) == -1) {
+        LOG_ERROR("wait for exec helper: %s", strerror(errno));
+    } else {
+        LOG("exec %d exited with status %d", info.si_pid, info.si_status);
+    }
+
+    close(fd);
+
+    for (i = 0; i < cont->n_exec && cont->exec_fds[i] != fd; i++);
+    if (i < cont->n_exec) cont->exec_fds[i] = cont->exec_fds[--cont->n_exec];
+}
+
+// in the helper, already in the cgroup, returns the exit status of the command
+static int
+container_exec_helper(container_t *cont, int pidfd, char **argv)
+{
+    char path[PATH_MAX];
+    int fd, status, i;
+    pid_t pid;
+
+    // through the host's /proc, before the mount namespace changes
+    for (i = 0; i < 3; i++) {
+        snprintf(path, sizeof(path), "/proc/%d/fd/%d", cont->child, i);
+        fd = i ? open(path, O_WRONLY) : -1;
+
+        if (fd == -1) fd = open("/dev/null", i ? O_WRONLY : O_RDONLY);
+
+        if (fd == -1 || dup2(fd, i) == -1) {
+            LOG_ERROR("exec stdio: %s", strerror(errno));
+            return 1;
+        }
+
+        if (fd != i) close(fd);
+    }
+
+    if (setns(pidfd, CLONE_NEWUSER | CLONE_NEWNS | CLONE_NEWUTS |
+                     CLONE_NEWIPC | CLONE_NEWNET | CLONE_NEWPID)) {
+        LOG_ERROR("join container: %s", strerror(errno));
+        return 1;
+    }
+
+    if (setgroups(0, NULL) || setresgid(0, 0, 0) || setresuid(0, 0, 0) || chdir("/")) {
+        LOG_ERROR("become root of the container: %s", strerror(errno));
+        return 1;
+    }
+
+    // the pid namespace only takes for children
+    pid = fork();
+
+    if (pid == -1) {
+        LOG_ERROR("fork: %s", strerror(errno));
+        return 1;
+    }
+
+    if (pid == 0) {
+        execv(argv[0], argv);
+        LOG_ERROR("execv: %s", strerror(errno));
+        _exit(127);
+    }
+
+    if (waitpid(pid, &status, 0) == -1) {
+        LOG_ERROR("waitpid: %s", strerror(errno));
+        return 1;
+    }
+
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+pid_t
+container_exec(container_t *cont, char **argv)
+{
+    int sync[2] = { -1, -1 };
+    int pidfd, fd = -1, ret;
+    pid_t pid = -1;
+    char buf[1];
+
+    if (!cont->running) {
+        LOG("exec needs a running container");
+        return -1;
+    }
+
+    pidfd = pidfd_open(cont->child, 0);
+
+    if (pidfd == -1) {
+        LOG_ERROR("pidfd_open: %s", strerror(errno));
+        return -1;
+    }
+
+    if (pipe2(sync, O_CLOEXEC)) {
+        LOG_ERROR("pipe: %s", strerror(errno));
+        goto CLEAN;
+    }
+
+    log_flush();
+    pid = fork();
+
+    if (pid == -1) {
+        LOG_ERROR("fork: %s", strerror(errno));
+        goto CLEAN;
+    }
+
+    if (pid == 0) {
+        close(sync[1]);
+
+        // nothing runs before it is accounted to the container
+        if (read(sync[0], buf, 1) != 1) _exit(1);
+
+        ret = container_exec_helper(cont, pidfd, argv);
+        log_flush();
+        _exit(ret);
+    }
+
+    close(sync[0]);
+    sync[0] = -1;
+
+    if (cgroup_attach(cont->cgroup, pid) || write(sync[1], "", 1) != 1) {
+        LOG_ERROR("failed to start exec helper");
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        pid = -1;
+        goto CLEAN;
+    }
+
+    fd = pidfd_open(pid, 0);
+
+    if (fd == -1 || loop_add(cont->loop, fd, EPOLLIN, container_exec_exit, cont)) {
+        // left for whoever reaps the supervisor
+        LOG_WARN("exec helper %d is not watched", pid);
+        if (fd != -1) close(fd);
+        goto CLEAN;
+    }
+
+    cont->exec_fds = realloc(cont->exec_fds, sizeof(*cont->exec_fds) * (cont->n_exec + 1));
+    ASSERT(cont->exec_fds, "out of mem");
+
+    cont->exec_fds[cont->n_exec++] = fd;
+
+CLEAN:
+    if (sync[0] != -1) close(sync[0]);
+    if (sync[1] != -1) close(sync[1]);
+    close(pidfd);
+
+    return pid;
 }
@@ -2,27 +2,130 @@
 #define _CORE_CONTAINER_H_
 
 #include "bridge.h"
+#include "fs.h"
 #include "cgroup.h"
+#include "proxy.h"
+#include "dns.h"
+#include "loop.h"
+#include "pod.h"
+#include "stats.h"
+#include "cpuset.h"
+#include "memwatch.h"
+#include "ctl.h"
+#include "reclaim.h"
+#include "ksm.h"
+#include "upper.h"
+#include "capture.h"
 
 typedef struct {
-    char *tmp_dir; // template ending with XXXXXX
+    char *tmp_dir; // template ending with XXXXXX, unused for a named container
+
+    // keep the image, upper and work dirs under state_dir/name across runs,
+    // so whatever the workload wrote is still there the next time.
+    // NULL for a throwaway container in a fresh tmp_dir
+    char *name;
+    char *state_dir;
     char *host_name;
     char *nameserver;
+
+    // an image unpacked already, shared read-only as the lower layer instead
+    // of unpacking one into the container's dir. NULL to unpack the one given
+    char *image_dir;
+
+    char **argv; // command run by init, NULL for an interactive shell
     bridge_config_t *bridge_conf;
 
+    // options of the root overlay, NULL for the kernel defaults
+    overlay_config_t *overlay_conf;
+
+    // account for what the container wrote to the overlay, NULL for none.
+    // goes to the stats_conf output along with the samples
+    upper_config_t *upper_conf;
+
+    // host id that root in the container maps to, USER_MAP_RANGE ids from it,
+    // 0 for the identity map. the image is idmapped instead of chowned,
+    // pod members have to use the leader's
+    uid_t id_base;
+
+    // host paths and tmpfs mounted into the root, in order, so a later
+    // target may be under an earlier one
+    volume_entry_t *volume_conf;
+    size_t volume_n_conf;
+
     cgroup_entry_t *cg_conf;
     size_t cg_n_conf;
+
+    // published ports, relayed by the supervisor
+    proxy_entry_t *proxy_conf;
+    size_t proxy_n_conf;
+
+    // caching forwarder on the bridge, NULL to use nameserver directly
+    dns_config_t *dns_conf;
+
+    // share user, net, ipc and uts namespaces with the other members of this pod,
+    // NULL for private ones. members after the first use the pod's bridge
+    // attachment and hostname, bridge_conf should match it
+    char *pod;
+
+    // sample cgroup usage while running, NULL for none
+    stats_config_t *stats_conf;
+
+    // run on cpus and memory nodes picked by the allocator, NULL to float
+    cpuset_config_t *cpuset_conf;
+
+    // oom and memory pressure notifications, NULL for none
+    memwatch_config_t *memwatch_conf;
+
+    // give back memory while idle, NULL for none. samples with the
+    // stats_conf interval, or the default one without stats_conf
+    reclaim_config_t *reclaim_conf;
+
+    // let ksmd merge identical pages of the container's processes,
+    // ksmd has to be running on the host
+    bool ksm;
+
+    // stdout and stderr of the container to a log, NULL to share the supervisor's
+    capture_config_t *capture_conf;
+
+    // unix socket taking commands (e.g. limit updates) while running, NULL for none
+    char *ctl_path;
 } container_config_t;
 
 typedef struct {
-    char stack[4096];
+    char stack[65536];
 } clone_stack_t;
 
 typedef struct {
     clone_stack_t stack;
     container_config_t *conf;
     int pipe[2];
-    char *tmp_dir;
+    char *tmp_dir; // absolute
+    int root_fd; // detached root mount until init attaches it, -1 if mounted in place
+    int *volume_fds; // same for each volume, NULL if there is none
+    int state_lock; // named containers, -1 otherwise
+    pid_t child; // init, -1 until started and after container_destroy
+    int child_fd; // its pidfd, on the supervisor loop while it runs
+    bool running; // false once init has been reaped
+    int exit_status; // of init's last run, as from waitpid
+
+    // pidfds of the helpers of container_exec, reaped on the supervisor loop
+    int *exec_fds;
+    size_t n_exec;
+
+    // supervisor side
+    loop_t *loop;
+    proxy_t *proxy;
+    dns_t *dns;
+    pod_t *pod;
+    cgroup_t *cgroup;
+    stats_t *stats;
+    cpuset_t *cpuset;
+    memwatch_t *memwatch;
+    ctl_t *ctl;
+    reclaim_t *reclaim;
+    upper_t *upper;
+    capture_t *capture;
+    uint64_t ksmd_base_usec; // ksmd cpu time at start
 } container_t;
 
 container_config_t *
@@ -49,7 +152,81 @@ container_pipe_write(container_t *cont, const char *buf, size_t size);
 ssize_t
 container_pipe_read(container_t *cont, char *buf, size_t size);
 
+/*
+
+non-blocking lifecycle, for running many containers from one thread
+
+container_start returns once init runs. everything the supervisor does
+for the container, init's exit included, is an event on its loop, whose
+epoll fd container_fd returns. when it is readable (it can be added to
+another epoll), container_poll handles what is pending without blocking
+
+teardown in container_destroy stays synchronous, it unmounts and runs
+the bridge clean up
+
+*/
+
+// a named container runs what container_create extracted, img is unused
+int
+container_start(container_t *cont, const char *img);
+
+int
+container_fd(const container_t *cont);
+
+// 1 once init has exited, with exit_status set, 0 while it runs
+int
+container_poll(container_t *cont);
+
+// serve the loop until init exits
+int
+container_wait(container_t *cont);
+
+// SIGKILL to init if it still runs, then clean up what start set up
+int
+container_destroy(container_t *cont);
+
+// start, wait and destroy
 int
 container_run_image(container_t *cont, const char *img);
 
+// lifecycle of named containers, started with container_run_image
+
+// extract the image into a new state_dir/name
+int
+container_create(const char *state_dir, const char *name, const char *img);
+
+// SIGTERM to its init, SIGKILL if it is still running after timeout_ms,
+// returns once the supervisor has cleaned up
+int
+container_stop(const char *state_dir, const char *name, int timeout_ms);
+
+// everything it wrote goes with it, refused while it runs
+int
+container_remove(const char *state_dir, const char *name);
+
+// run argv in the namespaces and cgroup of the running container, with the
+// stdout and stderr of its init. returns the pid of a host side helper that
+// exits with the command, or -1. needs the supervisor loop (e.g. ctl_path)
+pid_t
+container_exec(container_t *cont, char **argv);
+
+// park the processes of a running container without touching their state,
+// both return once the kernel reports the change
+int
+container_freeze(container_t *cont);
+
+int
+container_thaw(container_t *cont);
+
+// change cgroup variables of the running container, all or nothing
+int
+container_update_limits(container_t *cont, const cgroup_entry_t *conf, size_t n_conf);
+
+// replace the bandwidth limits of the running container, shared by a pod
+int
+container_shape(container_t *cont, const tc_config_t *shape);
+
+int
+container_shape_stats(container_t *cont, tc_stat_t *rx, tc_stat_t *tx);
+
 #endif
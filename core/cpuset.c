@@ -0,0 +1,699 @@
+#include <errno.h>
+#include <dirent.h>
+#include <signal.h>
+#include <sys/file.h>
+
+#include "pub/type.h"
+#include "pub/fd.h"
+
+#include "cpuset.h"
+
+#define CPUSET_SYS_CPU "/sys/devices/system/cpu"
+#define CPUSET_SYS_NODE "/sys/devices/system/node"
+
+typedef struct {
+    int node;
+    int l3; // lowest cpu sharing the l3, or -1 - node without one
+    int core; // lowest hyperthread sibling
+    int dom;
+} cpuset_cpu_t;
+
+typedef struct {
+    cpu_set_t usable; // online and in our affinity mask
+    cpuset_cpu_t cpu[CPU_SETSIZE];
+
+    int n_dom;
+    int dom_node[CPU_SETSIZE];
+    int dom_l3[CPU_SETSIZE];
+} cpuset_topo_t;
+
+typedef struct {
+    pid_t pid;
+    char id[CPUSET_ID_SIZE];
+    cpuset_mode_t mode;
+    cpuset_policy_t policy;
+    int n_req;
+    cpu_set_t cpus;
+    char path[PATH_MAX];
+} cpuset_entry_t;
+
+typedef struct {
+    int fd;
+    cpuset_entry_t *ents;
+    size_t n_ent;
+} cpuset_state_t;
+
+cpuset_config_t *
+cpuset_config_copy(const cpuset_config_t *conf)
+{
+    cpuset_config_t *copy;
+
+    if (!conf) return NULL;
+
+    copy = malloc(sizeof(*copy));
+    ASSERT(copy, "out of mem");
+
+    *copy = *conf;
+
+    return copy;
+}
+
+void
+cpuset_config_free(cpuset_config_t *conf)
+{
+    free(conf);
+}
+
+/* cpu lists */
+
+static int
+cpuset_parse_list(const char *list, cpu_set_t *set)
+{
+    const char *p = list;
+    char *end;
+    long lo, hi;
+
+    CPU_ZERO(set);
+
+    while (*p && *p != '\n') {
+        lo = strtol(p, &end, 10);
+        if (end == p) return -1;
+
+        hi = lo;
+        p = end;
+
+        if (*p == '-') {
+            hi = strtol(p + 1, &end, 10);
+            if (end == p + 1) return -1;
+            p = end;
+        }
+
+        for (; lo <= hi && lo < CPU_SETSIZE; lo++) {
+            CPU_SET(lo, set);
+        }
+
+        if (*p == ',') p++;
+    }
+
+    return 0;
+}
+
+_Static_assert(CPUSET_LIST_SIZE >= CPU_SETSIZE * 5, "a full cpu list must fit");
+
+// a cut list would name other cpus, so -1 if it does not fit
+static int
+cpuset_format_list(const cpu_set_t *set, char *buf, size_t size)
+{
+    size_t len = 0;
+    int i, j, n;
+
+    buf[0] = '\0';
+
+    for (i = 0; i < CPU_SETSIZE; i = j) {
+        if (!CPU_ISSET(i, set)) {
+            j = i + 1;
+            continue;
+        }
+
+        for (j = i + 1; j < CPU_SETSIZE && CPU_ISSET(j, set); j++);
+
+        if (j - 1 == i) {
+            n = snprintf(buf + len, size - len, "%s%d", len ? "," : "", i);
+        } else {
+            n = snprintf(buf + len, size - len, "%s%d-%d", len ? "," : "", i, j - 1);
+        }
+
+        if (n < 0 || (size_t)n >= size - len) {
+            LOG_ERROR("cpu list does not fit in %zu bytes", size);
+            buf[0] = '\0';
+            return -1;
+        }
+
+        len += n;
+    }
+
+    return 0;
+}
+
+static int
+cpuset_read_list(const char *path, cpu_set_t *set)
+{
+    char buf[4096];
+    ssize_t n;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1) return -1;
+
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+
+    if (n <= 0) return -1;
+    buf[n] = '\0';
+
+    return cpuset_parse_list(buf, set);
+}
+
+static int
+cpuset_first(const cpu_set_t *set)
+{
+    int i;
+
+    for (i = 0; i < CPU_SETSIZE; i++) {
+        if (CPU_ISSET(i, set)) return i;
+    }
+
+    return -1;
+}
+
+/* topology */
+
+static int
+cpuset_load_topo(cpuset_topo_t *topo)
+{
+    char path[PATH_MAX];
+    cpu_set_t online, set;
+    struct dirent *ent;
+    DIR *dir;
+    int cpu, node, i;
+
+    if (cpuset_read_list(CPUSET_SYS_CPU "/online", &online)) {
+        LOG_ERROR("failed to read online cpus");
+        return -1;
+    }
+
+    if (sched_getaffinity(0, sizeof(set), &set)) {
+        LOG_ERROR("sched_getaffinity: %s", strerror(errno));
+        return -1;
+    }
+
+    CPU_AND(&topo->usable, &online, &set);
+
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        topo->cpu[cpu].node = 0;
+    }
+
+    // hosts without numa have no node directory
+    dir = opendir(CPUSET_SYS_NODE);
+
+    while (dir && (ent = readdir(dir))) {
+        if (sscanf(ent->d_name, "node%d", &node) != 1) continue;
+
+        snprintf(path, sizeof(path), CPUSET_SYS_NODE "/%s/cpulist", ent->d_name);
+
+        if (cpuset_read_list(path, &set)) continue;
+
+        for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &set)) topo->cpu[cpu].node = node;
+        }
+    }
+
+    if (dir) closedir(dir);
+
+    topo->n_dom = 0;
+
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        cpuset_cpu_t *c = &topo->cpu[cpu];
+
+        if (!CPU_ISSET(cpu, &topo->usable)) continue;
+
+        snprintf(path, sizeof(path), CPUSET_SYS_CPU "/cpu%d/cache/index3/shared_cpu_list", cpu);
+        c->l3 = cpuset_read_list(path, &set) ? -1 - c->node : cpuset_first(&set);
+
+        snprintf(path, sizeof(path), CPUSET_SYS_CPU "/cpu%d/topology/thread_siblings_list", cpu);
+        c->core = cpuset_read_list(path, &set) ? cpu : cpuset_first(&set);
+
+        for (i = 0; i < topo->n_dom; i++) {
+            if (topo->dom_node[i] == c->node && topo->dom_l3[i] == c->l3) break;
+        }
+
+        if (i == topo->n_dom) {
+            topo->dom_node[i] = c->node;
+            topo->dom_l3[i] = c->l3;
+            topo->n_dom++;
+        }
+
+        c->dom = i;
+    }
+
+    return 0;
+}
+
+static int
+cpuset_mems(const cpuset_topo_t *topo, const cpu_set_t *cpus, char *buf, size_t size)
+{
+    cpu_set_t nodes;
+    int cpu;
+
+    CPU_ZERO(&nodes);
+
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, cpus)) CPU_SET(topo->cpu[cpu].node, &nodes);
+    }
+
+    return cpuset_format_list(&nodes, buf, size);
+}
+
+/* placement */
+
+// cpus held exclusively and the number of shared containers on each cpu
+static void
+cpuset_usage(const cpuset_state_t *state, const char *skip, cpu_set_t *excl, int *load)
+{
+    size_t i;
+    int cpu;
+
+    CPU_ZERO(excl);
+    memset(load, 0, sizeof(*load) * CPU_SETSIZE);
+
+    for (i = 0; i < state->n_ent; i++) {
+        const cpuset_entry_t *ent = &state->ents[i];
+
+        if (!strcmp(ent->id, skip)) continue;
+
+        if (ent->mode == CPUSET_EXCLUSIVE) {
+            CPU_OR(excl, excl, &ent->cpus);
+        } else {
+            for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                if (CPU_ISSET(cpu, &ent->cpus)) load[cpu]++;
+            }
+        }
+    }
+}
+
+// take up to n candidates of a domain, least loaded first, siblings together
+static int
+cpuset_pick(const cpuset_topo_t *topo, cpu_set_t *cand, const int *load,
+            int dom, int n, cpu_set_t *out)
+{
+    int taken = 0;
+    int cpu, best;
+
+    for (; taken < n; taken++) {
+        best = -1;
+
+        for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (!CPU_ISSET(cpu, cand) || topo->cpu[cpu].dom != dom) continue;
+
+            if (best == -1 || load[cpu] < load[best] ||
+                (load[cpu] == load[best] && topo->cpu[cpu].core < topo->cpu[best].core)) {
+                best = cpu;
+            }
+        }
+
+        if (best == -1) break;
+
+        CPU_CLR(best, cand);
+        CPU_SET(best, out);
+    }
+
+    return taken;
+}
+
+// whether domain a suits the policy better than b, both fit the request
+static bool
+cpuset_better(cpuset_mode_t mode, cpuset_policy_t policy,
+              const int *n_free, const int *dload, int a, int b)
+{
+    long la, lb;
+
+    if (b == -1) return true;
+
+    la = (long)dload[a] * n_free[b];
+    lb = (long)dload[b] * n_free[a];
+
+    if (policy == CPUSET_SPREAD) {
+        // lowest load per cpu, then the roomiest
+        return la < lb || (la == lb && n_free[a] > n_free[b]);
+    }
+
+    if (mode == CPUSET_SHARED && dload[a] != dload[b]) {
+        return dload[a] > dload[b];
+    }
+
+    // best fit
+    return n_free[a] < n_free[b];
+}
+
+static int
+cpuset_place(const cpuset_topo_t *topo, const cpuset_state_t *state, const char *skip,
+             int n, cpuset_mode_t mode, cpuset_policy_t policy, cpu_set_t *out)
+{
+    static int load[CPU_SETSIZE], n_free[CPU_SETSIZE], dload[CPU_SETSIZE];
+    cpu_set_t excl, cand, idle;
+    int cpu, d, best = -1, node = -1, taken = 0;
+    int node_cand[CPU_SETSIZE] = { 0 };
+
+    cpuset_usage(state, skip, &excl, load);
+
+    CPU_ZERO(out);
+    CPU_ZERO(&idle);
+
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &topo->usable) && !CPU_ISSET(cpu, &excl) && !load[cpu]) {
+            CPU_SET(cpu, &idle);
+        }
+    }
+
+    CPU_XOR(&cand, &topo->usable, &excl);
+    CPU_AND(&cand, &cand, &topo->usable);
+
+    // shared containers on the cpus taken are moved away by the rebalance
+    if (mode == CPUSET_EXCLUSIVE) {
+        if (CPU_COUNT(&idle) >= n) cand = idle;
+        else if (CPU_COUNT(&cand) < n) return -1;
+    }
+
+    if (n > CPU_COUNT(&cand)) n = CPU_COUNT(&cand);
+    if (n <= 0) return -1;
+
+    memset(n_free, 0, sizeof(n_free));
+    memset(dload, 0, sizeof(dload));
+
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &cand)) continue;
+
+        d = topo->cpu[cpu].dom;
+        n_free[d]++;
+        dload[d] += load[cpu];
+        node_cand[topo->cpu[cpu].node]++;
+    }
+
+    for (d = 0; d < topo->n_dom; d++) {
+        if (n_free[d] >= n && cpuset_better(mode, policy, n_free, dload, d, best)) {
+            best = d;
+        }
+    }
+
+    if (best != -1) {
+        cpuset_pick(topo, &cand, load, best, n, out);
+        return 0;
+    }
+
+    // no domain is big enough, stay on the node with most room, largest domains first
+    for (d = 0; d < topo->n_dom; d++) {
+        if (node == -1 || node_cand[topo->dom_node[d]] > node_cand[node]) {
+            node = topo->dom_node[d];
+        }
+    }
+
+    while (taken < n) {
+        best = -1;
+
+        for (d = 0; d < topo->n_dom; d++) {
+            if (!n_free[d]) continue;
+
+            if (best == -1 ||
+                (topo->dom_node[d] == node) > (topo->dom_node[best] == node) ||
+                ((topo->dom_node[d] == node) == (topo->dom_node[best] == node) && n_free[d] > n_free[best])) {
+                best = d;
+            }
+        }
+
+        if (best == -1) break;
+
+        taken += cpuset_pick(topo, &cand, load, best, n - taken, out);
+        n_free[best] = 0;
+    }
+
+    return 0;
+}
+
+/* state */
+
+static bool
+cpuset_alive(pid_t pid)
+{
+    return kill(pid, 0) == 0 || errno == EPERM;
+}
+
+static int
+cpuset_lock(cpuset_state_t *state)
+{
+    struct stat st;
+    char *buf, *line, *save;
+    cpuset_entry_t ent;
+    char cpus[CPUSET_LIST_SIZE];
+    int mode, policy;
+
+    state->ents = NULL;
+    state->n_ent = 0;
+
+    if (mkdir("/var/run/ducker", 0755) && errno != EEXIST) {
+        LOG_ERROR("mkdir /var/run/ducker: %s", strerror(errno));
+        return -1;
+    }
+
+    state->fd = open(CPUSET_STATE, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+    if (state->fd == -1) {
+        LOG_ERROR("open cpuset state: %s", strerror(errno));
+        return -1;
+    }
+
+    if (flock(state->fd, LOCK_EX) || fstat(state->fd, &st)) {
+        LOG_ERROR("lock cpuset state: %s", strerror(errno));
+        close(state->fd);
+        return -1;
+    }
+
+    buf = malloc(st.st_size + 1);
+    ASSERT(buf, "out of mem");
+
+    if (pread(state->fd, buf, st.st_size, 0) != st.st_size) {
+        LOG_ERROR("read cpuset state: %s", strerror(errno));
+        st.st_size = 0;
+    }
+
+    buf[st.st_size] = '\0';
+
+    for (line = strtok_r(buf, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+        memset(&ent, 0, sizeof(ent));
+
+        if (sscanf(line, "%d %47s %d %d %d %5119s %4095s",
+                   &ent.pid, ent.id, &mode, &policy, &ent.n_req, cpus, ent.path) < 6 ||
+            cpuset_parse_list(cpus, &ent.cpus)) {
+            LOG_WARN("ignoring bad cpuset state line '%s'", line);
+            continue;
+        }
+
+        ent.mode = mode;
+        ent.policy = policy;
+
+        // entries of supervisors that are gone
+        if (!cpuset_alive(ent.pid)) continue;
+
+        state->ents = realloc(state->ents, sizeof(*state->ents) * (state->n_ent + 1));
+        ASSERT(state->ents, "out of mem");
+
+        state->ents[state->n_ent++] = ent;
+    }
+
+    free(buf);
+
+    return 0;
+}
+
+static int
+cpuset_unlock(cpuset_state_t *state)
+{
+    char cpus[CPUSET_LIST_SIZE];
+    char *buf;
+    size_t size = state->n_ent * (PATH_MAX + CPUSET_ID_SIZE + 2 * CPUSET_LIST_SIZE) + 1;
+    size_t len = 0, i;
+    int ret = 0;
+
+    buf = malloc(size);
+    ASSERT(buf, "out of mem");
+
+    for (i = 0; i < state->n_ent; i++) {
+        // the old state is better than one with a line missing
+        if (cpuset_format_list(&state->ents[i].cpus, cpus, sizeof(cpus))) {
+            ret = -1;
+            break;
+        }
+
+        len += snprintf(buf + len, size - len, "%d %s %d %d %d %s %s\n",
+                        state->ents[i].pid, state->ents[i].id, state->ents[i].mode, state->ents[i].policy,
+                        state->ents[i].n_req, cpus, state->ents[i].path);
+    }
+
+    if (!ret && (pwrite(state->fd, buf, len, 0) != (ssize_t)len || ftruncate(state->fd, len))) {
+        LOG_ERROR("write cpuset state: %s", strerror(errno));
+        ret = -1;
+    }
+
+    free(buf);
+    free(state->ents);
+
+    close(state->fd);
+
+    return ret;
+}
+
+static int
+cpuset_write(const char *path, const char *var, const char *val)
+{
+    char file[PATH_MAX + 32];
+    int fd;
+
+    snprintf(file, sizeof(file), "%s/%s", path, var);
+
+    fd = open(file, O_WRONLY | O_CLOEXEC);
+
+    if (fd == -1 || write(fd, val, strlen(val)) == -1) {
+        LOG_ERROR("%s: %s", file, strerror(errno));
+        if (fd != -1) close(fd);
+        return -1;
+    }
+
+    close(fd);
+
+    return 0;
+}
+
+// move shared containers off exclusive cpus, and back to full size when there is room
+static void
+cpuset_rebalance(const cpuset_topo_t *topo, cpuset_state_t *state)
+{
+    char cpus[CPUSET_LIST_SIZE], mems[CPUSET_LIST_SIZE];
+    cpu_set_t excl, room, overlap, set;
+    static int load[CPU_SETSIZE];
+    cpuset_entry_t *ent;
+    size_t i;
+
+    for (i = 0; i < state->n_ent; i++) {
+        ent = &state->ents[i];
+
+        if (ent->mode != CPUSET_SHARED) continue;
+
+        cpuset_usage(state, ent->id, &excl, load);
+
+        CPU_AND(&overlap, &ent->cpus, &excl);
+        CPU_XOR(&room, &topo->usable, &excl);
+        CPU_AND(&room, &room, &topo->usable);
+
+        if (!CPU_COUNT(&overlap) &&
+            (CPU_COUNT(&ent->cpus) >= ent->n_req || CPU_COUNT(&room) <= CPU_COUNT(&ent->cpus))) {
+            continue;
+        }
+
+        if (cpuset_place(topo, state, ent->id, ent->n_req, CPUSET_SHARED, ent->policy, &set) ||
+            CPU_EQUAL(&set, &ent->cpus)) {
+            continue;
+        }
+
+        if (cpuset_format_list(&set, cpus, sizeof(cpus)) ||
+            cpuset_mems(topo, &set, mems, sizeof(mems))) {
+            continue;
+        }
+
+        LOG("cpuset: moving %s to cpus %s", ent->id, cpus);
+
+        // mems first, so the new cpus never lack a node
+        if (*ent->path &&
+            (cpuset_write(ent->path, "cpuset.mems", mems) ||
+             cpuset_write(ent->path, "cpuset.cpus", cpus))) {
+            continue;
+        }
+
+        ent->cpus = set;
+    }
+}
+
+cpuset_t *
+cpuset_alloc(const cpuset_config_t *conf, const char *id, pid_t pid, const char *path)
+{
+    cpuset_topo_t *topo = malloc(sizeof(*topo));
+    cpuset_state_t state;
+    cpuset_entry_t ent;
+    cpuset_t *set = NULL;
+
+    ASSERT(topo, "out of mem");
+
+    if (conf->n_cpu <= 0) {
+        LOG_ERROR("invalid cpu count %d", conf->n_cpu);
+        free(topo);
+        return NULL;
+    }
+
+    if (cpuset_load_topo(topo) || cpuset_lock(&state)) {
+        free(topo);
+        return NULL;
+    }
+
+    memset(&ent, 0, sizeof(ent));
+    ent.pid = pid;
+    snprintf(ent.id, sizeof(ent.id), "%s", id);
+    ent.mode = conf->mode;
+    ent.policy = conf->policy;
+    ent.n_req = conf->n_cpu;
+    snprintf(ent.path, sizeof(ent.path), "%s", path ? path : "");
+
+    if (cpuset_place(topo, &state, ent.id, conf->n_cpu, conf->mode, conf->policy, &ent.cpus)) {
+        LOG_ERROR("not enough cpus for %d %s cpu(s)", conf->n_cpu,
+            conf->mode == CPUSET_EXCLUSIVE ? "exclusive" : "shared");
+    } else {
+        set = malloc(sizeof(*set));
+        ASSERT(set, "out of mem");
+
+        snprintf(set->id, sizeof(set->id), "%s", ent.id);
+
+        if (cpuset_format_list(&ent.cpus, set->cpus, sizeof(set->cpus)) ||
+            cpuset_mems(topo, &ent.cpus, set->mems, sizeof(set->mems))) {
+            free(set);
+            cpuset_unlock(&state);
+            free(topo);
+            return NULL;
+        }
+
+        state.ents = realloc(state.ents, sizeof(*state.ents) * (state.n_ent + 1));
+        ASSERT(state.ents, "out of mem");
+
+        state.ents[state.n_ent++] = ent;
+
+        if (CPU_COUNT(&ent.cpus) < conf->n_cpu) {
+            LOG_WARN("cpuset: only %d of %d cpu(s) available", CPU_COUNT(&ent.cpus), conf->n_cpu);
+        }
+
+        cpuset_rebalance(topo, &state);
+    }
+
+    cpuset_unlock(&state);
+    free(topo);
+
+    return set;
+}
+
+int
+cpuset_release(cpuset_t *set)
+{
+    cpuset_topo_t *topo = malloc(sizeof(*topo));
+    cpuset_state_t state;
+    size_t i;
+
+    ASSERT(topo, "out of mem");
+
+    if (cpuset_load_topo(topo) || cpuset_lock(&state)) {
+        free(topo);
+        return -1;
+    }
+
+    for (i = 0; i < state.n_ent; i++) {
+        if (!strcmp(state.ents[i].id, set->id)) {
+            state.ents[i] = state.ents[--state.n_ent];
+            break;
+        }
+    }
+
+    cpuset_rebalance(topo, &state);
+
+    free(topo);
+
+    return cpuset_unlock(&state);
+}
+
+void
+cpuset_free(cpuset_t *set)
+{
+    free(set);
+}
@@ -0,0 +1,65 @@
+#ifndef _CORE_CPUSET_H_
+#define _CORE_CPUSET_H_
+
+#include "pub/type.h"
+#include "pub/clone.h"
+#include "pub/limit.h"
+
+/*
+
+cpu and memory node placement shared by all supervisors on the host
+
+cpus are grouped into domains (a numa node and an l3 cache), a container
+is kept within one domain when it fits, hyperthread siblings together
+
+allocations are kept in a flock'd state file, keyed by container, entries
+of dead supervisors are dropped, and shared containers are moved off cpus an exclusive one
+takes, or back to their full size when cpus free up
+
+*/
+
+#define CPUSET_STATE "/var/run/ducker/cpuset"
+#define CPUSET_LIST_SIZE 5120 // CPU_SETSIZE cpus, each at most ",dddd"
+#define CPUSET_ID_SIZE 48 // no whitespace
+
+typedef enum {
+    CPUSET_SHARED = 0, // may overlap other shared containers
+    CPUSET_EXCLUSIVE // no other container runs on these cpus
+} cpuset_mode_t;
+
+typedef enum {
+    CPUSET_PACK = 0, // fill up busy domains first, keeps others idle
+    CPUSET_SPREAD // least loaded domain first, less contention
+} cpuset_policy_t;
+
+typedef struct {
+    int n_cpu;
+    cpuset_mode_t mode;
+    cpuset_policy_t policy;
+} cpuset_config_t;
+
+typedef struct {
+    char id[CPUSET_ID_SIZE];
+    char cpus[CPUSET_LIST_SIZE]; // cpuset.cpus format
+    char mems[CPUSET_LIST_SIZE];
+} cpuset_t;
+
+cpuset_config_t *
+cpuset_config_copy(const cpuset_config_t *conf);
+
+void
+cpuset_config_free(cpuset_config_t *conf);
+
+// reserve cpus for the container identified by id, unique on the host, held
+// while pid lives. path is the cpuset cgroup the allocation is written to on rebalance
+cpuset_t *
+cpuset_alloc(const cpuset_config_t *conf, const char *id, pid_t pid, const char *path);
+
+// give the cpus back and rebalance the remaining containers
+int
+cpuset_release(cpuset_t *set);
+
+void
+cpuset_free(cpuset_t *set);
+
+#endif
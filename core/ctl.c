@@ -0,0 +1,454 @@
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "pub/type.h"
+#include "pub/fd.h"
+
+#include "ctl.h"
+
+#define CTL_BACKLOG 16
+
+struct ctl_conn_t {
+    ctl_t *ctl;
+    int fd;
+
+    char *in;
+    size_t in_len;
+    size_t in_cap;
+
+    char *out;
+    size_t out_len;
+    size_t out_off;
+
+    ctl_conn_t *prev;
+    ctl_conn_t *next;
+};
+
+static void ctl_conn_event(void *data, int fd, uint32_t events);
+
+static int
+ctl_addr(const char *path, struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        LOG_ERROR("control socket path too long: %s", path);
+        return -1;
+    }
+
+    strcpy(addr->sun_path, path);
+
+    return 0;
+}
+
+static void
+ctl_conn_free(ctl_conn_t *conn)
+{
+    ctl_t *ctl = conn->ctl;
+
+    loop_del(ctl->loop, conn->fd);
+    close(conn->fd);
+
+    if (conn->prev) conn->prev->next = conn->next;
+    else ctl->conns = conn->next;
+
+    if (conn->next) conn->next->prev = conn->prev;
+
+    free(conn->in);
+    free(conn->out);
+    free(conn);
+}
+
+static int
+ctl_help(void *data, int argc, char **argv, FILE *out)
+{
+    ctl_t *ctl = data;
+    size_t i;
+
+    for (i = 0; i < ctl->n_cmd; i++) {
+        fprintf(out, "%s%s%s\n", ctl->cmds[i].name,
+                *ctl->cmds[i].usage ? " " : "", ctl->cmds[i].usage);
+    }
+
+    return 0;
+}
+
+// run one request and queue its reply frame
+static void
+ctl_dispatch(ctl_conn_t *conn, char *req, uint32_t len)
+{
+    ctl_t *ctl = conn->ctl;
+    char *argv[CTL_MAX_ARG + 1];
+    int argc = 0, status = 1;
+    char *text = NULL;
+    size_t text_len = 0, i;
+    uint32_t reply_len;
+    FILE *out;
+    char *p;
+
+    out = open_memstream(&text, &text_len);
+    ASSERT(out, "out of mem");
+
+    // the last argument has to be terminated before strlen can be trusted
+    for (p = req; req[len - 1] == '\0' && p < req + len && argc < CTL_MAX_ARG; p += strlen(p) + 1) {
+        argv[argc++] = p;
+    }
+
+    argv[argc] = NULL;
+
+    if (!argc) {
+        fprintf(out, "malformed request\n");
+    } else if (p < req + len) {
+        fprintf(out, "too many arguments\n");
+    } else {
+        for (i = 0; i < ctl->n_cmd && strcmp(ctl->cmds[i].name, argv[0]); i++);
+
+        if (i == ctl->n_cmd) {
+            fprintf(out, "unknown command '%s', try help\n", argv[0]);
+        } else {
+            status = ctl->cmds[i].cb(ctl->cmds[i].data, argc, argv, out) ? 1 : 0;
+        }
+    }
+
+    fclose(out);
+
+    reply_len = text_len + 1;
+
+    conn->out = realloc(conn->out, conn->out_len + sizeof(reply_len) + reply_len);
+    ASSERT(conn->out, "out of mem");
+
+    memcpy(conn->out + conn->out_len, &reply_len, sizeof(reply_len));
+    conn->out[conn->out_len + sizeof(reply_len)] = status;
+    memcpy(conn->out + conn->out_len + sizeof(reply_len) + 1, text, text_len);
+
+    conn->out_len += sizeof(reply_len) + reply_len;
+
+    free(text);
+}
+
+// returns -1 if the connection should be dropped
+static int
+ctl_conn_read(ctl_conn_t *conn)
+{
+    uint32_t len;
+    ssize_t n;
+
+    while (1) {
+        if (conn->in_len == conn->in_cap) {
+            conn->in_cap = conn->in_cap ? conn->in_cap * 2 : 4096;
+            conn->in = realloc(conn->in, conn->in_cap);
+            ASSERT(conn->in, "out of mem");
+        }
+
+        n = read(conn->fd, conn->in + conn->in_len, conn->in_cap - conn->in_len);
+
+        if (n == 0) return -1;
+
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            if (errno == EINTR) continue;
+            return -1;
+        }
+
+        conn->in_len += n;
+    }
+
+    // every complete frame
+    while (conn->in_len >= sizeof(len)) {
+        memcpy(&len, conn->in, sizeof(len));
+
+        if (!len || len > CTL_MAX_FRAME) {
+            LOG_WARN("control socket: bad frame length %u", len);
+            return -1;
+        }
+
+        if (conn->in_len < sizeof(len) + len) break;
+
+        ctl_dispatch(conn, conn->in + sizeof(len), len);
+
+        conn->in_len -= sizeof(len) + len;
+        memmove(conn->in, conn->in + sizeof(len) + len, conn->in_len);
+    }
+
+    return 0;
+}
+
+// returns -1 if the connection should be dropped
+static int
+ctl_conn_write(ctl_conn_t *conn)
+{
+    ssize_t n;
+
+    while (conn->out_off < conn->out_len) {
+        n = write(conn->fd, conn->out + conn->out_off, conn->out_len - conn->out_off);
+
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            if (errno == EINTR) continue;
+            return -1;
+        }
+
+        conn->out_off += n;
+    }
+
+    if (conn->out_off == conn->out_len) {
+        conn->out_off = conn->out_len = 0;
+    }
+
+    return 0;
+}
+
+static void
+ctl_conn_event(void *data, int fd, uint32_t events)
+{
+    ctl_conn_t *conn = data;
+
+    if ((events & EPOLLIN) && ctl_conn_read(conn)) {
+        ctl_conn_free(conn);
+        return;
+    }
+
+    if ((events & (EPOLLERR | EPOLLHUP)) && !(events & EPOLLIN)) {
+        ctl_conn_free(conn);
+        return;
+    }
+
+    if (conn->out_len && ctl_conn_write(conn)) {
+        ctl_conn_free(conn);
+        return;
+    }
+
+    // stop reading while replies are backed up
+    loop_mod(conn->ctl->loop, conn->fd, conn->out_len ? EPOLLOUT : EPOLLIN);
+}
+
+static void
+ctl_accept(void *data, int fd, uint32_t events)
+{
+    ctl_t *ctl = data;
+    ctl_conn_t *conn;
+    int cfd;
+
+    while ((cfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+        conn = malloc(sizeof(*conn));
+        ASSERT(conn, "out of mem");
+
+        memset(conn, 0, sizeof(*conn));
+
+        conn->ctl = ctl;
+        conn->fd = cfd;
+
+        if (loop_add(ctl->loop, cfd, EPOLLIN, ctl_conn_event, conn)) {
+            close(cfd);
+            free(conn);
+            continue;
+        }
+
+        conn->next = ctl->conns;
+        if (ctl->conns) ctl->conns->prev = conn;
+        ctl->conns = conn;
+    }
+
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        LOG_ERROR("accept control connection: %s", strerror(errno));
+    }
+}
+
+ctl_t *
+ctl_new(loop_t *loop, const char *path)
+{
+    struct sockaddr_un addr;
+    ctl_t *ctl;
+
+    if (ctl_addr(path, &addr)) return NULL;
+
+    ctl = malloc(sizeof(*ctl));
+    ASSERT(ctl, "out of mem");
+
+    ctl->loop = loop;
+    ctl->path = strdup(path);
+    ctl->cmds = NULL;
+    ctl->n_cmd = 0;
+    ctl->conns = NULL;
+
+    ctl->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (ctl->fd == -1) {
+        LOG_ERROR("control socket: %s", strerror(errno));
+        goto ERROR;
+    }
+
+    // a stale socket of a dead supervisor
+    unlink(path);
+
+    if (bind(ctl->fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+        chmod(path, 0600) ||
+        listen(ctl->fd, CTL_BACKLOG)) {
+        LOG_ERROR("bind control socket: %s", strerror(errno));
+        goto ERROR;
+    }
+
+    if (loop_add(loop, ctl->fd, EPOLLIN, ctl_accept, ctl)) goto ERROR;
+
+    ctl_add(ctl, "help", "", ctl_help, ctl);
+
+    return ctl;
+
+ERROR:
+    ctl_free(ctl);
+    return NULL;
+}
+
+void
+ctl_free(ctl_t *ctl)
+{
+    size_t i;
+
+    if (ctl) {
+        while (ctl->conns) {
+            ctl_conn_free(ctl->conns);
+        }
+
+        if (ctl->fd != -1) {
+            loop_del(ctl->loop, ctl->fd);
+            close(ctl->fd);
+            unlink(ctl->path);
+        }
+
+        for (i = 0; i < ctl->n_cmd; i++) {
+            free(ctl->cmds[i].name);
+            free(ctl->cmds[i].usage);
+        }
+
+        free(ctl->cmds);
+        free(ctl->path);
+        free(ctl);
+    }
+}
+
+void
+ctl_add(ctl_t *ctl, const char *name, const char *usage, ctl_cmd_t cb, void *data)
+{
+    ctl->cmds = realloc(ctl->cmds, sizeof(*ctl->cmds) * (ctl->n_cmd + 1));
+    ASSERT(ctl->cmds, "out of mem");
+
+    ctl->cmds[ctl->n_cmd].name = strdup(name);
+    ctl->cmds[ctl->n_cmd].usage = strdup(usage);
+    ctl->cmds[ctl->n_cmd].cb = cb;
+    ctl->cmds[ctl->n_cmd].data = data;
+
+    ctl->n_cmd++;
+}
+
+/* client */
+
+static int
+ctl_write_all(int fd, const void *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len) {
+        n = write(fd, buf, len);
+
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+
+        buf = (const char *)buf + n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+static int
+ctl_read_all(int fd, void *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len) {
+        n = read(fd, buf, len);
+
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+
+        buf = (char *)buf + n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+int
+ctl_call(const char *path, int argc, char **argv, int timeout_ms, FILE *out)
+{
+    struct timeval tv = { .tv_sec = timeout_ms / 1000, .tv_usec = timeout_ms % 1000 * 1000 };
+    struct sockaddr_un addr;
+    uint32_t len = 0;
+    char *buf = NULL;
+    int fd, i, ret = -1;
+    size_t off = 0;
+
+    if (ctl_addr(path, &addr)) return -1;
+
+    for (i = 0; i < argc; i++) {
+        len += strlen(argv[i]) + 1;
+    }
+
+    if (!len || len > CTL_MAX_FRAME) {
+        LOG_ERROR("bad control request");
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    // the send timeout also bounds a connect to a full backlog
+    if (fd != -1 && timeout_ms &&
+        (setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) ||
+         setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)))) {
+        LOG_ERROR("control socket timeout: %s", strerror(errno));
+        goto CLEAN;
+    }
+
+    if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        LOG_ERROR("%s: %s", path, strerror(errno));
+        goto CLEAN;
+    }
+
+    buf = malloc(sizeof(len) + len);
+    ASSERT(buf, "out of mem");
+
+    memcpy(buf, &len, sizeof(len));
+    off = sizeof(len);
+
+    for (i = 0; i < argc; i++) {
+        strcpy(buf + off, argv[i]);
+        off += strlen(argv[i]) + 1;
+    }
+
+    if (ctl_write_all(fd, buf, off) || ctl_read_all(fd, &len, sizeof(len)) ||
+        !len || len > CTL_MAX_FRAME) {
+        LOG_ERROR("control request failed");
+        goto CLEAN;
+    }
+
+    buf = realloc(buf, len);
+    ASSERT(buf, "out of mem");
+
+    if (ctl_read_all(fd, buf, len)) {
+        LOG_ERROR("control reply truncated");
+        goto CLEAN;
+    }
+
+    fwrite(buf + 1, 1, len - 1, out);
+    ret = buf[0];
+
+CLEAN:
+    if (fd != -1) close(fd);
+    free(buf);
+
+    return ret;
+}
@@ -0,0 +1,60 @@
+#ifndef _CORE_CTL_H_
+#define _CORE_CTL_H_
+
+#include "pub/type.h"
+
+#include "loop.h"
+
+/*
+
+control socket of the supervisor
+
+a unix stream socket taking one request per frame, replied in order
+    frame: u32 length (host order), then length bytes
+    request: argv, each argument NUL terminated
+    reply: one status byte (0 for success), then the output text
+
+*/
+
+#define CTL_MAX_FRAME (16 << 20)
+#define CTL_MAX_ARG 256
+
+// write the output to out, return 0 on success
+typedef int (*ctl_cmd_t)(void *data, int argc, char **argv, FILE *out);
+
+typedef struct ctl_conn_t ctl_conn_t;
+
+typedef struct {
+    char *name;
+    char *usage;
+    ctl_cmd_t cb;
+    void *data;
+} ctl_entry_t;
+
+typedef struct {
+    loop_t *loop;
+    int fd;
+    char *path;
+
+    ctl_entry_t *cmds;
+    size_t n_cmd;
+
+    ctl_conn_t *conns;
+} ctl_t;
+
+ctl_t *
+ctl_new(loop_t *loop, const char *path);
+
+void
+ctl_free(ctl_t *ctl);
+
+void
+ctl_add(ctl_t *ctl, const char *name, const char *usage, ctl_cmd_t cb, void *data);
+
+// client side: run a command, its output goes to out,
+// returns the status of the command, or -1 if the call failed.
+// timeout_ms bounds each send and receive, 0 to wait forever
+int
+ctl_call(const char *path, int argc, char **argv, int timeout_ms, FILE *out);
+
+#endif
@@ -0,0 +1,893 @@
+#include <errno.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <getopt.h>
+#include <sys/signalfd.h>
+#include <sys/pidfd.h>
+
+#include "pub/type.h"
+#include "pub/fd.h"
+#include "pub/clone.h"
+#include "pub/limit.h"
+
+#include "daemon.h"
+#include "container.h"
+#include "image.h"
+
+#define DAEMON_MODE 0700
+#define DAEMON_IMAGE_DIR "images"
+#define DAEMON_RUN_DIR "run"
+#define DAEMON_MAX_NAME 64
+#define DAEMON_FAILED 255 // exit status when the container could not be run
+#define DAEMON_FORWARD_TIMEOUT_MS 2000 // a stuck supervisor must not hold up the others
+
+static const char *daemon_state_name[] = { "created", "running", "exited" };
+
+static void
+daemon_path(const daemon_t *daemon, const char *dir, const char *name, const char *ext,
+            char *buf, size_t size)
+{
+    snprintf(buf, size, "%s/%s/%s%s", daemon->conf.state_dir, dir, name, ext);
+}
+
+static int
+daemon_mkdir(const char *path)
+{
+    if (mkdir(path, DAEMON_MODE) && errno != EEXIST) {
+        LOG_ERROR("%s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* images */
+
+// archives are told apart by path, size and mtime, so a replaced one is unpacked again
+static uint64_t
+daemon_image_key(const char *path, const struct stat *st)
+{
+    uint64_t hash = 14695981039346656037ull;
+    uint64_t extra[] = { st->st_size, st->st_mtim.tv_sec, st->st_mtim.tv_nsec };
+    const byte_t *p;
+    size_t i;
+
+    for (p = (const byte_t *)path; *p; p++) {
+        hash = (hash ^ *p) * 1099511628211ull;
+    }
+
+    for (p = (const byte_t *)extra, i = 0; i < sizeof(extra); i++) {
+        hash = (hash ^ p[i]) * 1099511628211ull;
+    }
+
+    return hash;
+}
+
+static int daemon_start(daemon_t *daemon, daemon_cont_t *cont, FILE *out);
+
+// start what waited on the image, the requests that asked for it got their reply long ago
+static void
+daemon_image_ready(daemon_t *daemon, daemon_image_t *image)
+{
+    daemon_cont_t *cont;
+    char *text;
+    size_t size;
+    FILE *out;
+
+    for (cont = daemon->conts; cont; cont = cont->next) {
+        if (cont->image != image || !cont->start_pending) continue;
+
+        cont->start_pending = false;
+
+        if (image->failed) {
+            LOG_ERROR("not starting '%s', its image could not be unpacked", cont->name);
+            continue;
+        }
+
+        out = open_memstream(&text, &size);
+        ASSERT(out, "out of mem");
+
+        if (daemon_start(daemon, cont, out)) {
+            fclose(out);
+            LOG_ERROR("failed to start '%s': %.*s", cont->name, (int)strcspn(text, "\n"), text);
+        } else {
+            fclose(out);
+            LOG("started '%s', its image is unpacked", cont->name);
+        }
+
+        free(text);
+    }
+}
+
+static void
+daemon_image_done(void *data, int fd, uint32_t events)
+{
+    daemon_image_t *image = data;
+    daemon_t *daemon = image->daemon;
+    int status;
+
+    loop_del(daemon->loop, fd);
+    close(fd);
+    image->pidfd = -1;
+
+    if (waitpid(image->pid, &status, 0) == -1) {
+        LOG_ERROR("waitpid: %s", strerror(errno));
+        status = -1;
+    }
+
+    image->pid = -1;
+    image->failed = !WIFEXITED(status) || WEXITSTATUS(status);
+
+    if (image->failed) LOG_ERROR("failed to unpack '%s'", image->path);
+    else LOG("unpacked image %s to %s", image->path, image->dir);
+
+    daemon_image_ready(daemon, image);
+}
+
+// in a forked helper, a large archive must not hold up every other request
+static int
+daemon_image_unpack(daemon_t *daemon, daemon_image_t *image)
+{
+    char tmp[PATH_MAX], key[17];
+    sigset_t none;
+    int ret;
+
+    snprintf(key, sizeof(key), "%016" PRIx64, image->key);
+    daemon_path(daemon, DAEMON_IMAGE_DIR, key, ".XXXXXX", tmp, sizeof(tmp));
+
+    image->failed = false;
+
+    log_flush();
+    image->pid = fork();
+
+    if (image->pid == -1) {
+        LOG_ERROR("fork: %s", strerror(errno));
+        image->failed = true;
+        return -1;
+    }
+
+    if (image->pid == 0) {
+        // the daemon's signals are blocked for its signalfd, tar should not inherit that
+        close_range(3, ~0U, 0);
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+
+        // whole into place, or not at all
+        ret = !mkdtemp(tmp) || chmod(tmp, 0755) || decompress_image(image->path, tmp) ||
+              rename(tmp, image->dir);
+
+        log_flush();
+        _exit(ret ? 1 : 0);
+    }
+
+    image->pidfd = pidfd_open(image->pid, 0);
+
+    if (image->pidfd == -1 ||
+        loop_add(daemon->loop, image->pidfd, EPOLLIN, daemon_image_done, image)) {
+        LOG_ERROR("failed to watch the unpacking of '%s'", image->path);
+
+        if (image->pidfd != -1) close(image->pidfd);
+        kill(image->pid, SIGKILL);
+        waitpid(image->pid, NULL, 0);
+
+        image->pid = -1;
+        image->pidfd = -1;
+        image->failed = true;
+        return -1;
+    }
+
+    return 0;
+}
+
+static daemon_image_t *
+daemon_image_get(daemon_t *daemon, const char *path, FILE *out)
+{
+    char dir[PATH_MAX], key[17];
+    daemon_image_t *image;
+    struct stat st;
+    uint64_t hash;
+    char *real;
+
+    if (*path != '/' || !(real = realpath(path, NULL))) {
+        fprintf(out, "no image at '%s', the path has to be absolute\n", path);
+        return NULL;
+    }
+
+    if (stat(real, &st)) {
+        fprintf(out, "%s: %s\n", real, strerror(errno));
+        free(real);
+        return NULL;
+    }
+
+    // a replaced archive has another key, containers created before keep the old tree
+    hash = daemon_image_key(real, &st);
+
+    for (image = daemon->images; image && (image->key != hash || strcmp(image->path, real));
+         image = image->next);
+
+    if (image) {
+        free(real);
+
+        if (image->failed && daemon_image_unpack(daemon, image)) {
+            fprintf(out, "failed to unpack '%s'\n", image->path);
+            return NULL;
+        }
+
+        return image;
+    }
+
+    snprintf(key, sizeof(key), "%016" PRIx64, hash);
+    daemon_path(daemon, DAEMON_IMAGE_DIR, key, "", dir, sizeof(dir));
+
+    image = malloc(sizeof(*image));
+    ASSERT(image, "out of mem");
+
+    image->daemon = daemon;
+    image->path = real;
+    image->key = hash;
+    image->dir = strdup(dir);
+    image->pid = -1;
+    image->pidfd = -1;
+    image->failed = false;
+    image->next = daemon->images;
+    daemon->images = image;
+
+    // unpacked by an earlier daemon, or in the background now
+    if (access(dir, F_OK) && daemon_image_unpack(daemon, image)) {
+        fprintf(out, "failed to unpack '%s'\n", real);
+        return NULL;
+    }
+
+    return image;
+}
+
+/* containers */
+
+static daemon_cont_t *
+daemon_find(daemon_t *daemon, const char *name, FILE *out)
+{
+    daemon_cont_t *cont;
+
+    for (cont = daemon->conts; cont && strcmp(cont->name, name); cont = cont->next);
+
+    if (!cont) fprintf(out, "no container '%s'\n", name);
+
+    return cont;
+}
+
+static daemon_cont_t *
+daemon_find_running(daemon_t *daemon, const char *name, FILE *out)
+{
+    daemon_cont_t *cont = daemon_find(daemon, name, out);
+
+    if (cont && cont->state != DAEMON_RUNNING) {
+        fprintf(out, "container '%s' is not running\n", name);
+        return NULL;
+    }
+
+    return cont;
+}
+
+// it is also the host name and part of socket paths
+static int
+daemon_check_name(const char *name)
+{
+    const char *p;
+
+    if (!*name || strlen(name) > DAEMON_MAX_NAME || *name == '.' || *name == '-') return -1;
+
+    for (p = name; *p; p++) {
+        if (!isalnum((unsigned char)*p) && !strchr("_.-", *p)) return -1;
+    }
+
+    return 0;
+}
+
+static void
+daemon_cont_free(daemon_cont_t *cont)
+{
+    char **arg;
+
+    for (arg = cont->argv; *arg; arg++) {
+        free(*arg);
+    }
+
+    free(cont->argv);
+    free(cont->name);
+    free(cont->memory);
+    free(cont);
+}
+
+static void
+daemon_ip(int slot, int host, char *buf, size_t size)
+{
+    snprintf(buf, size, DAEMON_SUBNET ".%d.%d", slot, host ? 1 : 2);
+}
+
+// in the forked supervisor, returns its exit status
+static int
+daemon_supervise(daemon_cont_t *dc)
+{
+    daemon_t *daemon = dc->daemon;
+    char tmp_dir[PATH_MAX], ctl_path[PATH_MAX], log_path[PATH_MAX];
+    char host_ip[16], cont_ip[16];
+    container_t *cont;
+    sigset_t none;
+    int fd, status;
+
+    // unlimited without one, still there to be sampled
+    cgroup_entry_t cg_conf = {
+        .resrc = "memory",
+        .var = "memory.limit_in_bytes",
+        .val = dc->memory ? dc->memory : "-1"
+    };
+    stats_config_t stats_conf = { 0 };
+    capture_config_t capture_conf = { .path = log_path };
+
+    // throwaway root: nothing synced, chmod/chown without copying data
+    overlay_config_t overlay_conf = { .volatile_upper = true, .metacopy = true };
+
+    bridge_config_t bridge_conf = {
+        .host_ip = host_ip,
+        .cont_ip = cont_ip,
+        .use_physical = daemon->conf.use_physical
+    };
+
+    // the daemon's forwarder answers on our side of the bridge
+    container_config_t conf = {
+        .tmp_dir = tmp_dir,
+        .host_name = dc->name,
+        .nameserver = dc->dns ? host_ip : daemon->conf.nameserver,
+        .image_dir = dc->image->dir,
+        .argv = dc->argv,
+        .bridge_conf = &bridge_conf,
+        .overlay_conf = &overlay_conf,
+        .cg_conf = &cg_conf,
+        .cg_n_conf = 1,
+        .stats_conf = &stats_conf,
+        .capture_conf = &capture_conf,
+        .ctl_path = ctl_path
+    };
+
+    // nothing of the daemon's, its signal handling is not inherited by the container
+    close_range(3, ~0U, 0);
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+    signal(SIGPIPE, SIG_DFL);
+
+    // out of the daemon's session, a ^C to it must not skip the clean up
+    setsid();
+
+    fd = open("/dev/null", O_RDONLY);
+
+    if (fd > 0) {
+        dup2(fd, 0);
+        close(fd);
+    }
+
+    daemon_path(daemon, DAEMON_RUN_DIR, dc->name, ".XXXXXX", tmp_dir, sizeof(tmp_dir));
+    daemon_path(daemon, DAEMON_RUN_DIR, dc->name, ".sock", ctl_path, sizeof(ctl_path));
+    daemon_path(daemon, DAEMON_RUN_DIR, dc->name, ".log", log_path, sizeof(log_path));
+    daemon_ip(dc->slot, 1, host_ip, sizeof(host_ip));
+    daemon_ip(dc->slot, 0, cont_ip, sizeof(cont_ip));
+
+    cont = container_new(&conf);
+
+    if (container_run_image(cont, NULL)) {
+        status = DAEMON_FAILED;
+    } else if (WIFEXITED(cont->exit_status)) {
+        status = WEXITSTATUS(cont->exit_status);
+    } else {
+        status = 128 + WTERMSIG(cont->exit_status);
+    }
+
+    container_free(cont);
+    log_flush();
+
+    return status;
+}
+
+// before the fork, IP_FREEBIND lets it bind before the bridge is up
+static void
+daemon_listen(daemon_t *daemon, daemon_cont_t *cont)
+{
+    char host_ip[16];
+
+    if (!daemon->dns) return;
+
+    daemon_ip(cont->slot, 1, host_ip, sizeof(host_ip));
+
+    cont->dns = !dns_listen(daemon->dns, host_ip, daemon->conf.dns_conf->port);
+
+    if (!cont->dns) {
+        LOG_WARN("failed to serve dns to '%s', using %s directly", cont->name, daemon->conf.nameserver);
+    }
+}
+
+static void
+daemon_unlisten(daemon_t *daemon, daemon_cont_t *cont)
+{
+    char host_ip[16];
+
+    if (!cont->dns) return;
+
+    daemon_ip(cont->slot, 1, host_ip, sizeof(host_ip));
+    dns_unlisten(daemon->dns, host_ip, daemon->conf.dns_conf->port);
+
+    cont->dns = false;
+}
+
+static void
+daemon_cont_exit(void *data, int fd, uint32_t events)
+{
+    daemon_cont_t *cont = data;
+    daemon_t *daemon = cont->daemon;
+    int status;
+
+    loop_del(daemon->loop, fd);
+    close(fd);
+    cont->pidfd = -1;
+
+    if (waitpid(cont->pid, &status, 0) == -1) {
+        LOG_ERROR("waitpid: %s", strerror(errno));
+        cont->status = DAEMON_FAILED;
+    } else {
+        cont->status = WIFEXITED(status) ? WEXITSTATUS(status) : DAEMON_FAILED;
+    }
+
+    daemon_unlisten(daemon, cont);
+    daemon->slots[cont->slot] = false;
+
+    cont->state = DAEMON_EXITED;
+    cont->pid = -1;
+    cont->slot = 0;
+
+    LOG("container '%s' exited with status %d", cont->name, cont->status);
+}
+
+static int
+daemon_start(daemon_t *daemon, daemon_cont_t *cont, FILE *out)
+{
+    int slot;
+
+    for (slot = 1; slot <= DAEMON_MAX_SLOT && daemon->slots[slot]; slot++);
+
+    if (slot > DAEMON_MAX_SLOT) {
+        fprintf(out, "no free subnet, %d containers are running\n", DAEMON_MAX_SLOT);
+        return -1;
+    }
+
+    cont->slot = slot;
+    daemon_listen(daemon, cont);
+
+    // the supervisor starts with a copy of the ring
+    log_flush();
+    cont->pid = fork();
+
+    if (cont->pid == -1) {
+        fprintf(out, "fork: %s\n", strerror(errno));
+        daemon_unlisten(daemon, cont);
+        return -1;
+    }
+
+    if (cont->pid == 0) {
+        _exit(daemon_supervise(cont));
+    }
+
+    daemon->slots[slot] = true;
+    cont->state = DAEMON_RUNNING;
+    cont->pidfd = pidfd_open(cont->pid, 0);
+
+    if (cont->pidfd == -1 ||
+        loop_add(daemon->loop, cont->pidfd, EPOLLIN, daemon_cont_exit, cont)) {
+        // cannot tell when it is done, so it must not run unwatched
+        LOG_ERROR("failed to watch the supervisor of '%s'", cont->name);
+
+        if (cont->pidfd != -1) close(cont->pidfd);
+        kill(cont->pid, SIGKILL);
+        waitpid(cont->pid, NULL, 0);
+
+        daemon_unlisten(daemon, cont);
+        daemon->slots[slot] = false;
+
+        cont->state = DAEMON_EXITED;
+        cont->status = DAEMON_FAILED;
+        cont->pid = -1;
+        cont->pidfd = -1;
+        cont->slot = 0;
+
+        fprintf(out, "failed to start '%s'\n", cont->name);
+        return -1;
+    }
+
+    fprintf(out, "%d\n", cont->pid);
+
+    return 0;
+}
+
+// the supervisor's control socket, argv[0] is replaced by cmd
+static int
+daemon_forward(daemon_t *daemon, daemon_cont_t *cont, const char *cmd,
+               int argc, char **argv, FILE *out)
+{
+    char path[PATH_MAX];
+    char *req[CTL_MAX_ARG + 1];
+    int i, ret;
+
+    daemon_path(daemon, DAEMON_RUN_DIR, cont->name, ".sock", path, sizeof(path));
+
+    req[0] = (char *)cmd;
+
+    for (i = 1; i < argc && i < CTL_MAX_ARG; i++) {
+        req[i] = argv[i];
+    }
+
+    ret = ctl_call(path, i, req, DAEMON_FORWARD_TIMEOUT_MS, out);
+
+    if (ret == -1) {
+        fprintf(out, "container '%s' is not up yet or did not answer in %dms\n",
+                cont->name, DAEMON_FORWARD_TIMEOUT_MS);
+    }
+
+    return ret ? -1 : 0;
+}
+
+/* commands */
+
+static int
+daemon_cmd_create(void *data, int argc, char **argv, FILE *out)
+{
+    daemon_t *daemon = data;
+    daemon_cont_t *cont;
+    daemon_image_t *image;
+    char *memory = NULL;
+    int opt, i;
+
+    optind = 1;
+
+    while ((opt = getopt(argc, argv, "+m:")) != -1) {
+        switch (opt) {
+            case 'm': memory = optarg; break;
+            default: goto USAGE;
+        }
+    }
+
+    if (argc - optind < 3) goto USAGE;
+
+    if (daemon_check_name(argv[optind])) {
+        fprintf(out, "bad container name '%s'\n", argv[optind]);
+        return -1;
+    }
+
+    for (cont = daemon->conts; cont && strcmp(cont->name, argv[optind]); cont = cont->next);
+
+    if (cont) {
+        fprintf(out, "container '%s' exists\n", argv[optind]);
+        return -1;
+    }
+
+    image = daemon_image_get(daemon, argv[optind + 1], out);
+    if (!image) return -1;
+
+    cont = malloc(sizeof(*cont));
+    ASSERT(cont, "out of mem");
+
+    memset(cont, 0, sizeof(*cont));
+
+    cont->daemon = daemon;
+    cont->name = strdup(argv[optind]);
+    cont->image = image;
+    cont->memory = memory ? strdup(memory) : NULL;
+    cont->state = DAEMON_CREATED;
+    cont->pid = -1;
+    cont->pidfd = -1;
+
+    optind += 2;
+
+    cont->argv = malloc(sizeof(*cont->argv) * (argc - optind + 1));
+    ASSERT(cont->argv, "out of mem");
+
+    for (i = 0; optind + i < argc; i++) {
+        cont->argv[i] = strdup(argv[optind + i]);
+    }
+
+    cont->argv[i] = NULL;
+
+    cont->next = daemon->conts;
+    daemon->conts = cont;
+
+    if (image->pid != -1) {
+        fprintf(out, "unpacking %s\n", image->path);
+    }
+
+    return 0;
+
+USAGE:
+    fprintf(out, "usage: create [-m memory] <name> <image> <path> [args...]\n");
+    return -1;
+}
+
+static int
+daemon_cmd_start(void *data, int argc, char **argv, FILE *out)
+{
+    daemon_cont_t *cont;
+
+    if (argc != 2) {
+        fprintf(out, "usage: start <name>\n");
+        return -1;
+    }
+
+    if (!(cont = daemon_find(data, argv[1], out))) return -1;
+
+    if (cont->state == DAEMON_RUNNING || cont->start_pending) {
+        fprintf(out, "container '%s' is %s\n", argv[1],
+                cont->start_pending ? "waiting for its image" : "running");
+        return -1;
+    }
+
+    if (cont->image->failed && daemon_image_unpack(data, cont->image)) {
+        fprintf(out, "failed to unpack '%s'\n", cont->image->path);
+        return -1;
+    }
+
+    // replied now, started from daemon_image_done
+    if (cont->image->pid != -1) {
+        cont->start_pending = true;
+        fprintf(out, "starting '%s' once %s is unpacked\n", argv[1], cont->image->path);
+        return 0;
+    }
+
+    return daemon_start(data, cont, out);
+}
+
+// exec and kill
+static int
+daemon_cmd_pass(void *data, int argc, char **argv, FILE *out)
+{
+    daemon_cont_t *cont;
+
+    if (argc < 2 || (!strcmp(argv[0], "exec") && argc < 3)) {
+        fprintf(out, "usage: %s <name> %s\n", argv[0],
+                strcmp(argv[0], "exec") ? "[signal]" : "<path> [args...]");
+        return -1;
+    }
+
+    if (!(cont = daemon_find_running(data, argv[1], out))) return -1;
+
+    return daemon_forward(data, cont, argv[0], argc - 1, argv + 1, out);
+}
+
+// stats and samples
+static int
+daemon_cmd_stats(void *data, int argc, char **argv, FILE *out)
+{
+    daemon_cont_t *cont;
+    char ip[16];
+
+    if (argc != 2) {
+        fprintf(out, "usage: %s <name>\n", argv[0]);
+        return -1;
+    }
+
+    if (!(cont = daemon_find_running(data, argv[1], out))) return -1;
+
+    if (!strcmp(argv[0], "stats")) {
+        daemon_ip(cont->slot, 0, ip, sizeof(ip));
+
+        fprintf(out, "supervisor %d\n", cont->pid);
+        fprintf(out, "ip %s\n", ip);
+    }
+
+    return daemon_forward(data, cont, argv[0], 1, argv + 1, out);
+}
+
+// name state ip status image
+static int
+daemon_cmd_list(void *data, int argc, char **argv, FILE *out)
+{
+    daemon_t *daemon = data;
+    daemon_cont_t *cont;
+    char ip[16];
+
+    for (cont = daemon->conts; cont; cont = cont->next) {
+        if (cont->state == DAEMON_RUNNING) daemon_ip(cont->slot, 0, ip, sizeof(ip));
+        else strcpy(ip, "-");
+
+        fprintf(out, "%s %s %s ", cont->name, daemon_state_name[cont->state], ip);
+
+        if (cont->state == DAEMON_EXITED) fprintf(out, "%d", cont->status);
+        else fprintf(out, "-");
+
+        fprintf(out, " %s\n", cont->image->path);
+    }
+
+    return 0;
+}
+
+static int
+daemon_cmd_rm(void *data, int argc, char **argv, FILE *out)
+{
+    daemon_t *daemon = data;
+    daemon_cont_t **p, *cont;
+    char path[PATH_MAX];
+
+    if (argc != 2) {
+        fprintf(out, "usage: rm <name>\n");
+        return -1;
+    }
+
+    for (p = &daemon->conts; *p && strcmp((*p)->name, argv[1]); p = &(*p)->next);
+
+    if (!(cont = *p)) {
+        fprintf(out, "no container '%s'\n", argv[1]);
+        return -1;
+    }
+
+    if (cont->state == DAEMON_RUNNING) {
+        fprintf(out, "container '%s' is running\n", argv[1]);
+        return -1;
+    }
+
+    daemon_path(daemon, DAEMON_RUN_DIR, cont->name, ".log", path, sizeof(path));
+
+    if (unlink(path) && errno != ENOENT) {
+        LOG_ERROR("%s: %s", path, strerror(errno));
+    }
+
+    *p = cont->next;
+    daemon_cont_free(cont);
+
+    return 0;
+}
+
+daemon_t *
+daemon_new(const daemon_config_t *conf)
+{
+    daemon_t *daemon = malloc(sizeof(*daemon));
+    char path[PATH_MAX];
+
+    ASSERT(daemon, "out of mem");
+
+    memset(daemon, 0, sizeof(*daemon));
+
+    daemon->conf.ctl_path = strdup(conf->ctl_path);
+    daemon->conf.state_dir = strdup(conf->state_dir);
+    daemon->conf.nameserver = strdup(conf->nameserver);
+    daemon->conf.use_physical = conf->use_physical;
+    daemon->conf.dns_conf = dns_config_copy(conf->dns_conf);
+
+    if (daemon_mkdir(conf->state_dir)) goto ERROR;
+
+    snprintf(path, sizeof(path), "%s/%s", conf->state_dir, DAEMON_IMAGE_DIR);
+    if (daemon_mkdir(path)) goto ERROR;
+
+    snprintf(path, sizeof(path), "%s/%s", conf->state_dir, DAEMON_RUN_DIR);
+    if (daemon_mkdir(path)) goto ERROR;
+
+    daemon->loop = loop_new();
+    if (!daemon->loop) goto ERROR;
+
+    daemon->ctl = ctl_new(daemon->loop, conf->ctl_path);
+    if (!daemon->ctl) goto ERROR;
+
+    // one cache for every container
+    if (conf->dns_conf) {
+        daemon->dns = dns_new(daemon->loop,
+                              conf->dns_conf->upstream ? conf->dns_conf->upstream : conf->nameserver,
+                              conf->dns_conf->max_entry);
+        if (!daemon->dns) goto ERROR;
+    }
+
+    ctl_add(daemon->ctl, "create", "[-m memory] <name> <image> <path> [args...]",
+            daemon_cmd_create, daemon);
+    ctl_add(daemon->ctl, "start", "<name>", daemon_cmd_start, daemon);
+    ctl_add(daemon->ctl, "exec", "<name> <path> [args...]", daemon_cmd_pass, daemon);
+    ctl_add(daemon->ctl, "kill", "<name> [signal]", daemon_cmd_pass, daemon);
+    ctl_add(daemon->ctl, "stats", "<name>", daemon_cmd_stats, daemon);
+    ctl_add(daemon->ctl, "samples", "<name>", daemon_cmd_stats, daemon);
+    ctl_add(daemon->ctl, "list", "", daemon_cmd_list, daemon);
+    ctl_add(daemon->ctl, "rm", "<name>", daemon_cmd_rm, daemon);
+
+    return daemon;
+
+ERROR:
+    daemon_free(daemon);
+    return NULL;
+}
+
+void
+daemon_free(daemon_t *daemon)
+{
+    char *kill_argv[] = { "kill", "KILL" };
+    daemon_image_t *image;
+    daemon_cont_t *cont;
+
+    if (daemon) {
+        // their supervisors clean up once init is gone
+        for (cont = daemon->conts; cont; cont = cont->next) {
+            if (cont->state == DAEMON_RUNNING &&
+                daemon_forward(daemon, cont, "kill", 2, kill_argv, stderr)) {
+                // leaves its mounts and cgroup behind, but nothing waits forever
+                LOG_WARN("failed to kill container '%s', killing its supervisor", cont->name);
+                kill(cont->pid, SIGKILL);
+            }
+        }
+
+        while ((cont = daemon->conts)) {
+            if (cont->state == DAEMON_RUNNING) daemon_cont_exit(cont, cont->pidfd, 0);
+
+            daemon->conts = cont->next;
+            daemon_cont_free(cont);
+        }
+
+        while ((image = daemon->images)) {
+            daemon->images = image->next;
+
+            // its temporary dir is left behind, like after a crash
+            if (image->pid != -1) {
+                loop_del(daemon->loop, image->pidfd);
+                close(image->pidfd);
+                kill(image->pid, SIGKILL);
+                waitpid(image->pid, NULL, 0);
+            }
+
+            free(image->path);
+            free(image->dir);
+            free(image);
+        }
+
+        dns_free(daemon->dns);
+        ctl_free(daemon->ctl);
+        loop_free(daemon->loop);
+
+        dns_config_free(daemon->conf.dns_conf);
+        free(daemon->conf.ctl_path);
+        free(daemon->conf.state_dir);
+        free(daemon->conf.nameserver);
+        free(daemon);
+    }
+}
+
+static void
+daemon_signal(void *data, int fd, uint32_t events)
+{
+    struct signalfd_siginfo info;
+
+    if (read(fd, &info, sizeof(info)) == sizeof(info)) {
+        LOG("got signal %u, shutting down", info.ssi_signo);
+    }
+
+    loop_stop(data);
+}
+
+int
+daemon_run(daemon_t *daemon)
+{
+    sigset_t set;
+    int fd, ret;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+
+    if (sigprocmask(SIG_BLOCK, &set, NULL) ||
+        (fd = signalfd(-1, &set, SFD_CLOEXEC | SFD_NONBLOCK)) == -1) {
+        LOG_ERROR("signalfd: %s", strerror(errno));
+        return -1;
+    }
+
+    if (loop_add(daemon->loop, fd, EPOLLIN, daemon_signal, daemon->loop)) {
+        close(fd);
+        return -1;
+    }
+
+    LOG("serving %s", daemon->conf.ctl_path);
+
+    ret = loop_run(daemon->loop);
+
+    loop_del(daemon->loop, fd);
+    close(fd);
+
+    return ret;
+}
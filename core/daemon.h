@@ -0,0 +1,112 @@
+#ifndef _CORE_DAEMON_H_
+#define _CORE_DAEMON_H_
+
+#include "pub/type.h"
+
+#include "loop.h"
+#include "ctl.h"
+#include "dns.h"
+
+/*
+
+long-running host daemon that manages containers, requests come over a
+control socket with the framing of ctl.h, so ducker-ctl is its client
+
+    create [-m memory] <name> <image> <path> [args...]
+    start <name>
+    exec <name> <path> [args...]
+    kill <name> [signal]
+    stats <name>
+    samples <name>
+    list
+    rm <name>
+
+an image (absolute path to an archive) is unpacked once into
+state_dir/images and shared read-only as the lower layer of every
+container started from it. unpacking runs in a forked helper, so create
+returns right away and a start waits for it. an archive replaced while
+the daemon runs is unpacked again for the containers created after
+
+start forks a supervisor from the daemon, with no exec or argument
+parsing, which runs the container and serves its own control socket
+under state_dir/run. exec, kill and stats are passed on to it. each
+running container gets a /24 of DAEMON_SUBNET to itself, and its output
+goes to state_dir/run/<name>.log
+
+with a dns config the daemon runs a single caching forwarder on its own
+loop, and listens on the host address of each running container's /24,
+so containers share one cache
+
+*/
+
+#define DAEMON_SUBNET "10.201" // 10.201.<slot>.1 on the host, .2 in the container
+#define DAEMON_MAX_SLOT 254
+
+typedef struct {
+    char *ctl_path;
+    char *state_dir;
+    char *nameserver;
+    bool use_physical;
+    dns_config_t *dns_conf; // NULL for none
+} daemon_config_t;
+
+typedef enum {
+    DAEMON_CREATED,
+    DAEMON_RUNNING,
+    DAEMON_EXITED
+} daemon_state_t;
+
+typedef struct daemon_t daemon_t;
+
+typedef struct daemon_image_t {
+    daemon_t *daemon;
+    char *path; // real path of the archive
+    uint64_t key; // of its path, size and mtime
+    char *dir; // unpacked
+    pid_t pid; // unpacking helper, -1 once it is done
+    int pidfd;
+    bool failed; // tried again on the next create or start
+    struct daemon_image_t *next;
+} daemon_image_t;
+
+typedef struct daemon_cont_t {
+    daemon_t *daemon;
+    char *name;
+    daemon_image_t *image;
+    char **argv;
+    char *memory; // limit, NULL for none
+
+    daemon_state_t state;
+    pid_t pid; // supervisor, -1 unless running
+    int pidfd;
+    int slot; // 0 unless running
+    bool dns; // the forwarder listens on its host address
+    int status; // exit status of the last run, 255 if it could not be run
+    bool start_pending; // started once its image is unpacked
+
+    struct daemon_cont_t *next;
+} daemon_cont_t;
+
+struct daemon_t {
+    daemon_config_t conf;
+    loop_t *loop;
+    ctl_t *ctl;
+    dns_t *dns; // NULL for none
+
+    daemon_image_t *images;
+    daemon_cont_t *conts;
+    bool slots[DAEMON_MAX_SLOT + 1];
+};
+
+daemon_t *
+daemon_new(const daemon_config_t *conf);
+
+// kills what is still running and waits for its supervisors
+void
+daemon_free(daemon_t *daemon);
+
+// serve requests until SIGINT or SIGTERM
+int
+daemon_run(daemon_t *daemon);
+
+#endif
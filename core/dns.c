@@ -0,0 +1,880 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <ctype.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "pub/type.h"
+#include "pub/fd.h"
+
+#include "dns.h"
+
+#define DNS_PORT 53
+#define DNS_MAX_MSG 4096
+#define DNS_HDR_SIZE 12
+#define DNS_MAX_KEY 264 // longest name, type, class and flags
+
+#define DNS_N_BUCKET 4096 // has to be power of 2
+#define DNS_DEFAULT_MAX_ENTRY 4096
+
+#define DNS_NEG_TTL 30 // for answers without records
+#define DNS_MAX_TTL 3600
+
+#define DNS_TICK_MS 250
+#define DNS_RETRY_MS 1000
+#define DNS_TIMEOUT_MS 3000
+
+#define DNS_TYPE_OPT 41
+
+#define DNS_FLAG_TC 0x0200
+#define DNS_FLAG_RD 0x0100
+#define DNS_FLAG_CD 0x0010
+#define DNS_OPT_DO 0x8000 // in the ttl of the opt record
+
+// the last byte of a cache key
+#define DNS_KEY_RD 0x01
+#define DNS_KEY_EDNS 0x02
+#define DNS_KEY_CD 0x04
+#define DNS_KEY_DO 0x08 // dnssec records wanted
+#define DNS_RCODE(flags) ((flags) & 0xf)
+#define DNS_RCODE_NOERROR 0
+#define DNS_RCODE_SERVFAIL 2
+#define DNS_RCODE_NXDOMAIN 3
+
+typedef struct {
+    uint8_t buf[DNS_MAX_KEY];
+    size_t len;
+} dns_key_t;
+
+struct dns_entry_t {
+    dns_key_t key;
+    uint8_t *msg;
+    size_t len;
+    uint64_t stored; // ms
+    uint64_t expire; // ms
+
+    dns_entry_t *next; // bucket chain
+    dns_entry_t *lru_prev;
+    dns_entry_t *lru_next;
+};
+
+typedef struct dns_waiter_t {
+    int fd; // listener the question came in on
+    struct sockaddr_in addr;
+    uint16_t id;
+    struct dns_waiter_t *next;
+} dns_waiter_t;
+
+struct dns_pending_t {
+    dns_key_t key;
+    uint16_t id; // upstream id
+    uint8_t *query; // kept for retries
+    size_t len;
+    size_t qend; // end of the question section
+    uint64_t sent; // ms
+    bool retried;
+
+    dns_waiter_t *waiters;
+
+    dns_pending_t *prev;
+    dns_pending_t *next;
+};
+
+static uint64_t
+dns_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static uint16_t
+dns_get16(const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static uint32_t
+dns_get32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void
+dns_set16(uint8_t *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static void
+dns_set32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+dns_config_t *
+dns_config_copy(const dns_config_t *conf)
+{
+    dns_config_t *copy;
+
+    if (!conf) return NULL;
+
+    copy = malloc(sizeof(*copy));
+    ASSERT(copy, "out of mem");
+
+    *copy = *conf;
+    copy->upstream = conf->upstream ? strdup(conf->upstream) : NULL;
+
+    return copy;
+}
+
+void
+dns_config_free(dns_config_t *conf)
+{
+    if (conf) {
+        free(conf->upstream);
+        free(conf);
+    }
+}
+
+/* message parsing */
+
+static int
+dns_skip_name(const uint8_t *msg, size_t len, size_t *off)
+{
+    uint8_t l;
+
+    while (*off < len) {
+        l = msg[*off];
+
+        if (l == 0) {
+            (*off)++;
+            return 0;
+        }
+
+        // compression pointer ends the name
+        if ((l & 0xc0) == 0xc0) {
+            if (*off + 2 > len) return -1;
+            *off += 2;
+            return 0;
+        }
+
+        if (l & 0xc0) return -1;
+
+        *off += 1 + l;
+    }
+
+    return -1;
+}
+
+// extended flags of the opt record after the question at off, 0 without one
+static uint16_t
+dns_opt_flags(const uint8_t *msg, size_t len, size_t off)
+{
+    unsigned n_rr = dns_get16(msg + 6) + dns_get16(msg + 8) + dns_get16(msg + 10);
+    unsigned i;
+
+    for (i = 0; i < n_rr; i++) {
+        if (dns_skip_name(msg, len, &off) || off + 10 > len) return 0;
+
+        if (dns_get16(msg + off) == DNS_TYPE_OPT) return dns_get16(msg + off + 6);
+
+        off += 10 + dns_get16(msg + off + 8);
+    }
+
+    return 0;
+}
+
+// cache key: the question, lower cased, and the flags affecting the answer
+static int
+dns_make_key(const uint8_t *msg, size_t len, dns_key_t *key, size_t *qend)
+{
+    size_t off = DNS_HDR_SIZE, i;
+    uint16_t flags;
+
+    if (len < DNS_HDR_SIZE || dns_get16(msg + 4) != 1) return -1;
+
+    if (dns_skip_name(msg, len, &off) || off + 4 > len) return -1;
+
+    off += 4; // type and class
+
+    if (off - DNS_HDR_SIZE + 1 > sizeof(key->buf)) return -1;
+
+    key->len = 0;
+
+    for (i = DNS_HDR_SIZE; i < off; i++) {
+        key->buf[key->len++] = tolower(msg[i]);
+    }
+
+    flags = dns_get16(msg + 2);
+
+    key->buf[key->len++] = (flags & DNS_FLAG_RD ? DNS_KEY_RD : 0) |
+                           (dns_get16(msg + 10) ? DNS_KEY_EDNS : 0) |
+                           (flags & DNS_FLAG_CD ? DNS_KEY_CD : 0) |
+                           (dns_opt_flags(msg, len, off) & DNS_OPT_DO ? DNS_KEY_DO : 0);
+
+    if (qend) *qend = off;
+
+    return 0;
+}
+
+static bool
+dns_key_eq(const dns_key_t *a, const dns_key_t *b)
+{
+    return a->len == b->len && !memcmp(a->buf, b->buf, a->len);
+}
+
+// the flags of an answer need not be those of the query, an upstream
+// without edns drops the opt record
+static bool
+dns_question_eq(const dns_key_t *a, const dns_key_t *b)
+{
+    return a->len == b->len && !memcmp(a->buf, b->buf, a->len - 1);
+}
+
+static size_t
+dns_key_hash(const dns_key_t *key)
+{
+    // fnv-1a
+    uint32_t hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < key->len; i++) {
+        hash = (hash ^ key->buf[i]) * 16777619u;
+    }
+
+    return hash & (DNS_N_BUCKET - 1);
+}
+
+typedef void (*dns_rr_cb_t)(uint8_t *ttl, void *data);
+
+// visit the ttl of every record after the question section
+static int
+dns_walk_rr(uint8_t *msg, size_t len, dns_rr_cb_t cb, void *data)
+{
+    size_t off = DNS_HDR_SIZE;
+    unsigned n_q = dns_get16(msg + 4);
+    unsigned n_rr = dns_get16(msg + 6) + dns_get16(msg + 8) + dns_get16(msg + 10);
+    unsigned i;
+
+    for (i = 0; i < n_q; i++) {
+        if (dns_skip_name(msg, len, &off) || off + 4 > len) return -1;
+        off += 4;
+    }
+
+    for (i = 0; i < n_rr; i++) {
+        if (dns_skip_name(msg, len, &off) || off + 10 > len) return -1;
+
+        if (dns_get16(msg + off) != DNS_TYPE_OPT) {
+            cb(msg + off + 4, data);
+        }
+
+        off += 10 + dns_get16(msg + off + 8);
+
+        if (off > len) return -1;
+    }
+
+    return 0;
+}
+
+static void
+dns_min_ttl(uint8_t *ttl, void *data)
+{
+    uint32_t *min = data;
+    uint32_t val = dns_get32(ttl);
+
+    if (val < *min) *min = val;
+}
+
+static void
+dns_age_ttl(uint8_t *ttl, void *data)
+{
+    uint32_t age = *(uint32_t *)data;
+    uint32_t val = dns_get32(ttl);
+
+    dns_set32(ttl, val > age ? val - age : 0);
+}
+
+/* cache */
+
+static void
+dns_lru_unlink(dns_t *dns, dns_entry_t *entry)
+{
+    if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+    else dns->lru_head = entry->lru_next;
+
+    if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+    else dns->lru_tail = entry->lru_prev;
+}
+
+static void
+dns_lru_push(dns_t *dns, dns_entry_t *entry)
+{
+    entry->lru_prev = NULL;
+    entry->lru_next = dns->lru_head;
+
+    if (dns->lru_head) dns->lru_head->lru_prev = entry;
+    else dns->lru_tail = entry;
+
+    dns->lru_head = entry;
+}
+
+static void
+dns_cache_remove(dns_t *dns, dns_entry_t *entry)
+{
+    dns_entry_t **p = &dns->buckets[dns_key_hash(&entry->key)];
+
+    while (*p != entry) p = &(*p)->next;
+    *p = entry->next;
+
+    dns_lru_unlink(dns, entry);
+    dns->n_entry--;
+
+    free(entry->msg);
+    free(entry);
+}
+
+static dns_entry_t *
+dns_cache_lookup(dns_t *dns, const dns_key_t *key, uint64_t now)
+{
+    dns_entry_t *entry;
+
+    for (entry = dns->buckets[dns_key_hash(key)]; entry; entry = entry->next) {
+        if (dns_key_eq(&entry->key, key)) break;
+    }
+
+    if (!entry) return NULL;
+
+    if (now >= entry->expire) {
+        dns_cache_remove(dns, entry);
+        return NULL;
+    }
+
+    dns_lru_unlink(dns, entry);
+    dns_lru_push(dns, entry);
+
+    return entry;
+}
+
+static void
+dns_cache_insert(dns_t *dns, const dns_key_t *key, uint8_t *msg, size_t len, uint64_t now)
+{
+    uint16_t flags = dns_get16(msg + 2);
+    uint32_t ttl = DNS_MAX_TTL;
+    dns_entry_t *entry;
+    size_t h;
+
+    // truncated answers and server failures are never cached
+    if ((flags & DNS_FLAG_TC) ||
+        (DNS_RCODE(flags) != DNS_RCODE_NOERROR && DNS_RCODE(flags) != DNS_RCODE_NXDOMAIN)) {
+        return;
+    }
+
+    if (dns_walk_rr(msg, len, dns_min_ttl, &ttl)) return;
+
+    if (!dns_get16(msg + 6) && ttl > DNS_NEG_TTL) ttl = DNS_NEG_TTL;
+    if (!ttl) return;
+
+    if ((entry = dns_cache_lookup(dns, key, now))) {
+        dns_cache_remove(dns, entry);
+    }
+
+    // make room, least recently used first
+    while (dns->n_entry >= dns->max_entry && dns->lru_tail) {
+        dns_cache_remove(dns, dns->lru_tail);
+    }
+
+    entry = malloc(sizeof(*entry));
+    ASSERT(entry, "out of mem");
+
+    entry->key = *key;
+    entry->msg = malloc(len);
+    ASSERT(entry->msg, "out of mem");
+    memcpy(entry->msg, msg, len);
+    entry->len = len;
+    entry->stored = now;
+    entry->expire = now + ttl * 1000ULL;
+
+    h = dns_key_hash(key);
+    entry->next = dns->buckets[h];
+    dns->buckets[h] = entry;
+
+    dns_lru_push(dns, entry);
+    dns->n_entry++;
+}
+
+/* replies */
+
+static void
+dns_reply(int fd, const struct sockaddr_in *addr, uint16_t id, uint8_t *msg, size_t len)
+{
+    dns_set16(msg, id);
+
+    if (sendto(fd, msg, len, 0, (const struct sockaddr *)addr, sizeof(*addr)) == -1) {
+        LOG_ERROR("dns reply: %s", strerror(errno));
+    }
+}
+
+static void
+dns_reply_cached(int fd, const struct sockaddr_in *addr, uint16_t id,
+                 dns_entry_t *entry, uint64_t now)
+{
+    uint8_t msg[DNS_MAX_MSG];
+    uint32_t age = (now - entry->stored) / 1000;
+
+    memcpy(msg, entry->msg, entry->len);
+
+    if (age) dns_walk_rr(msg, entry->len, dns_age_ttl, &age);
+
+    dns_reply(fd, addr, id, msg, entry->len);
+}
+
+static void
+dns_reply_fail(int fd, const struct sockaddr_in *addr, uint16_t id,
+               const uint8_t *query, size_t qend)
+{
+    uint8_t msg[DNS_MAX_MSG];
+
+    // question only, counts other than qdcount cleared
+    memcpy(msg, query, qend);
+    dns_set16(msg + 2, (dns_get16(query + 2) & DNS_FLAG_RD) | 0x8080 | DNS_RCODE_SERVFAIL);
+    memset(msg + 6, 0, 6);
+
+    dns_reply(fd, addr, id, msg, qend);
+}
+
+/* in-flight queries */
+
+static void
+dns_pending_free(dns_t *dns, dns_pending_t *pend)
+{
+    dns_waiter_t *w;
+
+    while ((w = pend->waiters)) {
+        pend->waiters = w->next;
+        free(w);
+    }
+
+    if (pend->prev) pend->prev->next = pend->next;
+    else dns->pending = pend->next;
+
+    if (pend->next) pend->next->prev = pend->prev;
+
+    dns->by_id[pend->id] = NULL;
+
+    free(pend->query);
+    free(pend);
+}
+
+static dns_pending_t *
+dns_pending_find(dns_t *dns, const dns_key_t *key)
+{
+    dns_pending_t *pend;
+
+    for (pend = dns->pending; pend; pend = pend->next) {
+        if (dns_key_eq(&pend->key, key)) return pend;
+    }
+
+    return NULL;
+}
+
+static void
+dns_add_waiter(dns_pending_t *pend, int fd, const struct sockaddr_in *addr, uint16_t id)
+{
+    dns_waiter_t *w = malloc(sizeof(*w));
+    ASSERT(w, "out of mem");
+
+    w->fd = fd;
+    w->addr = *addr;
+    w->id = id;
+    w->next = pend->waiters;
+    pend->waiters = w;
+}
+
+static void
+dns_send_upstream(dns_t *dns, dns_pending_t *pend, uint64_t now)
+{
+    pend->sent = now;
+
+    if (send(dns->upstream, pend->query, pend->len, 0) == -1) {
+        LOG_ERROR("dns upstream send: %s", strerror(errno));
+    }
+
+    dns->stat.n_upstream++;
+}
+
+static dns_pending_t *
+dns_pending_new(dns_t *dns, const dns_key_t *key,
+                const uint8_t *query, size_t len, size_t qend)
+{
+    dns_pending_t *pend;
+    uint16_t id;
+    int tries;
+
+    // random ids make off-path spoofing of upstream answers harder
+    for (tries = 0; tries < 64; tries++) {
+        id = random();
+        if (!dns->by_id[id]) break;
+    }
+
+    if (dns->by_id[id]) return NULL;
+
+    pend = malloc(sizeof(*pend));
+    ASSERT(pend, "out of mem");
+
+    pend->key = *key;
+    pend->id = id;
+    pend->query = malloc(len);
+    ASSERT(pend->query, "out of mem");
+    memcpy(pend->query, query, len);
+    dns_set16(pend->query, id);
+    pend->len = len;
+    pend->qend = qend;
+    pend->retried = false;
+    pend->waiters = NULL;
+
+    pend->prev = NULL;
+    pend->next = dns->pending;
+    if (dns->pending) dns->pending->prev = pend;
+    dns->pending = pend;
+
+    dns->by_id[id] = pend;
+
+    return pend;
+}
+
+/* events */
+
+static void
+dns_on_query(void *data, int fd, uint32_t events)
+{
+    dns_t *dns = data;
+    uint8_t msg[DNS_MAX_MSG];
+    struct sockaddr_in addr;
+    socklen_t alen = sizeof(addr);
+    dns_pending_t *pend;
+    dns_entry_t *entry;
+    dns_key_t key;
+    uint64_t now;
+    size_t qend;
+    ssize_t n;
+
+    while ((n = recvfrom(fd, msg, sizeof(msg), MSG_DONTWAIT,
+                         (struct sockaddr *)&addr, &alen)) >= 0) {
+        alen = sizeof(addr);
+
+        // drop responses and anything we cannot parse
+        if (n < DNS_HDR_SIZE || (msg[2] & 0x80) || dns_make_key(msg, n, &key, &qend)) {
+            continue;
+        }
+
+        dns->stat.n_query++;
+        now = dns_now();
+
+        if ((entry = dns_cache_lookup(dns, &key, now))) {
+            dns->stat.n_hit++;
+            dns_reply_cached(fd, &addr, dns_get16(msg), entry, now);
+            continue;
+        }
+
+        if ((pend = dns_pending_find(dns, &key))) {
+            dns->stat.n_coalesced++;
+            dns_add_waiter(pend, fd, &addr, dns_get16(msg));
+            continue;
+        }
+
+        pend = dns_pending_new(dns, &key, msg, n, qend);
+
+        if (!pend) {
+            dns_reply_fail(fd, &addr, dns_get16(msg), msg, qend);
+            continue;
+        }
+
+        dns_add_waiter(pend, fd, &addr, dns_get16(msg));
+        dns_send_upstream(dns, pend, now);
+    }
+}
+
+static void
+dns_on_answer(void *data, int fd, uint32_t events)
+{
+    dns_t *dns = data;
+    uint8_t msg[DNS_MAX_MSG];
+    dns_pending_t *pend;
+    dns_waiter_t *w;
+    dns_key_t key;
+    ssize_t n;
+
+    while ((n = recv(fd, msg, sizeof(msg), MSG_DONTWAIT)) >= 0) {
+        if (n < DNS_HDR_SIZE) continue;
+
+        pend = dns->by_id[dns_get16(msg)];
+
+        // stale or spoofed, the question has to match as well
+        if (!pend || dns_make_key(msg, n, &key, NULL) || !dns_question_eq(&key, &pend->key)) {
+            continue;
+        }
+
+        // for the flags it was asked with
+        dns_cache_insert(dns, &pend->key, msg, n, dns_now());
+
+        for (w = pend->waiters; w; w = w->next) {
+            dns_reply(w->fd, &w->addr, w->id, msg, n);
+        }
+
+        dns_pending_free(dns, pend);
+    }
+}
+
+static void
+dns_on_tick(void *data, int fd, uint32_t events)
+{
+    dns_t *dns = data;
+    dns_pending_t *pend, *next;
+    dns_waiter_t *w;
+    uint64_t now = dns_now();
+
+    for (pend = dns->pending; pend; pend = next) {
+        next = pend->next;
+
+        if (!pend->retried) {
+            if (now - pend->sent >= DNS_RETRY_MS) {
+                pend->retried = true;
+                dns_send_upstream(dns, pend, now);
+            }
+
+            continue;
+        }
+
+        // the retry was sent DNS_RETRY_MS into the timeout
+        if (now - pend->sent >= DNS_TIMEOUT_MS - DNS_RETRY_MS) {
+            dns->stat.n_timeout++;
+
+            for (w = pend->waiters; w; w = w->next) {
+                dns_reply_fail(w->fd, &w->addr, w->id, pend->query, pend->qend);
+            }
+
+            dns_pending_free(dns, pend);
+        }
+    }
+}
+
+/* setup */
+
+static int
+dns_parse_addr(const char *str, int default_port, struct sockaddr_in *addr)
+{
+    char ip[INET_ADDRSTRLEN];
+    const char *colon = strchr(str, ':');
+    size_t len = colon ? (size_t)(colon - str) : strlen(str);
+
+    if (len >= sizeof(ip)) return -1;
+
+    memcpy(ip, str, len);
+    ip[len] = '\0';
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(colon ? atoi(colon + 1) : default_port);
+
+    return inet_pton(AF_INET, ip, &addr->sin_addr) == 1 ? 0 : -1;
+}
+
+dns_t *
+dns_new(loop_t *loop, const char *upstream, size_t max_entry)
+{
+    struct sockaddr_in addr;
+    dns_t *ret;
+
+    if (dns_parse_addr(upstream, DNS_PORT, &addr)) {
+        LOG_ERROR("invalid dns upstream '%s'", upstream);
+        return NULL;
+    }
+
+    ret = malloc(sizeof(*ret));
+    ASSERT(ret, "out of mem");
+
+    memset(ret, 0, sizeof(*ret));
+    ret->loop = loop;
+    ret->timer = -1;
+    ret->max_entry = max_entry ? max_entry : DNS_DEFAULT_MAX_ENTRY;
+
+    ret->buckets = calloc(DNS_N_BUCKET, sizeof(*ret->buckets));
+    ret->by_id = calloc(1 << 16, sizeof(*ret->by_id));
+    ASSERT(ret->buckets && ret->by_id, "out of mem");
+
+    ret->upstream = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (ret->upstream == -1 ||
+        connect(ret->upstream, (struct sockaddr *)&addr, sizeof(addr)) ||
+        loop_add(loop, ret->upstream, EPOLLIN, dns_on_answer, ret)) {
+        LOG_ERROR("dns upstream: %s", strerror(errno));
+        if (ret->upstream != -1) close(ret->upstream);
+        ret->upstream = -1;
+        dns_free(ret);
+        return NULL;
+    }
+
+    ret->timer = loop_add_timer(loop, DNS_TICK_MS, dns_on_tick, ret);
+
+    if (ret->timer == -1) {
+        dns_free(ret);
+        return NULL;
+    }
+
+    srandom(time(NULL) ^ getpid());
+
+    return ret;
+}
+
+int
+dns_listen(dns_t *dns, const char *ip, int port)
+{
+    struct sockaddr_in addr;
+    int one = 1;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port ? port : DNS_PORT);
+
+    if (inet_pton(AF_INET, ip, &addr.sin_addr) != 1) {
+        LOG_ERROR("invalid dns listen address '%s'", ip);
+        return -1;
+    }
+
+    fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (fd == -1) {
+        LOG_ERROR("dns socket: %s", strerror(errno));
+        return -1;
+    }
+
+    // the bridge address may not be assigned yet
+    setsockopt(fd, IPPROTO_IP, IP_FREEBIND, &one, sizeof(one));
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        LOG_ERROR("dns bind: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if (loop_add(dns->loop, fd, EPOLLIN, dns_on_query, dns)) {
+        close(fd);
+        return -1;
+    }
+
+    dns->listeners = realloc(dns->listeners, sizeof(*dns->listeners) * (dns->n_listener + 1));
+    ASSERT(dns->listeners, "out of mem");
+    dns->listeners[dns->n_listener++] = fd;
+
+    LOG("dns forwarder listening on %s:%d", ip, port ? port : DNS_PORT);
+
+    return 0;
+}
+
+// questions still waiting on the listener go unanswered
+static void
+dns_drop_waiters(dns_t *dns, int fd)
+{
+    dns_pending_t *pend;
+    dns_waiter_t **w, *dead;
+
+    for (pend = dns->pending; pend; pend = pend->next) {
+        for (w = &pend->waiters; *w;) {
+            if ((*w)->fd == fd) {
+                dead = *w;
+                *w = dead->next;
+                free(dead);
+            } else {
+                w = &(*w)->next;
+            }
+        }
+    }
+}
+
+int
+dns_unlisten(dns_t *dns, const char *ip, int port)
+{
+    struct sockaddr_in addr, bound;
+    socklen_t len;
+    size_t i;
+
+    memset(&addr, 0, sizeof(addr));
+
+    if (inet_pton(AF_INET, ip, &addr.sin_addr) != 1) {
+        LOG_ERROR("invalid dns listen address '%s'", ip);
+        return -1;
+    }
+
+    for (i = 0; i < dns->n_listener; i++) {
+        len = sizeof(bound);
+
+        if (getsockname(dns->listeners[i], (struct sockaddr *)&bound, &len) ||
+            bound.sin_addr.s_addr != addr.sin_addr.s_addr ||
+            bound.sin_port != htons(port ? port : DNS_PORT)) {
+            continue;
+        }
+
+        dns_drop_waiters(dns, dns->listeners[i]);
+
+        loop_del(dns->loop, dns->listeners[i]);
+        close(dns->listeners[i]);
+
+        dns->listeners[i] = dns->listeners[--dns->n_listener];
+
+        LOG("dns forwarder no longer listening on %s:%d", ip, port ? port : DNS_PORT);
+
+        return 0;
+    }
+
+    LOG_WARN("dns forwarder is not listening on %s:%d", ip, port ? port : DNS_PORT);
+
+    return -1;
+}
+
+void
+dns_free(dns_t *dns)
+{
+    size_t i;
+
+    if (dns) {
+        if (dns->stat.n_query) {
+            LOG("dns forwarder: %llu queries, %llu cache hits, %llu coalesced, %llu upstream, %llu timeouts",
+                (unsigned long long)dns->stat.n_query,
+                (unsigned long long)dns->stat.n_hit,
+                (unsigned long long)dns->stat.n_coalesced,
+                (unsigned long long)dns->stat.n_upstream,
+                (unsigned long long)dns->stat.n_timeout);
+        }
+
+        while (dns->pending) {
+            dns_pending_free(dns, dns->pending);
+        }
+
+        while (dns->lru_head) {
+            dns_cache_remove(dns, dns->lru_head);
+        }
+
+        for (i = 0; i < dns->n_listener; i++) {
+            loop_del(dns->loop, dns->listeners[i]);
+            close(dns->listeners[i]);
+        }
+
+        if (dns->upstream != -1) {
+            loop_del(dns->loop, dns->upstream);
+            close(dns->upstream);
+        }
+
+        loop_del_timer(dns->loop, dns->timer);
+
+        free(dns->listeners);
+        free(dns->buckets);
+        free(dns->by_id);
+        free(dns);
+    }
+}
@@ -0,0 +1,80 @@
+#ifndef _CORE_DNS_H_
+#define _CORE_DNS_H_
+
+#include <netinet/in.h>
+
+#include "pub/type.h"
+
+#include "loop.h"
+
+/*
+
+caching dns forwarder run by the supervisor for its container, or by
+the daemon for all of its containers
+
+listens on the host side of container bridges, answers repeated
+questions from an in-memory cache that honours record ttls and
+sends identical in-flight questions upstream only once
+
+*/
+
+typedef struct {
+    char *upstream; // "ip" or "ip:port", NULL to use the container's nameserver
+    int port; // 0 for 53, resolv.conf cannot name another port
+    size_t max_entry; // cache capacity, 0 for the default
+} dns_config_t;
+
+typedef struct {
+    uint64_t n_query;
+    uint64_t n_hit;
+    uint64_t n_coalesced; // answered by another client's in-flight query
+    uint64_t n_upstream;
+    uint64_t n_timeout;
+} dns_stat_t;
+
+typedef struct dns_entry_t dns_entry_t;
+typedef struct dns_pending_t dns_pending_t;
+
+typedef struct {
+    loop_t *loop;
+    int upstream; // connected udp socket
+    int timer;
+
+    int *listeners;
+    size_t n_listener;
+
+    // cache, chained hash table plus an lru list
+    dns_entry_t **buckets;
+    dns_entry_t *lru_head; // most recently used
+    dns_entry_t *lru_tail;
+    size_t n_entry;
+    size_t max_entry;
+
+    // in-flight upstream queries, by id and by question
+    dns_pending_t **by_id;
+    dns_pending_t *pending;
+
+    dns_stat_t stat;
+} dns_t;
+
+dns_config_t *
+dns_config_copy(const dns_config_t *conf);
+
+void
+dns_config_free(dns_config_t *conf);
+
+dns_t *
+dns_new(loop_t *loop, const char *upstream, size_t max_entry);
+
+// start answering on ip:port, can be called once per bridge
+int
+dns_listen(dns_t *dns, const char *ip, int port);
+
+// stop answering on ip:port, once its bridge is gone
+int
+dns_unlisten(dns_t *dns, const char *ip, int port);
+
+void
+dns_free(dns_t *dns);
+
+#endif
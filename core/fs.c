@@ -1,19 +1,77 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "pub/type.h"
+#include "pub/fd.h"
+#include "pub/limit.h"
+
+#include <linux/openat2.h>
 
 #include "fs.h"
 
+#define ROOT_MAX_LAYER 128
+
+overlay_config_t *overlay_config_copy(const overlay_config_t *conf)
+{
+    overlay_config_t *copy;
+
+    if (!conf) return NULL;
+
+    copy = malloc(sizeof(*copy));
+    ASSERT(copy, "out of mem");
+
+    *copy = *conf;
+    copy->redirect_dir = conf->redirect_dir ? strdup(conf->redirect_dir) : NULL;
+    copy->index = conf->index ? strdup(conf->index) : NULL;
+
+    return copy;
+}
+
+void overlay_config_free(overlay_config_t *conf)
+{
+    if (conf) {
+        free(conf->redirect_dir);
+        free(conf->index);
+        free(conf);
+    }
+}
+
 int root_mount(const char *root,
                const char *lower,
                const char *upper,
-               const char *work)
+               const char *work,
+               const overlay_config_t *conf)
 {
     char *param;
+    int ret;
+
+    if (conf) {
+        asprintf(&param, "lowerdir=%s,upperdir=%s,workdir=%s%s%s%s%s%s%s",
+                 lower, upper, work,
+                 conf->volatile_upper ? ",volatile" : "",
+                 conf->metacopy ? ",metacopy=on" : "",
+                 conf->redirect_dir ? ",redirect_dir=" : "",
+                 conf->redirect_dir ? conf->redirect_dir : "",
+                 conf->index ? ",index=" : "",
+                 conf->index ? conf->index : "");
+
+        ret = mount("overlay", root, "overlay", MS_MGC_VAL, param);
+        free(param);
+
+        if (!ret) return 0;
+
+        // no way to tell which one was refused here
+        LOG_ERROR("mount root with options: %s", strerror(errno));
+        LOG_WARN("mounting root without overlay options");
+    }
 
     asprintf(&param, "lowerdir=%s,upperdir=%s,workdir=%s", lower, upper, work);
 
     if (mount("overlay", root, "overlay", MS_MGC_VAL, param)) {
-        perror("mount root");
+        LOG_ERROR("mount root: %s", strerror(errno));
         free(param);
         return -1;
     }
@@ -23,33 +81,547 @@ int root_mount(const char *root,
     return 0;
 }
 
+// the kernel queues the reasons of a failed fsconfig on the fs context
+static void root_log_context(int fs)
+{
+    char buf[256];
+    ssize_t n;
+
+    while ((n = read(fs, buf, sizeof(buf) - 1)) > 0) {
+        // "e overlay: ..." for errors, "w " for warnings, "i " for info
+        while (n && buf[n - 1] == '\n') n--;
+        buf[n] = '\0';
+
+        if (n < 2 || buf[1] != ' ') LOG("%s", buf);
+        else if (buf[0] == 'e') LOG_ERROR("%s", buf + 2);
+        else if (buf[0] == 'w') LOG_WARN("%s", buf + 2);
+        else LOG("%s", buf + 2);
+    }
+}
+
+// "lowerdir+" (linux 6.8) takes one layer per call, so no option length limit
+static int root_set_lower(int fs, const char *lower)
+{
+    char *layers = strdup(lower), *layer, *save;
+    int ret = 0, n = 0;
+
+    for (layer = strtok_r(layers, ":", &save); layer; layer = strtok_r(NULL, ":", &save), n++) {
+        ret = fsconfig(fs, FSCONFIG_SET_STRING, "lowerdir+", layer, 0);
+        if (ret) break;
+    }
+
+    free(layers);
+
+    // older kernels refuse the first one, they take the whole list in one string
+    if (ret && n == 0 && errno == EINVAL) {
+        root_log_context(fs);
+        ret = fsconfig(fs, FSCONFIG_SET_STRING, "lowerdir", lower, 0);
+    }
+
+    return ret;
+}
+
+// idmapped clones of the layers, reachable by path through their fds,
+// which have to stay open until the overlay is created
+static char *root_idmap_layers(const char *lower, int userns, int *trees, size_t *n_tree)
+{
+    struct mount_attr attr = { .attr_set = MOUNT_ATTR_IDMAP, .userns_fd = userns };
+    char *layers = strdup(lower), *layer, *save;
+    char *list = NULL;
+    size_t len = 0;
+    FILE *fp = open_memstream(&list, &len);
+    int tree;
+
+    for (layer = strtok_r(layers, ":", &save); layer; layer = strtok_r(NULL, ":", &save)) {
+        if (*n_tree == ROOT_MAX_LAYER) {
+            LOG_ERROR("too many layers");
+            goto ERROR;
+        }
+
+        tree = open_tree(AT_FDCWD, layer, OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC);
+
+        if (tree == -1) {
+            LOG_ERROR("open_tree: %s", strerror(errno));
+            goto ERROR;
+        }
+
+        trees[(*n_tree)++] = tree;
+
+        if (mount_setattr(tree, "", AT_EMPTY_PATH, &attr, sizeof(attr))) {
+            LOG_ERROR("idmap layer: %s", strerror(errno));
+            goto ERROR;
+        }
+
+        fprintf(fp, "%s/proc/self/fd/%d", ftell(fp) ? ":" : "", tree);
+    }
+
+    fclose(fp);
+    free(layers);
+
+    return list;
+
+ERROR:
+    fclose(fp);
+    free(list);
+    free(layers);
+
+    return NULL;
+}
+
+// a kernel without an option goes without it, val NULL for a flag
+static void root_set_option(int fs, const char *key, const char *val)
+{
+    int ret;
+
+    if (val) {
+        ret = fsconfig(fs, FSCONFIG_SET_STRING, key, val, 0);
+    } else {
+        ret = fsconfig(fs, FSCONFIG_SET_FLAG, key, NULL, 0);
+    }
+
+    if (ret) {
+        LOG_WARN("overlay option '%s' refused, skipped", key);
+        root_log_context(fs);
+    }
+}
+
+// a created fs context, ready for fsmount
+static int root_create(const char *lower,
+                       const char *upper,
+                       const char *work,
+                       const overlay_config_t *conf)
+{
+    int fs = fsopen("overlay", FSOPEN_CLOEXEC);
+
+    if (fs == -1) return -1;
+
+    if (root_set_lower(fs, lower) ||
+        fsconfig(fs, FSCONFIG_SET_STRING, "upperdir", upper, 0) ||
+        fsconfig(fs, FSCONFIG_SET_STRING, "workdir", work, 0)) {
+        LOG_ERROR("configure root: %s", strerror(errno));
+        root_log_context(fs);
+        close(fs);
+        return -1;
+    }
+
+    if (conf) {
+        if (conf->volatile_upper) root_set_option(fs, "volatile", NULL);
+        if (conf->metacopy) root_set_option(fs, "metacopy", "on");
+        if (conf->redirect_dir) root_set_option(fs, "redirect_dir", conf->redirect_dir);
+        if (conf->index) root_set_option(fs, "index", conf->index);
+    }
+
+    if (fsconfig(fs, FSCONFIG_CMD_CREATE, NULL, NULL, 0)) {
+        LOG_ERROR("create root: %s", strerror(errno));
+        root_log_context(fs);
+        close(fs);
+        return -1;
+    }
+
+    return fs;
+}
+
+int root_mount_detached(const char *lower,
+                        const char *upper,
+                        const char *work,
+                        int userns,
+                        const overlay_config_t *conf)
+{
+    int trees[ROOT_MAX_LAYER];
+    char *idmapped = NULL;
+    size_t n_tree = 0, i;
+    int fs = -1, mnt = -1;
+
+    if (userns != -1) {
+        idmapped = root_idmap_layers(lower, userns, trees, &n_tree);
+        if (!idmapped) goto CLEAN;
+
+        lower = idmapped;
+    }
+
+    fs = root_create(lower, upper, work, conf);
+
+    // options that are each supported can still conflict with each other
+    if (fs == -1 && conf && errno != ENOSYS) {
+        LOG_WARN("mounting root without overlay options");
+        fs = root_create(lower, upper, work, NULL);
+    }
+
+    if (fs == -1) goto CLEAN;
+
+    mnt = fsmount(fs, FSMOUNT_CLOEXEC, 0);
+
+    if (mnt == -1) {
+        LOG_ERROR("fsmount root: %s", strerror(errno));
+    }
+
+CLEAN:
+    // the overlay holds on to the layers itself
+    if (fs != -1) close(fs);
+    for (i = 0; i < n_tree; i++) close(trees[i]);
+    free(idmapped);
+
+    return mnt;
+}
+
+int root_attach(int fd, const char *root)
+{
+    if (move_mount(fd, "", AT_FDCWD, root, MOVE_MOUNT_F_EMPTY_PATH)) {
+        LOG_ERROR("attach root: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
 int root_umount(const char *root)
 {
     if (umount(root)) {
-        perror("umount root");
+        LOG_ERROR("umount root: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+volume_entry_t *volume_entry_copy(const volume_entry_t *conf, size_t n)
+{
+    volume_entry_t *copy = malloc(sizeof(*conf) * n);
+    size_t i;
+
+    ASSERT(copy || !n, "out of mem");
+
+    for (i = 0; i < n; i++) {
+        copy[i] = conf[i];
+        copy[i].source = conf[i].source ? strdup(conf[i].source) : NULL;
+        copy[i].target = strdup(conf[i].target);
+        copy[i].size = conf[i].size ? strdup(conf[i].size) : NULL;
+    }
+
+    return copy;
+}
+
+void volume_entry_free(volume_entry_t *conf, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        free(conf[i].source);
+        free(conf[i].target);
+        free(conf[i].size);
+    }
+
+    free(conf);
+}
+
+static uint64_t volume_attr(const volume_entry_t *conf)
+{
+    return (conf->read_only ? MOUNT_ATTR_RDONLY : 0) |
+           (conf->nosuid ? MOUNT_ATTR_NOSUID : 0) |
+           (conf->nodev ? MOUNT_ATTR_NODEV : 0);
+}
+
+static unsigned long volume_flags(const volume_entry_t *conf)
+{
+    return (conf->read_only ? MS_RDONLY : 0) |
+           (conf->nosuid ? MS_NOSUID : 0) |
+           (conf->nodev ? MS_NODEV : 0);
+}
+
+static int volume_bind_detached(const volume_entry_t *conf, int userns)
+{
+    // a slave gets the host's later mounts under the source, but never sends its own back
+    struct mount_attr attr = { .attr_set = volume_attr(conf), .propagation = MS_SLAVE };
+    int tree = open_tree(AT_FDCWD, conf->source, OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC | AT_RECURSIVE);
+
+    if (tree == -1) {
+        if (errno != ENOSYS) LOG_ERROR("%s: %s", conf->source, strerror(errno));
+        return -1;
+    }
+
+    if (userns != -1) {
+        attr.attr_set |= MOUNT_ATTR_IDMAP;
+        attr.userns_fd = userns;
+    }
+
+    if (mount_setattr(tree, "", AT_EMPTY_PATH | AT_RECURSIVE, &attr, sizeof(attr))) {
+        LOG_ERROR("set volume attributes: %s", strerror(errno));
+        close(tree);
+        return -1;
+    }
+
+    return tree;
+}
+
+static int volume_tmpfs_detached(const volume_entry_t *conf, uid_t owner)
+{
+    int fs = fsopen("tmpfs", FSOPEN_CLOEXEC), mnt;
+    char id[16];
+
+    if (fs == -1) return -1;
+
+    snprintf(id, sizeof(id), "%u", owner);
+
+    if ((conf->size && fsconfig(fs, FSCONFIG_SET_STRING, "size", conf->size, 0)) ||
+        fsconfig(fs, FSCONFIG_SET_STRING, "uid", id, 0) ||
+        fsconfig(fs, FSCONFIG_SET_STRING, "gid", id, 0) ||
+        fsconfig(fs, FSCONFIG_CMD_CREATE, NULL, NULL, 0)) {
+        LOG_ERROR("create tmpfs volume: %s", strerror(errno));
+        root_log_context(fs);
+        close(fs);
+        return -1;
+    }
+
+    mnt = fsmount(fs, FSMOUNT_CLOEXEC, volume_attr(conf));
+
+    if (mnt == -1) {
+        LOG_ERROR("fsmount volume: %s", strerror(errno));
+    }
+
+    close(fs);
+
+    return mnt;
+}
+
+int volume_mount_detached(const volume_entry_t *conf, int userns, uid_t owner)
+{
+    if (conf->type == VOLUME_TMPFS) {
+        return volume_tmpfs_detached(conf, owner);
+    }
+
+    return volume_bind_detached(conf, userns);
+}
+
+// absolute, not the root itself, and never going up
+static int volume_check_target(const char *target)
+{
+    const char *p;
+
+    if (*target != '/' || !target[strspn(target, "/")]) goto ERROR;
+
+    for (p = target; (p = strstr(p, "..")); p += 2) {
+        if (p[-1] == '/' && (p[2] == '/' || p[2] == '\0')) goto ERROR;
+    }
+
+    return 0;
+
+ERROR:
+    LOG_ERROR("bad volume target '%s'", target);
+    return -1;
+}
+
+static int volume_create(int dir, const char *name, bool is_dir)
+{
+    int fd;
+
+    if (is_dir) return mkdirat(dir, name, 0755);
+
+    fd = openat(dir, name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0644);
+    if (fd == -1) return -1;
+
+    close(fd);
+
+    return 0;
+}
+
+static int volume_open_in_root(int root, const char *path)
+{
+    struct open_how how = { .flags = O_PATH | O_CLOEXEC, .resolve = RESOLVE_IN_ROOT };
+
+    return syscall(SYS_openat2, root, path, &how, sizeof(how));
+}
+
+// the target under root one component at a time, each one resolved
+// from root and created in the last one where missing
+static int volume_open_target(const char *root, const char *target, bool is_dir)
+{
+    char *path = strdup(target), *name, *next, *save;
+    char prefix[PATH_MAX];
+    size_t len = 0;
+    int dir, cur, fd;
+
+    dir = open(root, O_PATH | O_DIRECTORY | O_CLOEXEC);
+
+    if (dir == -1) {
+        LOG_ERROR("%s: %s", root, strerror(errno));
+        free(path);
+        return -1;
+    }
+
+    cur = fcntl(dir, F_DUPFD_CLOEXEC, 0);
+
+    for (name = strtok_r(path, "/", &save); name && cur != -1; name = next) {
+        next = strtok_r(NULL, "/", &save);
+        len += snprintf(prefix + len, sizeof(prefix) - len, "/%s", name);
+
+        fd = volume_open_in_root(dir, prefix);
+
+        if (fd == -1 && errno == ENOENT && !volume_create(cur, name, next || is_dir)) {
+            fd = volume_open_in_root(dir, prefix);
+        }
+
+        if (fd == -1) {
+            LOG_ERROR("%s: %s", target, strerror(errno));
+        }
+
+        close(cur);
+        cur = fd;
+    }
+
+    close(dir);
+    free(path);
+
+    return cur;
+}
+
+// without openat2 as well: one component at a time from root, created
+// where missing, and no symlink followed, so root and target joined name
+// the target for as long as nothing runs in the container
+static int volume_make_target(const char *root, const char *target, bool is_dir,
+                              char *path, size_t size)
+{
+    char *copy = strdup(target), *name, *next, *save;
+    struct stat st;
+    int cur, fd;
+
+    cur = open(root, O_PATH | O_DIRECTORY | O_CLOEXEC);
+
+    if (cur == -1) {
+        LOG_ERROR("%s: %s", root, strerror(errno));
+        free(copy);
+        return -1;
+    }
+
+    for (name = strtok_r(copy, "/", &save); name && cur != -1; name = next) {
+        next = strtok_r(NULL, "/", &save);
+
+        // a symlink is opened itself, which O_DIRECTORY then refuses
+        fd = openat(cur, name, O_PATH | O_NOFOLLOW | O_CLOEXEC | (next ? O_DIRECTORY : 0));
+
+        if (fd == -1 && errno == ENOENT && !volume_create(cur, name, next || is_dir)) {
+            fd = openat(cur, name, O_PATH | O_NOFOLLOW | O_CLOEXEC | (next ? O_DIRECTORY : 0));
+        }
+
+        if (fd != -1 && !next && !fstat(fd, &st) && S_ISLNK(st.st_mode)) {
+            close(fd);
+            fd = -1;
+            errno = ELOOP;
+        }
+
+        if (fd == -1) {
+            LOG_ERROR("volume target '%s' at '%s': %s", target, name, strerror(errno));
+        }
+
+        close(cur);
+        cur = fd;
+    }
+
+    free(copy);
+
+    if (cur == -1) return -1;
+
+    close(cur);
+
+    if ((size_t)snprintf(path, size, "%s%s", root, target) >= size) {
+        LOG_ERROR("volume target '%s' is too long", target);
         return -1;
     }
 
     return 0;
 }
 
+static int volume_mount_in_place(const volume_entry_t *conf, const char *root)
+{
+    unsigned long flags = volume_flags(conf);
+    char path[PATH_MAX], *opts = NULL;
+    struct stat st;
+    int ret;
+
+    if (conf->type == VOLUME_TMPFS) {
+        if (volume_make_target(root, conf->target, true, path, sizeof(path))) return -1;
+
+        if (conf->size) asprintf(&opts, "size=%s", conf->size);
+
+        ret = mount("tmpfs", path, "tmpfs", flags, opts);
+        free(opts);
+
+        if (ret) {
+            LOG_ERROR("mount tmpfs volume: %s", strerror(errno));
+            return -1;
+        }
+
+        return 0;
+    }
+
+    if (stat(conf->source, &st)) {
+        LOG_ERROR("%s: %s", conf->source, strerror(errno));
+        return -1;
+    }
+
+    if (volume_make_target(root, conf->target, S_ISDIR(st.st_mode), path, sizeof(path))) {
+        return -1;
+    }
+
+    if (mount(conf->source, path, NULL, MS_BIND | MS_REC, NULL) ||
+        mount(NULL, path, NULL, MS_SLAVE | MS_REC, NULL)) {
+        LOG_ERROR("bind mount volume: %s", strerror(errno));
+        return -1;
+    }
+
+    // the flags of a bind mount only change on a remount, of the top one only
+    if (flags && mount(NULL, path, NULL, MS_REMOUNT | MS_BIND | flags, NULL)) {
+        LOG_ERROR("remount volume: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+int volume_attach(const volume_entry_t *conf, int fd, const char *root)
+{
+    struct stat st;
+    int target, ret;
+
+    if (volume_check_target(conf->target)) return -1;
+
+    if (fd == -1) return volume_mount_in_place(conf, root);
+
+    if (fstat(fd, &st)) {
+        LOG_ERROR("stat volume: %s", strerror(errno));
+        return -1;
+    }
+
+    target = volume_open_target(root, conf->target, S_ISDIR(st.st_mode));
+    if (target == -1) return -1;
+
+    ret = move_mount(fd, "", target, "", MOVE_MOUNT_F_EMPTY_PATH | MOVE_MOUNT_T_EMPTY_PATH);
+
+    if (ret) {
+        LOG_ERROR("attach volume: %s", strerror(errno));
+    }
+
+    close(target);
+
+    return ret ? -1 : 0;
+}
+
 int vfs_mount()
 {
     // mount proc vfs
     if (mount("proc", "/proc", "proc", 0, NULL)) {
-        perror("mount proc");
+        LOG_ERROR("mount proc: %s", strerror(errno));
         return -1;
     }
 
     // mount sys vfs
     if (mount("sys", "/sys", "sysfs", 0, NULL)) {
-        perror("mount sys");
+        LOG_ERROR("mount sys: %s", strerror(errno));
         return -1;
     }
 
     // mount tmpfs
     if (mount("tmp", "/tmp", "tmpfs", 0, NULL)) {
-        perror("mount tmpfs");
+        LOG_ERROR("mount tmpfs: %s", strerror(errno));
         return -1;
     }
 
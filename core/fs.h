@@ -1,15 +1,74 @@
 #ifndef _CORE_FS_H_
 #define _CORE_FS_H_
 
+#include "pub/type.h"
 #include "pub/mount.h"
 
+// optional overlay features, each one is skipped where the kernel lacks it
+typedef struct {
+    bool volatile_upper; // "volatile", no syncs to the upper dir, which is lost on a crash
+    bool metacopy; // "metacopy=on", chmod/chown copy up metadata only, data on first write
+    char *redirect_dir; // on, follow, nofollow or off, NULL for the kernel default
+    char *index; // on or off, NULL for the kernel default
+} overlay_config_t;
+
+overlay_config_t *overlay_config_copy(const overlay_config_t *conf);
+
+void overlay_config_free(overlay_config_t *conf);
+
+// conf may be NULL for the kernel defaults
 int root_mount(const char *root,
                const char *lower,
                const char *upper,
-               const char *work);
+               const char *work,
+               const overlay_config_t *conf);
+
+// the overlay as a detached mount, not visible anywhere until root_attach,
+// which may run in another mount namespace. lower is a ':' separated list
+// of layers, passed one at a time where the kernel allows it.
+// with userns other than -1 the lower layers are idmapped through its map,
+// so they keep their host ownership on disk.
+// returns -1 with errno ENOSYS on kernels without the new mount api
+int root_mount_detached(const char *lower,
+                        const char *upper,
+                        const char *work,
+                        int userns,
+                        const overlay_config_t *conf);
+
+int root_attach(int fd, const char *root);
 
 int root_umount(const char *root);
 
+typedef enum {
+    VOLUME_BIND, // a host path, with everything mounted under it
+    VOLUME_TMPFS
+} volume_type_t;
+
+typedef struct {
+    volume_type_t type;
+    char *source; // host path, bind volumes only
+    char *target; // absolute path in the container, created if missing
+    bool read_only;
+    bool nosuid;
+    bool nodev;
+    char *size; // tmpfs size option, e.g. "64m", NULL for the kernel default
+} volume_entry_t;
+
+volume_entry_t *volume_entry_copy(const volume_entry_t *conf, size_t n);
+
+void volume_entry_free(volume_entry_t *conf, size_t n);
+
+// the volume as a detached mount, like root_mount_detached.
+// with userns other than -1 a bind volume is idmapped through its map,
+// and a tmpfs volume is owned by owner (a host id).
+// returns -1 with errno ENOSYS on kernels without the new mount api
+int volume_mount_detached(const volume_entry_t *conf, int userns, uid_t owner);
+
+// put the volume at its target under root, from fd if it was mounted
+// detached, or with mount(2) if fd is -1. symlinks in the image are
+// followed as if root was already /
+int volume_attach(const volume_entry_t *conf, int fd, const char *root);
+
 int vfs_mount();
 
 #endif
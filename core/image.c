@@ -28,7 +28,7 @@ decompress_image(const char *path, const char *target)
             asprintf(&cmd, "tar %s '%s' -C '%s'", param_map[i].param, path, target);
 
             if (system(cmd)) {
-                LOG("failed to decompress image '%s'", path);
+                LOG_ERROR("failed to decompress image '%s'", path);
                 free(cmd);
                 return -1;
             }
@@ -38,7 +38,7 @@ decompress_image(const char *path, const char *target)
         }
     }
 
-    LOG("unable to recognize image format for '%s'", path);
+    LOG_ERROR("unable to recognize image format for '%s'", path);
 
     return -1;
 }
@@ -0,0 +1,172 @@
+#include <errno.h>
+#include <dirent.h>
+#include <inttypes.h>
+#include <sys/prctl.h>
+
+#include "pub/type.h"
+#include "pub/fd.h"
+#include "pub/string.h"
+
+#include "ksm.h"
+
+#ifndef PR_SET_MEMORY_MERGE
+#define PR_SET_MEMORY_MERGE 67 // linux 6.4
+#endif
+
+#define KSM_SYSFS "/sys/kernel/mm/ksm"
+
+int
+ksm_enable()
+{
+    if (prctl(PR_SET_MEMORY_MERGE, 1, 0, 0, 0)) {
+        LOG_ERROR("prctl(PR_SET_MEMORY_MERGE): %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+static uint64_t
+ksm_read_u64(const char *path)
+{
+    uint64_t val = 0;
+    FILE *fp = fopen(path, "re");
+
+    if (fp) {
+        if (fscanf(fp, "%" SCNu64, &val) != 1) val = 0;
+        fclose(fp);
+    }
+
+    return val;
+}
+
+bool
+ksm_running()
+{
+    return ksm_read_u64(KSM_SYSFS "/run") == 1;
+}
+
+uint64_t
+ksm_ksmd_usec()
+{
+    static pid_t ksmd = -1;
+    unsigned long utime, stime;
+    char path[64], buf[512], *p;
+    struct dirent *ent;
+    FILE *fp;
+    DIR *dir;
+
+    // kernel threads keep their pid, look it up once
+    if (ksmd == -1 && (dir = opendir("/proc"))) {
+        while (ksmd == -1 && (ent = readdir(dir))) {
+            snprintf(path, sizeof(path), "/proc/%.16s/comm", ent->d_name);
+
+            if ((fp = fopen(path, "re"))) {
+                if (fgets(buf, sizeof(buf), fp) && !strcmp(buf, "ksmd\n")) {
+                    ksmd = atoi(ent->d_name);
+                }
+
+                fclose(fp);
+            }
+        }
+
+        closedir(dir);
+    }
+
+    if (ksmd == -1) return 0;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", ksmd);
+
+    if (!(fp = fopen(path, "re"))) return 0;
+
+    p = fgets(buf, sizeof(buf), fp);
+    fclose(fp);
+
+    // utime and stime are the 14th and 15th fields, the name may hold spaces
+    if (!p || !(p = strrchr(buf, ')')) ||
+        sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+               &utime, &stime) != 2) {
+        return 0;
+    }
+
+    return (uint64_t)(utime + stime) * 1000000 / sysconf(_SC_CLK_TCK);
+}
+
+static void
+ksm_add_proc(ksm_stat_t *st, pid_t pid)
+{
+    char path[64], buf[512];
+    ssize_t n;
+    int fd;
+
+    snprintf(path, sizeof(path), "/proc/%d/ksm_stat", pid);
+
+    // gone in the meantime
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) return;
+
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+
+    if (n <= 0) return;
+
+    buf[n] = '\0';
+
+    st->n_proc++;
+    st->merging_pages += string_key(buf, "ksm_merging_pages");
+    st->zero_pages += string_key(buf, "ksm_zero_pages");
+    st->rmap_items += string_key(buf, "ksm_rmap_items");
+    st->profit += (int64_t)string_key(buf, "ksm_process_profit");
+}
+
+int
+ksm_stat(const cgroup_t *cg, ksm_stat_t *st)
+{
+    FILE *fp = NULL;
+    size_t i;
+    pid_t pid;
+    int fd;
+
+    memset(st, 0, sizeof(*st));
+
+    // every hierarchy has all the processes
+    for (i = 0; i < cg->n_dir && cg->dirs[i].fd == -1; i++);
+
+    if (i == cg->n_dir) {
+        LOG_ERROR("container has no cgroup");
+        return -1;
+    }
+
+    fd = openat(cg->dirs[i].fd, "cgroup.procs", O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1 || !(fp = fdopen(fd, "r"))) {
+        LOG_ERROR("open cgroup.procs: %s", strerror(errno));
+        if (fd != -1) close(fd);
+        return -1;
+    }
+
+    while (fscanf(fp, "%d", &pid) == 1) {
+        ksm_add_proc(st, pid);
+    }
+
+    fclose(fp);
+
+    st->pages_shared = ksm_read_u64(KSM_SYSFS "/pages_shared");
+    st->pages_sharing = ksm_read_u64(KSM_SYSFS "/pages_sharing");
+    st->ksmd_usec = ksm_ksmd_usec();
+
+    return 0;
+}
+
+void
+ksm_report(const ksm_stat_t *st, uint64_t ksmd_base_usec, FILE *out)
+{
+    fprintf(out, "processes %zu\n", st->n_proc);
+    fprintf(out, "merging_pages %" PRIu64 "\n", st->merging_pages);
+    fprintf(out, "zero_pages %" PRIu64 "\n", st->zero_pages);
+    fprintf(out, "rmap_items %" PRIu64 "\n", st->rmap_items);
+    fprintf(out, "profit %" PRId64 "\n", st->profit);
+    fprintf(out, "host_pages_shared %" PRIu64 "\n", st->pages_shared);
+    fprintf(out, "host_pages_sharing %" PRIu64 "\n", st->pages_sharing);
+    fprintf(out, "ksmd_usec %" PRIu64 "\n",
+            st->ksmd_usec > ksmd_base_usec ? st->ksmd_usec - ksmd_base_usec : 0);
+}
@@ -0,0 +1,52 @@
+#ifndef _CORE_KSM_H_
+#define _CORE_KSM_H_
+
+#include "pub/type.h"
+
+#include "cgroup.h"
+
+/*
+
+kernel same-page merging of whole containers
+
+init opts in with PR_SET_MEMORY_MERGE, every process it starts inherits it,
+ksmd then scans all their anonymous memory (it has to be started through
+/sys/kernel/mm/ksm/run). per process counters come from /proc/<pid>/ksm_stat
+
+*/
+
+typedef struct {
+    size_t n_proc;
+
+    // summed over the processes of the container
+    uint64_t merging_pages; // pages of the container backed by a shared one
+    uint64_t zero_pages; // merged with the zero page
+    uint64_t rmap_items; // ksmd bookkeeping for the scanned pages
+    int64_t profit; // bytes saved minus the rmap_items overhead
+
+    // host wide
+    uint64_t pages_shared;
+    uint64_t pages_sharing;
+    uint64_t ksmd_usec; // cpu time of ksmd so far
+} ksm_stat_t;
+
+// opt the calling process, and its future children, in
+int
+ksm_enable();
+
+// whether ksmd is running
+bool
+ksm_running();
+
+int
+ksm_stat(const cgroup_t *cg, ksm_stat_t *st);
+
+// ksmd_base_usec is the ksmd cpu time when the container started
+void
+ksm_report(const ksm_stat_t *st, uint64_t ksmd_base_usec, FILE *out);
+
+// cpu time of ksmd, 0 if it is not found
+uint64_t
+ksm_ksmd_usec();
+
+#endif
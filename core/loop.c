@@ -0,0 +1,222 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/timerfd.h>
+
+#include "pub/type.h"
+#include "pub/fd.h"
+
+#include "loop.h"
+
+#define LOOP_MAX_EVENTS 64
+
+loop_t *
+loop_new()
+{
+    loop_t *ret = malloc(sizeof(*ret));
+    ASSERT(ret, "out of mem");
+
+    ret->epfd = epoll_create1(EPOLL_CLOEXEC);
+
+    if (ret->epfd == -1) {
+        LOG_ERROR("epoll_create1: %s", strerror(errno));
+        free(ret);
+        return NULL;
+    }
+
+    ret->stop = false;
+    ret->handlers = NULL;
+    ret->n_handler = 0;
+
+    return ret;
+}
+
+void
+loop_free(loop_t *loop)
+{
+    size_t i;
+
+    if (loop) {
+        for (i = 0; i < loop->n_handler; i++) {
+            free(loop->handlers[i]);
+        }
+
+        free(loop->handlers);
+        close(loop->epfd);
+        free(loop);
+    }
+}
+
+int
+loop_add(loop_t *loop, int fd, uint32_t events, loop_cb_t cb, void *data)
+{
+    struct epoll_event ev;
+    loop_handler_t *handler;
+    size_t n;
+
+    if (fd < 0) return -1;
+
+    if ((size_t)fd >= loop->n_handler) {
+        n = loop->n_handler ? loop->n_handler : 16;
+        while (n <= (size_t)fd) n *= 2;
+
+        loop->handlers = realloc(loop->handlers, sizeof(*loop->handlers) * n);
+        ASSERT(loop->handlers, "out of mem");
+
+        memset(loop->handlers + loop->n_handler, 0,
+               sizeof(*loop->handlers) * (n - loop->n_handler));
+        loop->n_handler = n;
+    }
+
+    ASSERT(!loop->handlers[fd], "fd %d registered twice", fd);
+
+    handler = malloc(sizeof(*handler));
+    ASSERT(handler, "out of mem");
+
+    handler->cb = cb;
+    handler->data = data;
+    handler->timer = false;
+
+    ev.events = events;
+    ev.data.fd = fd;
+
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+        LOG_ERROR("epoll_ctl add: %s", strerror(errno));
+        free(handler);
+        return -1;
+    }
+
+    loop->handlers[fd] = handler;
+
+    return 0;
+}
+
+int
+loop_mod(loop_t *loop, int fd, uint32_t events)
+{
+    struct epoll_event ev;
+
+    ev.events = events;
+    ev.data.fd = fd;
+
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &ev)) {
+        LOG_ERROR("epoll_ctl mod: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+loop_del(loop_t *loop, int fd)
+{
+    if (fd < 0 || (size_t)fd >= loop->n_handler || !loop->handlers[fd]) {
+        return -1;
+    }
+
+    free(loop->handlers[fd]);
+    loop->handlers[fd] = NULL;
+
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL)) {
+        LOG_ERROR("epoll_ctl del: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+loop_add_timer(loop_t *loop, unsigned interval_ms, loop_cb_t cb, void *data)
+{
+    struct itimerspec spec;
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    if (fd == -1) {
+        LOG_ERROR("timerfd_create: %s", strerror(errno));
+        return -1;
+    }
+
+    spec.it_interval.tv_sec = interval_ms / 1000;
+    spec.it_interval.tv_nsec = (interval_ms % 1000) * 1000000L;
+    spec.it_value = spec.it_interval;
+
+    if (timerfd_settime(fd, 0, &spec, NULL)) {
+        LOG_ERROR("timerfd_settime: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if (loop_add(loop, fd, EPOLLIN, cb, data)) {
+        close(fd);
+        return -1;
+    }
+
+    loop->handlers[fd]->timer = true;
+
+    return fd;
+}
+
+void
+loop_del_timer(loop_t *loop, int fd)
+{
+    if (fd != -1) {
+        loop_del(loop, fd);
+        close(fd);
+    }
+}
+
+int
+loop_run_once(loop_t *loop, int timeout_ms)
+{
+    struct epoll_event evs[LOOP_MAX_EVENTS];
+    loop_handler_t *handler;
+    uint64_t expired;
+    int n, i, fd;
+
+    // what the last round logged, before waiting for the next
+    log_flush();
+
+    n = epoll_wait(loop->epfd, evs, LOOP_MAX_EVENTS, timeout_ms);
+
+    if (n == -1) {
+        if (errno == EINTR) return 0;
+        LOG_ERROR("epoll_wait: %s", strerror(errno));
+        return -1;
+    }
+
+    for (i = 0; i < n; i++) {
+        fd = evs[i].data.fd;
+
+        // handler may have been removed by an earlier callback
+        if ((size_t)fd >= loop->n_handler || !(handler = loop->handlers[fd])) {
+            continue;
+        }
+
+        if (handler->timer && read(fd, &expired, sizeof(expired)) == -1) {
+            continue;
+        }
+
+        handler->cb(handler->data, fd, evs[i].events);
+    }
+
+    return 0;
+}
+
+int
+loop_run(loop_t *loop)
+{
+    loop->stop = false;
+
+    while (!loop->stop) {
+        if (loop_run_once(loop, -1)) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void
+loop_stop(loop_t *loop)
+{
+    loop->stop = true;
+}
@@ -0,0 +1,66 @@
+#ifndef _CORE_LOOP_H_
+#define _CORE_LOOP_H_
+
+#include <sys/epoll.h>
+
+#include "pub/type.h"
+
+/*
+
+a minimal level-triggered epoll loop run by the supervisor
+
+handlers are looked up by fd, so a callback may safely
+remove any fd (including its own) while events are dispatched
+
+*/
+
+typedef void (*loop_cb_t)(void *data, int fd, uint32_t events);
+
+typedef struct {
+    loop_cb_t cb;
+    void *data;
+    bool timer; // expirations are drained before cb is called
+} loop_handler_t;
+
+typedef struct {
+    int epfd;
+    bool stop;
+
+    loop_handler_t **handlers; // indexed by fd
+    size_t n_handler;
+} loop_t;
+
+loop_t *
+loop_new();
+
+void
+loop_free(loop_t *loop);
+
+int
+loop_add(loop_t *loop, int fd, uint32_t events, loop_cb_t cb, void *data);
+
+int
+loop_mod(loop_t *loop, int fd, uint32_t events);
+
+int
+loop_del(loop_t *loop, int fd);
+
+// returns a timerfd firing every interval_ms, close it with loop_del_timer
+int
+loop_add_timer(loop_t *loop, unsigned interval_ms, loop_cb_t cb, void *data);
+
+void
+loop_del_timer(loop_t *loop, int fd);
+
+// dispatch one batch of events, returns -1 on error
+int
+loop_run_once(loop_t *loop, int timeout_ms);
+
+// run until loop_stop is called
+int
+loop_run(loop_t *loop);
+
+void
+loop_stop(loop_t *loop);
+
+#endif
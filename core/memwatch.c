@@ -0,0 +1,407 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+
+#include "pub/type.h"
+#include "pub/fd.h"
+#include "pub/limit.h"
+#include "pub/string.h"
+
+#include "memwatch.h"
+
+#define MEMWATCH_DEFAULT_WINDOW 1000000 // us
+#define MEMWATCH_DEFAULT_LEVEL "medium"
+#define MEMWATCH_PRESSURE_GAP 100 // ms between reported pressure events
+
+static const char *memwatch_names[MEMWATCH_N_TYPE] = {
+    [MEMWATCH_OOM] = "oom",
+    [MEMWATCH_OOM_KILL] = "oom_kill",
+    [MEMWATCH_HIGH] = "high",
+    [MEMWATCH_MAX] = "max",
+    [MEMWATCH_PRESSURE] = "pressure",
+};
+
+memwatch_config_t *
+memwatch_config_copy(const memwatch_config_t *conf)
+{
+    memwatch_config_t *copy;
+
+    if (!conf) return NULL;
+
+    copy = malloc(sizeof(*copy));
+    ASSERT(copy, "out of mem");
+
+    *copy = *conf;
+    copy->level = conf->level ? strdup(conf->level) : NULL;
+    copy->out = conf->out ? strdup(conf->out) : NULL;
+
+    return copy;
+}
+
+void
+memwatch_config_free(memwatch_config_t *conf)
+{
+    if (conf) {
+        free(conf->level);
+        free(conf->out);
+        free(conf);
+    }
+}
+
+const char *
+memwatch_type_name(memwatch_type_t type)
+{
+    return type < MEMWATCH_N_TYPE ? memwatch_names[type] : "unknown";
+}
+
+static void
+memwatch_emit(memwatch_t *mw, memwatch_type_t type, uint64_t count)
+{
+    memwatch_event_t ev = { .type = type, .count = count };
+    struct timespec now;
+    char buf[128];
+    int len;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    ev.ts_ms = (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+
+    mw->count[type] = count;
+
+    // v1 signals every reclaim pass, report bursts once
+    if (type == MEMWATCH_PRESSURE) {
+        if (ev.ts_ms < mw->last_pressure_ms + MEMWATCH_PRESSURE_GAP) return;
+        mw->last_pressure_ms = ev.ts_ms;
+    }
+
+    // pressure and high fire routinely under load, the rest deserve a line
+    if (type != MEMWATCH_PRESSURE && type != MEMWATCH_HIGH) {
+        LOG("memory event: %s (%" PRIu64 ")", memwatch_names[type], count);
+    }
+
+    if (mw->out != -1) {
+        len = snprintf(buf, sizeof(buf), "{\"ts\":%" PRIu64 ",\"event\":\"%s\",\"count\":%" PRIu64 "}\n",
+                       ev.ts_ms, memwatch_names[type], count);
+
+        if (write(mw->out, buf, len) != len) {
+            LOG_ERROR("write memory event: %s", strerror(errno));
+        }
+    }
+
+    if (mw->cb) mw->cb(mw->cb_data, &ev);
+}
+
+static uint64_t
+memwatch_drain(int efd)
+{
+    uint64_t n = 0;
+
+    if (read(efd, &n, sizeof(n)) != sizeof(n)) return 0;
+
+    return n;
+}
+
+/* v1 */
+
+// the kill follows the notification, so it is picked up by later events
+static void
+memwatch_v1_poll(memwatch_t *mw)
+{
+    char buf[256];
+    uint64_t kills;
+
+    // oom_kill is only reported by newer kernels
+    if (cgroup_reread(mw->events, buf, sizeof(buf)) != -1) {
+        kills = string_key(buf, "oom_kill");
+
+        if (kills > mw->count[MEMWATCH_OOM_KILL]) {
+            memwatch_emit(mw, MEMWATCH_OOM_KILL, kills);
+        }
+    }
+}
+
+static void
+memwatch_v1_oom(void *data, int fd, uint32_t events)
+{
+    memwatch_t *mw = data;
+    uint64_t n = memwatch_drain(fd);
+
+    if (n) memwatch_emit(mw, MEMWATCH_OOM, mw->count[MEMWATCH_OOM] + n);
+
+    memwatch_v1_poll(mw);
+}
+
+static void
+memwatch_v1_pressure(void *data, int fd, uint32_t events)
+{
+    memwatch_t *mw = data;
+    uint64_t n = memwatch_drain(fd);
+
+    if (n) memwatch_emit(mw, MEMWATCH_PRESSURE, mw->count[MEMWATCH_PRESSURE] + n);
+
+    memwatch_v1_poll(mw);
+}
+
+// returns an eventfd signalled on events of file
+static int
+memwatch_v1_register(int dir, const char *file, const char *args)
+{
+    char buf[64];
+    int efd, cfd, ctl;
+
+    efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    cfd = openat(dir, file, O_RDONLY | O_CLOEXEC);
+    ctl = openat(dir, "cgroup.event_control", O_WRONLY | O_CLOEXEC);
+
+    if (efd == -1 || cfd == -1 || ctl == -1) {
+        LOG_ERROR("%s: %s", file, strerror(errno));
+        goto ERROR;
+    }
+
+    snprintf(buf, sizeof(buf), "%d %d%s%s", efd, cfd, args ? " " : "", args ? args : "");
+
+    if (write(ctl, buf, strlen(buf)) == -1) {
+        LOG_ERROR("cgroup.event_control: %s", strerror(errno));
+        goto ERROR;
+    }
+
+    // the registration holds on to what it needs
+    close(cfd);
+    close(ctl);
+
+    return efd;
+
+ERROR:
+    if (efd != -1) close(efd);
+    if (cfd != -1) close(cfd);
+    if (ctl != -1) close(ctl);
+    return -1;
+}
+
+static int
+memwatch_v1_init(memwatch_t *mw, int dir, const memwatch_config_t *conf)
+{
+    char buf[256];
+
+    mw->oom_efd = memwatch_v1_register(dir, "memory.oom_control", NULL);
+
+    if (mw->oom_efd == -1 ||
+        loop_add(mw->loop, mw->oom_efd, EPOLLIN, memwatch_v1_oom, mw)) {
+        return -1;
+    }
+
+    // kept to read oom_kill from
+    mw->events = openat(dir, "memory.oom_control", O_RDONLY | O_CLOEXEC);
+
+    // kills from before we started are not reported, the cgroup may be reused
+    if (cgroup_reread(mw->events, buf, sizeof(buf)) != -1) {
+        mw->count[MEMWATCH_OOM_KILL] = string_key(buf, "oom_kill");
+    }
+
+    mw->pressure_efd = memwatch_v1_register(dir, "memory.pressure_level",
+                                            conf->level ? conf->level : MEMWATCH_DEFAULT_LEVEL);
+
+    if (mw->pressure_efd == -1 ||
+        loop_add(mw->loop, mw->pressure_efd, EPOLLIN, memwatch_v1_pressure, mw)) {
+        LOG_WARN("no memory pressure notifications");
+    }
+
+    return 0;
+}
+
+/* v2 */
+
+static void
+memwatch_v2_poll(memwatch_t *mw)
+{
+    static const struct {
+        const char *key;
+        memwatch_type_t type;
+    } keys[] = {
+        { "high", MEMWATCH_HIGH },
+        { "max", MEMWATCH_MAX },
+        { "oom", MEMWATCH_OOM },
+        { "oom_kill", MEMWATCH_OOM_KILL },
+    };
+
+    char buf[256];
+    uint64_t n;
+    size_t i;
+
+    if (cgroup_reread(mw->events, buf, sizeof(buf)) == -1) return;
+
+    for (i = 0; i < sizeof(keys) / sizeof(*keys); i++) {
+        n = string_key(buf, keys[i].key);
+
+        if (n > mw->count[keys[i].type]) {
+            memwatch_emit(mw, keys[i].type, n);
+        }
+    }
+}
+
+static void
+memwatch_v2_events(void *data, int fd, uint32_t events)
+{
+    char buf[sizeof(struct inotify_event) + NAME_MAX + 1];
+
+    while (read(fd, buf, sizeof(buf)) > 0);
+
+    memwatch_v2_poll(data);
+}
+
+static void
+memwatch_v2_psi(void *data, int fd, uint32_t events)
+{
+    memwatch_t *mw = data;
+
+    if (events & EPOLLPRI) {
+        memwatch_emit(mw, MEMWATCH_PRESSURE, mw->count[MEMWATCH_PRESSURE] + 1);
+    }
+}
+
+static int
+memwatch_v2_init(memwatch_t *mw, int dir, const memwatch_config_t *conf)
+{
+    char path[PATH_MAX], buf[256];
+    int len;
+
+    mw->events = openat(dir, "memory.events", O_RDONLY | O_CLOEXEC);
+    mw->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+    if (mw->events == -1 || mw->inotify == -1) {
+        LOG_ERROR("memory.events: %s", strerror(errno));
+        return -1;
+    }
+
+    // events that happened before we started are not reported
+    if (cgroup_reread(mw->events, buf, sizeof(buf)) != -1) {
+        mw->count[MEMWATCH_HIGH] = string_key(buf, "high");
+        mw->count[MEMWATCH_MAX] = string_key(buf, "max");
+        mw->count[MEMWATCH_OOM] = string_key(buf, "oom");
+        mw->count[MEMWATCH_OOM_KILL] = string_key(buf, "oom_kill");
+    }
+
+    // inotify takes a path, reach the file through our dirfd
+    snprintf(path, sizeof(path), "/proc/self/fd/%d/memory.events", dir);
+
+    if (inotify_add_watch(mw->inotify, path, IN_MODIFY) == -1) {
+        LOG_ERROR("inotify_add_watch: %s", strerror(errno));
+        return -1;
+    }
+
+    if (loop_add(mw->loop, mw->inotify, EPOLLIN, memwatch_v2_events, mw)) return -1;
+
+    if (!conf->stall_us) return 0;
+
+    mw->psi = openat(dir, "memory.pressure", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+
+    len = snprintf(buf, sizeof(buf), "some %u %u", conf->stall_us,
+                   conf->window_us ? conf->window_us : MEMWATCH_DEFAULT_WINDOW);
+
+    // the kernel keeps the trigger for as long as the fd is open
+    if (mw->psi == -1 || write(mw->psi, buf, len + 1) == -1 ||
+        loop_add(mw->loop, mw->psi, EPOLLPRI, memwatch_v2_psi, mw)) {
+        LOG_ERROR("memory.pressure trigger: %s", strerror(errno));
+        LOG_WARN("no memory pressure notifications");
+    }
+
+    return 0;
+}
+
+memwatch_t *
+memwatch_new(loop_t *loop, const cgroup_t *cg, const memwatch_config_t *conf)
+{
+    memwatch_t *mw;
+    int dir = -1;
+    size_t i;
+
+    // v1 has the memory hierarchy among others, v2 has one directory
+    for (i = 0; i < cg->n_dir; i++) {
+        if (cg->version == CGROUP_V2 || !strcmp(cg->dirs[i].ctrl, "memory")) {
+            dir = cg->dirs[i].fd;
+            break;
+        }
+    }
+
+    if (dir == -1) {
+        LOG_ERROR("no memory cgroup to watch");
+        return NULL;
+    }
+
+    mw = malloc(sizeof(*mw));
+    ASSERT(mw, "out of mem");
+
+    memset(mw, 0, sizeof(*mw));
+
+    mw->loop = loop;
+    mw->version = cg->version;
+    mw->oom_efd = mw->pressure_efd = -1;
+    mw->inotify = mw->events = mw->psi = -1;
+    mw->out = -1;
+
+    if (conf->out) {
+        mw->out = open(conf->out, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+        if (mw->out == -1) {
+            LOG_ERROR("open memory event output: %s", strerror(errno));
+            goto ERROR;
+        }
+    }
+
+    if (mw->version == CGROUP_V2 ? memwatch_v2_init(mw, dir, conf) : memwatch_v1_init(mw, dir, conf)) {
+        goto ERROR;
+    }
+
+    return mw;
+
+ERROR:
+    memwatch_free(mw);
+    return NULL;
+}
+
+void
+memwatch_poll(memwatch_t *mw)
+{
+    if (mw->version == CGROUP_V2) {
+        memwatch_v2_poll(mw);
+    } else {
+        memwatch_v1_poll(mw);
+    }
+}
+
+static void
+memwatch_close(memwatch_t *mw, int fd)
+{
+    if (fd != -1) {
+        loop_del(mw->loop, fd);
+        close(fd);
+    }
+}
+
+void
+memwatch_free(memwatch_t *mw)
+{
+    if (mw) {
+        if (mw->count[MEMWATCH_OOM] || mw->count[MEMWATCH_PRESSURE]) {
+            LOG("memory events: %" PRIu64 " oom, %" PRIu64 " oom kills, %" PRIu64 " pressure",
+                mw->count[MEMWATCH_OOM], mw->count[MEMWATCH_OOM_KILL], mw->count[MEMWATCH_PRESSURE]);
+        }
+
+        memwatch_close(mw, mw->oom_efd);
+        memwatch_close(mw, mw->pressure_efd);
+        memwatch_close(mw, mw->inotify);
+        memwatch_close(mw, mw->psi);
+
+        if (mw->events != -1) close(mw->events);
+        if (mw->out != -1) close(mw->out);
+
+        free(mw);
+    }
+}
+
+void
+memwatch_set_cb(memwatch_t *mw, memwatch_cb_t cb, void *data)
+{
+    mw->cb = cb;
+    mw->cb_data = data;
+}
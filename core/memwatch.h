@@ -0,0 +1,86 @@
+#ifndef _CORE_MEMWATCH_H_
+#define _CORE_MEMWATCH_H_
+
+#include "pub/type.h"
+
+#include "loop.h"
+#include "cgroup.h"
+
+/*
+
+memory event notifications of the container cgroup, on the supervisor loop
+
+v1: eventfds registered through cgroup.event_control on
+    memory.oom_control and memory.pressure_level
+v2: inotify on memory.events, and a psi trigger on memory.pressure
+
+*/
+
+typedef enum {
+    MEMWATCH_OOM, // hit the limit and could not reclaim
+    MEMWATCH_OOM_KILL, // a process was killed for it
+    MEMWATCH_HIGH, // throttled above memory.high, v2 only
+    MEMWATCH_MAX, // reached memory.max, v2 only
+    MEMWATCH_PRESSURE, // stall trigger (v2) or pressure level (v1) fired
+    MEMWATCH_N_TYPE
+} memwatch_type_t;
+
+typedef struct {
+    memwatch_type_t type;
+    uint64_t count; // events of this type so far
+    uint64_t ts_ms;
+} memwatch_event_t;
+
+typedef void (*memwatch_cb_t)(void *data, const memwatch_event_t *ev);
+
+typedef struct {
+    // v2 psi trigger: fire when tasks stall on memory for stall_us within window_us,
+    // 0 for no trigger
+    unsigned stall_us;
+    unsigned window_us; // 0 for one second
+    char *level; // v1 pressure level, low, medium or critical, NULL for medium
+    char *out; // events appended as json lines, NULL for none
+} memwatch_config_t;
+
+typedef struct {
+    loop_t *loop;
+    cgroup_version_t version;
+
+    int oom_efd; // v1
+    int pressure_efd; // v1
+    int inotify; // v2
+    int events; // memory.events, or memory.oom_control on v1
+    int psi; // v2 trigger
+    int out;
+
+    uint64_t count[MEMWATCH_N_TYPE];
+    uint64_t last_pressure_ms;
+
+    memwatch_cb_t cb;
+    void *cb_data;
+} memwatch_t;
+
+memwatch_config_t *
+memwatch_config_copy(const memwatch_config_t *conf);
+
+void
+memwatch_config_free(memwatch_config_t *conf);
+
+// cg has to be created already
+memwatch_t *
+memwatch_new(loop_t *loop, const cgroup_t *cg, const memwatch_config_t *conf);
+
+void
+memwatch_free(memwatch_t *mw);
+
+// check the counters now, for events whose notification is still pending
+void
+memwatch_poll(memwatch_t *mw);
+
+void
+memwatch_set_cb(memwatch_t *mw, memwatch_cb_t cb, void *data);
+
+const char *
+memwatch_type_name(memwatch_type_t type);
+
+#endif
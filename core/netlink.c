@@ -0,0 +1,178 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+#include "pub/type.h"
+#include "pub/fd.h"
+
+#include "netlink.h"
+
+#define NL_TAIL(msg) ((struct rtattr *)((msg)->buf + NLMSG_ALIGN((msg)->hdr.nlmsg_len)))
+
+int
+nl_open()
+{
+    struct sockaddr_nl addr = { .nl_family = AF_NETLINK };
+    int one = 1;
+    int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+
+    if (fd == -1) {
+        LOG_ERROR("netlink socket: %s", strerror(errno));
+        return -1;
+    }
+
+    // ask for the error code only, not the whole request echoed back
+    setsockopt(fd, SOL_NETLINK, NETLINK_CAP_ACK, &one, sizeof(one));
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        LOG_ERROR("netlink bind: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+void *
+nl_msg_init(nl_msg_t *msg, uint16_t type, uint16_t flags, size_t len)
+{
+    static uint32_t seq = 0;
+
+    memset(msg, 0, sizeof(*msg));
+
+    msg->hdr.nlmsg_len = NLMSG_LENGTH(len);
+    msg->hdr.nlmsg_type = type;
+    msg->hdr.nlmsg_flags = NLM_F_REQUEST | flags;
+    msg->hdr.nlmsg_seq = ++seq;
+
+    return NLMSG_DATA(&msg->hdr);
+}
+
+void
+nl_put(nl_msg_t *msg, uint16_t type, const void *data, size_t len)
+{
+    struct rtattr *rta = NL_TAIL(msg);
+    size_t total = NLMSG_ALIGN(msg->hdr.nlmsg_len) + RTA_SPACE(len);
+
+    ASSERT(total <= sizeof(msg->buf), "netlink message too long");
+
+    rta->rta_type = type;
+    rta->rta_len = RTA_LENGTH(len);
+
+    if (len) memcpy(RTA_DATA(rta), data, len);
+
+    msg->hdr.nlmsg_len = total;
+}
+
+void
+nl_put_str(nl_msg_t *msg, uint16_t type, const char *str)
+{
+    nl_put(msg, type, str, strlen(str) + 1);
+}
+
+void
+nl_put_u32(nl_msg_t *msg, uint16_t type, uint32_t val)
+{
+    nl_put(msg, type, &val, sizeof(val));
+}
+
+void
+nl_put_u64(nl_msg_t *msg, uint16_t type, uint64_t val)
+{
+    nl_put(msg, type, &val, sizeof(val));
+}
+
+struct rtattr *
+nl_nest_start(nl_msg_t *msg, uint16_t type)
+{
+    struct rtattr *nest = NL_TAIL(msg);
+
+    nl_put(msg, type, NULL, 0);
+
+    return nest;
+}
+
+void
+nl_nest_end(nl_msg_t *msg, struct rtattr *nest)
+{
+    nest->rta_len = (char *)NL_TAIL(msg) - (char *)nest;
+}
+
+static int
+nl_send(int fd, nl_msg_t *msg)
+{
+    struct sockaddr_nl addr = { .nl_family = AF_NETLINK };
+
+    if (sendto(fd, msg->buf, msg->hdr.nlmsg_len, 0,
+               (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        LOG_ERROR("netlink send: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+// read replies to msg until an ack, an error or the end of a dump
+static int
+nl_recv(int fd, nl_msg_t *msg, nl_dump_cb_t cb, void *data)
+{
+    static char buf[1 << 15];
+    struct nlmsghdr *hdr;
+    struct nlmsgerr *err;
+    ssize_t n;
+
+    while (1) {
+        n = recv(fd, buf, sizeof(buf), 0);
+
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            LOG_ERROR("netlink recv: %s", strerror(errno));
+            return -errno;
+        }
+
+        for (hdr = (struct nlmsghdr *)buf; NLMSG_OK(hdr, n); hdr = NLMSG_NEXT(hdr, n)) {
+            if (hdr->nlmsg_seq != msg->hdr.nlmsg_seq) continue;
+
+            if (hdr->nlmsg_type == NLMSG_DONE) return 0;
+
+            if (hdr->nlmsg_type == NLMSG_ERROR) {
+                err = NLMSG_DATA(hdr);
+                return err->error;
+            }
+
+            if (cb && cb(hdr, data)) return -ECANCELED;
+        }
+    }
+}
+
+int
+nl_talk(int fd, nl_msg_t *msg)
+{
+    msg->hdr.nlmsg_flags |= NLM_F_ACK;
+
+    if (nl_send(fd, msg)) return -EIO;
+
+    return nl_recv(fd, msg, NULL, NULL);
+}
+
+int
+nl_dump(int fd, nl_msg_t *msg, nl_dump_cb_t cb, void *data)
+{
+    msg->hdr.nlmsg_flags |= NLM_F_DUMP;
+
+    if (nl_send(fd, msg)) return -EIO;
+
+    return nl_recv(fd, msg, cb, data);
+}
+
+void
+nl_parse(struct rtattr **tb, int max, struct rtattr *rta, size_t len)
+{
+    memset(tb, 0, sizeof(*tb) * (max + 1));
+
+    for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        if (rta->rta_type <= max) {
+            tb[rta->rta_type] = rta;
+        }
+    }
+}
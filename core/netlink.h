@@ -0,0 +1,58 @@
+#ifndef _CORE_NETLINK_H_
+#define _CORE_NETLINK_H_
+
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include "pub/type.h"
+
+#define NL_BUF_SIZE 4096
+
+// one request message, built in place
+typedef struct {
+    union {
+        struct nlmsghdr hdr;
+        char buf[NL_BUF_SIZE];
+    };
+} nl_msg_t;
+
+typedef int (*nl_dump_cb_t)(struct nlmsghdr *hdr, void *data);
+
+int
+nl_open();
+
+// starts a message followed by a fixed header of size len (e.g. struct tcmsg)
+void *
+nl_msg_init(nl_msg_t *msg, uint16_t type, uint16_t flags, size_t len);
+
+void
+nl_put(nl_msg_t *msg, uint16_t type, const void *data, size_t len);
+
+void
+nl_put_str(nl_msg_t *msg, uint16_t type, const char *str);
+
+void
+nl_put_u32(nl_msg_t *msg, uint16_t type, uint32_t val);
+
+void
+nl_put_u64(nl_msg_t *msg, uint16_t type, uint64_t val);
+
+struct rtattr *
+nl_nest_start(nl_msg_t *msg, uint16_t type);
+
+void
+nl_nest_end(nl_msg_t *msg, struct rtattr *nest);
+
+// send a request and wait for the ack, returns 0 or -errno
+int
+nl_talk(int fd, nl_msg_t *msg);
+
+// send a dump request and call cb on every reply
+int
+nl_dump(int fd, nl_msg_t *msg, nl_dump_cb_t cb, void *data);
+
+// index attributes of a nested or top level block, tb has max + 1 slots
+void
+nl_parse(struct rtattr **tb, int max, struct rtattr *rta, size_t len);
+
+#endif
@@ -0,0 +1,516 @@
+#include <errno.h>
+#include <dirent.h>
+#include <net/if.h>
+#include <sys/file.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
+
+#include "pub/type.h"
+#include "pub/limit.h"
+#include "pub/fd.h"
+#include "pub/mount.h"
+
+#include "pod.h"
+#include "bridge.h"
+#include "fs.h"
+
+#define POD_STATE "state"
+#define POD_SHM "shm"
+#define POD_LOCK "/var/run/ducker/pods.lock" // taken by leaders picking a slot
+
+// user goes first, joining it grants the rights over the rest
+static const struct {
+    const char *name;
+    int type;
+} pod_ns[] = {
+    { "user", CLONE_NEWUSER },
+    { "net", CLONE_NEWNET },
+    { "ipc", CLONE_NEWIPC },
+    { "uts", CLONE_NEWUTS },
+};
+
+#define POD_N_NS (sizeof(pod_ns) / sizeof(*pod_ns))
+
+static void
+pod_path(const pod_t *pod, const char *file, char *buf, size_t size)
+{
+    snprintf(buf, size, POD_DIR "/%s/%s", pod->name, file);
+}
+
+static int
+pod_mkdir(const char *name)
+{
+    char path[PATH_MAX];
+    char *p;
+
+    snprintf(path, sizeof(path), POD_DIR "/%s", name);
+
+    for (p = path + 1; ; p++) {
+        if (*p == '/' || !*p) {
+            char c = *p;
+
+            *p = '\0';
+
+            if (mkdir(path, 0755) && errno != EEXIST) {
+                LOG_ERROR("mkdir pod dir: %s", strerror(errno));
+                return -1;
+            }
+
+            if (!c) break;
+            *p = c;
+        }
+    }
+
+    return 0;
+}
+
+static int
+pod_read_state(pod_t *pod, int *n_member)
+{
+    char buf[64];
+    ssize_t n = pread(pod->state, buf, sizeof(buf) - 1, 0);
+
+    if (n == -1) {
+        LOG_ERROR("read pod state: %s", strerror(errno));
+        return -1;
+    }
+
+    buf[n] = '\0';
+    *n_member = 0;
+    pod->slot = 0;
+
+    // an empty file is a new pod
+    sscanf(buf, "%d %d", n_member, &pod->slot);
+
+    return 0;
+}
+
+static int
+pod_write_state(pod_t *pod, int n_member)
+{
+    char buf[64];
+    int len = snprintf(buf, sizeof(buf), "%d %d\n", n_member, pod->slot);
+
+    if (pwrite(pod->state, buf, len, 0) != len || ftruncate(pod->state, len)) {
+        LOG_ERROR("write pod state: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+// whether the namespaces are still pinned, they are gone if the host rebooted
+static bool
+pod_is_pinned(const pod_t *pod)
+{
+    char path[PATH_MAX];
+    struct statfs st;
+    int fd;
+    bool ret;
+
+    pod_path(pod, "net", path, sizeof(path));
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return false;
+
+    ret = !fstatfs(fd, &st) && st.f_type == NSFS_MAGIC;
+
+    close(fd);
+
+    return ret;
+}
+
+static void
+pod_unlock(pod_t *pod)
+{
+    flock(pod->state, LOCK_UN);
+}
+
+// mounted before the state names a leader, so members always find it
+static int
+pod_mount_shm(const pod_t *pod)
+{
+    char path[PATH_MAX];
+
+    pod_path(pod, POD_SHM, path, sizeof(path));
+
+    // stale mount left by a crashed pod
+    umount2(path, MNT_DETACH);
+
+    if (mkdir(path, 0755) && errno != EEXIST) {
+        LOG_ERROR("mkdir pod shm: %s", strerror(errno));
+        return -1;
+    }
+
+    if (mount("shm", path, "tmpfs", MS_NOSUID | MS_NODEV, "mode=1777")) {
+        LOG_ERROR("mount pod shm: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+// the slots of the other live pods, read without their locks: a leader
+// writes its state before it lets go of POD_LOCK
+static void
+pod_used_slots(const pod_t *pod, bool *used)
+{
+    char path[PATH_MAX], buf[64];
+    struct dirent *ent;
+    int fd, n_member, slot;
+    ssize_t n;
+    DIR *dir = opendir(POD_DIR);
+
+    if (!dir) {
+        LOG_ERROR("open pod dir: %s", strerror(errno));
+        return;
+    }
+
+    while ((ent = readdir(dir))) {
+        if (ent->d_name[0] == '.' || !strcmp(ent->d_name, pod->name)) continue;
+
+        snprintf(path, sizeof(path), POD_DIR "/%s/" POD_STATE, ent->d_name);
+
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) continue;
+
+        n = pread(fd, buf, sizeof(buf) - 1, 0);
+        close(fd);
+
+        if (n <= 0) continue;
+        buf[n] = '\0';
+
+        if (sscanf(buf, "%d %d", &n_member, &slot) == 2 && n_member > 0 &&
+            slot > 0 && slot <= POD_MAX_SLOT) {
+            used[slot] = true;
+        }
+    }
+
+    closedir(dir);
+}
+
+// the lowest slot no live pod holds, and whose veth the last pod to have
+// it has already removed
+static int
+pod_alloc_slot(pod_t *pod, int n_member)
+{
+    bool used[POD_MAX_SLOT + 1] = { false };
+    char id[IF_NAMESIZE - sizeof(BRIDGE_VETH_PREFIX) + 1], veth[IF_NAMESIZE];
+    int lock, ret = -1;
+
+    lock = open(POD_LOCK, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+    if (lock == -1 || flock(lock, LOCK_EX)) {
+        LOG_ERROR("lock pods: %s", strerror(errno));
+        if (lock != -1) close(lock);
+        return -1;
+    }
+
+    pod_used_slots(pod, used);
+
+    for (pod->slot = 1; pod->slot <= POD_MAX_SLOT; pod->slot++) {
+        pod_net_id(pod, id, sizeof(id));
+        snprintf(veth, sizeof(veth), BRIDGE_VETH_PREFIX "%s", id);
+
+        if (!used[pod->slot] && !if_nametoindex(veth)) break;
+    }
+
+    if (pod->slot > POD_MAX_SLOT) {
+        LOG_ERROR("no free pod slot, %d pods are up", POD_MAX_SLOT);
+        pod->slot = 0;
+    } else {
+        ret = pod_write_state(pod, n_member);
+    }
+
+    close(lock);
+
+    return ret;
+}
+
+pod_t *
+pod_join(const char *name)
+{
+    char path[PATH_MAX];
+    pod_t *pod;
+    int n_member;
+
+    if (!*name || strchr(name, '/') || !strcmp(name, ".") || !strcmp(name, "..")) {
+        LOG_ERROR("invalid pod name '%s'", name);
+        return NULL;
+    }
+
+    if (pod_mkdir(name)) return NULL;
+
+    pod = malloc(sizeof(*pod));
+    ASSERT(pod, "out of mem");
+
+    pod->name = strdup(name);
+    pod->leader = false;
+    pod->slot = 0;
+
+    pod_path(pod, POD_STATE, path, sizeof(path));
+
+    pod->state = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+    if (pod->state == -1) {
+        LOG_ERROR("open pod state: %s", strerror(errno));
+        goto ERROR;
+    }
+
+    if (flock(pod->state, LOCK_EX)) {
+        LOG_ERROR("lock pod state: %s", strerror(errno));
+        goto ERROR;
+    }
+
+    if (pod_read_state(pod, &n_member)) goto ERROR;
+
+    if (n_member > 0 && !pod_is_pinned(pod)) {
+        LOG_WARN("pod '%s' has %d stale member(s), recreating it", name, n_member);
+        n_member = 0;
+    }
+
+    if (n_member == 0) {
+        pod->leader = true;
+        if (pod_mount_shm(pod) || pod_alloc_slot(pod, 1)) goto ERROR;
+    } else if (pod_write_state(pod, n_member + 1)) {
+        goto ERROR;
+    }
+
+    return pod;
+
+ERROR:
+    pod_free(pod);
+    return NULL;
+}
+
+int
+pod_publish(pod_t *pod, pid_t pid)
+{
+    char src[PATH_MAX], dst[PATH_MAX];
+    size_t i;
+    int fd;
+    int ret = -1;
+
+    ASSERT(pod->leader, "only the leader pins the pod");
+
+    for (i = 0; i < POD_N_NS; i++) {
+        snprintf(src, sizeof(src), "/proc/%d/ns/%s", pid, pod_ns[i].name);
+        pod_path(pod, pod_ns[i].name, dst, sizeof(dst));
+
+        // stale mounts left by a crashed pod
+        umount2(dst, MNT_DETACH);
+
+        fd = open(dst, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+
+        if (fd == -1) {
+            LOG_ERROR("create pod ns file: %s", strerror(errno));
+            goto UNLOCK;
+        }
+
+        close(fd);
+
+        if (mount(src, dst, NULL, MS_BIND, NULL)) {
+            LOG_ERROR("pin pod namespace: %s", strerror(errno));
+            goto UNLOCK;
+        }
+    }
+
+    ret = 0;
+
+UNLOCK:
+    pod_unlock(pod);
+    return ret;
+}
+
+// the helper can only enter the user namespace of the pod if it is
+// single-threaded and nothing else needs it afterwards, so it forks
+// from the supervisor and the member becomes a sibling via CLONE_PARENT
+static int
+pod_helper(int *ns_fd, int (*fn)(void *), void *stack, void *arg, int out)
+{
+    pid_t child;
+    size_t i;
+
+    for (i = 0; i < POD_N_NS; i++) {
+        if (setns(ns_fd[i], pod_ns[i].type)) {
+            LOG_ERROR("setns pod namespace: %s", strerror(errno));
+            return -1;
+        }
+    }
+
+    child = clone(fn, stack, CLONE_NEWPID | CLONE_NEWNS | CLONE_PARENT | SIGCHLD, arg);
+
+    if (child == -1) {
+        LOG_ERROR("clone pod member: %s", strerror(errno));
+        return -1;
+    }
+
+    if (write(out, &child, sizeof(child)) != sizeof(child)) {
+        LOG_ERROR("report pod member: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+pid_t
+pod_clone(pod_t *pod, int (*fn)(void *), void *stack, void *arg)
+{
+    char path[PATH_MAX];
+    int ns_fd[POD_N_NS];
+    int report[2] = { -1, -1 };
+    pid_t helper, child = -1;
+    size_t i;
+    int ret;
+
+    ASSERT(!pod->leader, "the leader creates the namespaces");
+
+    for (i = 0; i < POD_N_NS; i++) {
+        pod_path(pod, pod_ns[i].name, path, sizeof(path));
+        ns_fd[i] = open(path, O_RDONLY | O_CLOEXEC);
+
+        if (ns_fd[i] == -1) {
+            LOG_ERROR("open pod namespace: %s", strerror(errno));
+            goto CLEAN;
+        }
+    }
+
+    if (pipe2(report, O_CLOEXEC)) {
+        LOG_ERROR("pipe: %s", strerror(errno));
+        goto CLEAN;
+    }
+
+    log_flush();
+    helper = fork();
+
+    if (helper == -1) {
+        LOG_ERROR("fork: %s", strerror(errno));
+        goto CLEAN;
+    }
+
+    if (helper == 0) {
+        close(report[0]);
+        ret = pod_helper(ns_fd, fn, stack, arg, report[1]);
+        log_flush();
+        _exit(ret ? 1 : 0);
+    }
+
+    close(report[1]);
+    report[1] = -1;
+
+    if (read(report[0], &child, sizeof(child)) != sizeof(child)) {
+        LOG_ERROR("failed to start pod member");
+        child = -1;
+    }
+
+    if (waitpid(helper, NULL, 0) == -1) {
+        LOG_ERROR("waitpid: %s", strerror(errno));
+    }
+
+CLEAN:
+    for (; i > 0; i--) {
+        close(ns_fd[i - 1]);
+    }
+
+    if (report[0] != -1) close(report[0]);
+    if (report[1] != -1) close(report[1]);
+
+    pod_unlock(pod);
+
+    return child;
+}
+
+int
+pod_leave(pod_t *pod, bool *last)
+{
+    char path[PATH_MAX];
+    int n_member;
+    size_t i;
+    int ret = -1;
+
+    *last = false;
+
+    if (flock(pod->state, LOCK_EX)) {
+        LOG_ERROR("lock pod state: %s", strerror(errno));
+        return -1;
+    }
+
+    if (pod_read_state(pod, &n_member)) goto UNLOCK;
+
+    if (--n_member <= 0) {
+        n_member = 0;
+        *last = true;
+
+        // the state file stays, a joiner may already be waiting on its lock
+        for (i = 0; i < POD_N_NS; i++) {
+            pod_path(pod, pod_ns[i].name, path, sizeof(path));
+
+            if (umount2(path, MNT_DETACH) && errno != EINVAL && errno != ENOENT) {
+                LOG_ERROR("unpin pod namespace: %s", strerror(errno));
+            }
+
+            unlink(path);
+        }
+
+        pod_path(pod, POD_SHM, path, sizeof(path));
+
+        if (umount2(path, MNT_DETACH) && errno != EINVAL && errno != ENOENT) {
+            LOG_ERROR("unmount pod shm: %s", strerror(errno));
+        }
+
+        rmdir(path);
+    }
+
+    if (pod_write_state(pod, n_member)) goto UNLOCK;
+
+    ret = 0;
+
+UNLOCK:
+    pod_unlock(pod);
+    return ret;
+}
+
+int
+pod_attach_shm(const pod_t *pod, const char *root)
+{
+    char path[PATH_MAX];
+
+    volume_entry_t shm = {
+        .type = VOLUME_BIND,
+        .source = path,
+        .target = "/dev/shm",
+        .read_only = false,
+        .nosuid = true,
+        .nodev = true,
+        .size = NULL
+    };
+
+    pod_path(pod, POD_SHM, path, sizeof(path));
+
+    return volume_attach(&shm, -1, root);
+}
+
+void
+pod_net_id(const pod_t *pod, char *buf, size_t size)
+{
+    snprintf(buf, size, "p%d", pod->slot);
+}
+
+void
+pod_close(pod_t *pod)
+{
+    if (pod && pod->state != -1) {
+        close(pod->state);
+        pod->state = -1;
+    }
+}
+
+void
+pod_free(pod_t *pod)
+{
+    if (pod) {
+        pod_close(pod);
+        free(pod->name);
+        free(pod);
+    }
+}
@@ -0,0 +1,66 @@
+#ifndef _CORE_POD_H_
+#define _CORE_POD_H_
+
+#include "pub/type.h"
+#include "pub/clone.h"
+
+/*
+
+pods are groups of containers sharing user, network, ipc and uts namespaces
+
+the first member creates the namespaces and the bridge attachment,
+they are pinned by bind mounts under POD_DIR/<name> so later members
+can join them, and the last member to leave tears them down
+
+sysv ipc is shared through the ipc namespace, posix shm through a tmpfs
+the leader mounts at POD_DIR/<name>/shm, bound at /dev/shm of every member
+
+the network devices of a pod outlive its leader, so they are named after
+a slot the leader allocates, unique among live pods, not after a pid
+
+*/
+
+#define POD_DIR "/var/run/ducker/pods"
+#define POD_SHARED_NS (CLONE_NEWUSER | CLONE_NEWNET | CLONE_NEWIPC | CLONE_NEWUTS)
+#define POD_MAX_SLOT 9999
+
+typedef struct {
+    char *name;
+    int state; // flock'd state file, held from join until the member is started
+    bool leader; // created the namespaces
+    int slot; // names the veth pair of the pod, 0 until joined
+} pod_t;
+
+// lock the pod and register as a member
+pod_t *
+pod_join(const char *name);
+
+// leader: pin the namespaces of pid
+// member: clone fn into the pinned namespaces, with new pid and mount namespaces
+// either way the pod is unlocked afterwards
+int
+pod_publish(pod_t *pod, pid_t pid);
+
+pid_t
+pod_clone(pod_t *pod, int (*fn)(void *), void *stack, void *arg);
+
+// unregister, *last is set if the caller should clean up the bridge
+int
+pod_leave(pod_t *pod, bool *last);
+
+// in init, before pivot_root: bind the shm of the pod at root/dev/shm
+int
+pod_attach_shm(const pod_t *pod, const char *root);
+
+// device name suffix for bridge_set_up, "p<slot>"
+void
+pod_net_id(const pod_t *pod, char *buf, size_t size);
+
+// close the state fd in a forked child without touching the lock
+void
+pod_close(pod_t *pod);
+
+void
+pod_free(pod_t *pod);
+
+#endif
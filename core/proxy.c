@@ -0,0 +1,495 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "pub/type.h"
+#include "pub/fd.h"
+
+#include "proxy.h"
+
+#define PROXY_BACKLOG 1024
+#define PROXY_PIPE_SIZE (1 << 20)
+#define PROXY_MAX_FREE_PIPE 64
+
+struct proxy_pipe_t {
+    int fd[2];
+    size_t len; // bytes currently buffered in the pipe
+    proxy_pipe_t *next;
+};
+
+// one direction of a connection
+typedef struct {
+    int src;
+    int dst;
+    proxy_pipe_t *pipe;
+    bool eof; // src has been fully read
+    bool shut; // eof has been forwarded to dst
+    uint64_t *bytes;
+} proxy_dir_t;
+
+struct proxy_conn_t {
+    proxy_t *proxy;
+
+    int client;
+    int upstream;
+    bool connecting;
+
+    proxy_dir_t in; // client -> upstream
+    proxy_dir_t out; // upstream -> client
+
+    proxy_conn_t *prev;
+    proxy_conn_t *next;
+};
+
+struct proxy_listener_t {
+    proxy_t *proxy;
+    int fd;
+    int cont_port;
+};
+
+proxy_entry_t *
+proxy_entry_copy(proxy_entry_t *conf, size_t n)
+{
+    proxy_entry_t *copy = malloc(sizeof(*conf) * n);
+    size_t i;
+
+    ASSERT(copy || !n, "out of mem");
+
+    for (i = 0; i < n; i++) {
+        copy[i].host_ip = conf[i].host_ip ? strdup(conf[i].host_ip) : NULL;
+        copy[i].host_port = conf[i].host_port;
+        copy[i].cont_port = conf[i].cont_port;
+    }
+
+    return copy;
+}
+
+void
+proxy_entry_free(proxy_entry_t *conf, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        free(conf[i].host_ip);
+    }
+
+    free(conf);
+}
+
+/* pipes */
+
+static proxy_pipe_t *
+proxy_pipe_get(proxy_t *proxy)
+{
+    proxy_pipe_t *pipe = proxy->free_pipes;
+
+    if (pipe) {
+        proxy->free_pipes = pipe->next;
+        pipe->next = NULL;
+        return pipe;
+    }
+
+    pipe = malloc(sizeof(*pipe));
+    ASSERT(pipe, "out of mem");
+
+    if (pipe2(pipe->fd, O_NONBLOCK | O_CLOEXEC)) {
+        LOG_ERROR("pipe2: %s", strerror(errno));
+        free(pipe);
+        return NULL;
+    }
+
+    // larger pipes mean fewer splice calls per connection,
+    // failure only costs throughput
+    fcntl(pipe->fd[1], F_SETPIPE_SZ, PROXY_PIPE_SIZE);
+
+    pipe->len = 0;
+    pipe->next = NULL;
+
+    return pipe;
+}
+
+static void
+proxy_pipe_destroy(proxy_pipe_t *pipe)
+{
+    close(pipe->fd[0]);
+    close(pipe->fd[1]);
+    free(pipe);
+}
+
+static void
+proxy_pipe_put(proxy_t *proxy, proxy_pipe_t *pipe)
+{
+    proxy_pipe_t *p;
+    size_t n = 0;
+
+    if (!pipe) return;
+
+    for (p = proxy->free_pipes; p; p = p->next) n++;
+
+    // only empty pipes can be reused
+    if (pipe->len || n >= PROXY_MAX_FREE_PIPE) {
+        proxy_pipe_destroy(pipe);
+        return;
+    }
+
+    pipe->next = proxy->free_pipes;
+    proxy->free_pipes = pipe;
+}
+
+/* connections */
+
+static void
+proxy_conn_close(proxy_conn_t *conn)
+{
+    proxy_t *proxy = conn->proxy;
+
+    loop_del(proxy->loop, conn->client);
+    loop_del(proxy->loop, conn->upstream);
+
+    close(conn->client);
+    close(conn->upstream);
+
+    proxy_pipe_put(proxy, conn->in.pipe);
+    proxy_pipe_put(proxy, conn->out.pipe);
+
+    if (conn->prev) conn->prev->next = conn->next;
+    else proxy->conns = conn->next;
+
+    if (conn->next) conn->next->prev = conn->prev;
+
+    proxy->stat.n_active--;
+
+    free(conn);
+}
+
+// move as much data as possible in one direction, returns -1 on error
+static int
+proxy_pump(proxy_dir_t *dir)
+{
+    ssize_t n;
+
+    // only refill an empty pipe so a full pipe never looks readable
+    if (!dir->eof && !dir->pipe->len) {
+        n = splice(dir->src, NULL, dir->pipe->fd[1], NULL, PROXY_PIPE_SIZE,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+        if (n > 0) {
+            dir->pipe->len += n;
+        } else if (n == 0) {
+            dir->eof = true;
+        } else if (errno != EAGAIN) {
+            return -1;
+        }
+    }
+
+    if (dir->pipe->len) {
+        n = splice(dir->pipe->fd[0], NULL, dir->dst, NULL, dir->pipe->len,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+        if (n > 0) {
+            dir->pipe->len -= n;
+            *dir->bytes += n;
+        } else if (n == -1 && errno != EAGAIN) {
+            return -1;
+        }
+    }
+
+    if (dir->eof && !dir->pipe->len && !dir->shut) {
+        shutdown(dir->dst, SHUT_WR);
+        dir->shut = true;
+    }
+
+    return 0;
+}
+
+static uint32_t
+proxy_interest(proxy_dir_t *rd, proxy_dir_t *wr)
+{
+    uint32_t events = 0;
+
+    if (!rd->eof && !rd->pipe->len) events |= EPOLLIN;
+    if (wr->pipe->len) events |= EPOLLOUT;
+
+    return events;
+}
+
+static void
+proxy_conn_update(proxy_conn_t *conn)
+{
+    proxy_t *proxy = conn->proxy;
+
+    // hold the client until the upstream is connected
+    if (conn->connecting) {
+        loop_mod(proxy->loop, conn->client, 0);
+        loop_mod(proxy->loop, conn->upstream, EPOLLOUT);
+    } else {
+        loop_mod(proxy->loop, conn->client, proxy_interest(&conn->in, &conn->out));
+        loop_mod(proxy->loop, conn->upstream, proxy_interest(&conn->out, &conn->in));
+    }
+}
+
+static void
+proxy_conn_event(void *data, int fd, uint32_t events)
+{
+    proxy_conn_t *conn = data;
+    proxy_t *proxy = conn->proxy;
+    uint64_t before = proxy->stat.bytes_in + proxy->stat.bytes_out;
+    bool eof_before = conn->in.eof && conn->out.eof;
+    int err;
+    socklen_t len = sizeof(err);
+
+    if (events & EPOLLERR) {
+        if (conn->connecting) proxy->stat.n_failed++;
+        proxy_conn_close(conn);
+        return;
+    }
+
+    if (conn->connecting) {
+        // the client gave up, a hangup is reported whatever the interest
+        if (fd != conn->upstream && (events & EPOLLHUP)) {
+            proxy_conn_close(conn);
+            return;
+        }
+
+        if (fd != conn->upstream) return;
+
+        if (getsockopt(conn->upstream, SOL_SOCKET, SO_ERROR, &err, &len) || err) {
+            proxy->stat.n_failed++;
+            proxy_conn_close(conn);
+            return;
+        }
+
+        conn->connecting = false;
+    }
+
+    if (proxy_pump(&conn->in) || proxy_pump(&conn->out)) {
+        proxy_conn_close(conn);
+        return;
+    }
+
+    if (conn->in.shut && conn->out.shut) {
+        proxy_conn_close(conn);
+        return;
+    }
+
+    // peer is gone and nothing moved, avoid spinning on EPOLLHUP
+    if ((events & EPOLLHUP) &&
+        before == proxy->stat.bytes_in + proxy->stat.bytes_out &&
+        eof_before == (conn->in.eof && conn->out.eof)) {
+        proxy_conn_close(conn);
+        return;
+    }
+
+    proxy_conn_update(conn);
+}
+
+static void
+proxy_conn_open(proxy_listener_t *listener, int client)
+{
+    proxy_t *proxy = listener->proxy;
+    struct sockaddr_in addr = proxy->cont_addr;
+    proxy_conn_t *conn;
+    int one = 1;
+    int upstream;
+
+    upstream = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (upstream == -1) {
+        LOG_ERROR("proxy socket: %s", strerror(errno));
+        close(client);
+        return;
+    }
+
+    setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(upstream, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    addr.sin_port = htons(listener->cont_port);
+
+    if (connect(upstream, (struct sockaddr *)&addr, sizeof(addr)) && errno != EINPROGRESS) {
+        proxy->stat.n_failed++;
+        close(upstream);
+        close(client);
+        return;
+    }
+
+    conn = malloc(sizeof(*conn));
+    ASSERT(conn, "out of mem");
+
+    conn->proxy = proxy;
+    conn->client = client;
+    conn->upstream = upstream;
+    conn->connecting = true;
+
+    conn->in = (proxy_dir_t) {
+        .src = client, .dst = upstream,
+        .pipe = proxy_pipe_get(proxy),
+        .bytes = &proxy->stat.bytes_in
+    };
+
+    conn->out = (proxy_dir_t) {
+        .src = upstream, .dst = client,
+        .pipe = proxy_pipe_get(proxy),
+        .bytes = &proxy->stat.bytes_out
+    };
+
+    conn->prev = NULL;
+    conn->next = proxy->conns;
+    if (proxy->conns) proxy->conns->prev = conn;
+    proxy->conns = conn;
+
+    proxy->stat.n_accepted++;
+    proxy->stat.n_active++;
+
+    if (!conn->in.pipe || !conn->out.pipe ||
+        loop_add(proxy->loop, client, 0, proxy_conn_event, conn) ||
+        loop_add(proxy->loop, upstream, EPOLLOUT, proxy_conn_event, conn)) {
+        LOG_WARN("failed to set up proxy connection");
+        proxy_conn_close(conn);
+        return;
+    }
+
+    proxy_conn_update(conn);
+}
+
+static void
+proxy_accept(void *data, int fd, uint32_t events)
+{
+    proxy_listener_t *listener = data;
+    int client;
+
+    while ((client = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+        proxy_conn_open(listener, client);
+    }
+
+    if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED) {
+        LOG_ERROR("proxy accept: %s", strerror(errno));
+    }
+}
+
+static int
+proxy_listen(const char *ip, int port)
+{
+    struct sockaddr_in addr;
+    int one = 1;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+
+    if (ip && inet_pton(AF_INET, ip, &addr.sin_addr) != 1) {
+        LOG_ERROR("invalid proxy address '%s'", ip);
+        return -1;
+    }
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (fd == -1) {
+        LOG_ERROR("proxy socket: %s", strerror(errno));
+        return -1;
+    }
+
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        LOG_ERROR("proxy bind: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if (listen(fd, PROXY_BACKLOG)) {
+        LOG_ERROR("proxy listen: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+proxy_t *
+proxy_new(loop_t *loop, const char *cont_ip,
+          const proxy_entry_t *conf, size_t n_conf)
+{
+    proxy_t *ret = malloc(sizeof(*ret));
+    proxy_listener_t *listener;
+    size_t i;
+
+    ASSERT(ret, "out of mem");
+
+    memset(ret, 0, sizeof(*ret));
+    ret->loop = loop;
+    ret->cont_addr.sin_family = AF_INET;
+
+    if (inet_pton(AF_INET, cont_ip, &ret->cont_addr.sin_addr) != 1) {
+        LOG_ERROR("invalid container address '%s'", cont_ip);
+        free(ret);
+        return NULL;
+    }
+
+    ret->listeners = calloc(n_conf, sizeof(*ret->listeners));
+    ASSERT(ret->listeners || !n_conf, "out of mem");
+
+    for (i = 0; i < n_conf; i++) {
+        listener = &ret->listeners[ret->n_listener];
+
+        listener->proxy = ret;
+        listener->cont_port = conf[i].cont_port;
+        listener->fd = proxy_listen(conf[i].host_ip, conf[i].host_port);
+
+        if (listener->fd == -1) {
+            LOG_ERROR("failed to publish port %d", conf[i].host_port);
+            proxy_free(ret);
+            return NULL;
+        }
+
+        if (loop_add(loop, listener->fd, EPOLLIN, proxy_accept, listener)) {
+            close(listener->fd);
+            proxy_free(ret);
+            return NULL;
+        }
+
+        ret->n_listener++;
+
+        LOG("publishing %s:%d -> %s:%d",
+            conf[i].host_ip ? conf[i].host_ip : "*", conf[i].host_port,
+            cont_ip, conf[i].cont_port);
+    }
+
+    return ret;
+}
+
+void
+proxy_free(proxy_t *proxy)
+{
+    proxy_pipe_t *pipe;
+    size_t i;
+
+    if (proxy) {
+        while (proxy->conns) {
+            proxy_conn_close(proxy->conns);
+        }
+
+        while ((pipe = proxy->free_pipes)) {
+            proxy->free_pipes = pipe->next;
+            proxy_pipe_destroy(pipe);
+        }
+
+        for (i = 0; i < proxy->n_listener; i++) {
+            loop_del(proxy->loop, proxy->listeners[i].fd);
+            close(proxy->listeners[i].fd);
+        }
+
+        if (proxy->stat.n_accepted) {
+            LOG("proxy relayed %llu connections (%llu failed), %llu bytes in, %llu bytes out",
+                (unsigned long long)proxy->stat.n_accepted,
+                (unsigned long long)proxy->stat.n_failed,
+                (unsigned long long)proxy->stat.bytes_in,
+                (unsigned long long)proxy->stat.bytes_out);
+        }
+
+        free(proxy->listeners);
+        free(proxy);
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef _CORE_PROXY_H_
+#define _CORE_PROXY_H_
+
+#include <netinet/in.h>
+
+#include "pub/type.h"
+
+#include "loop.h"
+
+/*
+
+published-port proxy
+
+accepts tcp connections on a host port and relays them to
+cont_ip:cont_port with splice() through a pair of pipes,
+so payload never gets copied into user space
+
+*/
+
+typedef struct {
+    char *host_ip; // address to bind on the host, NULL for any
+    int host_port;
+    int cont_port;
+} proxy_entry_t;
+
+typedef struct {
+    uint64_t n_accepted;
+    uint64_t n_active;
+    uint64_t n_failed; // failed to connect to the container
+    uint64_t bytes_in; // host -> container
+    uint64_t bytes_out; // container -> host
+} proxy_stat_t;
+
+typedef struct proxy_pipe_t proxy_pipe_t;
+typedef struct proxy_conn_t proxy_conn_t;
+typedef struct proxy_listener_t proxy_listener_t;
+
+typedef struct {
+    loop_t *loop;
+    struct sockaddr_in cont_addr;
+
+    proxy_listener_t *listeners;
+    size_t n_listener;
+
+    proxy_conn_t *conns; // active connections
+    proxy_pipe_t *free_pipes; // pipes kept for reuse
+
+    proxy_stat_t stat;
+} proxy_t;
+
+proxy_entry_t *
+proxy_entry_copy(proxy_entry_t *conf, size_t n);
+
+void
+proxy_entry_free(proxy_entry_t *conf, size_t n);
+
+proxy_t *
+proxy_new(loop_t *loop, const char *cont_ip,
+          const proxy_entry_t *conf, size_t n_conf);
+
+// closes all listeners and active connections
+void
+proxy_free(proxy_t *proxy);
+
+#endif
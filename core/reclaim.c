@@ -0,0 +1,304 @@
+#include <errno.h>
+#include <time.h>
+#include <inttypes.h>
+
+#include "pub/type.h"
+#include "pub/fd.h"
+#include "pub/string.h"
+
+#include "reclaim.h"
+
+#define RECLAIM_MIN_STEP (1 << 20) // smaller steps are not worth the syscalls
+
+reclaim_config_t *
+reclaim_config_copy(const reclaim_config_t *conf)
+{
+    reclaim_config_t *copy;
+
+    if (!conf) return NULL;
+
+    copy = malloc(sizeof(*copy));
+    ASSERT(copy, "out of mem");
+
+    *copy = *conf;
+
+    return copy;
+}
+
+void
+reclaim_config_free(reclaim_config_t *conf)
+{
+    free(conf);
+}
+
+static uint64_t
+reclaim_now_ms()
+{
+    struct timespec now;
+
+    // same clock as the samples
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static uint64_t
+reclaim_usage(reclaim_t *rc)
+{
+    char buf[32];
+
+    if (cgroup_read_at(rc->dir, "memory.current", buf, sizeof(buf)) == -1 &&
+        cgroup_read_at(rc->dir, "memory.usage_in_bytes", buf, sizeof(buf)) == -1) {
+        return 0;
+    }
+
+    return strtoull(buf, NULL, 10);
+}
+
+// pages brought back in after being reclaimed, major faults on v1
+static uint64_t
+reclaim_refaults(reclaim_t *rc)
+{
+    char buf[4096];
+
+    if (cgroup_reread(rc->stat, buf, sizeof(buf)) == -1) return 0;
+
+    if (rc->mode == RECLAIM_LIMIT) {
+        return string_key(buf, "total_pgmajfault");
+    }
+
+    // split into anon and file since 5.9
+    return string_key(buf, "workingset_refault") +
+           string_key(buf, "workingset_refault_anon") +
+           string_key(buf, "workingset_refault_file");
+}
+
+reclaim_t *
+reclaim_new(const cgroup_t *cg, const stats_t *stats, const reclaim_config_t *conf)
+{
+    reclaim_t *rc;
+    int dir = -1;
+    size_t i;
+
+    // every container would look idle
+    if (!stats_has_cpu(stats)) {
+        LOG_ERROR("no cpu usage in the cgroup stats, cannot tell when the container idles");
+        return NULL;
+    }
+
+    for (i = 0; i < cg->n_dir; i++) {
+        if (cg->version == CGROUP_V2 || !strcmp(cg->dirs[i].ctrl, "memory")) {
+            dir = cg->dirs[i].fd;
+            break;
+        }
+    }
+
+    if (dir == -1) {
+        LOG_ERROR("no memory cgroup to reclaim from");
+        return NULL;
+    }
+
+    rc = malloc(sizeof(*rc));
+    ASSERT(rc, "out of mem");
+
+    memset(rc, 0, sizeof(*rc));
+
+    rc->conf = *conf;
+    rc->dir = dir;
+
+    if (!rc->conf.idle_ms) rc->conf.idle_ms = RECLAIM_DEFAULT_IDLE_MS;
+    if (!rc->conf.idle_pct) rc->conf.idle_pct = RECLAIM_DEFAULT_IDLE_PCT;
+    if (!rc->conf.step_pct) rc->conf.step_pct = RECLAIM_DEFAULT_STEP_PCT;
+    if (!rc->conf.stall_pct) rc->conf.stall_pct = RECLAIM_DEFAULT_STALL_PCT;
+    if (!rc->conf.refault_pct) rc->conf.refault_pct = RECLAIM_DEFAULT_REFAULT_PCT;
+    if (!rc->conf.backoff_ms) rc->conf.backoff_ms = RECLAIM_DEFAULT_BACKOFF_MS;
+
+    if (cg->version == CGROUP_V1) {
+        rc->mode = RECLAIM_LIMIT;
+    } else if (faccessat(dir, "memory.reclaim", W_OK, 0) == 0) {
+        rc->mode = RECLAIM_FILE;
+    } else {
+        rc->mode = RECLAIM_HIGH;
+    }
+
+    rc->stat = openat(dir, "memory.stat", O_RDONLY | O_CLOEXEC);
+
+    if (rc->stat == -1) {
+        LOG_ERROR("open memory.stat: %s", strerror(errno));
+        free(rc);
+        return NULL;
+    }
+
+    return rc;
+}
+
+// undo a lowered memory.high, the other modes leave nothing behind
+static void
+reclaim_restore(reclaim_t *rc)
+{
+    if (!rc->lowered) return;
+
+    if (cgroup_write_at(rc->dir, "memory.high", rc->high)) {
+        LOG_ERROR("restore memory.high: %s", strerror(errno));
+    }
+
+    rc->lowered = false;
+}
+
+void
+reclaim_free(reclaim_t *rc)
+{
+    if (rc) {
+        reclaim_restore(rc);
+        close(rc->stat);
+        free(rc);
+    }
+}
+
+void
+reclaim_backoff(reclaim_t *rc)
+{
+    reclaim_restore(rc);
+
+    // only count it while reclaim was running
+    if (rc->last_step) {
+        LOG("memory reclaim backing off for %ums", rc->conf.backoff_ms);
+        rc->n_backoff++;
+    }
+
+    rc->last_step = 0;
+    rc->backoff_until_ms = reclaim_now_ms() + rc->conf.backoff_ms;
+}
+
+// bring usage down to target, returns the bytes it went down by
+static uint64_t
+reclaim_step(reclaim_t *rc, uint64_t usage, uint64_t target)
+{
+    char val[32], limit[32];
+    uint64_t after;
+
+    switch (rc->mode) {
+        case RECLAIM_FILE:
+            snprintf(val, sizeof(val), "%" PRIu64, usage - target);
+
+            // EAGAIN once nothing more could be taken, which is fine
+            if (cgroup_write_at(rc->dir, "memory.reclaim", val) && errno != EAGAIN) {
+                LOG_ERROR("write memory.reclaim: %s", strerror(errno));
+            }
+
+            break;
+
+        case RECLAIM_HIGH:
+            if (!rc->lowered) {
+                if (cgroup_read_at(rc->dir, "memory.high", rc->high, sizeof(rc->high)) == -1) {
+                    LOG_ERROR("read memory.high: %s", strerror(errno));
+                    return 0;
+                }
+
+                rc->lowered = true;
+            }
+
+            snprintf(val, sizeof(val), "%" PRIu64, target);
+
+            if (cgroup_write_at(rc->dir, "memory.high", val)) {
+                LOG_ERROR("write memory.high: %s", strerror(errno));
+            }
+
+            break;
+
+        case RECLAIM_LIMIT:
+            if (cgroup_read_at(rc->dir, "memory.limit_in_bytes", limit, sizeof(limit)) == -1) {
+                LOG_ERROR("read memory.limit_in_bytes: %s", strerror(errno));
+                return 0;
+            }
+
+            snprintf(val, sizeof(val), "%" PRIu64, target);
+
+            // the write reclaims down to the new limit, EBUSY if it could not get all of it
+            if (cgroup_write_at(rc->dir, "memory.limit_in_bytes", val) && errno != EBUSY) {
+                LOG_ERROR("write memory.limit_in_bytes: %s", strerror(errno));
+            }
+
+            if (cgroup_write_at(rc->dir, "memory.limit_in_bytes", limit)) {
+                LOG_ERROR("restore memory.limit_in_bytes: %s", strerror(errno));
+            }
+
+            break;
+    }
+
+    after = reclaim_usage(rc);
+
+    return after < usage ? usage - after : 0;
+}
+
+void
+reclaim_sample(void *data, const stats_sample_t *s)
+{
+    reclaim_t *rc = data;
+    uint64_t dt_us, cpu, stall, refaults, refault_bytes, step, page = sysconf(_SC_PAGESIZE);
+
+    if (!rc->has_last || s->ts_ms <= rc->last.ts_ms) {
+        rc->last = *s;
+        rc->has_last = true;
+        rc->idle_since_ms = s->ts_ms;
+        return;
+    }
+
+    dt_us = (s->ts_ms - rc->last.ts_ms) * 1000;
+    cpu = s->cpu_usec - rc->last.cpu_usec;
+    stall = s->psi_mem_some - rc->last.psi_mem_some;
+
+    rc->last = *s;
+
+    refaults = reclaim_refaults(rc);
+    refault_bytes = (refaults - rc->refault_last) * page;
+    rc->refault_last = refaults;
+
+    if (rc->n_round) {
+        rc->refaulted = (refaults - rc->refault_base) * page;
+    }
+
+    // busy again, it gets its memory back on demand
+    if (cpu * 100 > rc->conf.idle_pct * dt_us) {
+        reclaim_restore(rc);
+        rc->last_step = 0;
+        rc->idle_since_ms = s->ts_ms;
+        return;
+    }
+
+    // the last step went too deep
+    if (rc->last_step &&
+        (stall * 100 > rc->conf.stall_pct * dt_us ||
+         refault_bytes * 100 > rc->conf.refault_pct * rc->last_step)) {
+        reclaim_backoff(rc);
+        return;
+    }
+
+    if (s->ts_ms - rc->idle_since_ms < rc->conf.idle_ms || s->ts_ms < rc->backoff_until_ms) return;
+
+    if (s->mem <= rc->conf.min_bytes) return;
+
+    step = s->mem * rc->conf.step_pct / 100;
+    if (step > s->mem - rc->conf.min_bytes) step = s->mem - rc->conf.min_bytes;
+    if (step < RECLAIM_MIN_STEP) return;
+
+    if (!rc->n_round) {
+        rc->refault_base = refaults;
+    }
+
+    rc->last_step = reclaim_step(rc, s->mem, s->mem - step);
+    rc->reclaimed += rc->last_step;
+    rc->n_round++;
+}
+
+void
+reclaim_report(const reclaim_t *rc, FILE *out)
+{
+    static const char *modes[] = { "memory.reclaim", "memory.high", "memory.limit_in_bytes" };
+
+    fprintf(out, "mode %s\n", modes[rc->mode]);
+    fprintf(out, "reclaimed %" PRIu64 "\n", rc->reclaimed);
+    fprintf(out, "refaulted %" PRIu64 "\n", rc->refaulted);
+    fprintf(out, "rounds %" PRIu64 "\n", rc->n_round);
+    fprintf(out, "backoffs %" PRIu64 "\n", rc->n_backoff);
+}
@@ -0,0 +1,99 @@
+#ifndef _CORE_RECLAIM_H_
+#define _CORE_RECLAIM_H_
+
+#include "pub/type.h"
+
+#include "cgroup.h"
+#include "stats.h"
+
+/*
+
+proactive memory reclaim of idle containers, driven by the stats sampler
+
+a container is idle once its cpu use stayed below idle_pct of a cpu for idle_ms,
+then every sample takes step_pct of its memory, never going below min_bytes
+    v2: memory.reclaim, or memory.high lowered step by step on kernels without it
+    v1: memory.limit_in_bytes pulled down to the target and put back right away
+
+it stops once the container is busy again, and backs off for backoff_ms when
+memory stalls more than stall_pct of the time (v2 psi, or a memwatch event),
+or when pages fault back in faster than refault_pct of the last step
+
+*/
+
+#define RECLAIM_DEFAULT_IDLE_MS 10000
+#define RECLAIM_DEFAULT_IDLE_PCT 1
+#define RECLAIM_DEFAULT_STEP_PCT 10
+#define RECLAIM_DEFAULT_STALL_PCT 1
+#define RECLAIM_DEFAULT_REFAULT_PCT 10
+#define RECLAIM_DEFAULT_BACKOFF_MS 60000
+
+// 0 for the defaults
+typedef struct {
+    unsigned idle_ms;
+    unsigned idle_pct;
+    unsigned step_pct;
+    uint64_t min_bytes;
+    unsigned stall_pct;
+    unsigned refault_pct;
+    unsigned backoff_ms;
+} reclaim_config_t;
+
+typedef enum {
+    RECLAIM_FILE, // memory.reclaim
+    RECLAIM_HIGH, // lowered memory.high
+    RECLAIM_LIMIT // memory.limit_in_bytes pulse, v1
+} reclaim_mode_t;
+
+typedef struct {
+    reclaim_config_t conf;
+    reclaim_mode_t mode;
+
+    int dir; // memory cgroup, owned by the cgroup
+    int stat; // memory.stat
+
+    char high[32]; // memory.high before it was lowered
+    bool lowered;
+
+    stats_sample_t last;
+    bool has_last;
+    uint64_t idle_since_ms;
+    uint64_t backoff_until_ms;
+
+    uint64_t last_step; // bytes taken by the latest round
+    uint64_t refault_base; // counter at the first round
+    uint64_t refault_last;
+
+    // report
+    uint64_t reclaimed; // bytes
+    uint64_t refaulted; // bytes faulted back in since the first round
+    uint64_t n_round;
+    uint64_t n_backoff;
+} reclaim_t;
+
+reclaim_config_t *
+reclaim_config_copy(const reclaim_config_t *conf);
+
+void
+reclaim_config_free(reclaim_config_t *conf);
+
+// cg has to be created already, refused if stats cannot tell an idle container
+reclaim_t *
+reclaim_new(const cgroup_t *cg, const stats_t *stats, const reclaim_config_t *conf);
+
+// puts memory.high back if it was lowered
+void
+reclaim_free(reclaim_t *rc);
+
+// feed every sample of the container, a stats_cb_t
+void
+reclaim_sample(void *data, const stats_sample_t *sample);
+
+// the container is short on memory, stop and back off
+void
+reclaim_backoff(reclaim_t *rc);
+
+void
+reclaim_report(const reclaim_t *rc, FILE *out);
+
+#endif
@@ -0,0 +1,345 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <stddef.h>
+
+#include "pub/type.h"
+#include "pub/fd.h"
+#include "pub/string.h"
+
+#include "stats.h"
+
+#define STATS_BUF_SIZE 8192
+
+static const char *stats_file_name[STATS_N_FILE] = {
+    [STATS_CPU_STAT] = "cpu.stat",
+    [STATS_CPUACCT_USAGE] = "cpuacct.usage",
+    [STATS_MEM_CURRENT] = "memory.current",
+    [STATS_MEM_USAGE] = "memory.usage_in_bytes",
+    [STATS_MEM_STAT] = "memory.stat",
+    [STATS_IO_STAT] = "io.stat",
+    [STATS_CPU_PRESSURE] = "cpu.pressure",
+    [STATS_MEM_PRESSURE] = "memory.pressure",
+    [STATS_IO_PRESSURE] = "io.pressure",
+};
+
+stats_config_t *
+stats_config_copy(const stats_config_t *conf)
+{
+    stats_config_t *copy;
+
+    if (!conf) return NULL;
+
+    copy = malloc(sizeof(*copy));
+    ASSERT(copy, "out of mem");
+
+    *copy = *conf;
+    copy->out = conf->out ? strdup(conf->out) : NULL;
+
+    return copy;
+}
+
+void
+stats_config_free(stats_config_t *conf)
+{
+    if (conf) {
+        free(conf->out);
+        free(conf);
+    }
+}
+
+/* parsing */
+
+// "total=" of the some or full line of a pressure file
+static uint64_t
+stats_psi(const char *buf, const char *line)
+{
+    const char *p = strstr(buf, line);
+
+    if (!p) return 0;
+
+    p = strstr(p, "total=");
+
+    return p ? strtoull(p + 6, NULL, 10) : 0;
+}
+
+// io.stat has one line per device, sum them up
+static void
+stats_parse_io(const char *buf, stats_sample_t *sample)
+{
+    static const struct {
+        const char *key;
+        size_t off;
+    } keys[] = {
+        { "rbytes=", offsetof(stats_sample_t, io_rbytes) },
+        { "wbytes=", offsetof(stats_sample_t, io_wbytes) },
+        { "rios=", offsetof(stats_sample_t, io_rios) },
+        { "wios=", offsetof(stats_sample_t, io_wios) },
+    };
+
+    const char *line, *end, *p;
+    size_t i;
+
+    for (line = buf; *line; line = *end ? end + 1 : end) {
+        end = strchrnul(line, '\n');
+
+        for (i = 0; i < sizeof(keys) / sizeof(*keys); i++) {
+            p = memmem(line, end - line, keys[i].key, strlen(keys[i].key));
+
+            if (p) {
+                *(uint64_t *)((char *)sample + keys[i].off) +=
+                    strtoull(p + strlen(keys[i].key), NULL, 10);
+            }
+        }
+    }
+}
+
+/* sampling */
+
+static int
+stats_format_json(char *buf, size_t size, const stats_sample_t *s)
+{
+    return snprintf(buf, size,
+        "{\"ts\":%" PRIu64 ","
+        "\"cpu_usec\":%" PRIu64 ",\"cpu_user_usec\":%" PRIu64 ",\"cpu_system_usec\":%" PRIu64 ","
+        "\"nr_throttled\":%" PRIu64 ",\"throttled_usec\":%" PRIu64 ","
+        "\"mem\":%" PRIu64 ",\"mem_anon\":%" PRIu64 ",\"mem_file\":%" PRIu64 ","
+        "\"io_rbytes\":%" PRIu64 ",\"io_wbytes\":%" PRIu64 ",\"io_rios\":%" PRIu64 ",\"io_wios\":%" PRIu64 ","
+        "\"psi_cpu_some\":%" PRIu64 ",\"psi_mem_some\":%" PRIu64 ",\"psi_mem_full\":%" PRIu64 ","
+        "\"psi_io_some\":%" PRIu64 ",\"psi_io_full\":%" PRIu64 "}\n",
+        s->ts_ms,
+        s->cpu_usec, s->cpu_user_usec, s->cpu_system_usec,
+        s->nr_throttled, s->throttled_usec,
+        s->mem, s->mem_anon, s->mem_file,
+        s->io_rbytes, s->io_wbytes, s->io_rios, s->io_wios,
+        s->psi_cpu_some, s->psi_mem_some, s->psi_mem_full,
+        s->psi_io_some, s->psi_io_full);
+}
+
+static void
+stats_write_json(int fd, const stats_sample_t *s)
+{
+    char buf[1024];
+    int len = stats_format_json(buf, sizeof(buf), s);
+
+    // a single write keeps lines whole for concurrent readers
+    if (write(fd, buf, len) != len) {
+        LOG_ERROR("write stats: %s", strerror(errno));
+    }
+}
+
+int
+stats_read(const stats_t *stats, stats_sample_t *s)
+{
+    char buf[STATS_BUF_SIZE];
+    struct timespec now;
+
+    memset(s, 0, sizeof(*s));
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    s->ts_ms = (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+
+    // v1 reports throttled_time in ns
+    if (cgroup_reread(stats->fds[STATS_CPU_STAT], buf, sizeof(buf)) != -1) {
+        s->cpu_usec = string_key(buf, "usage_usec");
+        s->cpu_user_usec = string_key(buf, "user_usec");
+        s->cpu_system_usec = string_key(buf, "system_usec");
+        s->nr_throttled = string_key(buf, "nr_throttled");
+        s->throttled_usec = string_key(buf, "throttled_usec") + string_key(buf, "throttled_time") / 1000;
+    }
+
+    if (!stats->cpu_stat_usage &&
+        cgroup_reread(stats->fds[STATS_CPUACCT_USAGE], buf, sizeof(buf)) != -1) {
+        s->cpu_usec = strtoull(buf, NULL, 10) / 1000;
+    }
+
+    if (cgroup_reread(stats->fds[STATS_MEM_CURRENT], buf, sizeof(buf)) != -1 ||
+        cgroup_reread(stats->fds[STATS_MEM_USAGE], buf, sizeof(buf)) != -1) {
+        s->mem = strtoull(buf, NULL, 10);
+    }
+
+    // v1 calls them rss and cache
+    if (cgroup_reread(stats->fds[STATS_MEM_STAT], buf, sizeof(buf)) != -1) {
+        s->mem_anon = string_key(buf, "anon") + string_key(buf, "rss");
+        s->mem_file = string_key(buf, "file") + string_key(buf, "cache");
+    }
+
+    if (cgroup_reread(stats->fds[STATS_IO_STAT], buf, sizeof(buf)) != -1) {
+        stats_parse_io(buf, s);
+    }
+
+    if (cgroup_reread(stats->fds[STATS_CPU_PRESSURE], buf, sizeof(buf)) != -1) {
+        s->psi_cpu_some = stats_psi(buf, "some");
+    }
+
+    if (cgroup_reread(stats->fds[STATS_MEM_PRESSURE], buf, sizeof(buf)) != -1) {
+        s->psi_mem_some = stats_psi(buf, "some");
+        s->psi_mem_full = stats_psi(buf, "full");
+    }
+
+    if (cgroup_reread(stats->fds[STATS_IO_PRESSURE], buf, sizeof(buf)) != -1) {
+        s->psi_io_some = stats_psi(buf, "some");
+        s->psi_io_full = stats_psi(buf, "full");
+    }
+
+    return 0;
+}
+
+int
+stats_sample(stats_t *stats)
+{
+    stats_sample_t *s = &stats->ring[stats->head];
+
+    stats_read(stats, s);
+
+    if (s->mem > stats->peak_mem) stats->peak_mem = s->mem;
+
+    stats->head = (stats->head + 1) % stats->n_ring;
+    stats->n_sample++;
+
+    if (stats->out != -1) {
+        stats_write_json(stats->out, s);
+    }
+
+    if (stats->cb) {
+        stats->cb(stats->cb_data, s);
+    }
+
+    return 0;
+}
+
+static void
+stats_tick(void *data, int fd, uint32_t events)
+{
+    stats_sample(data);
+}
+
+stats_t *
+stats_new(loop_t *loop, const cgroup_t *cg, const stats_config_t *conf)
+{
+    char buf[STATS_BUF_SIZE];
+    stats_t *stats;
+    bool any = false;
+    size_t i, j;
+
+    stats = malloc(sizeof(*stats));
+    ASSERT(stats, "out of mem");
+
+    stats->loop = loop;
+    stats->timer = -1;
+    stats->out = -1;
+    stats->cpu_stat_usage = false;
+    stats->head = 0;
+    stats->n_sample = 0;
+    stats->peak_mem = 0;
+    stats->cb = NULL;
+    stats->cb_data = NULL;
+
+    stats->n_ring = conf->n_sample ? conf->n_sample : STATS_DEFAULT_N_SAMPLE;
+    stats->ring = calloc(stats->n_ring, sizeof(*stats->ring));
+    ASSERT(stats->ring, "out of mem");
+
+    // on v1 each file lives in the hierarchy of its controller
+    for (i = 0; i < STATS_N_FILE; i++) {
+        stats->fds[i] = -1;
+
+        for (j = 0; j < cg->n_dir && stats->fds[i] == -1; j++) {
+            if (cg->dirs[j].fd != -1) {
+                stats->fds[i] = openat(cg->dirs[j].fd, stats_file_name[i], O_RDONLY | O_CLOEXEC);
+            }
+        }
+
+        any = any || stats->fds[i] != -1;
+    }
+
+    if (!any) {
+        LOG_ERROR("no cgroup stat files to sample");
+        goto ERROR;
+    }
+
+    if (cgroup_reread(stats->fds[STATS_CPU_STAT], buf, sizeof(buf)) != -1) {
+        stats->cpu_stat_usage = strstr(buf, "usage_usec ") != NULL;
+    }
+
+    if (conf->out) {
+        stats->out = open(conf->out, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+        if (stats->out == -1) {
+            LOG_ERROR("open stats output: %s", strerror(errno));
+            goto ERROR;
+        }
+    }
+
+    stats->timer = loop_add_timer(loop, conf->interval_ms ? conf->interval_ms : STATS_DEFAULT_INTERVAL,
+                                  stats_tick, stats);
+
+    if (stats->timer == -1) goto ERROR;
+
+    return stats;
+
+ERROR:
+    stats_free(stats);
+    return NULL;
+}
+
+void
+stats_free(stats_t *stats)
+{
+    const stats_sample_t *last;
+    size_t i;
+
+    if (stats) {
+        last = stats_last(stats);
+
+        if (last) {
+            LOG("stats: %zu samples, cpu %" PRIu64 " usec, peak memory %" PRIu64 " bytes",
+                stats->n_sample, last->cpu_usec, stats->peak_mem);
+        }
+
+        if (stats->timer != -1) loop_del_timer(stats->loop, stats->timer);
+        if (stats->out != -1) close(stats->out);
+
+        for (i = 0; i < STATS_N_FILE; i++) {
+            if (stats->fds[i] != -1) close(stats->fds[i]);
+        }
+
+        free(stats->ring);
+        free(stats);
+    }
+}
+
+void
+stats_set_cb(stats_t *stats, stats_cb_t cb, void *data)
+{
+    stats->cb = cb;
+    stats->cb_data = data;
+}
+
+bool
+stats_has_cpu(const stats_t *stats)
+{
+    return stats->cpu_stat_usage || stats->fds[STATS_CPUACCT_USAGE] != -1;
+}
+
+const stats_sample_t *
+stats_last(const stats_t *stats)
+{
+    if (!stats->n_sample) return NULL;
+
+    return &stats->ring[(stats->head + stats->n_ring - 1) % stats->n_ring];
+}
+
+int
+stats_dump(const stats_t *stats, FILE *out)
+{
+    size_t n = stats->n_sample < stats->n_ring ? stats->n_sample : stats->n_ring;
+    char buf[1024];
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        stats_format_json(buf, sizeof(buf), &stats->ring[(stats->head + stats->n_ring - n + i) % stats->n_ring]);
+
+        if (fputs(buf, out) == EOF) return -1;
+    }
+
+    return 0;
+}
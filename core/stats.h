@@ -0,0 +1,125 @@
+#ifndef _CORE_STATS_H_
+#define _CORE_STATS_H_
+
+#include "pub/type.h"
+
+#include "loop.h"
+#include "cgroup.h"
+
+/*
+
+resource usage sampler run on the supervisor loop
+
+every stat file of the container cgroup is opened once and
+re-read with pread on each tick, samples go to a fixed ring
+and optionally to a file as json lines
+
+*/
+
+#define STATS_DEFAULT_INTERVAL 1000 // ms
+#define STATS_DEFAULT_N_SAMPLE 300
+
+typedef struct {
+    unsigned interval_ms; // 0 for the default
+    size_t n_sample; // ring size, 0 for the default
+    char *out; // json lines appended here, NULL to keep the ring only
+} stats_config_t;
+
+// counters are cumulative, as reported by the kernel
+typedef struct {
+    uint64_t ts_ms; // wall clock
+
+    uint64_t cpu_usec;
+    uint64_t cpu_user_usec;
+    uint64_t cpu_system_usec;
+    uint64_t nr_throttled;
+    uint64_t throttled_usec;
+
+    uint64_t mem; // bytes in use
+    uint64_t mem_anon;
+    uint64_t mem_file;
+
+    uint64_t io_rbytes;
+    uint64_t io_wbytes;
+    uint64_t io_rios;
+    uint64_t io_wios;
+
+    // stall time in usec
+    uint64_t psi_cpu_some;
+    uint64_t psi_mem_some;
+    uint64_t psi_mem_full;
+    uint64_t psi_io_some;
+    uint64_t psi_io_full;
+} stats_sample_t;
+
+typedef void (*stats_cb_t)(void *data, const stats_sample_t *sample);
+
+typedef enum {
+    STATS_CPU_STAT,
+    STATS_CPUACCT_USAGE, // v1
+    STATS_MEM_CURRENT,
+    STATS_MEM_USAGE, // v1
+    STATS_MEM_STAT,
+    STATS_IO_STAT,
+    STATS_CPU_PRESSURE,
+    STATS_MEM_PRESSURE,
+    STATS_IO_PRESSURE,
+    STATS_N_FILE
+} stats_file_t;
+
+typedef struct {
+    loop_t *loop;
+    int timer;
+    int fds[STATS_N_FILE]; // -1 if the host does not provide it
+    int out;
+    bool cpu_stat_usage; // cpu.stat has usage_usec, v1 keeps it in cpuacct.usage
+
+    stats_sample_t *ring;
+    size_t n_ring;
+    size_t head; // next slot to write
+    size_t n_sample; // total taken
+
+    uint64_t peak_mem;
+
+    // called after each sample
+    stats_cb_t cb;
+    void *cb_data;
+} stats_t;
+
+stats_config_t *
+stats_config_copy(const stats_config_t *conf);
+
+void
+stats_config_free(stats_config_t *conf);
+
+// cg has to be created already
+stats_t *
+stats_new(loop_t *loop, const cgroup_t *cg, const stats_config_t *conf);
+
+void
+stats_free(stats_t *stats);
+
+void
+stats_set_cb(stats_t *stats, stats_cb_t cb, void *data);
+
+// take a sample now, also done on every tick
+int
+stats_sample(stats_t *stats);
+
+// current counters, leaving the ring, the output and the callback alone
+int
+stats_read(const stats_t *stats, stats_sample_t *sample);
+
+// whether cpu_usec of the samples is measured or always 0
+bool
+stats_has_cpu(const stats_t *stats);
+
+// most recent sample, NULL if none yet
+const stats_sample_t *
+stats_last(const stats_t *stats);
+
+// write the ring, oldest first, as json lines
+int
+stats_dump(const stats_t *stats, FILE *out);
+
+#endif
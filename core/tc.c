@@ -0,0 +1,602 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/param.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+#include <linux/pkt_sched.h>
+#include <linux/pkt_cls.h>
+#include <linux/gen_stats.h>
+#include <linux/tc_act/tc_mirred.h>
+
+#include "pub/type.h"
+#include "pub/fd.h"
+
+#include "netlink.h"
+#include "bridge.h"
+#include "tc.h"
+
+#define TC_IFB_PREFIX "difb"
+
+#define TC_ROOT_HANDLE TC_H_MAKE(1 << 16, 0) // 1:
+#define TC_TBF_CLASS TC_H_MAKE(1 << 16, 1) // 1:1
+#define TC_FQ_HANDLE TC_H_MAKE(10 << 16, 0) // 10:
+
+#define TC_MIN_BURST (16 * 1024)
+#define TC_MIN_LIMIT (64 * 1024)
+#define TC_MIN_PKT_BURST 16
+
+tc_config_t *
+tc_config_copy(const tc_config_t *conf)
+{
+    tc_config_t *copy;
+
+    if (!conf) return NULL;
+
+    copy = malloc(sizeof(*copy));
+    ASSERT(copy, "out of mem");
+
+    *copy = *conf;
+
+    return copy;
+}
+
+void
+tc_config_free(tc_config_t *conf)
+{
+    free(conf);
+}
+
+static bool
+tc_limit_shapes(const tc_limit_t *limit)
+{
+    return limit->rate || limit->flow_rate;
+}
+
+static bool
+tc_limit_any(const tc_limit_t *limit)
+{
+    return tc_limit_shapes(limit) || limit->pps;
+}
+
+static struct tcmsg *
+tc_msg_init(nl_msg_t *msg, uint16_t type, uint16_t flags,
+            int ifindex, uint32_t parent, uint32_t handle)
+{
+    struct tcmsg *tcm = nl_msg_init(msg, type, flags, sizeof(*tcm));
+
+    tcm->tcm_family = AF_UNSPEC;
+    tcm->tcm_ifindex = ifindex;
+    tcm->tcm_parent = parent;
+    tcm->tcm_handle = handle;
+
+    return tcm;
+}
+
+static int
+tc_del_qdisc(int nl, int ifindex, uint32_t parent)
+{
+    nl_msg_t msg;
+    int ret;
+
+    tc_msg_init(&msg, RTM_DELQDISC, 0, ifindex, parent, 0);
+
+    ret = nl_talk(nl, &msg);
+
+    // nothing installed there
+    if (ret == -ENOENT || ret == -EINVAL) return 0;
+
+    return ret;
+}
+
+typedef struct {
+    int ifindex;
+    char kind[IFNAMSIZ];
+} tc_kind_req_t;
+
+static int
+tc_kind_cb(struct nlmsghdr *hdr, void *data)
+{
+    tc_kind_req_t *req = data;
+    struct tcmsg *tcm = NLMSG_DATA(hdr);
+    struct rtattr *tb[TCA_MAX + 1];
+
+    if (hdr->nlmsg_type != RTM_NEWQDISC || tcm->tcm_ifindex != req->ifindex ||
+        tcm->tcm_parent != TC_H_ROOT || tcm->tcm_handle != TC_ROOT_HANDLE) {
+        return 0;
+    }
+
+    nl_parse(tb, TCA_MAX, TCA_RTA(tcm), TCA_PAYLOAD(hdr));
+
+    if (tb[TCA_KIND]) {
+        snprintf(req->kind, sizeof(req->kind), "%s", (char *)RTA_DATA(tb[TCA_KIND]));
+    }
+
+    return 0;
+}
+
+// a replace cannot change the kind of a qdisc, the old one goes first
+static int
+tc_make_room(int nl, int ifindex, const char *kind)
+{
+    tc_kind_req_t req = { .ifindex = ifindex };
+    nl_msg_t msg;
+
+    tc_msg_init(&msg, RTM_GETQDISC, 0, ifindex, 0, 0);
+
+    if (nl_dump(nl, &msg, tc_kind_cb, &req)) return -EIO;
+
+    if (!*req.kind || !strcmp(req.kind, kind)) return 0;
+
+    return tc_del_qdisc(nl, ifindex, TC_H_ROOT);
+}
+
+static int
+tc_add_fq(int nl, int ifindex, uint32_t parent, uint32_t handle, uint64_t flow_rate)
+{
+    struct rtattr *opt;
+    nl_msg_t msg;
+
+    tc_msg_init(&msg, RTM_NEWQDISC, NLM_F_CREATE | NLM_F_REPLACE, ifindex, parent, handle);
+
+    nl_put_str(&msg, TCA_KIND, "fq");
+    opt = nl_nest_start(&msg, TCA_OPTIONS);
+
+    if (flow_rate) {
+        nl_put_u32(&msg, TCA_FQ_FLOW_MAX_RATE, flow_rate > UINT32_MAX ? UINT32_MAX : flow_rate);
+    }
+
+    nl_nest_end(&msg, opt);
+
+    return nl_talk(nl, &msg);
+}
+
+static int
+tc_add_tbf(int nl, int ifindex, uint64_t rate)
+{
+    struct tc_tbf_qopt qopt;
+    struct rtattr *opt;
+    nl_msg_t msg;
+    uint64_t burst = rate / 100; // 10ms worth of traffic
+    uint64_t limit = rate / 20; // at most 50ms of queueing
+
+    if (burst < TC_MIN_BURST) burst = TC_MIN_BURST;
+    if (limit < TC_MIN_LIMIT) limit = TC_MIN_LIMIT;
+
+    memset(&qopt, 0, sizeof(qopt));
+    qopt.rate.rate = rate > UINT32_MAX ? UINT32_MAX : rate;
+    qopt.rate.linklayer = TC_LINKLAYER_ETHERNET;
+    qopt.limit = limit > UINT32_MAX ? UINT32_MAX : limit;
+
+    tc_msg_init(&msg, RTM_NEWQDISC, NLM_F_CREATE | NLM_F_REPLACE,
+                ifindex, TC_H_ROOT, TC_ROOT_HANDLE);
+
+    nl_put_str(&msg, TCA_KIND, "tbf");
+    opt = nl_nest_start(&msg, TCA_OPTIONS);
+    nl_put(&msg, TCA_TBF_PARMS, &qopt, sizeof(qopt));
+    nl_put_u64(&msg, TCA_TBF_RATE64, rate);
+    nl_put_u32(&msg, TCA_TBF_BURST, burst > UINT32_MAX ? UINT32_MAX : burst);
+    nl_nest_end(&msg, opt);
+
+    return nl_talk(nl, &msg);
+}
+
+// shape everything leaving ifindex
+static int
+tc_shape_dev(int nl, int ifindex, const tc_limit_t *limit)
+{
+    int ret;
+
+    if (limit->rate) {
+        if ((ret = tc_make_room(nl, ifindex, "tbf"))) return ret;
+
+        // tbf caps the aggregate, fq underneath keeps flows fair and paced
+        if ((ret = tc_add_tbf(nl, ifindex, limit->rate))) return ret;
+
+        ret = tc_add_fq(nl, ifindex, TC_TBF_CLASS, TC_FQ_HANDLE, limit->flow_rate);
+
+        // kernel without sch_fq, tbf keeps its own fifo
+        if (ret == -ENOENT && !limit->flow_rate) {
+            LOG_WARN("fq is not available, shaping with tbf only");
+            return 0;
+        }
+
+        return ret;
+    }
+
+    if (limit->flow_rate) {
+        if ((ret = tc_make_room(nl, ifindex, "fq"))) return ret;
+
+        return tc_add_fq(nl, ifindex, TC_H_ROOT, TC_ROOT_HANDLE, limit->flow_rate);
+    }
+
+    return tc_del_qdisc(nl, ifindex, TC_H_ROOT);
+}
+
+static void
+tc_put_police(nl_msg_t *msg, int order, uint64_t pps)
+{
+    struct tc_police parm;
+    struct rtattr *act, *opt;
+    uint64_t burst = pps / 100;
+
+    if (burst < TC_MIN_PKT_BURST) burst = TC_MIN_PKT_BURST;
+
+    memset(&parm, 0, sizeof(parm));
+    parm.action = TC_ACT_SHOT; // exceeding packets are dropped
+
+    act = nl_nest_start(msg, order);
+    nl_put_str(msg, TCA_ACT_KIND, "police");
+    opt = nl_nest_start(msg, TCA_ACT_OPTIONS);
+    nl_put(msg, TCA_POLICE_TBF, &parm, sizeof(parm));
+    nl_put_u64(msg, TCA_POLICE_PKTRATE64, pps);
+    nl_put_u64(msg, TCA_POLICE_PKTBURST64, burst);
+    nl_put_u32(msg, TCA_POLICE_RESULT, TC_ACT_PIPE); // go on to the next action
+    nl_nest_end(msg, opt);
+    nl_nest_end(msg, act);
+}
+
+static void
+tc_put_redirect(nl_msg_t *msg, int order, int ifindex)
+{
+    struct tc_mirred parm;
+    struct rtattr *act, *opt;
+
+    memset(&parm, 0, sizeof(parm));
+    parm.action = TC_ACT_STOLEN;
+    parm.eaction = TCA_EGRESS_REDIR;
+    parm.ifindex = ifindex;
+
+    act = nl_nest_start(msg, order);
+    nl_put_str(msg, TCA_ACT_KIND, "mirred");
+    opt = nl_nest_start(msg, TCA_ACT_OPTIONS);
+    nl_put(msg, TCA_MIRRED_PARMS, &parm, sizeof(parm));
+    nl_nest_end(msg, opt);
+    nl_nest_end(msg, act);
+}
+
+// matchall filter on a clsact hook, optionally policing and redirecting
+static int
+tc_add_hook(int nl, int ifindex, uint32_t hook, uint64_t pps, int redirect)
+{
+    struct rtattr *opt, *acts;
+    struct tcmsg *tcm;
+    nl_msg_t msg;
+    int order = 1;
+
+    tcm = tc_msg_init(&msg, RTM_NEWTFILTER, NLM_F_CREATE | NLM_F_EXCL,
+                      ifindex, TC_H_MAKE(TC_H_CLSACT, hook), 0);
+    tcm->tcm_info = TC_H_MAKE(1 << 16, htons(ETH_P_ALL));
+
+    nl_put_str(&msg, TCA_KIND, "matchall");
+    opt = nl_nest_start(&msg, TCA_OPTIONS);
+    acts = nl_nest_start(&msg, TCA_MATCHALL_ACT);
+
+    if (pps) tc_put_police(&msg, order++, pps);
+    if (redirect) tc_put_redirect(&msg, order++, redirect);
+
+    nl_nest_end(&msg, acts);
+    nl_nest_end(&msg, opt);
+
+    return nl_talk(nl, &msg);
+}
+
+static int
+tc_ifb_set_up(int nl, const char *name)
+{
+    struct ifinfomsg *ifi;
+    struct rtattr *info;
+    nl_msg_t msg;
+    int ifindex = if_nametoindex(name);
+    int ret;
+
+    if (!ifindex) {
+        nl_msg_init(&msg, RTM_NEWLINK, NLM_F_CREATE | NLM_F_EXCL, sizeof(*ifi));
+        nl_put_str(&msg, IFLA_IFNAME, name);
+        info = nl_nest_start(&msg, IFLA_LINKINFO);
+        nl_put_str(&msg, IFLA_INFO_KIND, "ifb");
+        nl_nest_end(&msg, info);
+
+        if ((ret = nl_talk(nl, &msg))) {
+            errno = -ret;
+            LOG_ERROR("create ifb: %s", strerror(errno));
+            return -1;
+        }
+
+        ifindex = if_nametoindex(name);
+    }
+
+    ifi = nl_msg_init(&msg, RTM_NEWLINK, 0, sizeof(*ifi));
+    ifi->ifi_index = ifindex;
+    ifi->ifi_flags = IFF_UP;
+    ifi->ifi_change = IFF_UP;
+
+    if ((ret = nl_talk(nl, &msg))) {
+        errno = -ret;
+        LOG_ERROR("start ifb: %s", strerror(errno));
+        return -1;
+    }
+
+    return ifindex;
+}
+
+static int
+tc_del_link(int nl, const char *name)
+{
+    struct ifinfomsg *ifi;
+    nl_msg_t msg;
+    int ifindex = if_nametoindex(name);
+
+    if (!ifindex) return 0;
+
+    ifi = nl_msg_init(&msg, RTM_DELLINK, 0, sizeof(*ifi));
+    ifi->ifi_index = ifindex;
+
+    return nl_talk(nl, &msg);
+}
+
+static int
+tc_apply(int nl, const tc_config_t *conf, const char *id)
+{
+    char veth[IF_NAMESIZE], ifb[IF_NAMESIZE];
+    int veth_idx, ifb_idx = 0;
+    nl_msg_t msg;
+    int ret;
+
+    snprintf(veth, sizeof(veth), BRIDGE_VETH_PREFIX "%s", id);
+    snprintf(ifb, sizeof(ifb), TC_IFB_PREFIX "%s", id);
+
+    veth_idx = if_nametoindex(veth);
+
+    if (!veth_idx) {
+        LOG_ERROR("find veth: %s", strerror(errno));
+        return -1;
+    }
+
+#define TRY(action, expr) \
+    do { \
+        if ((ret = (expr))) { \
+            errno = ret < 0 ? -ret : EIO; \
+            LOG_ERROR("failed to " action ": %s", strerror(errno)); \
+            return -1; \
+        } \
+    } while (0)
+
+    // dropping clsact drops its filters, they are rebuilt below
+    TRY("remove clsact", tc_del_qdisc(nl, veth_idx, TC_H_CLSACT));
+    TRY("shape rx", tc_shape_dev(nl, veth_idx, &conf->rx));
+
+    // what the container sends enters the veth, shaped on the ifb
+    if (tc_limit_shapes(&conf->tx)) {
+        ifb_idx = tc_ifb_set_up(nl, ifb);
+        if (ifb_idx == -1) return -1;
+
+        TRY("shape tx", tc_shape_dev(nl, ifb_idx, &conf->tx));
+    } else {
+        TRY("remove ifb", tc_del_link(nl, ifb));
+    }
+
+    if (conf->rx.pps || tc_limit_any(&conf->tx)) {
+        tc_msg_init(&msg, RTM_NEWQDISC, NLM_F_CREATE | NLM_F_EXCL,
+                    veth_idx, TC_H_CLSACT, TC_H_MAKE(TC_H_CLSACT, 0));
+        nl_put_str(&msg, TCA_KIND, "clsact");
+
+        TRY("add clsact", nl_talk(nl, &msg));
+    }
+
+    if (conf->rx.pps) {
+        TRY("police rx", tc_add_hook(nl, veth_idx, TC_H_MIN_EGRESS, conf->rx.pps, 0));
+    }
+
+    if (tc_limit_any(&conf->tx)) {
+        TRY("redirect tx", tc_add_hook(nl, veth_idx, TC_H_MIN_INGRESS,
+                                       conf->tx.pps, ifb_idx));
+    }
+
+#undef TRY
+
+    return 0;
+}
+
+int
+tc_set_up(const tc_config_t *conf, const char *id)
+{
+    int nl, ret;
+
+    if (!conf) return 0;
+
+    nl = nl_open();
+    if (nl == -1) return -1;
+
+    LOG("shaping %s: rx %llu B/s, %llu pps; tx %llu B/s, %llu pps",
+        id,
+        (unsigned long long)conf->rx.rate, (unsigned long long)conf->rx.pps,
+        (unsigned long long)conf->tx.rate, (unsigned long long)conf->tx.pps);
+
+    ret = tc_apply(nl, conf, id);
+
+    close(nl);
+
+    return ret;
+}
+
+typedef struct {
+    int ifindex;
+    tc_stat_t *stat;
+} tc_stat_req_t;
+
+static int
+tc_stat_cb(struct nlmsghdr *hdr, void *data)
+{
+    tc_stat_req_t *req = data;
+    struct tcmsg *tcm = NLMSG_DATA(hdr);
+    struct rtattr *tb[TCA_MAX + 1], *st[TCA_STATS_MAX + 1];
+    struct gnet_stats_basic basic;
+    struct gnet_stats_queue queue;
+
+    if (hdr->nlmsg_type != RTM_NEWQDISC ||
+        tcm->tcm_ifindex != req->ifindex || tcm->tcm_parent != TC_H_ROOT) {
+        return 0;
+    }
+
+    nl_parse(tb, TCA_MAX, TCA_RTA(tcm), TCA_PAYLOAD(hdr));
+
+    if (!tb[TCA_STATS2]) return 0;
+
+    nl_parse(st, TCA_STATS_MAX, RTA_DATA(tb[TCA_STATS2]), RTA_PAYLOAD(tb[TCA_STATS2]));
+
+    if (st[TCA_STATS_BASIC]) {
+        memset(&basic, 0, sizeof(basic));
+        memcpy(&basic, RTA_DATA(st[TCA_STATS_BASIC]),
+               MIN(sizeof(basic), RTA_PAYLOAD(st[TCA_STATS_BASIC])));
+
+        req->stat->bytes = basic.bytes;
+        req->stat->packets = basic.packets;
+    }
+
+    if (st[TCA_STATS_QUEUE]) {
+        memset(&queue, 0, sizeof(queue));
+        memcpy(&queue, RTA_DATA(st[TCA_STATS_QUEUE]),
+               MIN(sizeof(queue), RTA_PAYLOAD(st[TCA_STATS_QUEUE])));
+
+        req->stat->drops = queue.drops;
+        req->stat->overlimits = queue.overlimits;
+        req->stat->backlog = queue.backlog;
+        req->stat->qlen = queue.qlen;
+    }
+
+    return 0;
+}
+
+static int
+tc_dev_stats(int nl, int ifindex, tc_stat_t *stat)
+{
+    tc_stat_req_t req = { .ifindex = ifindex, .stat = stat };
+    nl_msg_t msg;
+
+    // no ifb means tx is not shaped
+    if (!req.ifindex) return 0;
+
+    tc_msg_init(&msg, RTM_GETQDISC, 0, req.ifindex, 0, 0);
+
+    return nl_dump(nl, &msg, tc_stat_cb, &req) ? -1 : 0;
+}
+
+// police drops never reach a qdisc, they are counted on the action
+static int
+tc_police_cb(struct nlmsghdr *hdr, void *data)
+{
+    tc_stat_req_t *req = data;
+    struct tcmsg *tcm = NLMSG_DATA(hdr);
+    struct rtattr *tb[TCA_MAX + 1], *opt[TCA_MATCHALL_MAX + 1];
+    struct rtattr *acts[TCA_ACT_MAX_PRIO + 1], *act[TCA_ACT_MAX + 1], *st[TCA_STATS_MAX + 1];
+    struct gnet_stats_queue queue;
+    int i;
+
+    if (hdr->nlmsg_type != RTM_NEWTFILTER || tcm->tcm_ifindex != req->ifindex) {
+        return 0;
+    }
+
+    nl_parse(tb, TCA_MAX, TCA_RTA(tcm), TCA_PAYLOAD(hdr));
+
+    // the head of each filter chain comes without options
+    if (!tb[TCA_KIND] || strcmp(RTA_DATA(tb[TCA_KIND]), "matchall") || !tb[TCA_OPTIONS]) {
+        return 0;
+    }
+
+    nl_parse(opt, TCA_MATCHALL_MAX, RTA_DATA(tb[TCA_OPTIONS]), RTA_PAYLOAD(tb[TCA_OPTIONS]));
+
+    if (!opt[TCA_MATCHALL_ACT]) return 0;
+
+    nl_parse(acts, TCA_ACT_MAX_PRIO, RTA_DATA(opt[TCA_MATCHALL_ACT]), RTA_PAYLOAD(opt[TCA_MATCHALL_ACT]));
+
+    for (i = 1; i <= TCA_ACT_MAX_PRIO; i++) {
+        if (!acts[i]) continue;
+
+        nl_parse(act, TCA_ACT_MAX, RTA_DATA(acts[i]), RTA_PAYLOAD(acts[i]));
+
+        if (!act[TCA_ACT_KIND] || strcmp(RTA_DATA(act[TCA_ACT_KIND]), "police") || !act[TCA_ACT_STATS]) {
+            continue;
+        }
+
+        nl_parse(st, TCA_STATS_MAX, RTA_DATA(act[TCA_ACT_STATS]), RTA_PAYLOAD(act[TCA_ACT_STATS]));
+
+        if (st[TCA_STATS_QUEUE]) {
+            memset(&queue, 0, sizeof(queue));
+            memcpy(&queue, RTA_DATA(st[TCA_STATS_QUEUE]),
+                   MIN(sizeof(queue), RTA_PAYLOAD(st[TCA_STATS_QUEUE])));
+
+            req->stat->policed += queue.drops;
+        }
+    }
+
+    return 0;
+}
+
+static int
+tc_police_stats(int nl, int ifindex, uint32_t hook, tc_stat_t *stat)
+{
+    tc_stat_req_t req = { .ifindex = ifindex, .stat = stat };
+    nl_msg_t msg;
+
+    // no clsact on the veth makes an empty dump
+    tc_msg_init(&msg, RTM_GETTFILTER, 0, ifindex, TC_H_MAKE(TC_H_CLSACT, hook), 0);
+
+    return nl_dump(nl, &msg, tc_police_cb, &req) ? -1 : 0;
+}
+
+int
+tc_stats(const char *id, tc_stat_t *rx, tc_stat_t *tx)
+{
+    char veth[IF_NAMESIZE], ifb[IF_NAMESIZE];
+    int veth_idx, nl, ret = 0;
+
+    snprintf(veth, sizeof(veth), BRIDGE_VETH_PREFIX "%s", id);
+    snprintf(ifb, sizeof(ifb), TC_IFB_PREFIX "%s", id);
+
+    veth_idx = if_nametoindex(veth);
+
+    // gone with the network namespace, once init has exited
+    if (!veth_idx) {
+        LOG_ERROR("no veth %s", veth);
+        return -1;
+    }
+
+    nl = nl_open();
+    if (nl == -1) return -1;
+
+    memset(rx, 0, sizeof(*rx));
+    memset(tx, 0, sizeof(*tx));
+
+    if (tc_dev_stats(nl, veth_idx, rx) || tc_dev_stats(nl, if_nametoindex(ifb), tx) ||
+        tc_police_stats(nl, veth_idx, TC_H_MIN_EGRESS, rx) ||
+        tc_police_stats(nl, veth_idx, TC_H_MIN_INGRESS, tx)) {
+        LOG_ERROR("failed to read shaping stats");
+        ret = -1;
+    }
+
+    close(nl);
+
+    return ret;
+}
+
+int
+tc_clean(const char *id)
+{
+    char ifb[IF_NAMESIZE];
+    int nl, ret;
+
+    snprintf(ifb, sizeof(ifb), TC_IFB_PREFIX "%s", id);
+
+    // qdiscs on the veth go away with it, only the ifb is ours
+    if (!if_nametoindex(ifb)) return 0;
+
+    nl = nl_open();
+    if (nl == -1) return -1;
+
+    ret = tc_del_link(nl, ifb);
+
+    close(nl);
+
+    return ret ? -1 : 0;
+}
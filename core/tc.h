@@ -0,0 +1,63 @@
+#ifndef _CORE_TC_H_
+#define _CORE_TC_H_
+
+#include "pub/type.h"
+#include "pub/clone.h"
+
+/*
+
+bandwidth shaping on the host-side veth, installed over netlink
+
+directions are those of the container:
+    rx is traffic the container receives, shaped on the
+    egress of the veth by fq (per-flow pacing) under an optional tbf
+    tx is traffic the container sends, redirected from the
+    ingress of the veth to an ifb device and shaped there the same way
+
+packet rate limits use a police action on the clsact hooks,
+its drops are reported apart from those of the qdiscs
+
+id is the suffix of the device names, see bridge_set_up
+
+*/
+
+typedef struct {
+    uint64_t rate; // aggregate bytes/s, 0 for unlimited
+    uint64_t flow_rate; // per-flow pacing in bytes/s (fq maxrate), 0 for unlimited
+    uint64_t pps; // packets/s, 0 for unlimited
+} tc_limit_t;
+
+typedef struct {
+    tc_limit_t rx;
+    tc_limit_t tx;
+} tc_config_t;
+
+typedef struct {
+    uint64_t bytes;
+    uint64_t packets;
+    uint32_t drops;
+    uint32_t overlimits;
+    uint32_t backlog; // bytes queued right now
+    uint32_t qlen; // packets queued right now
+    uint32_t policed; // packets dropped over the pps limit
+} tc_stat_t;
+
+tc_config_t *
+tc_config_copy(const tc_config_t *conf);
+
+void
+tc_config_free(tc_config_t *conf);
+
+// install or replace the limits, can be called again on a running container
+int
+tc_set_up(const tc_config_t *conf, const char *id);
+
+// statistics of the root qdiscs and police actions of each direction, while
+// the container runs: the veth goes with its network namespace
+int
+tc_stats(const char *id, tc_stat_t *rx, tc_stat_t *tx);
+
+int
+tc_clean(const char *id);
+
+#endif
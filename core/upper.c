@@ -0,0 +1,518 @@
+#include <errno.h>
+#include <time.h>
+#include <inttypes.h>
+#include <dirent.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sys/xattr.h>
+
+#include "pub/type.h"
+#include "pub/fd.h"
+#include "pub/limit.h"
+
+#include "upper.h"
+
+#define UPPER_ORIGIN "trusted.overlay.origin"
+#define UPPER_METACOPY "trusted.overlay.metacopy"
+#define UPPER_OPAQUE "trusted.overlay.opaque"
+
+upper_config_t *
+upper_config_copy(const upper_config_t *conf)
+{
+    upper_config_t *copy;
+
+    if (!conf) return NULL;
+
+    copy = malloc(sizeof(*copy));
+    ASSERT(copy, "out of mem");
+
+    *copy = *conf;
+
+    return copy;
+}
+
+void
+upper_config_free(upper_config_t *conf)
+{
+    free(conf);
+}
+
+static uint64_t
+upper_now_ms()
+{
+    struct timespec now;
+
+    // same clock as the stats samples
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static uint64_t
+upper_now_usec()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void
+upper_stat_clear(upper_stat_t *st)
+{
+    size_t i;
+
+    for (i = 0; i < st->n_largest; i++) {
+        free(st->largest[i].path);
+    }
+
+    free(st->largest);
+    memset(st, 0, sizeof(*st));
+}
+
+// keeps the max biggest, sorted
+static void
+upper_add_largest(upper_stat_t *st, size_t max, const char *path, uint64_t bytes)
+{
+    size_t i;
+
+    if (st->n_largest == max && (!max || st->largest[max - 1].bytes >= bytes)) return;
+
+    if (st->n_largest < max) st->n_largest++;
+    else free(st->largest[max - 1].path);
+
+    for (i = st->n_largest - 1; i > 0 && st->largest[i - 1].bytes < bytes; i--) {
+        st->largest[i] = st->largest[i - 1];
+    }
+
+    st->largest[i].path = strdup(path);
+    st->largest[i].bytes = bytes;
+}
+
+static bool
+upper_has_xattr(const char *path, const char *name)
+{
+    return lgetxattr(path, name, NULL, 0) >= 0;
+}
+
+// path is absolute with room for PATH_MAX, len is where the dir ends in it
+static int
+upper_walk(upper_t *up, upper_stat_t *st, char *path, size_t len)
+{
+    struct dirent *ent;
+    struct stat sb;
+    uint64_t bytes;
+    char opaque;
+    DIR *dir;
+    int n;
+
+    if (!(dir = opendir(path))) return -1;
+
+    while ((ent = readdir(dir))) {
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) continue;
+
+        n = snprintf(path + len, PATH_MAX - len, "/%s", ent->d_name);
+
+        // the container keeps writing while it is walked
+        if (len + n >= PATH_MAX || lstat(path, &sb)) continue;
+
+        bytes = (uint64_t)sb.st_blocks * 512;
+        st->bytes += bytes;
+
+        if (S_ISDIR(sb.st_mode)) {
+            st->n_dir++;
+
+            if (lgetxattr(path, UPPER_OPAQUE, &opaque, 1) == 1 && opaque == 'y') {
+                st->n_opaque++;
+            }
+
+            upper_walk(up, st, path, len + n);
+        } else if (S_ISCHR(sb.st_mode) && sb.st_rdev == 0) {
+            st->n_whiteout++;
+        } else {
+            st->n_file++;
+
+            if (upper_has_xattr(path, UPPER_ORIGIN)) {
+                st->n_copied_up++;
+                st->copied_up_bytes += bytes;
+
+                if (upper_has_xattr(path, UPPER_METACOPY)) st->n_meta_only++;
+
+                // as seen from inside the container
+                upper_add_largest(st, up->conf.n_largest, path + strlen(up->dir), bytes);
+            }
+        }
+    }
+
+    path[len] = '\0';
+    closedir(dir);
+
+    return 0;
+}
+
+static void
+upper_json_string(FILE *fp, const char *s)
+{
+    fputc('"', fp);
+
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') fprintf(fp, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20) fprintf(fp, "\\u%04x", *s);
+        else fputc(*s, fp);
+    }
+
+    fputc('"', fp);
+}
+
+static void
+upper_write_json(int fd, const upper_stat_t *st)
+{
+    char *buf = NULL;
+    size_t len = 0, i;
+    FILE *fp = open_memstream(&buf, &len);
+
+    ASSERT(fp, "out of mem");
+
+    fprintf(fp,
+        "{\"ts\":%" PRIu64 ",\"event\":\"upper\",\"scan_usec\":%" PRIu64 ","
+        "\"bytes\":%" PRIu64 ",\"files\":%" PRIu64 ",\"dirs\":%" PRIu64 ","
+        "\"whiteouts\":%" PRIu64 ",\"opaque_dirs\":%" PRIu64 ","
+        "\"copied_up\":%" PRIu64 ",\"copied_up_bytes\":%" PRIu64 ",\"meta_only\":%" PRIu64 ","
+        "\"largest\":[",
+        st->ts_ms, st->scan_usec,
+        st->bytes, st->n_file, st->n_dir,
+        st->n_whiteout, st->n_opaque,
+        st->n_copied_up, st->copied_up_bytes, st->n_meta_only);
+
+    for (i = 0; i < st->n_largest; i++) {
+        fprintf(fp, "%s{\"path\":", i ? "," : "");
+        upper_json_string(fp, st->largest[i].path);
+        fprintf(fp, ",\"bytes\":%" PRIu64 "}", st->largest[i].bytes);
+    }
+
+    fprintf(fp, "]}\n");
+    fclose(fp);
+
+    // a single write keeps lines whole for concurrent readers
+    if (write(fd, buf, len) != (ssize_t)len) {
+        LOG_ERROR("write upper stats: %s", strerror(errno));
+    }
+
+    free(buf);
+}
+
+static int
+upper_collect(upper_t *up, upper_stat_t *st)
+{
+    char path[PATH_MAX];
+    uint64_t start = upper_now_usec();
+
+    memset(st, 0, sizeof(*st));
+
+    if (up->conf.n_largest) {
+        st->largest = calloc(up->conf.n_largest, sizeof(*st->largest));
+        ASSERT(st->largest, "out of mem");
+    }
+
+    snprintf(path, sizeof(path), "%s", up->dir);
+
+    if (upper_walk(up, st, path, strlen(path))) {
+        LOG_ERROR("walk upper dir: %s", strerror(errno));
+        return -1;
+    }
+
+    st->ts_ms = upper_now_ms();
+    st->scan_usec = upper_now_usec() - start;
+
+    return 0;
+}
+
+// in the helper: the counters as they are, then bytes, length and path of each largest
+static int
+upper_send(int fd, const upper_stat_t *st)
+{
+    char *buf = NULL;
+    size_t len = 0, off, n, i;
+    FILE *fp = open_memstream(&buf, &len);
+    ssize_t ret = 0;
+
+    ASSERT(fp, "out of mem");
+
+    fwrite(st, sizeof(*st), 1, fp);
+
+    for (i = 0; i < st->n_largest; i++) {
+        n = strlen(st->largest[i].path);
+
+        fwrite(&st->largest[i].bytes, sizeof(st->largest[i].bytes), 1, fp);
+        fwrite(&n, sizeof(n), 1, fp);
+        fwrite(st->largest[i].path, 1, n, fp);
+    }
+
+    fclose(fp);
+
+    for (off = 0; off < len && ret != -1; off += ret) {
+        ret = write(fd, buf + off, len - off);
+    }
+
+    free(buf);
+
+    return ret == -1 ? -1 : 0;
+}
+
+static int
+upper_decode(const upper_t *up, upper_stat_t *st, const char *buf, size_t len)
+{
+    size_t off = sizeof(*st), n_largest, n, i;
+
+    memset(st, 0, sizeof(*st));
+
+    if (len < off) return -1;
+
+    memcpy(st, buf, sizeof(*st));
+
+    n_largest = st->n_largest;
+    st->n_largest = 0;
+    st->largest = NULL;
+
+    if (n_largest > up->conf.n_largest) return -1;
+
+    if (n_largest) {
+        st->largest = calloc(n_largest, sizeof(*st->largest));
+        ASSERT(st->largest, "out of mem");
+    }
+
+    for (i = 0; i < n_largest; i++) {
+        if (len - off < sizeof(st->largest[i].bytes) + sizeof(n)) return -1;
+
+        memcpy(&st->largest[i].bytes, buf + off, sizeof(st->largest[i].bytes));
+        off += sizeof(st->largest[i].bytes);
+        memcpy(&n, buf + off, sizeof(n));
+        off += sizeof(n);
+
+        if (len - off < n) return -1;
+
+        st->largest[i].path = strndup(buf + off, n);
+        ASSERT(st->largest[i].path, "out of mem");
+
+        off += n;
+        st->n_largest++;
+    }
+
+    return 0;
+}
+
+static void
+upper_reset(upper_t *up)
+{
+    loop_del(up->loop, up->pipe);
+    close(up->pipe);
+
+    free(up->buf);
+    up->buf = NULL;
+    up->len = 0;
+
+    up->pipe = -1;
+    up->pid = -1;
+}
+
+// the background walk, if any, its result is dropped
+static void
+upper_stop(upper_t *up)
+{
+    if (up->pid == -1) return;
+
+    kill(up->pid, SIGKILL);
+    waitpid(up->pid, NULL, 0);
+
+    upper_reset(up);
+}
+
+static void
+upper_recv(void *data, int fd, uint32_t events)
+{
+    upper_t *up = data;
+    upper_stat_t st = { 0 };
+    char chunk[4096];
+    ssize_t n;
+    int status;
+
+    n = read(fd, chunk, sizeof(chunk));
+
+    if (n > 0) {
+        up->buf = realloc(up->buf, up->len + n);
+        ASSERT(up->buf, "out of mem");
+
+        memcpy(up->buf + up->len, chunk, n);
+        up->len += n;
+        return;
+    }
+
+    if (n == -1 && errno == EINTR) return;
+
+    // the helper is done writing, it exits right after
+    if (waitpid(up->pid, &status, 0) == -1) status = -1;
+
+    if (n == 0 && status == 0 && !upper_decode(up, &st, up->buf, up->len)) {
+        upper_stat_clear(&up->last);
+        up->last = st;
+
+        if (up->out != -1) upper_write_json(up->out, &up->last);
+    } else {
+        upper_stat_clear(&st);
+        LOG_ERROR("background walk of %s failed", up->dir);
+    }
+
+    upper_reset(up);
+}
+
+int
+upper_scan(upper_t *up)
+{
+    upper_stat_t st;
+
+    // the walk here supersedes it
+    upper_stop(up);
+
+    if (upper_collect(up, &st)) {
+        upper_stat_clear(&st);
+        return -1;
+    }
+
+    upper_stat_clear(&up->last);
+    up->last = st;
+
+    if (up->out != -1) upper_write_json(up->out, &up->last);
+
+    return 0;
+}
+
+int
+upper_scan_start(upper_t *up)
+{
+    upper_stat_t st;
+    int fds[2];
+    int ret;
+
+    if (up->pid != -1) return 0;
+
+    if (pipe2(fds, O_CLOEXEC)) {
+        LOG_ERROR("pipe: %s", strerror(errno));
+        return -1;
+    }
+
+    log_flush();
+    up->pid = fork();
+
+    if (up->pid == -1) {
+        LOG_ERROR("fork: %s", strerror(errno));
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    if (up->pid == 0) {
+        close(fds[0]);
+
+        // nobody to send the result to after the supervisor
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+
+        ret = upper_collect(up, &st) || upper_send(fds[1], &st);
+        log_flush();
+        _exit(ret);
+    }
+
+    close(fds[1]);
+    up->pipe = fds[0];
+
+    if (loop_add(up->loop, up->pipe, EPOLLIN, upper_recv, up)) {
+        upper_stop(up);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+upper_tick(void *data, int fd, uint32_t events)
+{
+    upper_scan_start(data);
+}
+
+upper_t *
+upper_new(loop_t *loop, const char *dir, const upper_config_t *conf, int out)
+{
+    upper_t *up = malloc(sizeof(*up));
+    ASSERT(up, "out of mem");
+
+    memset(up, 0, sizeof(*up));
+
+    up->conf = *conf;
+    up->loop = loop;
+    up->timer = -1;
+    up->dir = strdup(dir);
+    up->out = -1;
+    up->pid = -1;
+    up->pipe = -1;
+
+    if (!up->conf.n_largest) up->conf.n_largest = UPPER_DEFAULT_N_LARGEST;
+
+    if (out != -1) {
+        up->out = fcntl(out, F_DUPFD_CLOEXEC, 0);
+
+        if (up->out == -1) {
+            LOG_ERROR("dup stats output: %s", strerror(errno));
+            goto ERROR;
+        }
+    }
+
+    if (conf->interval_ms) {
+        up->timer = loop_add_timer(loop, conf->interval_ms, upper_tick, up);
+        if (up->timer == -1) goto ERROR;
+    }
+
+    return up;
+
+ERROR:
+    upper_free(up);
+    return NULL;
+}
+
+void
+upper_free(upper_t *up)
+{
+    if (up) {
+        if (up->timer != -1) loop_del_timer(up->loop, up->timer);
+        if (up->out != -1) close(up->out);
+
+        upper_stop(up);
+
+        upper_stat_clear(&up->last);
+        free(up->dir);
+        free(up);
+    }
+}
+
+void
+upper_report(const upper_t *up, FILE *out)
+{
+    const upper_stat_t *st = &up->last;
+    size_t i;
+
+    fprintf(out, "ts %" PRIu64 "\n", st->ts_ms);
+    fprintf(out, "bytes %" PRIu64 "\n", st->bytes);
+    fprintf(out, "files %" PRIu64 "\n", st->n_file);
+    fprintf(out, "dirs %" PRIu64 "\n", st->n_dir);
+    fprintf(out, "whiteouts %" PRIu64 "\n", st->n_whiteout);
+    fprintf(out, "opaque_dirs %" PRIu64 "\n", st->n_opaque);
+    fprintf(out, "copied_up %" PRIu64 "\n", st->n_copied_up);
+    fprintf(out, "copied_up_bytes %" PRIu64 "\n", st->copied_up_bytes);
+    fprintf(out, "meta_only %" PRIu64 "\n", st->n_meta_only);
+    fprintf(out, "scan_usec %" PRIu64 "\n", st->scan_usec);
+
+    for (i = 0; i < st->n_largest; i++) {
+        fprintf(out, "largest %" PRIu64 " %s\n", st->largest[i].bytes, st->largest[i].path);
+    }
+}
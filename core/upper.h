@@ -0,0 +1,96 @@
+#ifndef _CORE_UPPER_H_
+#define _CORE_UPPER_H_
+
+#include "pub/type.h"
+
+#include "loop.h"
+
+/*
+
+write amplification of the root overlay, from a walk of its upper dir
+
+a file with an origin xattr was copied up from the image, whole unless it
+also has a metacopy one, the others were created in the container.
+whiteouts (0/0 char devices) hide image files, opaque dirs whole image dirs
+
+scanned once at exit, and every interval_ms while running if set,
+each scan goes out as a json line with "event":"upper"
+
+a walk of a big upper dir takes long, so while running it is done by a
+forked helper sending the result back to the loop, the exit scan walks
+in place
+
+*/
+
+#define UPPER_DEFAULT_N_LARGEST 10
+
+typedef struct {
+    unsigned interval_ms; // 0 to scan at exit only
+    size_t n_largest; // copied up files to name, 0 for the default
+} upper_config_t;
+
+typedef struct {
+    char *path; // relative to the upper dir
+    uint64_t bytes;
+} upper_file_t;
+
+typedef struct {
+    uint64_t ts_ms; // wall clock
+    uint64_t scan_usec;
+
+    uint64_t bytes; // allocated, everything
+    uint64_t n_file;
+    uint64_t n_dir;
+    uint64_t n_whiteout;
+    uint64_t n_opaque;
+
+    uint64_t n_copied_up;
+    uint64_t copied_up_bytes;
+    uint64_t n_meta_only; // metadata copied up, data still in the image
+
+    upper_file_t *largest; // copied up, biggest first
+    size_t n_largest;
+} upper_stat_t;
+
+typedef struct {
+    upper_config_t conf;
+    loop_t *loop;
+    int timer;
+    char *dir;
+    int out;
+
+    pid_t pid; // of the helper walking in the background, -1 for none
+    int pipe; // its result comes through here
+    char *buf; // read so far
+    size_t len;
+
+    upper_stat_t last;
+} upper_t;
+
+upper_config_t *
+upper_config_copy(const upper_config_t *conf);
+
+void
+upper_config_free(upper_config_t *conf);
+
+// out is where the json lines go, -1 for none, it is dup'ed
+upper_t *
+upper_new(loop_t *loop, const char *dir, const upper_config_t *conf, int out);
+
+void
+upper_free(upper_t *up);
+
+// walk the upper dir now, in place
+int
+upper_scan(upper_t *up);
+
+// walk the upper dir in a helper, last is updated once it is done,
+// also done on every tick, nothing if a walk is already running
+int
+upper_scan_start(upper_t *up);
+
+// the last scan
+void
+upper_report(const upper_t *up, FILE *out);
+
+#endif
@@ -1,11 +1,15 @@
+#include <errno.h>
 #include <stdio.h>
+#include <sched.h>
+#include <sys/wait.h>
 
+#include "pub/type.h"
 #include "pub/limit.h"
 #include "pub/fd.h"
 
 #include "user.h"
 
-int user_map_set_up(pid_t child)
+int user_map_set_up(pid_t child, uid_t base)
 {
     char path[PATH_MAX];
 
@@ -15,11 +19,64 @@ int user_map_set_up(pid_t child)
     int gid_map = open(path, O_WRONLY);
 
     // map all users
-    dprintf(uid_map, "0 0 65536\n");
-    dprintf(gid_map, "0 0 65536\n");
+    dprintf(uid_map, "0 %u %d\n", base, USER_MAP_RANGE);
+    dprintf(gid_map, "0 %u %d\n", base, USER_MAP_RANGE);
 
     close(uid_map);
     close(gid_map);
 
     return 0;
 }
+
+int user_ns_open(uid_t base)
+{
+    char path[PATH_MAX], buf[1];
+    int pipefd[2], fd = -1;
+    pid_t helper;
+
+    if (pipe(pipefd)) {
+        LOG_ERROR("pipe: %s", strerror(errno));
+        return -1;
+    }
+
+    // the helper would print what is pending again
+    log_flush();
+    helper = fork();
+
+    if (helper == -1) {
+        LOG_ERROR("fork: %s", strerror(errno));
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return -1;
+    }
+
+    // stays in the namespace until its map is written and the fd is taken
+    if (helper == 0) {
+        close(pipefd[0]);
+
+        if (unshare(CLONE_NEWUSER)) {
+            LOG_ERROR("unshare user namespace: %s", strerror(errno));
+            _exit(1);
+        }
+
+        write(pipefd[1], "", 1);
+        close(pipefd[1]);
+        pause();
+        _exit(0);
+    }
+
+    close(pipefd[1]);
+
+    if (read(pipefd[0], buf, 1) == 1 && !user_map_set_up(helper, base)) {
+        snprintf(path, sizeof(path), "/proc/%d/ns/user", helper);
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+
+        if (fd == -1) LOG_ERROR("open user namespace: %s", strerror(errno));
+    }
+
+    close(pipefd[0]);
+    kill(helper, SIGKILL);
+    waitpid(helper, NULL, 0);
+
+    return fd;
+}
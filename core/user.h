@@ -3,6 +3,13 @@
 
 #include "pub/clone.h"
 
-int user_map_set_up(pid_t child);
+#define USER_MAP_RANGE 65536
+
+// map ids 0..USER_MAP_RANGE of the child to base.. on the host
+int user_map_set_up(pid_t child, uid_t base);
+
+// a user namespace with the same map, to idmap mounts with before the
+// container exists, returns an fd to it
+int user_ns_open(uid_t base);
 
 #endif
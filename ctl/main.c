@@ -0,0 +1,26 @@
+/*
+
+talks to the control socket of a running supervisor (ducker-main -C)
+
+    ducker-ctl <socket> update memory memory.limit_in_bytes 256M
+    ducker-ctl <socket> limits
+
+and to ducker-daemon, see core/daemon.h
+
+*/
+
+#include "core/ctl.h"
+
+int main(int argc, char **argv)
+{
+    int ret;
+
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s <socket> <command> [args...]\n", argv[0]);
+        return 2;
+    }
+
+    ret = ctl_call(argv[1], argc - 2, argv + 2, 0, stdout);
+
+    return ret == -1 ? 2 : ret;
+}
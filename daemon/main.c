@@ -0,0 +1,82 @@
+/*
+
+long-running ducker daemon, see core/daemon.h for its requests
+
+    ducker-daemon [-s socket] [-D state_dir] [-N nameserver] [-d] [-H]
+    ducker-ctl /run/ducker.sock create -m 256M web /srv/web.tar.gz /bin/httpd
+    ducker-ctl /run/ducker.sock start web
+
+*/
+
+#include <getopt.h>
+#include <signal.h>
+
+#include "core/daemon.h"
+
+#define CTL_PATH "/run/ducker.sock"
+#define STATE_DIR "/var/lib/ducker-daemon"
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-s socket] [-D state_dir] [-N nameserver] [-d] [-H]\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    // -H keeps containers on the host, without forwarding to the physical interface
+    daemon_config_t conf = {
+        .ctl_path = CTL_PATH,
+        .state_dir = STATE_DIR,
+        .nameserver = "1.1.1.1",
+        .use_physical = true
+    };
+
+    // -d, forward to the nameserver above, cached for every container
+    dns_config_t dns_conf = {
+        .upstream = NULL,
+        .port = 0,
+        .max_entry = 0
+    };
+
+    daemon_t *daemon;
+    int opt, ret;
+
+    // timestamps from here, and the pending log on a crash
+    log_init(2);
+
+    while ((opt = getopt(argc, argv, "s:D:N:dH")) != -1) {
+        switch (opt) {
+            case 's': conf.ctl_path = optarg; break;
+            case 'D': conf.state_dir = optarg; break;
+            case 'N': conf.nameserver = optarg; break;
+            case 'd': conf.dns_conf = &dns_conf; break;
+            case 'H': conf.use_physical = false; break;
+
+            default:
+                usage(argv[0]);
+                return -1;
+        }
+    }
+
+    if (optind != argc) {
+        usage(argv[0]);
+        return -1;
+    }
+
+    // a client that hangs up early must not take the daemon with it
+    signal(SIGPIPE, SIG_IGN);
+
+    daemon = daemon_new(&conf);
+
+    if (!daemon) {
+        fprintf(stderr, "failed to start daemon\n");
+        return 1;
+    }
+
+    ret = daemon_run(daemon);
+
+    daemon_free(daemon);
+
+    return ret ? 1 : 0;
+}
@@ -0,0 +1,303 @@
+#include <errno.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#include "pub/type.h"
+
+#define LOG_FLUSH_SIZE 4096 // up to PIPE_BUF a write stays whole on a pipe
+#define LOG_LINE_MAX (LOG_TEXT_SIZE + 48)
+
+typedef struct {
+    // the ticket the slot is free for, + 1 once written. stored less the slot
+    // index, so the zeroed ring starts out free
+    _Atomic uint64_t seq;
+
+    uint64_t ts_ns;
+    uint8_t level;
+    uint16_t len;
+    char text[LOG_TEXT_SIZE];
+} log_record_t;
+
+static log_record_t log_ring[LOG_RING_SIZE];
+
+static _Atomic uint64_t log_head; // next ticket to claim
+static _Atomic uint64_t log_tail; // next ticket to flush
+static _Atomic uint64_t log_dropped; // the ring was full and someone else was flushing
+static _Atomic uint64_t log_base_ns; // timestamps are relative to it
+
+static atomic_flag log_busy = ATOMIC_FLAG_INIT;
+static atomic_flag log_at_exit = ATOMIC_FLAG_INIT;
+
+static int log_fd = 2;
+
+static const char *log_level_name[] = { "debug", "log", "warn", "error" };
+
+static const int log_crash_sigs[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT };
+
+static uint64_t
+log_now_ns()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static uint64_t
+log_seq(log_record_t *rec)
+{
+    return atomic_load_explicit(&rec->seq, memory_order_acquire) + (rec - log_ring);
+}
+
+static void
+log_set_seq(log_record_t *rec, uint64_t seq)
+{
+    atomic_store_explicit(&rec->seq, seq - (rec - log_ring), memory_order_release);
+}
+
+/* the rest down to log_drain runs in signal handlers, no stdio */
+
+static size_t
+log_put_str(char *buf, const char *s)
+{
+    size_t len = strlen(s);
+
+    memcpy(buf, s, len);
+
+    return len;
+}
+
+static size_t
+log_put_u64(char *buf, uint64_t v, size_t min_digits)
+{
+    char tmp[20];
+    size_t len = 0, i;
+
+    do {
+        tmp[len++] = '0' + v % 10;
+        v /= 10;
+    } while (v || len < min_digits);
+
+    for (i = 0; i < len; i++) {
+        buf[i] = tmp[len - 1 - i];
+    }
+
+    return len;
+}
+
+static void
+log_out(const char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len) {
+        n = write(log_fd, buf, len);
+
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return;
+
+        buf += n;
+        len -= n;
+    }
+}
+
+// "[log 1.234] text", seconds since the base
+static size_t
+log_format(char *buf, const log_record_t *rec)
+{
+    uint64_t base = atomic_load_explicit(&log_base_ns, memory_order_relaxed);
+    uint64_t ms = rec->ts_ns > base ? (rec->ts_ns - base) / 1000000 : 0;
+    size_t len = 0;
+
+    buf[len++] = '[';
+    len += log_put_str(buf + len, log_level_name[rec->level]);
+    buf[len++] = ' ';
+    len += log_put_u64(buf + len, ms / 1000, 1);
+    buf[len++] = '.';
+    len += log_put_u64(buf + len, ms % 1000, 3);
+    buf[len++] = ']';
+    buf[len++] = ' ';
+
+    memcpy(buf + len, rec->text, rec->len);
+    len += rec->len;
+    buf[len++] = '\n';
+
+    return len;
+}
+
+// with log_busy held
+static void
+log_drain()
+{
+    char buf[LOG_FLUSH_SIZE];
+    uint64_t tail = atomic_load_explicit(&log_tail, memory_order_relaxed);
+    uint64_t dropped = atomic_exchange_explicit(&log_dropped, 0, memory_order_relaxed);
+    log_record_t *rec;
+    size_t len = 0;
+
+    if (dropped) {
+        len += log_put_str(buf, "[warn] ");
+        len += log_put_u64(buf + len, dropped, 1);
+        len += log_put_str(buf + len, " log records dropped\n");
+    }
+
+    // a writer that has claimed a slot but not filled it holds back the rest
+    while (log_seq(rec = &log_ring[tail % LOG_RING_SIZE]) == tail + 1) {
+        if (len + LOG_LINE_MAX > sizeof(buf)) {
+            log_out(buf, len);
+            len = 0;
+        }
+
+        len += log_format(buf + len, rec);
+        log_set_seq(rec, tail + LOG_RING_SIZE);
+
+        atomic_store_explicit(&log_tail, ++tail, memory_order_relaxed);
+    }
+
+    if (len) log_out(buf, len);
+}
+
+static void
+log_crash(int sig)
+{
+    char buf[64];
+    size_t len;
+
+    // a crash in the middle of a flush loses what is left
+    if (!atomic_flag_test_and_set_explicit(&log_busy, memory_order_acquire)) {
+        log_drain();
+    }
+
+    len = log_put_str(buf, "[error] caught signal ");
+    len += log_put_u64(buf + len, sig, 1);
+    buf[len++] = '\n';
+
+    log_out(buf, len);
+
+    // the handler was reset, this takes the default action on return
+    raise(sig);
+}
+
+void
+log_init(int fd)
+{
+    struct sigaction act;
+    size_t i;
+
+    log_fd = fd;
+    atomic_store(&log_base_ns, log_now_ns());
+
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = log_crash;
+    act.sa_flags = SA_RESETHAND;
+    sigemptyset(&act.sa_mask);
+
+    for (i = 0; i < sizeof(log_crash_sigs) / sizeof(*log_crash_sigs); i++) {
+        if (sigaction(log_crash_sigs[i], &act, NULL)) {
+            LOG_ERROR("sigaction: %s", strerror(errno));
+        }
+    }
+}
+
+void
+log_flush()
+{
+    if (atomic_flag_test_and_set_explicit(&log_busy, memory_order_acquire)) return;
+
+    log_drain();
+
+    atomic_flag_clear_explicit(&log_busy, memory_order_release);
+}
+
+static void
+log_vwrite(int level, const char *fmt, va_list ap)
+{
+    uint64_t pos, seq, base = 0;
+    log_record_t *rec;
+    int n;
+
+    if (!atomic_flag_test_and_set_explicit(&log_at_exit, memory_order_relaxed)) {
+        atexit(log_flush);
+    }
+
+    pos = atomic_load_explicit(&log_head, memory_order_relaxed);
+
+    for (;;) {
+        rec = &log_ring[pos % LOG_RING_SIZE];
+        seq = log_seq(rec);
+
+        if (seq == pos) {
+            if (atomic_compare_exchange_weak_explicit(&log_head, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if ((int64_t)(seq - pos) < 0) {
+            // full, the slot is still waiting to be flushed
+            log_flush();
+
+            if (log_seq(rec) == seq) {
+                atomic_fetch_add_explicit(&log_dropped, 1, memory_order_relaxed);
+                return;
+            }
+
+            pos = atomic_load_explicit(&log_head, memory_order_relaxed);
+        } else {
+            // claimed by another writer first
+            pos = atomic_load_explicit(&log_head, memory_order_relaxed);
+        }
+    }
+
+    rec->ts_ns = log_now_ns();
+    rec->level = level;
+
+    // without log_init, the first record is the base
+    atomic_compare_exchange_strong(&log_base_ns, &base, rec->ts_ns);
+
+    n = vsnprintf(rec->text, sizeof(rec->text), fmt, ap);
+
+    if (n < 0) n = 0;
+
+    if ((size_t)n >= sizeof(rec->text)) {
+        n = sizeof(rec->text) - 1;
+        memcpy(rec->text + n - 3, "...", 3);
+    }
+
+    rec->len = n;
+
+    log_set_seq(rec, pos + 1);
+
+    if (level >= LOG_LEVEL_ERROR ||
+        pos + 1 - atomic_load_explicit(&log_tail, memory_order_relaxed) >= LOG_RING_SIZE / 2) {
+        log_flush();
+    }
+}
+
+void
+log_write(int level, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    log_vwrite(level, fmt, ap);
+    va_end(ap);
+}
+
+void
+log_panic(const char *cond, const char *fmt, ...)
+{
+    char msg[LOG_TEXT_SIZE];
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+
+    log_write(LOG_LEVEL_ERROR, "assertion failed: %s: %s", cond, msg);
+
+    // already flushed, no crash dump
+    signal(SIGABRT, SIG_DFL);
+    abort();
+}
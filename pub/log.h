@@ -0,0 +1,69 @@
+#ifndef _PUB_LOG_H_
+#define _PUB_LOG_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+
+per-process log ring
+
+a message is rendered into a slot of a fixed ring at the call, which
+takes no lock and makes no syscall. slots are written out later in
+batches of whole lines, one write each, so lines of processes sharing
+a stderr do not mix
+
+the supervisor flushes on every loop round, any process when its ring is
+half full, at exit, on an error record or a failed ASSERT, and after
+log_init also on a crash. fork, clone and exec lose or duplicate what is
+pending, so flush before them
+
+the loop round is the asynchronous flusher, there is no flusher thread:
+init and pod members are started with a bare clone, which runs no atfork
+handler, and would inherit the ring locked by a thread caught mid flush
+
+errno goes in as LOG_ERROR("...: %s", strerror(errno)) rather than
+perror, which writes ahead of what is still pending
+
+levels below LOG_MIN_LEVEL are compiled out
+
+*/
+
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_ERROR 3
+
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_LEVEL_INFO
+#endif
+
+#define LOG_RING_SIZE 256 // records, a power of 2
+#define LOG_TEXT_SIZE 232 // longer messages are cut
+
+#define LOG_AT(level, ...) \
+    do { \
+        if ((level) >= LOG_MIN_LEVEL) log_write((level), __VA_ARGS__); \
+    } while (0)
+
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+// output fd, also dumps the ring on a crash, optional for stderr
+void
+log_init(int fd);
+
+void
+log_write(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+// nothing happens if another thread is flushing
+void
+log_flush();
+
+// records the failed assertion, flushes and aborts
+void
+log_panic(const char *cond, const char *fmt, ...) __attribute__((format(printf, 2, 3), noreturn));
+
+#endif
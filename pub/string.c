@@ -14,3 +14,18 @@ string_endswith(const char *str, const char *suf)
 
     return memcmp(sub, suf, l2) == 0;
 }
+
+uint64_t
+string_key(const char *buf, const char *key)
+{
+    size_t len = strlen(key);
+    const char *p;
+
+    for (p = buf; (p = strstr(p, key)); p += len) {
+        if ((p == buf || p[-1] == '\n') && p[len] == ' ') {
+            return strtoull(p + len + 1, NULL, 10);
+        }
+    }
+
+    return 0;
+}
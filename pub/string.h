@@ -6,4 +6,9 @@
 bool
 string_endswith(const char *str, const char *suf);
 
+// value of "key value" in a flat keyed file (cgroup and proc stats), 0 if absent.
+// a negative value comes back as its two's complement
+uint64_t
+string_key(const char *buf, const char *key);
+
 #endif
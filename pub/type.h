@@ -10,21 +10,13 @@
 
 typedef uint8_t byte_t;
 
+#include "pub/log.h"
+
 #define ASSERT(cond, ...) \
     do { \
-        if (!(cond)) { \
-            fprintf(stderr, "assertion failed: %s: ", #cond); \
-            fprintf(stderr, __VA_ARGS__); \
-            fprintf(stderr, "\n"); \
-            abort(); \
-        } \
+        if (!(cond)) log_panic(#cond, __VA_ARGS__); \
     } while (0)
 
-#define LOG(...) \
-    do { \
-        fprintf(stderr, "[log] "); \
-        fprintf(stderr, __VA_ARGS__); \
-        fprintf(stderr, "\n"); \
-    } while (0)
+#define LOG(...) LOG_INFO(__VA_ARGS__)
 
 #endif